@@ -0,0 +1,126 @@
+#!/usr/bin/perl -w
+
+# Copyright (C) Nginx, Inc.
+#
+# this script reads access logs written with "log_format ... escape=binary"
+# and prints each record as a line of JSON, or of tab separated values with -t
+#
+#   binlog2text.pl [-t] [file ...]
+#
+# a log is a sequence of records, each record starts with the 12 bytes header:
+#
+#   length       4 bytes, the length of the body following the header
+#   type         1 byte, "S" for a schema record, "R" for a data record
+#   version      1 byte, 1
+#   fields       2 bytes, the number of fields
+#   schema id    4 bytes, crc32 of the schema record body
+#
+# all numbers are in network byte order.  The body of a data record is a list
+# of fields, each is 2 bytes of the length followed by the value.  The body
+# of a schema record has the same layout and contains the format name followed
+# by the field names; each worker process writes the schema record before its
+# first data record in a file.
+
+
+use warnings;
+use strict;
+
+my $tsv = 0;
+
+if (@ARGV && $ARGV[0] eq '-t') {
+	$tsv = 1;
+	shift @ARGV;
+}
+
+my %schemas;
+
+push @ARGV, '-' unless @ARGV;
+
+for my $file (@ARGV) {
+	my $fh;
+
+	if ($file eq '-') {
+		$fh = \*STDIN;
+	} else {
+		open($fh, '<', $file) or die "cannot open $file: $!\n";
+	}
+
+	binmode($fh);
+
+	while (1) {
+		my $header = read_bytes($fh, 12, $file);
+		last unless defined $header;
+
+		my ($len, $type, $version, $n, $id) = unpack('N a C n N', $header);
+
+		die "$file: unsupported version $version\n" if $version != 1;
+
+		my $body = read_bytes($fh, $len, $file);
+		die "$file: truncated record\n" unless defined $body;
+
+		my @fields = unpack('(n/a*)*', $body);
+
+		if ($type eq 'S') {
+			my $name = shift @fields;
+			$schemas{$id} = { name => $name, fields => \@fields };
+			next;
+		}
+
+		die "$file: unknown record type \"$type\"\n" if $type ne 'R';
+
+		my $schema = $schemas{$id};
+
+		unless (defined $schema) {
+			warn "$file: record with unknown schema $id skipped\n";
+			next;
+		}
+
+		print_record($schema, \@fields);
+	}
+
+	close($fh) unless $file eq '-';
+}
+
+sub read_bytes {
+	my ($fh, $len, $file) = @_;
+	my $buf = '';
+
+	return $buf if $len == 0;
+
+	my $n = read($fh, $buf, $len);
+
+	die "$file: $!\n" unless defined $n;
+	return undef if $n == 0;
+	die "$file: truncated record\n" if $n != $len;
+
+	return $buf;
+}
+
+sub print_record {
+	my ($schema, $values) = @_;
+	my $names = $schema->{fields};
+
+	if ($tsv) {
+		print join("\t", map { s/([\\\t\n])/sprintf('\\x%02X', ord($1))/ger }
+		                 @$values), "\n";
+		return;
+	}
+
+	my @pairs;
+
+	for my $i (0 .. $#$names) {
+		my $v = defined $values->[$i] ? $values->[$i] : '';
+		push @pairs, json($names->[$i]) . ':' . json($v);
+	}
+
+	print '{', join(',', @pairs), "}\n";
+}
+
+sub json {
+	my ($s) = @_;
+
+	$s =~ s/(["\\])/\\$1/g;
+	$s =~ s/([\x00-\x1f])/sprintf('\\u%04X', ord($1))/ge;
+
+	return '"' . $s . '"';
+}
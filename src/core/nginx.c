@@ -132,6 +132,15 @@ static ngx_command_t  ngx_core_commands[] = {
       offsetof(ngx_core_conf_t, rlimit_core),
       NULL },
 
+    // 设置每个工作进程为每种大小缓存多少个空闲的内存池块，
+    // 销毁连接和请求的内存池时块放入缓存，创建时优先使用，默认为0不缓存
+    { ngx_string("worker_pool_cache"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_core_conf_t, pool_cache),
+      NULL },
+
     // 这个参数在最新的nginx里已经去掉
     { ngx_string("worker_rlimit_sigpending"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
@@ -1015,6 +1024,8 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->rlimit_core = NGX_CONF_UNSET;
     ccf->rlimit_sigpending = NGX_CONF_UNSET;
 
+    ccf->pool_cache = NGX_CONF_UNSET;
+
     ccf->user = (ngx_uid_t) NGX_CONF_UNSET_UINT;
     ccf->group = (ngx_gid_t) NGX_CONF_UNSET_UINT;
 
@@ -1046,6 +1057,8 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
 
+    ngx_conf_init_value(ccf->pool_cache, 0);
+
 #if (NGX_HAVE_CPU_AFFINITY)
 
     if (ccf->cpu_affinity_n
@@ -6,6 +6,9 @@
 
 // 这组头文件与实现文件实现了nginx 6个基本容器之一的ngx_array_t及相关操作函数。
 
+// 这个文件里的内存池申请记在调用者的源文件上
+#define NGX_POOL_PROFILE_CORE  1
+
 #include <ngx_config.h>
 #include <ngx_core.h>
 
@@ -49,7 +49,8 @@ ngx_array_init(ngx_array_t *array, ngx_pool_t *pool, ngx_uint_t n, size_t size)
     array->nalloc = n;
     array->pool = pool;
 
-    array->elts = ngx_palloc(pool, n * size);
+    // 括号避开分析模式的宏，内存记在调用ngx_array_init()的源文件上
+    array->elts = (ngx_palloc)(pool, n * size);
     if (array->elts == NULL) {
         return NGX_ERROR;
     }
@@ -58,4 +59,18 @@ ngx_array_init(ngx_array_t *array, ngx_pool_t *pool, ngx_uint_t n, size_t size)
 }
 
 
+#if (NGX_POOL_PROFILE && !NGX_POOL_PROFILE_CORE)
+
+#define ngx_array_create(p, n, size)                                          \
+    (ngx_pool_site = __FILE__, ngx_array_create(p, n, size))
+#define ngx_array_push(a)                                                     \
+    (ngx_pool_site = __FILE__, ngx_array_push(a))
+#define ngx_array_push_n(a, n)                                                \
+    (ngx_pool_site = __FILE__, ngx_array_push_n(a, n))
+#define ngx_array_init(array, pool, n, size)                                  \
+    (ngx_pool_site = __FILE__, ngx_array_init(array, pool, n, size))
+
+#endif
+
+
 #endif /* _NGX_ARRAY_H_INCLUDED_ */
@@ -6,6 +6,9 @@
 
 // 这组头文件和实现文件声明了ngx_buf_t和ngx_chain_t结构体体，并实现了相关的操作函数。
 
+// 这个文件里的内存池申请记在调用者的源文件上
+#define NGX_POOL_PROFILE_CORE  1
+
 #include <ngx_config.h>
 #include <ngx_core.h>
 
@@ -160,4 +160,18 @@ void ngx_chain_update_chains(ngx_pool_t *p, ngx_chain_t **free,
     ngx_chain_t **busy, ngx_chain_t **out, ngx_buf_tag_t tag);
 
 
+#if (NGX_POOL_PROFILE && !NGX_POOL_PROFILE_CORE)
+
+#define ngx_create_temp_buf(pool, size)                                      \
+    (ngx_pool_site = __FILE__, ngx_create_temp_buf(pool, size))
+#define ngx_create_chain_of_bufs(pool, bufs)                                 \
+    (ngx_pool_site = __FILE__, ngx_create_chain_of_bufs(pool, bufs))
+#define ngx_alloc_chain_link(pool)                                           \
+    (ngx_pool_site = __FILE__, ngx_alloc_chain_link(pool))
+#define ngx_chain_get_free_buf(p, free)                                      \
+    (ngx_pool_site = __FILE__, ngx_chain_get_free_buf(p, free))
+
+#endif
+
+
 #endif /* _NGX_BUF_H_INCLUDED_ */
@@ -105,6 +105,9 @@ struct ngx_open_file_s {
 
     void                (*flush)(ngx_open_file_t *file, ngx_log_t *log);
     void                 *data;
+
+    // 本进程每次重新打开这个文件时加1
+    ngx_uint_t            generation;
 };
 
 
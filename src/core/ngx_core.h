@@ -76,6 +76,8 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 #include <ngx_process_cycle.h>
 #include <ngx_conf_file.h>
 #include <ngx_open_file_cache.h>
+#include <ngx_log_ring.h>
+#include <ngx_syslog.h>
 #include <ngx_os.h>
 #include <ngx_connection.h>
 #include <ngx_proxy_protocol.h>
@@ -92,6 +94,8 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 
 void ngx_cpuinfo(void);
 
+extern ngx_uint_t  ngx_cpu_sse42;
+
 #if (NGX_HAVE_OPENAT)
 #define NGX_DISABLE_SYMLINKS_OFF        0
 #define NGX_DISABLE_SYMLINKS_ON         1
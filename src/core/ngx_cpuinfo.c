@@ -4,12 +4,16 @@
  * Copyright (C) Nginx, Inc.
  */
 
-// 这个文件实现了用于初始化全局变量ngx_cacheline_size的ngx_cpuinfo函数。
+// 这个文件实现了用于初始化全局变量ngx_cacheline_size和ngx_cpu_sse42的ngx_cpuinfo函数。
 
 #include <ngx_config.h>
 #include <ngx_core.h>
 
 
+// cpu是否支持SSE4.2指令集，在ngx_cpuinfo()中初始化，http解析器据此在运行时选择向量化的快速路径
+ngx_uint_t  ngx_cpu_sse42;
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
@@ -72,7 +76,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
 /* auto detect the L2 cache line size of modern and widespread CPUs */
 
-// 初始化全局变量ngx_cacheline_size
+// 初始化全局变量ngx_cacheline_size和ngx_cpu_sse42
 void
 ngx_cpuinfo(void)
 {
@@ -95,6 +99,9 @@ ngx_cpuinfo(void)
 
     ngx_cpuid(1, cpu);
 
+    /* CPUID.01H:ECX.SSE42[bit 20] */
+    ngx_cpu_sse42 = (cpu[3] & 0x00100000) ? 1 : 0;
+
     if (ngx_strcmp(vendor, "GenuineIntel") == 0) {
 
         switch ((cpu[0] & 0xf00) >> 8) {
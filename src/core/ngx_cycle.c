@@ -143,6 +143,13 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
     cycle->paths.nalloc = n;
     cycle->paths.pool = pool;
 
+    if (ngx_array_init(&cycle->log_rings, pool, 4, sizeof(ngx_log_ring_t *))
+        != NGX_OK)
+    {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
     // 得到一个合适的cycle->open_files.nalloc值。
     if (old_cycle->open_files.part.nelts) {
         n = old_cycle->open_files.part.nelts;
@@ -914,6 +921,7 @@ ngx_init_zone_pool(ngx_cycle_t *cycle, ngx_shm_zone_t *zn)
     sp->end = zn->shm.addr + zn->shm.size;
     sp->min_shift = 3;
     sp->addr = zn->shm.addr;
+    sp->next = NULL;
 
 #if (NGX_HAVE_ATOMIC_OPS)
 
@@ -1207,6 +1215,7 @@ ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user)
         }
 
         file[i].fd = fd;
+        file[i].generation++;
     }
 
     (void) ngx_log_redirect_stderr(cycle);
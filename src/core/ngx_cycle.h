@@ -65,6 +65,8 @@ struct ngx_cycle_s {
     ngx_array_t               listening;      // ngx_listening_t
     // 配置文件中所使用的path
     ngx_array_t               paths;          // ngx_path_t *
+    // 由log writer进程写入文件的日志环形缓冲区
+    ngx_array_t               log_rings;      // ngx_log_ring_t *
     // 在reopen操作时需要重新打开的文件
     ngx_list_t                open_files;     // ngx_open_file_t
     // 正常运行时会使用的共享内存。
@@ -112,6 +114,9 @@ typedef struct {
      ngx_int_t                rlimit_sigpending;
      off_t                    rlimit_core;
 
+     // 每个worker为每种大小缓存的空闲内存池块数
+     ngx_int_t                pool_cache;
+
      int                      priority;
 
      ngx_uint_t               cpu_affinity_n;
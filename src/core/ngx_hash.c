@@ -250,6 +250,10 @@ ngx_hash_find_combined(ngx_hash_combined_t *hash, ngx_uint_t key, u_char *name,
 #define NGX_HASH_ELT_SIZE(name)                                               \
     (sizeof(void *) + ngx_align((name)->key.len + 2, sizeof(void *)))
 
+static ngx_uint_t ngx_hash_auto_size(ngx_hash_init_t *hinit,
+    ngx_hash_key_t *names, ngx_uint_t nelts);
+
+
 // 初始化一个散列表。
 // hinit[in&out]: 见ngx_hash_init_t声明。
 // name[in]: 要初始化的散列表元素数组。
@@ -263,6 +267,20 @@ ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
     ngx_uint_t       i, n, key, size, start, bucket_size;
     ngx_hash_elt_t  *elt, **buckets;
 
+    if (hinit->max_size == NGX_HASH_AUTO_SIZE) {
+        size = ngx_hash_auto_size(hinit, names, nelts);
+        if (size == 0) {
+            return NGX_ERROR;
+        }
+
+        test = ngx_alloc(size * sizeof(u_short), hinit->pool->log);
+        if (test == NULL) {
+            return NGX_ERROR;
+        }
+
+        goto found;
+    }
+
     for (n = 0; n < nelts; n++) {
     // 如果hinit->bucket_size长度设置过短，出错返回 
         if (hinit->bucket_size < NGX_HASH_ELT_SIZE(&names[n]) + sizeof(void *))
@@ -459,6 +477,87 @@ found:
 }
 
 
+// 自动选择散列表的桶个数，返回0表示出错。
+// 桶的大小从能放下最长元素的cache line整数倍开始，每次加倍；
+// 桶的个数按1.25倍递增直到元素个数的两倍，所以只需要O(log n)次O(n)的尝试。
+static ngx_uint_t
+ngx_hash_auto_size(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts)
+{
+    size_t       elt_size, bucket_size;
+    u_short     *test;
+    ngx_uint_t   n, key, size, start, max_size;
+
+    elt_size = 0;
+
+    for (n = 0; n < nelts; n++) {
+        if (names[n].key.data == NULL) {
+            continue;
+        }
+
+        if (elt_size < NGX_HASH_ELT_SIZE(&names[n])) {
+            elt_size = NGX_HASH_ELT_SIZE(&names[n]);
+        }
+    }
+
+    max_size = 2 * nelts + 1;
+
+    test = ngx_alloc(max_size * sizeof(u_short), hinit->pool->log);
+    if (test == NULL) {
+        return 0;
+    }
+
+    bucket_size = ngx_align(elt_size + sizeof(void *), ngx_cacheline_size);
+
+    for ( ;; ) {
+
+        start = nelts / ((bucket_size - sizeof(void *)) / (2 * sizeof(void *)));
+        start = start ? start : 1;
+
+        for (size = start; size <= max_size; size += size / 4 + 1) {
+
+            ngx_memzero(test, size * sizeof(u_short));
+
+            for (n = 0; n < nelts; n++) {
+                if (names[n].key.data == NULL) {
+                    continue;
+                }
+
+                key = names[n].key_hash % size;
+                test[key] = (u_short) (test[key] + NGX_HASH_ELT_SIZE(&names[n]));
+
+                if (test[key] > (u_short) (bucket_size - sizeof(void *))) {
+                    goto next;
+                }
+            }
+
+            goto found;
+
+        next:
+
+            continue;
+        }
+
+        if (bucket_size >= NGX_HASH_AUTO_MAX_BUCKET) {
+            size = max_size;
+            break;
+        }
+
+        bucket_size *= 2;
+    }
+
+found:
+
+    ngx_free(test);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_CORE, hinit->pool->log, 0,
+                   "%s: %ui elements in %ui buckets of %uz bytes",
+                   hinit->name, nelts, size, bucket_size);
+
+    return size;
+}
+
+
 ngx_int_t
 ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
     ngx_uint_t nelts)
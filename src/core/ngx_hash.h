@@ -73,6 +73,7 @@ typedef struct {
     ngx_hash_key_pt   key;
 
     // 在ngx_hash_init()用于输入
+    // 为NGX_HASH_AUTO_SIZE时由ngx_hash_init()自动选择桶的个数和大小，忽略bucket_size
     ngx_uint_t        max_size;
     // 在ngx_hash_init()用于输入
     // 哈希表存的最长字符串对齐后加上一个指针的长度后应小于这个值
@@ -87,6 +88,10 @@ typedef struct {
 } ngx_hash_init_t;
 
 
+#define NGX_HASH_AUTO_SIZE        0
+#define NGX_HASH_AUTO_MAX_BUCKET  32768
+
+
 #define NGX_HASH_SMALL            1
 #define NGX_HASH_LARGE            2
 
@@ -53,7 +53,8 @@ ngx_list_t *ngx_list_create(ngx_pool_t *pool, ngx_uint_t n, size_t size);
 static ngx_inline ngx_int_t
 ngx_list_init(ngx_list_t *list, ngx_pool_t *pool, ngx_uint_t n, size_t size)
 {
-    list->part.elts = ngx_palloc(pool, n * size);
+    // 括号避开分析模式的宏，内存记在调用ngx_list_init()的源文件上
+    list->part.elts = (ngx_palloc)(pool, n * size);
     if (list->part.elts == NULL) {
         return NGX_ERROR;
     }
@@ -97,4 +98,16 @@ ngx_list_init(ngx_list_t *list, ngx_pool_t *pool, ngx_uint_t n, size_t size)
 void *ngx_list_push(ngx_list_t *list);
 
 
+#if (NGX_POOL_PROFILE && !NGX_POOL_PROFILE_CORE)
+
+#define ngx_list_create(pool, n, size)                                        \
+    (ngx_pool_site = __FILE__, ngx_list_create(pool, n, size))
+#define ngx_list_init(list, pool, n, size)                                    \
+    (ngx_pool_site = __FILE__, ngx_list_init(list, pool, n, size))
+#define ngx_list_push(list)                                                   \
+    (ngx_pool_site = __FILE__, ngx_list_push(list))
+
+#endif
+
+
 #endif /* _NGX_LIST_H_INCLUDED_ */
@@ -43,6 +43,8 @@
 
 
 typedef u_char *(*ngx_log_handler_pt) (ngx_log_t *log, u_char *buf, size_t len);
+typedef void (*ngx_log_writer_pt) (ngx_log_t *log, ngx_uint_t level,
+    u_char *buf, size_t len);
 
 
 // 调用ngx_log_error()要输入的这个结构体的对象作为参数，
@@ -64,6 +66,10 @@ struct ngx_log_s {
 
     char                *action;
 
+    // 不为NULL时日志不写入file，而是交给writer输出，如发给syslog
+    ngx_log_writer_pt    writer;
+    void                *wdata;
+
     ngx_log_t           *next;
 };
 
@@ -227,6 +233,7 @@ ngx_log_t *ngx_log_init(u_char *prefix);
 void ngx_cdecl ngx_log_abort(ngx_err_t err, const char *fmt, ...);
 void ngx_cdecl ngx_log_stderr(ngx_err_t err, const char *fmt, ...);
 u_char *ngx_log_errno(u_char *buf, u_char *last, ngx_err_t err);
+ngx_log_t *ngx_log_get_file_log(ngx_log_t *head);
 ngx_int_t ngx_log_open_default(ngx_cycle_t *cycle);
 ngx_int_t ngx_log_redirect_stderr(ngx_cycle_t *cycle);
 char *ngx_log_set_log(ngx_conf_t *cf, ngx_log_t **head);
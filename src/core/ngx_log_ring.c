@@ -0,0 +1,443 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这组头文件和实现文件实现了多个进程共用的日志环形缓冲区。
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+// 每条记录前的头部。size不为0说明记录已经提交，len为0的记录是填充到缓冲区
+// 末尾的空记录或者是分配它的进程退出后代替它提交的墓碑记录。
+// pid是分配记录的进程，只有它退出后log writer进程才能代替它提交墓碑记录
+typedef struct {
+    uint32_t                  size;
+    uint32_t                  len;
+    uint32_t                  pid;
+    uint32_t                  reserved;
+} ngx_log_ring_hdr_t;
+
+
+static ngx_int_t ngx_log_ring_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static size_t ngx_log_ring_skip(ngx_log_ring_t *ring, ngx_atomic_uint_t pos,
+    ngx_log_t *log);
+
+
+static ngx_uint_t  ngx_log_ring_tag;
+
+
+// 为file创建环形缓冲区，size会向上取整为2的整数次方。
+// 同一个文件只创建一个缓冲区，所有缓冲区记录在cycle->log_rings中，
+// 由log writer进程负责写入文件
+ngx_log_ring_t *
+ngx_log_ring_add(ngx_conf_t *cf, ngx_open_file_t *file, size_t size)
+{
+    size_t            n;
+    ngx_str_t         name;
+    ngx_uint_t        i;
+    ngx_log_ring_t   *ring, **rings;
+
+    for (n = 8 * ngx_pagesize; n < size; n <<= 1) { /* void */ }
+
+    rings = cf->cycle->log_rings.elts;
+
+    for (i = 0; i < cf->cycle->log_rings.nelts; i++) {
+
+        if (rings[i]->file != file) {
+            continue;
+        }
+
+        if (rings[i]->size != n) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "log ring of \"%V\" is already defined "
+                               "with size %uz", &file->name, rings[i]->size);
+            return NULL;
+        }
+
+        return rings[i];
+    }
+
+    ring = ngx_pcalloc(cf->pool, sizeof(ngx_log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->file = file;
+    ring->size = n;
+    ring->stuck = (ngx_atomic_uint_t) -1;
+
+    name.len = sizeof("log_ring:") - 1 + file->name.len;
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NULL;
+    }
+
+    ngx_sprintf(name.data, "log_ring:%V", &file->name);
+
+    /* the slab pool page descriptors and the ring header */
+
+    n += n / 64 + 8 * ngx_pagesize;
+
+    ring->shm_zone = ngx_shared_memory_add(cf, &name, n, &ngx_log_ring_tag);
+    if (ring->shm_zone == NULL) {
+        return NULL;
+    }
+
+    ring->shm_zone->init = ngx_log_ring_init_zone;
+    ring->shm_zone->data = ring;
+
+    rings = ngx_array_push(&cf->cycle->log_rings);
+    if (rings == NULL) {
+        return NULL;
+    }
+
+    *rings = ring;
+
+    return ring;
+}
+
+
+static ngx_int_t
+ngx_log_ring_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_log_ring_t  *oring = data;
+
+    ngx_log_ring_t   *ring;
+    ngx_slab_pool_t  *shpool;
+
+    ring = shm_zone->data;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ring->shpool = shpool;
+
+    if (oring) {
+        ring->sh = oring->sh;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        ring->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    ring->sh = ngx_slab_alloc(shpool,
+                              offsetof(ngx_log_ring_sh_t, data) + ring->size);
+    if (ring->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = ring->sh;
+
+    ngx_memzero(ring->sh, offsetof(ngx_log_ring_sh_t, data) + ring->size);
+
+    ring->sh->size = ring->size;
+
+    return NGX_OK;
+}
+
+
+// 在缓冲区中为长度为len的记录分配空间，返回记录数据的起始地址。
+// 缓冲区满时丢弃记录，计数后返回NULL；overflow=block时先让出CPU几次，
+// 等log writer进程腾出空间，但不睡眠，进程正在退出时也不等待。
+// 分配到的空间必须用ngx_log_ring_commit()提交，提交前log writer进程不会越过这条记录
+u_char *
+ngx_log_ring_reserve(ngx_log_ring_t *ring, size_t len)
+{
+    size_t               size, need, pad;
+    ngx_uint_t           spin;
+    ngx_atomic_uint_t    head, tail, off;
+    ngx_log_ring_sh_t   *sh;
+    ngx_log_ring_hdr_t  *hdr;
+
+    sh = ring->sh;
+    size = sh->size;
+
+    need = ngx_align(sizeof(ngx_log_ring_hdr_t) + len,
+                     sizeof(ngx_log_ring_hdr_t));
+
+    if (need > size / 2) {
+        (void) ngx_atomic_fetch_add(&sh->dropped, 1);
+        return NULL;
+    }
+
+    spin = 0;
+
+    for ( ;; ) {
+
+        /* head must be read before tail, so head never exceeds tail */
+
+        head = sh->head;
+        ngx_memory_barrier();
+        tail = sh->tail;
+
+        off = tail & (size - 1);
+        pad = (off + need > size) ? size - off : 0;
+
+        if (tail + pad + need - head > size) {
+
+            if (ring->overflow == NGX_LOG_RING_DROP
+                || ngx_quit || ngx_terminate || ngx_exiting
+                || spin++ >= NGX_LOG_RING_BLOCK_SPINS)
+            {
+                (void) ngx_atomic_fetch_add(&sh->dropped, 1);
+                return NULL;
+            }
+
+            ngx_sched_yield();
+
+            continue;
+        }
+
+        if (ngx_atomic_cmp_set(&sh->tail, tail, tail + pad + need)) {
+            break;
+        }
+
+        ngx_cpu_pause();
+    }
+
+    if (pad) {
+        hdr = (ngx_log_ring_hdr_t *) &sh->data[off];
+        hdr->len = 0;
+        ngx_memory_barrier();
+        hdr->size = (uint32_t) pad;
+
+        off = 0;
+    }
+
+    hdr = (ngx_log_ring_hdr_t *) &sh->data[off];
+
+    /*
+     * the reserved size is kept in len until the record is committed,
+     * it is valid once pid is set
+     */
+
+    hdr->len = (uint32_t) need;
+    ngx_memory_barrier();
+    hdr->pid = (uint32_t) ngx_pid;
+
+    return (u_char *) hdr + sizeof(ngx_log_ring_hdr_t);
+}
+
+
+// 提交ngx_log_ring_reserve()分配的记录，len不能超过分配时的长度
+void
+ngx_log_ring_commit(ngx_log_ring_t *ring, u_char *p, size_t len)
+{
+    uint32_t             size;
+    ngx_log_ring_hdr_t  *hdr;
+
+    hdr = (ngx_log_ring_hdr_t *) (p - sizeof(ngx_log_ring_hdr_t));
+
+    size = hdr->len;
+    hdr->len = (uint32_t) len;
+
+    ngx_memory_barrier();
+
+    hdr->size = size;
+}
+
+
+// 由log writer进程调用，把缓冲区中已经提交的记录写入文件，
+// 分配记录的进程在提交前退出时代替它提交一个墓碑记录，
+// 写完的区域清零后再移动head，这样未提交记录的头部总是0。
+// 缓冲区只能有一个消费者，reload时新旧log writer进程用slab池的互斥锁轮流写，
+// 拿不到锁说明另一个log writer进程正在写，这次直接返回。
+// 持有锁的进程异常退出时master进程会在ngx_unlock_mutexes()中释放锁
+void
+ngx_log_ring_flush(ngx_log_ring_t *ring, ngx_log_t *log)
+{
+    size_t               size, len, start, skip;
+    ssize_t              n;
+    ngx_uint_t           niov;
+    ngx_err_t            err;
+    ngx_atomic_uint_t    head, tail, pos, dropped;
+    ngx_log_ring_sh_t   *sh;
+    ngx_log_ring_hdr_t  *hdr;
+    struct iovec         iov[NGX_LOG_RING_IOVS];
+
+    sh = ring->sh;
+    size = sh->size;
+
+    if (!ngx_shmtx_trylock(&ring->shpool->mutex)) {
+        return;
+    }
+
+    tail = sh->tail;
+    head = sh->head;
+
+    while (head != tail) {
+
+        niov = 0;
+        len = 0;
+
+        for (pos = head; pos != tail && niov < NGX_LOG_RING_IOVS; /* void */) {
+
+            hdr = (ngx_log_ring_hdr_t *) &sh->data[pos & (size - 1)];
+
+            if (hdr->size == 0) {
+
+                /* not committed yet */
+
+                if (pos != head) {
+                    break;
+                }
+
+                skip = ngx_log_ring_skip(ring, pos, log);
+
+                if (skip == 0) {
+                    break;
+                }
+
+                hdr->len = 0;
+                ngx_memory_barrier();
+                hdr->size = (uint32_t) skip;
+            }
+
+            ngx_memory_barrier();
+
+            if (hdr->len) {
+                iov[niov].iov_base = (u_char *) hdr
+                                     + sizeof(ngx_log_ring_hdr_t);
+                iov[niov].iov_len = hdr->len;
+                len += hdr->len;
+                niov++;
+            }
+
+            pos += hdr->size;
+        }
+
+        if (pos == head) {
+            break;
+        }
+
+        if (niov) {
+            n = ngx_writev_fd(ring->file->fd, iov, niov);
+
+            if (n == -1) {
+                err = ngx_errno;
+                ngx_log_error(NGX_LOG_ALERT, log, err,
+                              ngx_writev_fd_n " to \"%V\" failed",
+                              &ring->file->name);
+
+            } else if ((size_t) n != len) {
+                ngx_log_error(NGX_LOG_ALERT, log, 0,
+                              ngx_writev_fd_n " to \"%V\" was incomplete: "
+                              "%z of %uz", &ring->file->name, n, len);
+
+            } else {
+                (void) ngx_atomic_fetch_add(&sh->records, niov);
+            }
+        }
+
+        start = head & (size - 1);
+        len = pos - head;
+
+        if (start + len <= size) {
+            ngx_memzero(&sh->data[start], len);
+
+        } else {
+            ngx_memzero(&sh->data[start], size - start);
+            ngx_memzero(sh->data, len - (size - start));
+        }
+
+        ngx_memory_barrier();
+
+        sh->head = pos;
+        head = pos;
+    }
+
+    dropped = sh->dropped;
+
+    if (dropped != sh->reported) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%uA records dropped in log ring of \"%V\", %uA total",
+                      dropped - sh->reported, &ring->file->name, dropped);
+
+        sh->reported = dropped;
+    }
+
+    ngx_shmtx_unlock(&ring->shpool->mutex);
+}
+
+
+// head处的记录一直没有提交时，返回应该跳过的字节数，还不能跳过时返回0。
+// 头部有分配它的进程号时，只有这个进程已经退出才跳过，它不会再晚些提交而破坏缓冲区。
+// 进程在写进程号之前就退出时，这条记录的区域全是0，超过NGX_LOG_RING_STUCK_TIMEOUT
+// 毫秒后跳到后面第一个头部不为0的记录，最多跳到发现它时的tail，
+// 那之前分配的记录在超时之前都已经写了头部
+static size_t
+ngx_log_ring_skip(ngx_log_ring_t *ring, ngx_atomic_uint_t pos, ngx_log_t *log)
+{
+    size_t               size, off, end, skip;
+    ngx_pid_t            pid;
+    ngx_log_ring_sh_t   *sh;
+    ngx_log_ring_hdr_t  *hdr;
+
+    sh = ring->sh;
+    size = sh->size;
+    off = pos & (size - 1);
+
+    hdr = (ngx_log_ring_hdr_t *) &sh->data[off];
+
+    pid = (ngx_pid_t) hdr->pid;
+
+    if (pid) {
+        ngx_memory_barrier();
+
+        if (kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH) {
+            return 0;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "skipped %uz bytes of record uncommitted by exited "
+                      "process %P in log ring of \"%V\"",
+                      (size_t) hdr->len, pid, &ring->file->name);
+
+        ring->stuck = (ngx_atomic_uint_t) -1;
+
+        return hdr->len;
+    }
+
+    if (ring->stuck != pos) {
+        ring->stuck = pos;
+        ring->stuck_tail = sh->tail;
+        ring->stuck_time = ngx_current_msec;
+        return 0;
+    }
+
+    if ((ngx_msec_int_t) (ngx_current_msec - ring->stuck_time)
+        < NGX_LOG_RING_STUCK_TIMEOUT)
+    {
+        return 0;
+    }
+
+    if (hdr->pid) {
+        return 0;
+    }
+
+    /* a reservation never wraps, the padding record does it */
+
+    end = ngx_min(ring->stuck_tail - pos, size - off);
+
+    for (skip = sizeof(ngx_log_ring_hdr_t);
+         skip < end;
+         skip += sizeof(ngx_log_ring_hdr_t))
+    {
+        hdr = (ngx_log_ring_hdr_t *) &sh->data[off + skip];
+
+        if (hdr->size || hdr->len || hdr->pid) {
+            break;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, log, 0,
+                  "skipped %uz bytes of uncommitted record in log ring "
+                  "of \"%V\"", skip, &ring->file->name);
+
+    ring->stuck = (ngx_atomic_uint_t) -1;
+
+    return skip;
+}
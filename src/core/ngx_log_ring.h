@@ -0,0 +1,79 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这组头文件和实现文件实现了多个进程共用的日志环形缓冲区。
+// worker进程不加锁地把日志记录追加到共享内存中，
+// 由log writer进程定时把已经提交的记录用writev()批量写入文件。
+
+#ifndef _NGX_LOG_RING_H_INCLUDED_
+#define _NGX_LOG_RING_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+// 缓冲区满时的处理方式
+#define NGX_LOG_RING_DROP         0
+#define NGX_LOG_RING_BLOCK        1
+
+#define NGX_LOG_RING_IOVS         64
+
+// overflow=block时让出CPU等log writer进程腾出空间的最多次数，之后丢弃记录。
+// worker进程不能在事件循环中睡眠，否则这个进程上的所有连接都会停顿
+#define NGX_LOG_RING_BLOCK_SPINS     64
+// 记录的头部还没有写入分配它的进程号时，超过这个毫秒数就认为分配它的进程已经退出
+#define NGX_LOG_RING_STUCK_TIMEOUT   5000
+
+
+// 共享内存中的环形缓冲区，head和tail只增不减，对size取模后是在data中的偏移
+typedef struct {
+    // 下一个要写入文件的记录的位置，只由log writer进程修改
+    ngx_atomic_t              head;
+    // 下一个可以分配的位置，worker进程用原子操作修改
+    ngx_atomic_t              tail;
+    // 已经写入文件的记录数
+    ngx_atomic_t              records;
+    // 因为缓冲区满而丢弃的记录数
+    ngx_atomic_t              dropped;
+    // log writer进程已经报告过的丢弃记录数
+    ngx_atomic_t              reported;
+    // data的大小，是2的整数次方
+    size_t                    size;
+    u_char                    data[1];
+} ngx_log_ring_sh_t;
+
+
+typedef struct {
+    ngx_log_ring_sh_t        *sh;
+    // 共享内存的slab池，它的互斥锁保证同一时刻只有一个log writer进程写这个缓冲区，
+    // 比如reload时新旧两个log writer进程同时存在
+    ngx_slab_pool_t          *shpool;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_open_file_t          *file;
+
+    size_t                    size;
+    // log writer进程写文件的时间间隔
+    ngx_msec_t                flush;
+    // NGX_LOG_RING_DROP或NGX_LOG_RING_BLOCK
+    ngx_uint_t                overflow;
+
+    // 只在log writer进程中使用：head处一直没有提交的记录的位置，
+    // 发现它时的tail和时间
+    ngx_atomic_uint_t         stuck;
+    ngx_atomic_uint_t         stuck_tail;
+    ngx_msec_t                stuck_time;
+} ngx_log_ring_t;
+
+
+ngx_log_ring_t *ngx_log_ring_add(ngx_conf_t *cf, ngx_open_file_t *file,
+    size_t size);
+u_char *ngx_log_ring_reserve(ngx_log_ring_t *ring, size_t len);
+void ngx_log_ring_commit(ngx_log_ring_t *ring, u_char *p, size_t len);
+void ngx_log_ring_flush(ngx_log_ring_t *ring, ngx_log_t *log);
+
+
+#endif /* _NGX_LOG_RING_H_INCLUDED_ */
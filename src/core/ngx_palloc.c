@@ -6,12 +6,86 @@
 
 // 这组头文件和实现文件实现了nginx的内存池
 
+// 这个文件里的内存池申请记在调用者的源文件上
+#define NGX_POOL_PROFILE_CORE  1
+
 #include <ngx_config.h>
 #include <ngx_core.h>
 
 
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static void *ngx_pool_block_alloc(size_t size, ngx_log_t *log);
+static void ngx_pool_block_free(void *p, size_t size);
+#if (NGX_POOL_PROFILE)
+static void ngx_pool_profile_alloc(ngx_pool_t *pool, size_t size,
+    ngx_uint_t large);
+static ngx_pool_profile_entry_t *ngx_pool_profile_entry(
+    ngx_pool_profile_entry_t *table, ngx_uint_t n, void *key, u_char *name,
+    size_t len);
+#endif
+
+
+// 一种大小的空闲内存池块的链表，块的开头用来链接下一块
+typedef struct {
+    size_t                size;
+    ngx_uint_t            n;
+    // 上次整理以来链表最短时的块数，这些块一直没有被用到，整理时释放
+    ngx_uint_t            low;
+    void                **free;
+} ngx_pool_cache_t;
+
+
+#define NGX_POOL_CACHE_SIZES  8
+
+
+// 每个进程私有的内存池块缓存，每种大小最多缓存ngx_pool_cache_max块，为0时不缓存。
+// 连接和请求的内存池大小都是配置好的，所以销毁的块大多可以被后面创建的内存池重用
+static ngx_pool_cache_t  ngx_pool_cache[NGX_POOL_CACHE_SIZES];
+ngx_uint_t               ngx_pool_cache_max;
+
+
+#if (NGX_STAT_STUB)
+
+// 内存池调用malloc()和free()的次数，及从缓存中取得块的次数
+ngx_atomic_t   ngx_stat_pool_mallocs0;
+ngx_atomic_t  *ngx_stat_pool_mallocs = &ngx_stat_pool_mallocs0;
+ngx_atomic_t   ngx_stat_pool_frees0;
+ngx_atomic_t  *ngx_stat_pool_frees = &ngx_stat_pool_frees0;
+ngx_atomic_t   ngx_stat_pool_reused0;
+ngx_atomic_t  *ngx_stat_pool_reused = &ngx_stat_pool_reused0;
+
+#define ngx_pool_stat(stat)  (void) ngx_atomic_fetch_add(stat, 1)
+
+#else
+
+#define ngx_pool_stat(stat)
+
+#endif
+
+
+#if (NGX_POOL_PROFILE)
+
+// 最近一次申请内存池内存的源文件，由ngx_palloc.h中的宏设置
+char                *ngx_pool_site = "unknown";
+// 共享内存中的统计表，由ngx_http_pool_profile_module在创建共享内存时设置
+ngx_pool_profile_t  *ngx_pool_profile;
+
+#define ngx_pool_profile_held(pool, size)                                     \
+    (pool)->held += size;                                                     \
+    if ((pool)->held > (pool)->peak) {                                        \
+        (pool)->peak = (pool)->held;                                          \
+    }
+
+#define ngx_pool_profile_free(pool, l)  (pool)->held -= (l)->size
+
+#else
+
+#define ngx_pool_profile_alloc(pool, size, large)
+#define ngx_pool_profile_held(pool, size)
+#define ngx_pool_profile_free(pool, l)
+
+#endif
 
 
 // 创建一个内存池。
@@ -21,8 +95,8 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    // 申请一块对齐的内存，不同操作系统实现不一样
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    // 申请一块对齐的内存，优先使用缓存的块
+    p = ngx_pool_block_alloc(size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -41,6 +115,14 @@ ngx_create_pool(size_t size, ngx_log_t *log)
     p->cleanup = NULL;
     p->log = log;
 
+#if (NGX_POOL_PROFILE)
+    p->held = (size_t) (p->d.end - (u_char *) p);
+    p->peak = p->held;
+    p->nalloc = 0;
+    p->bytes = 0;
+    p->nlarge = 0;
+#endif
+
     return p;
 }
 
@@ -52,6 +134,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 void
 ngx_destroy_pool(ngx_pool_t *pool)
 {
+    size_t               size;
     ngx_pool_t          *p, *n;
     ngx_pool_large_t    *l;
     ngx_pool_cleanup_t  *c;
@@ -70,6 +153,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
         if (l->alloc) {
             ngx_free(l->alloc);
+            ngx_pool_stat(ngx_stat_pool_frees);
         }
     }
 
@@ -91,8 +175,11 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
 #endif
 
+    // 内存池的每一块都和第一块一样大
+    size = (size_t) (pool->d.end - (u_char *) pool);
+
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_block_free(p, size);
 
         if (n == NULL) {
             break;
@@ -110,6 +197,8 @@ ngx_reset_pool(ngx_pool_t *pool)
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
             ngx_free(l->alloc);
+            ngx_pool_stat(ngx_stat_pool_frees);
+            ngx_pool_profile_free(pool, l);
         }
     }
 
@@ -131,6 +220,8 @@ ngx_palloc(ngx_pool_t *pool, size_t size)
     u_char      *m;
     ngx_pool_t  *p;
 
+    ngx_pool_profile_alloc(pool, size, size > pool->max);
+
     // 如果申请的内存大小小于pool->max就从内存池的池中申请，
     if (size <= pool->max) {
 
@@ -165,6 +256,8 @@ ngx_pnalloc(ngx_pool_t *pool, size_t size)
     u_char      *m;
     ngx_pool_t  *p;
 
+    ngx_pool_profile_alloc(pool, size, size > pool->max);
+
     // 如果申请的内存大小小于pool->max就从内存池的池中申请，
     if (size <= pool->max) {
 
@@ -201,11 +294,13 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_block_alloc(psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
 
+    ngx_pool_profile_held(pool, psize);
+
     new = (ngx_pool_t *) m;
 
     new->d.end = m + psize;
@@ -246,11 +341,17 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
         return NULL;
     }
 
+    ngx_pool_stat(ngx_stat_pool_mallocs);
+
     n = 0;
 
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+#if (NGX_POOL_PROFILE)
+            large->size = size;
+            ngx_pool_profile_held(pool, size);
+#endif
             return p;
         }
 
@@ -262,6 +363,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
     if (large == NULL) {
         ngx_free(p);
+        ngx_pool_stat(ngx_stat_pool_frees);
         return NULL;
     }
 
@@ -269,6 +371,11 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     large->next = pool->large;
     pool->large = large;
 
+#if (NGX_POOL_PROFILE)
+    large->size = size;
+    ngx_pool_profile_held(pool, size);
+#endif
+
     return p;
 }
 
@@ -279,14 +386,19 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     void              *p;
     ngx_pool_large_t  *large;
 
+    ngx_pool_profile_alloc(pool, size, 1);
+
     p = ngx_memalign(alignment, size, pool->log);
     if (p == NULL) {
         return NULL;
     }
 
+    ngx_pool_stat(ngx_stat_pool_mallocs);
+
     large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
     if (large == NULL) {
         ngx_free(p);
+        ngx_pool_stat(ngx_stat_pool_frees);
         return NULL;
     }
 
@@ -294,6 +406,11 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     large->next = pool->large;
     pool->large = large;
 
+#if (NGX_POOL_PROFILE)
+    large->size = size;
+    ngx_pool_profile_held(pool, size);
+#endif
+
     return p;
 }
 
@@ -308,6 +425,8 @@ ngx_pfree(ngx_pool_t *pool, void *p)
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
             ngx_free(l->alloc);
+            ngx_pool_stat(ngx_stat_pool_frees);
+            ngx_pool_profile_free(pool, l);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -332,6 +451,124 @@ ngx_pcalloc(ngx_pool_t *pool, size_t size)
 }
 
 
+// 申请内存池的一块，有同样大小的缓存块时直接使用
+static void *
+ngx_pool_block_alloc(size_t size, ngx_log_t *log)
+{
+    void              *p;
+    ngx_uint_t         i;
+    ngx_pool_cache_t  *cache;
+
+    for (i = 0; ngx_pool_cache_max && i < NGX_POOL_CACHE_SIZES; i++) {
+        cache = &ngx_pool_cache[i];
+
+        if (cache->size != size) {
+            continue;
+        }
+
+        if (cache->n == 0) {
+            break;
+        }
+
+        p = cache->free;
+        cache->free = *cache->free;
+
+        if (--cache->n < cache->low) {
+            cache->low = cache->n;
+        }
+
+        ngx_pool_stat(ngx_stat_pool_reused);
+
+        return p;
+    }
+
+    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+
+    if (p) {
+        ngx_pool_stat(ngx_stat_pool_mallocs);
+    }
+
+    return p;
+}
+
+
+// 释放内存池的一块，缓存没满时放入缓存。还没有这种大小的缓存时占用一个空位
+static void
+ngx_pool_block_free(void *p, size_t size)
+{
+    ngx_uint_t         i;
+    ngx_pool_cache_t  *cache, *empty;
+
+    empty = NULL;
+
+    for (i = 0; ngx_pool_cache_max && i < NGX_POOL_CACHE_SIZES; i++) {
+        cache = &ngx_pool_cache[i];
+
+        if (cache->size == 0) {
+            if (empty == NULL) {
+                empty = cache;
+            }
+
+            continue;
+        }
+
+        if (cache->size == size) {
+            empty = cache;
+            break;
+        }
+    }
+
+    if (empty && empty->n < ngx_pool_cache_max) {
+        empty->size = size;
+
+        *(void **) p = empty->free;
+        empty->free = p;
+        empty->n++;
+
+        return;
+    }
+
+    ngx_free(p);
+    ngx_pool_stat(ngx_stat_pool_frees);
+}
+
+
+// 定时调用，释放上次整理以来一直没有用到的缓存块，
+// 空闲时缓存会逐渐清空，不再用到的大小让出位置给别的大小
+void
+ngx_pool_cache_trim(void)
+{
+    void              *p;
+    ngx_uint_t         i;
+    ngx_pool_cache_t  *cache;
+
+    for (i = 0; i < NGX_POOL_CACHE_SIZES; i++) {
+        cache = &ngx_pool_cache[i];
+
+        if (cache->size == 0) {
+            continue;
+        }
+
+        if (cache->n == 0 && cache->low == 0) {
+            cache->size = 0;
+            continue;
+        }
+
+        while (cache->low) {
+            p = cache->free;
+            cache->free = *cache->free;
+            cache->n--;
+            cache->low--;
+
+            ngx_free(p);
+            ngx_pool_stat(ngx_stat_pool_frees);
+        }
+
+        cache->low = cache->n;
+    }
+}
+
+
 // 添加一个销毁pool时的回调函数节点
 ngx_pool_cleanup_t *
 ngx_pool_cleanup_add(ngx_pool_t *p, size_t size)
@@ -426,6 +663,119 @@ ngx_pool_delete_file(void *data)
 }
 
 
+#if (NGX_POOL_PROFILE)
+
+// 记一次申请：内存池自己的统计，以及共享内存中按源文件的统计
+static void
+ngx_pool_profile_alloc(ngx_pool_t *pool, size_t size, ngx_uint_t large)
+{
+    u_char                    *name;
+    ngx_pool_profile_entry_t  *e;
+
+    pool->nalloc++;
+    pool->bytes += size;
+    pool->nlarge += large;
+
+    if (ngx_pool_profile == NULL) {
+        return;
+    }
+
+    // 只显示文件名，大多数情况下就是模块名
+    name = (u_char *) ngx_pool_site + ngx_strlen(ngx_pool_site);
+
+    while (name > (u_char *) ngx_pool_site && name[-1] != '/') {
+        name--;
+    }
+
+    e = ngx_pool_profile_entry(ngx_pool_profile->sites,
+                               ngx_pool_profile->nsites, ngx_pool_site,
+                               name, ngx_strlen(name));
+    if (e == NULL) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&e->count, 1);
+    (void) ngx_atomic_fetch_add(&e->bytes, size);
+
+    if (large) {
+        (void) ngx_atomic_fetch_add(&e->large, 1);
+    }
+}
+
+
+// 把一个即将销毁的内存池的统计加到key对应的统计上，
+// http模块在销毁请求的内存池前调用，key是请求所在location的配置
+void
+ngx_pool_profile_account(ngx_pool_t *pool, void *key, ngx_str_t *name)
+{
+    ngx_atomic_uint_t          peak;
+    ngx_pool_profile_entry_t  *e;
+
+    if (ngx_pool_profile == NULL) {
+        return;
+    }
+
+    e = ngx_pool_profile_entry(ngx_pool_profile->locations,
+                               ngx_pool_profile->nlocations, key,
+                               name->data, name->len);
+    if (e == NULL) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&e->requests, 1);
+    (void) ngx_atomic_fetch_add(&e->count, pool->nalloc);
+    (void) ngx_atomic_fetch_add(&e->bytes, pool->bytes);
+    (void) ngx_atomic_fetch_add(&e->large, pool->nlarge);
+
+    for ( ;; ) {
+        peak = e->peak;
+
+        if (pool->peak <= peak
+            || ngx_atomic_cmp_set(&e->peak, peak, pool->peak))
+        {
+            break;
+        }
+    }
+}
+
+
+// 在开放定址的表中查找key对应的统计，没有时用cmp_set占用一个空位，表满时返回NULL
+static ngx_pool_profile_entry_t *
+ngx_pool_profile_entry(ngx_pool_profile_entry_t *table, ngx_uint_t n,
+    void *key, u_char *name, size_t len)
+{
+    ngx_uint_t         i, k;
+    ngx_atomic_uint_t  key0;
+
+    key0 = (ngx_atomic_uint_t) (uintptr_t) key;
+
+    // 地址的低几位总是对齐的0
+    k = (ngx_uint_t) ((key0 >> 4) % n);
+
+    for (i = 0; i < n; i++, k = (k + 1) % n) {
+
+        if (table[k].key == 0 && ngx_atomic_cmp_set(&table[k].key, 0, key0)) {
+            // 名字在占用之后写入，读统计的一方可能短暂地看到空的名字
+            len = ngx_min(len, NGX_POOL_PROFILE_NAME_LEN - 1);
+            ngx_memcpy(table[k].name, name, len);
+            table[k].name[len] = '\0';
+
+            return &table[k];
+        }
+
+        /* also catches another process that has just taken it for key */
+
+        if (table[k].key == key0) {
+            return &table[k];
+        }
+    }
+
+    return NULL;
+}
+
+#endif
+
+
 #if 0
 
 static void *
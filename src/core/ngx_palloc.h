@@ -48,6 +48,9 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;
     void                 *alloc;
+#if (NGX_POOL_PROFILE)
+    size_t                size;
+#endif
 };
 
 typedef struct {
@@ -71,6 +74,15 @@ struct ngx_pool_s {
     // 销毁内存池时的回调函数链表。
     ngx_pool_cleanup_t   *cleanup;
     ngx_log_t            *log;
+#if (NGX_POOL_PROFILE)
+    // 内存池当前占用和最多占用的内存，包括池的各块和大块内存
+    size_t                held;
+    size_t                peak;
+    // 申请的次数、字节数和其中大块内存的次数
+    ngx_uint_t            nalloc;
+    size_t                bytes;
+    ngx_uint_t            nlarge;
+#endif
 };
 
 
@@ -81,6 +93,34 @@ typedef struct {
 } ngx_pool_cleanup_file_t;
 
 
+#if (NGX_POOL_PROFILE)
+
+#define NGX_POOL_PROFILE_NAME_LEN  64
+
+// 共享内存中的一条内存池统计，
+// 按申请内存的源文件统计时key是__FILE__的地址，按location统计时key是location配置的地址
+typedef struct {
+    ngx_atomic_t          key;
+    ngx_atomic_t          count;
+    ngx_atomic_t          bytes;
+    ngx_atomic_t          large;
+    // 以下两项只用于location：请求数和单个请求内存池占用内存的最大值
+    ngx_atomic_t          requests;
+    ngx_atomic_t          peak;
+    u_char                name[NGX_POOL_PROFILE_NAME_LEN];
+} ngx_pool_profile_entry_t;
+
+
+typedef struct {
+    ngx_pool_profile_entry_t  *sites;
+    ngx_uint_t                 nsites;
+    ngx_pool_profile_entry_t  *locations;
+    ngx_uint_t                 nlocations;
+} ngx_pool_profile_t;
+
+#endif
+
+
 void *ngx_alloc(size_t size, ngx_log_t *log);
 void *ngx_calloc(size_t size, ngx_log_t *log);
 
@@ -95,10 +135,52 @@ void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment);
 ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
 
 
+void ngx_pool_cache_trim(void);
+
 ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
 void ngx_pool_run_cleanup_file(ngx_pool_t *p, ngx_fd_t fd);
 void ngx_pool_cleanup_file(void *data);
 void ngx_pool_delete_file(void *data);
 
+#if (NGX_POOL_PROFILE)
+void ngx_pool_profile_account(ngx_pool_t *pool, void *key, ngx_str_t *name);
+#endif
+
+
+extern ngx_uint_t     ngx_pool_cache_max;
+
+#if (NGX_STAT_STUB)
+
+extern ngx_atomic_t  *ngx_stat_pool_mallocs;
+extern ngx_atomic_t  *ngx_stat_pool_frees;
+extern ngx_atomic_t  *ngx_stat_pool_reused;
+
+#endif
+
+
+#if (NGX_POOL_PROFILE)
+
+extern char                *ngx_pool_site;
+extern ngx_pool_profile_t  *ngx_pool_profile;
+
+#endif
+
+
+#if (NGX_POOL_PROFILE && !NGX_POOL_PROFILE_CORE)
+
+// 分析模式下每次申请前记下调用者的源文件，
+// 内存池的实现文件定义了NGX_POOL_PROFILE_CORE，沿用调用者记下的源文件
+
+#define ngx_palloc(pool, size)                                                \
+    (ngx_pool_site = __FILE__, ngx_palloc(pool, size))
+#define ngx_pnalloc(pool, size)                                               \
+    (ngx_pool_site = __FILE__, ngx_pnalloc(pool, size))
+#define ngx_pcalloc(pool, size)                                               \
+    (ngx_pool_site = __FILE__, ngx_pcalloc(pool, size))
+#define ngx_pmemalign(pool, size, alignment)                                  \
+    (ngx_pool_site = __FILE__, ngx_pmemalign(pool, size, alignment))
+
+#endif
+
 
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
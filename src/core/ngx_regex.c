@@ -21,6 +21,8 @@ static void ngx_libc_cdecl ngx_regex_free(void *p);
 static void ngx_pcre_free_studies(void *data);
 #endif
 
+static ngx_uint_t ngx_regex_has_references(u_char *p);
+
 static ngx_int_t ngx_regex_module_init(ngx_cycle_t *cycle);
 
 static void *ngx_regex_create_conf(ngx_cycle_t *cycle);
@@ -213,6 +215,155 @@ failed:
 }
 
 
+// 把n个已编译的正则表达式合并成一个"(?J)(?:re1\E)|(?i:re2\E)|..."形式的正则表达式，
+// 合并后的正则表达式匹配当且仅当其中至少有一个参与合并的正则表达式匹配，一次执行就能排除它们全部不匹配的情况。
+// 按编号或名字引用子模式的正则表达式合并后语义会改变，这时返回NGX_DECLINED；
+// 含有"(*"的正则表达式（(*COMMIT)、(*PRUNE)、(*SKIP)、(*ACCEPT)这类回溯控制动词会改变整个
+// 选择结构的匹配结果）不参与合并，调用者要单独执行它们，见ngx_regex_has_verbs()
+ngx_int_t
+ngx_regex_compile_set(ngx_regex_compile_t *rc, ngx_regex_elt_t *elts,
+    ngx_uint_t n)
+{
+    int                 backrefs;
+    u_char             *p;
+    size_t              len;
+    ngx_uint_t          i, merged;
+    unsigned long int   options;
+
+    len = 0;
+    merged = 0;
+
+    for (i = 0; i < n; i++) {
+
+        if (ngx_regex_has_verbs(elts[i].name)) {
+            continue;
+        }
+
+        if (pcre_fullinfo(elts[i].regex->code, NULL, PCRE_INFO_BACKREFMAX,
+                          &backrefs)
+            != 0
+            || pcre_fullinfo(elts[i].regex->code, NULL, PCRE_INFO_OPTIONS,
+                             &options)
+               != 0)
+        {
+            return NGX_DECLINED;
+        }
+
+        if (backrefs || ngx_regex_has_references(elts[i].name)) {
+            return NGX_DECLINED;
+        }
+
+        len += ngx_strlen(elts[i].name) + sizeof("|(?i:\\E)") - 1;
+        merged++;
+    }
+
+    if (merged == 0) {
+        return NGX_DECLINED;
+    }
+
+    rc->pattern.data = ngx_pnalloc(rc->pool, sizeof("(?J)") - 1 + len + 1);
+    if (rc->pattern.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the same names of subpatterns may be used in different regexes */
+
+    p = ngx_cpymem(rc->pattern.data, "(?J)", sizeof("(?J)") - 1);
+
+    merged = 0;
+
+    for (i = 0; i < n; i++) {
+
+        if (ngx_regex_has_verbs(elts[i].name)) {
+            continue;
+        }
+
+        if (merged++) {
+            *p++ = '|';
+        }
+
+        (void) pcre_fullinfo(elts[i].regex->code, NULL, PCRE_INFO_OPTIONS,
+                             &options);
+
+        /* "\E" terminates an unterminated "\Q" of the pattern */
+
+        if (options & PCRE_CASELESS) {
+            p = ngx_sprintf(p, "(?i:%s\\E)", elts[i].name);
+
+        } else {
+            p = ngx_sprintf(p, "(?:%s\\E)", elts[i].name);
+        }
+    }
+
+    *p = '\0';
+
+    rc->pattern.len = p - rc->pattern.data;
+    rc->options = 0;
+
+    return ngx_regex_compile(rc);
+}
+
+
+// 检查正则表达式中是否有"(*"开头的回溯控制动词或者选项设置，有的话不能参与合并。
+// 转义的"\\(*"和字符类中的"[(*]"也算在内，只是少合并一个正则表达式而已
+ngx_uint_t
+ngx_regex_has_verbs(u_char *p)
+{
+    return ngx_strstr(p, "(*") != NULL;
+}
+
+
+// 检查正则表达式中是否有按编号或名字引用子模式的语法，
+// 比如"\g1"、"\k<name>"、"(?1)"、"(?R)"、"(?&name)"和"(?(1)...)"
+static ngx_uint_t
+ngx_regex_has_references(u_char *p)
+{
+    for ( /* void */ ; *p; p++) {
+
+        if (*p == '\\') {
+            if (p[1] == 'g' || p[1] == 'k') {
+                return 1;
+            }
+
+            if (p[1] != '\0') {
+                p++;
+            }
+
+            continue;
+        }
+
+        if (p[0] != '(' || p[1] != '?') {
+            continue;
+        }
+
+        switch (p[2]) {
+
+        case 'R':
+        case '&':
+        case '(':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return 1;
+
+        case '+':
+        case '-':
+            if (p[3] >= '0' && p[3] <= '9') {
+                return 1;
+            }
+            break;
+
+        case 'P':
+            if (p[3] == '>' || p[3] == '=') {
+                return 1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
 // 检查一个具体字符串是否和之前定义的一组模版中的任意一个匹配
 ngx_int_t
 ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log)
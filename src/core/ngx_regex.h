@@ -53,6 +53,9 @@ typedef struct {
 
 void ngx_regex_init(void);
 ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
+ngx_int_t ngx_regex_compile_set(ngx_regex_compile_t *rc, ngx_regex_elt_t *elts,
+    ngx_uint_t n);
+ngx_uint_t ngx_regex_has_verbs(u_char *p);
 
 // 检查一个具体字符串是否和之前定义的一个正则表达式模版匹配
 #define ngx_regex_exec(re, s, captures, size)                                \
@@ -60,6 +63,10 @@ ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
               captures, size)
 #define ngx_regex_exec_n      "pcre_exec()"
 
+// 执行时超过了PCRE的回溯次数或者递归深度的限制，不能说明是否匹配
+#define ngx_regex_exec_limited(rc)                                           \
+    ((rc) == PCRE_ERROR_MATCHLIMIT || (rc) == PCRE_ERROR_RECURSIONLIMIT)
+
 ngx_int_t ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log);
 
 
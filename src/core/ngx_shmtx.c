@@ -16,24 +16,47 @@
 
 
 static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx);
+static void ngx_shmtx_locked(ngx_shmtx_t *mtx, struct timeval *start);
+
+
+#define NGX_SHMTX_MIN_SPIN  16
+
+
+#if (NGX_HAVE_FUTEX)
+
+// futex只能等待32位的值，锁的原子变量中保存的是pid，等待它的低32位
+#if (NGX_HAVE_LITTLE_ENDIAN || NGX_PTR_SIZE == 4)
+#define ngx_shmtx_futex_addr(lock)  ((uint32_t *) (lock))
+#else
+#define ngx_shmtx_futex_addr(lock)  ((uint32_t *) (lock) + 1)
+#endif
+
+#endif
+
 
 // 支持原子变量时的初始化锁函数
 // 这个函数只使用第二个参数，使用文件锁时才使用第三个参数。
-// 这个函数使用原子变量和信号量共同加锁，一方面让较短时间的锁有较高性能，
+// 这个函数使用原子变量和futex(或信号量)共同加锁，一方面让较短时间的锁有较高性能，
 // 另一方面防止以自旋锁形式长期等待。
 // mtx[out]: 被初始化的互斥锁对象
 ngx_int_t
 ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 {
     mtx->lock = &addr->lock;
+    mtx->sh = addr;
 
     if (mtx->spin == (ngx_uint_t) -1) {
         return NGX_OK;
     }
 
     mtx->spin = 2048;
+    mtx->spins = mtx->spin;
 
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    mtx->wait = &addr->wait;
+
+#elif (NGX_HAVE_POSIX_SEM)
 
     mtx->wait = &addr->wait;
 
@@ -54,7 +77,7 @@ ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 void
 ngx_shmtx_destroy(ngx_shmtx_t *mtx)
 {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
 
     if (mtx->semaphore) {
         if (sem_destroy(&mtx->sem) == -1) {
@@ -72,47 +95,118 @@ ngx_shmtx_destroy(ngx_shmtx_t *mtx)
 ngx_uint_t
 ngx_shmtx_trylock(ngx_shmtx_t *mtx)
 {
-    return (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid));
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        (void) ngx_atomic_fetch_add(&mtx->sh->locks, 1);
+        return 1;
+    }
+
+    return 0;
 }
 
 
-// 支持原子变量时以阻塞的方式获得锁
+// 支持原子变量时以阻塞的方式获得锁。
+// 先自旋等待，自旋的上限随持有锁的进程是否在推进调整：自旋期间锁换了主人
+// 说明锁在正常流转，自旋中获得锁时上限加倍；整个自旋期间都是同一个进程持有锁时
+// 说明它可能在做耗时的操作或者被调度出去了，上限减半，尽早休眠
 void
 ngx_shmtx_lock(ngx_shmtx_t *mtx)
 {
-    ngx_uint_t         i, n;
+    ngx_uint_t         i, n, moved;
+    struct timeval     start;
+    ngx_atomic_uint_t  owner, lock;
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx lock");
 
-    for ( ;; ) {
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        (void) ngx_atomic_fetch_add(&mtx->sh->locks, 1);
+        return;
+    }
 
-        if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
-            return;
-        }
+    ngx_gettimeofday(&start);
+
+    for ( ;; ) {
 
         if (ngx_ncpu > 1) {
 
-            for (n = 1; n < mtx->spin; n <<= 1) {
+            owner = *mtx->lock;
+            moved = 0;
+
+            for (n = 1; n < mtx->spins; n <<= 1) {
 
                 for (i = 0; i < n; i++) {
                     ngx_cpu_pause();
                 }
 
-                if (*mtx->lock == 0
-                    && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
-                {
+                lock = *mtx->lock;
+
+                if (lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+
+                    if (mtx->spins < mtx->spin) {
+                        mtx->spins <<= 1;
+                    }
+
+                    ngx_shmtx_locked(mtx, &start);
                     return;
                 }
+
+                if (lock != owner) {
+                    owner = lock;
+                    moved = 1;
+                }
+            }
+
+            if (!moved && mtx->spins > NGX_SHMTX_MIN_SPIN) {
+                mtx->spins >>= 1;
             }
         }
 
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+        // 当长时间不能获取锁时，在锁的原子变量上休眠，解锁时如果有进程在等待会唤醒一个
+        (void) ngx_atomic_fetch_add(mtx->wait, 1);
+
+        lock = *mtx->lock;
+
+        if (lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+            (void) ngx_atomic_fetch_add(mtx->wait, -1);
+            ngx_shmtx_locked(mtx, &start);
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "shmtx wait %uA", *mtx->wait);
+
+        // 锁的值不再是lock时立即返回，所以不会错过休眠前发生的解锁
+        if (lock
+            && syscall(SYS_futex, ngx_shmtx_futex_addr(mtx->lock), FUTEX_WAIT,
+                       (uint32_t) lock, NULL, NULL, 0)
+               == -1)
+        {
+            ngx_err_t  err;
+
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                              "futex(FUTEX_WAIT) failed while waiting on shmtx");
+            }
+        }
+
+        (void) ngx_atomic_fetch_add(mtx->wait, -1);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "shmtx awoke");
+
+        continue;
+
+#elif (NGX_HAVE_POSIX_SEM)
 
         // 当长时间不能获取锁时，进入休眠，减少cpu消耗
         if (mtx->semaphore) {
             (void) ngx_atomic_fetch_add(mtx->wait, 1);
 
             if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+                ngx_shmtx_locked(mtx, &start);
                 return;
             }
 
@@ -140,6 +234,32 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 #endif
 
         ngx_sched_yield();
+
+        if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+            ngx_shmtx_locked(mtx, &start);
+            return;
+        }
+    }
+}
+
+
+// 经过等待获得了锁，记录统计
+static void
+ngx_shmtx_locked(ngx_shmtx_t *mtx, struct timeval *start)
+{
+    struct timeval     tv;
+    ngx_atomic_int_t   usec;
+
+    ngx_gettimeofday(&tv);
+
+    usec = (tv.tv_sec - start->tv_sec) * 1000000
+           + (tv.tv_usec - start->tv_usec);
+
+    (void) ngx_atomic_fetch_add(&mtx->sh->locks, 1);
+    (void) ngx_atomic_fetch_add(&mtx->sh->contended, 1);
+
+    if (usec > 0) {
+        (void) ngx_atomic_fetch_add(&mtx->sh->wait_time, usec);
     }
 }
 
@@ -173,11 +293,28 @@ ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid)
 }
 
 
-// 支持原子变量时的打开等待的信号量
+// 支持原子变量时唤醒一个休眠等待锁的进程
 static void
 ngx_shmtx_wakeup(ngx_shmtx_t *mtx)
 {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    if (mtx->spin == (ngx_uint_t) -1 || *mtx->wait == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "shmtx wake %uA", *mtx->wait);
+
+    if (syscall(SYS_futex, ngx_shmtx_futex_addr(mtx->lock), FUTEX_WAKE, 1,
+                NULL, NULL, 0)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "futex(FUTEX_WAKE) failed while wake shmtx");
+    }
+
+#elif (NGX_HAVE_POSIX_SEM)
     ngx_atomic_uint_t  wait;
 
     if (!mtx->semaphore) {
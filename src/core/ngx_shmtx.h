@@ -17,9 +17,16 @@
 
 typedef struct {
     ngx_atomic_t   lock;
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM || NGX_HAVE_FUTEX)
     ngx_atomic_t   wait;
 #endif
+    // 锁的统计，放在共享内存中，是所有进程的合计
+    // 获得锁的次数
+    ngx_atomic_t   locks;
+    // 其中第一次尝试没有获得锁的次数
+    ngx_atomic_t   contended;
+    // 等待锁的总时间，单位微秒
+    ngx_atomic_t   wait_time;
 } ngx_shmtx_sh_t;
 
 
@@ -27,23 +34,29 @@ typedef struct {
 typedef struct {
 #if (NGX_HAVE_ATOMIC_OPS)
     // 自旋锁使用的原子变量
-    ngx_atomic_t  *lock;
+    ngx_atomic_t    *lock;
+#if (NGX_HAVE_POSIX_SEM || NGX_HAVE_FUTEX)
+    // 标识有几个进程在休眠等待
+    ngx_atomic_t    *wait;
+#endif
 #if (NGX_HAVE_POSIX_SEM)
-    // 标识有几个信号量在等待
-    ngx_atomic_t  *wait;
     // 如果为1信号量初始化成功可以使用
-    ngx_uint_t     semaphore;
+    ngx_uint_t       semaphore;
     // 信号量
-    sem_t          sem;
+    sem_t            sem;
 #endif
+    // 锁的统计
+    ngx_shmtx_sh_t  *sh;
 #else
     // 文件锁才用
-    ngx_fd_t       fd;
+    ngx_fd_t         fd;
     // 文件锁才用
-    u_char        *name;
+    u_char          *name;
 #endif
     // 如果为-1说明是自旋锁,不为-1将决定自旋多少次进入信号量等待
-    ngx_uint_t     spin;
+    ngx_uint_t       spin;
+    // 当前的自旋上限，在16和spin之间根据持有锁的进程是否在推进调整
+    ngx_uint_t       spins;
 } ngx_shmtx_t;
 
 
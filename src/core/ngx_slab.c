@@ -66,6 +66,15 @@ static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages);
 static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
+static ngx_int_t ngx_slab_cache_init_locked(ngx_slab_cache_t *cache);
+static ngx_int_t ngx_slab_cache_slot(ngx_slab_cache_t *cache, void *p);
+static ngx_uint_t ngx_slab_cache_refill_locked(ngx_slab_cache_t *cache,
+    ngx_uint_t slot);
+static void ngx_slab_cache_drain_locked(ngx_slab_cache_t *cache,
+    ngx_uint_t slot);
+static void ngx_slab_cache_cleanup(void *data);
+static ngx_uint_t ngx_slab_cache_reclaim_locked(ngx_slab_pool_t *pool,
+    ngx_pid_t pid);
 
 
 static ngx_uint_t  ngx_slab_max_size;
@@ -73,8 +82,8 @@ static ngx_uint_t  ngx_slab_exact_size;
 static ngx_uint_t  ngx_slab_exact_shift;
 
 
-// |--------------|--------------|-----------|
-//    ngx_slab_t      slot数组      
+// |--------------|--------------|--------------|-----------|
+//    ngx_slab_t      slot数组       slot统计数组     页数组
 //
 // 初始化slab内存区
 // pool[in&out]: 指针
@@ -98,6 +107,7 @@ ngx_slab_init(ngx_slab_pool_t *pool)
     /**/
 
     pool->min_size = 1 << pool->min_shift;
+    pool->caches = NULL;
 
     // p指向slot数组。
     p = (u_char *) pool + sizeof(ngx_slab_pool_t);
@@ -117,6 +127,13 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 
     p += n * sizeof(ngx_slab_page_t);
 
+    pool->stats = (ngx_slab_stat_t *) p;
+    ngx_memzero(pool->stats, n * sizeof(ngx_slab_stat_t));
+
+    p += n * sizeof(ngx_slab_stat_t);
+
+    size -= n * (sizeof(ngx_slab_page_t) + sizeof(ngx_slab_stat_t));
+
     pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t)));
 
     ngx_memzero(p, pages * sizeof(ngx_slab_page_t));
@@ -140,6 +157,8 @@ ngx_slab_init(ngx_slab_pool_t *pool)
         pool->pages->slab = pages;
     }
 
+    pool->pfree = pages;
+
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
     pool->zero = '\0';
@@ -203,6 +222,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
     ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                    "slab alloc: %uz slot: %ui", size, slot);
 
+    pool->stats[slot].reqs++;
+
     slots = (ngx_slab_page_t *) ((u_char *) pool + sizeof(ngx_slab_pool_t));
     page = slots[slot].next;
 
@@ -236,6 +257,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                                      if (bitmap[n] != NGX_SLAB_BUSY) {
                                          p = (uintptr_t) bitmap + i;
 
+                                         pool->stats[slot].used++;
+
                                          goto done;
                                      }
                                 }
@@ -251,6 +274,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
                             p = (uintptr_t) bitmap + i;
 
+                            pool->stats[slot].used++;
+
                             goto done;
                         }
                     }
@@ -286,6 +311,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         p += i << shift;
                         p += (uintptr_t) pool->start;
 
+                        pool->stats[slot].used++;
+
                         goto done;
                     }
                 }
@@ -328,6 +355,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         p += i << shift;
                         p += (uintptr_t) pool->start;
 
+                        pool->stats[slot].used++;
+
                         goto done;
                     }
                 }
@@ -369,6 +398,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             p = ((page - pool->pages) << ngx_pagesize_shift) + s * n;
             p += (uintptr_t) pool->start;
 
+            pool->stats[slot].total += (ngx_pagesize >> shift) - n;
+            pool->stats[slot].used++;
+
             goto done;
 
         } else if (shift == ngx_slab_exact_shift) {
@@ -382,6 +414,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             p = (page - pool->pages) << ngx_pagesize_shift;
             p += (uintptr_t) pool->start;
 
+            pool->stats[slot].total += 8 * sizeof(uintptr_t);
+            pool->stats[slot].used++;
+
             goto done;
 
         } else { /* shift > ngx_slab_exact_shift */
@@ -395,12 +430,17 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             p = (page - pool->pages) << ngx_pagesize_shift;
             p += (uintptr_t) pool->start;
 
+            pool->stats[slot].total += ngx_pagesize >> shift;
+            pool->stats[slot].used++;
+
             goto done;
         }
     }
 
     p = 0;
 
+    pool->stats[slot].fails++;
+
 done:
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %p", p);
@@ -432,7 +472,7 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab free: %p", p);
 
-    if ((u_char *) p < pool->start || (u_char *) p > pool->end) {
+    if ((u_char *) p < pool->start || (u_char *) p >= pool->end) {
         ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): outside of pool");
         goto fail;
     }
@@ -460,11 +500,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                              ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
 
         if (bitmap[n] & m) {
+            slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
                 slots = (ngx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = shift - pool->min_shift;
 
                 page->next = slots[slot].next;
                 slots[slot].next = page;
@@ -481,20 +521,24 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 n = 1;
             }
 
+            pool->stats[slot].used--;
+
             if (bitmap[0] & ~(((uintptr_t) 1 << n) - 1)) {
                 goto done;
             }
 
             map = (1 << (ngx_pagesize_shift - shift)) / (sizeof(uintptr_t) * 8);
 
-            for (n = 1; n < map; n++) {
-                if (bitmap[n]) {
+            for (m = 1; m < map; m++) {
+                if (bitmap[m]) {
                     goto done;
                 }
             }
 
             ngx_slab_free_pages(pool, page, 1);
 
+            pool->stats[slot].total -= (ngx_pagesize >> shift) - n;
+
             goto done;
         }
 
@@ -511,10 +555,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         }
 
         if (slab & m) {
+            slot = ngx_slab_exact_shift - pool->min_shift;
+
             if (slab == NGX_SLAB_BUSY) {
                 slots = (ngx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = ngx_slab_exact_shift - pool->min_shift;
 
                 page->next = slots[slot].next;
                 slots[slot].next = page;
@@ -525,12 +570,16 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
             page->slab &= ~m;
 
+            pool->stats[slot].used--;
+
             if (page->slab) {
                 goto done;
             }
 
             ngx_slab_free_pages(pool, page, 1);
 
+            pool->stats[slot].total -= 8 * sizeof(uintptr_t);
+
             goto done;
         }
 
@@ -549,11 +598,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                               + NGX_SLAB_MAP_SHIFT);
 
         if (slab & m) {
+            slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
                 slots = (ngx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = shift - pool->min_shift;
 
                 page->next = slots[slot].next;
                 slots[slot].next = page;
@@ -564,12 +613,16 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
             page->slab &= ~m;
 
+            pool->stats[slot].used--;
+
             if (page->slab & NGX_SLAB_MAP_MASK) {
                 goto done;
             }
 
             ngx_slab_free_pages(pool, page, 1);
 
+            pool->stats[slot].total -= ngx_pagesize >> shift;
+
             goto done;
         }
 
@@ -659,6 +712,8 @@ ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
             page->next = NULL;
             page->prev = NGX_SLAB_PAGE;
 
+            pool->pfree -= pages;
+
             if (--pages == 0) {
                 return page;
             }
@@ -675,8 +730,9 @@ ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
     }
 
     if (pool->log_nomem) {
-        ngx_slab_error(pool, NGX_LOG_CRIT,
-                       "ngx_slab_alloc() failed: no memory");
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                      "ngx_slab_alloc() failed: no memory for %ui pages, "
+                      "%ui pages free%s", pages, pool->pfree, pool->log_ctx);
     }
 
     return NULL;
@@ -689,6 +745,8 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
 {
     ngx_slab_page_t  *prev;
 
+    pool->pfree += pages;
+
     page->slab = pages--;
 
     if (pages) {
@@ -710,6 +768,414 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
 }
 
 
+// 统计空闲页的数量和碎片情况，调用前要加锁。
+// 空闲页链表的每个节点是一段连续的空闲页，释放时相邻的段不会合并，
+// 所以超过一页的申请只能从单独一段中分配
+void
+ngx_slab_pages_stat_locked(ngx_slab_pool_t *pool, ngx_slab_pages_stat_t *stat)
+{
+    ngx_slab_page_t  *page;
+
+    stat->pages = (pool->end - pool->start) / ngx_pagesize;
+    stat->free = 0;
+    stat->runs = 0;
+    stat->largest = 0;
+
+    for (page = pool->free.next; page != &pool->free; page = page->next) {
+        stat->free += page->slab;
+        stat->runs++;
+
+        if (page->slab > stat->largest) {
+            stat->largest = page->slab;
+        }
+    }
+}
+
+
+// 创建一个内存块缓存，size是每种大小的内存块最多缓存的块数，为0时不缓存。
+// 在读配置时创建，fork之后每个worker各有一份。内存池在共享内存初始化之后才设置，
+// magazine在进程第一次从内存池补充时才在共享内存中分配。
+// 缓存的块在进程退出销毁cycle->pool时还给内存池，
+// 进程异常退出时由master进程在ngx_slab_cache_reclaim()中还
+ngx_slab_cache_t *
+ngx_slab_cache_create(ngx_pool_t *pool, ngx_uint_t size)
+{
+    ngx_slab_cache_t    *cache;
+    ngx_pool_cleanup_t  *cln;
+
+    cache = ngx_pcalloc(pool, sizeof(ngx_slab_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->size = size;
+
+    if (size == 0) {
+        return cache;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_slab_cache_cleanup;
+    cln->data = cache;
+
+    return cache;
+}
+
+
+// 从缓存中取一块size大小的内存，缓存空了时加锁从内存池批量补充
+void *
+ngx_slab_cache_alloc(ngx_slab_cache_t *cache, size_t size)
+{
+    void                 *p;
+    size_t                s;
+    ngx_uint_t            shift;
+    ngx_slab_magazine_t  *mag;
+
+    if (cache->size == 0 || size >= ngx_slab_max_size) {
+        return ngx_slab_alloc(cache->pool, size);
+    }
+
+    if (cache->mags) {
+
+        if (size > cache->pool->min_size) {
+            shift = 1;
+            for (s = size - 1; s >>= 1; shift++) { /* void */ }
+
+        } else {
+            shift = cache->pool->min_shift;
+        }
+
+        mag = &cache->mags[shift - cache->pool->min_shift];
+
+        if (mag->n) {
+            return mag->chunks[--mag->n];
+        }
+    }
+
+    ngx_shmtx_lock(&cache->pool->mutex);
+
+    p = ngx_slab_cache_alloc_locked(cache, size);
+
+    ngx_shmtx_unlock(&cache->pool->mutex);
+
+    return p;
+}
+
+
+// 同ngx_slab_cache_alloc()，调用前已对内存池加锁
+void *
+ngx_slab_cache_alloc_locked(ngx_slab_cache_t *cache, size_t size)
+{
+    size_t                s;
+    ngx_uint_t            i, slot, shift;
+    ngx_slab_magazine_t  *mag;
+
+    if (cache->size == 0 || size >= ngx_slab_max_size) {
+        return ngx_slab_alloc_locked(cache->pool, size);
+    }
+
+    if (cache->mags == NULL && ngx_slab_cache_init_locked(cache) != NGX_OK) {
+        return ngx_slab_alloc_locked(cache->pool, size);
+    }
+
+    if (size > cache->pool->min_size) {
+        shift = 1;
+        for (s = size - 1; s >>= 1; shift++) { /* void */ }
+
+    } else {
+        shift = cache->pool->min_shift;
+    }
+
+    slot = shift - cache->pool->min_shift;
+    mag = &cache->mags[slot];
+
+    if (mag->n == 0 && ngx_slab_cache_refill_locked(cache, slot) == 0) {
+
+        /* the chunks cached in other slots may be holding the last pages */
+
+        for (i = 0; i < ngx_pagesize_shift - cache->pool->min_shift; i++) {
+            while (cache->mags[i].n) {
+                ngx_slab_free_locked(cache->pool,
+                                     cache->mags[i].chunks[--cache->mags[i].n]);
+            }
+        }
+
+        if (ngx_slab_cache_refill_locked(cache, slot) == 0) {
+            return NULL;
+        }
+    }
+
+    return mag->chunks[--mag->n];
+}
+
+
+// 把一块内存放回缓存，缓存满了时加锁把一半还给内存池
+void
+ngx_slab_cache_free(ngx_slab_cache_t *cache, void *p)
+{
+    ngx_int_t             slot;
+    ngx_slab_magazine_t  *mag;
+
+    if (cache->mags == NULL) {
+        ngx_slab_free(cache->pool, p);
+        return;
+    }
+
+    slot = ngx_slab_cache_slot(cache, p);
+
+    if (slot == NGX_ERROR) {
+        ngx_slab_free(cache->pool, p);
+        return;
+    }
+
+    mag = &cache->mags[slot];
+
+    if (mag->n == cache->size) {
+        ngx_shmtx_lock(&cache->pool->mutex);
+
+        ngx_slab_cache_drain_locked(cache, slot);
+
+        ngx_shmtx_unlock(&cache->pool->mutex);
+    }
+
+    mag->chunks[mag->n++] = p;
+}
+
+
+// 同ngx_slab_cache_free()，调用前已对内存池加锁
+void
+ngx_slab_cache_free_locked(ngx_slab_cache_t *cache, void *p)
+{
+    ngx_int_t             slot;
+    ngx_slab_magazine_t  *mag;
+
+    if (cache->mags == NULL) {
+        ngx_slab_free_locked(cache->pool, p);
+        return;
+    }
+
+    slot = ngx_slab_cache_slot(cache, p);
+
+    if (slot == NGX_ERROR) {
+        ngx_slab_free_locked(cache->pool, p);
+        return;
+    }
+
+    mag = &cache->mags[slot];
+
+    if (mag->n == cache->size) {
+        ngx_slab_cache_drain_locked(cache, slot);
+    }
+
+    mag->chunks[mag->n++] = p;
+}
+
+
+// 在共享内存中为本进程分配各个magazine，挂到内存池的caches链表上。
+// 分配失败时这个缓存不再缓存内存块，直接使用内存池
+static ngx_int_t
+ngx_slab_cache_init_locked(ngx_slab_cache_t *cache)
+{
+    u_char                *p;
+    ngx_uint_t             i, n;
+    ngx_slab_pool_t       *pool;
+    ngx_slab_magazines_t  *sh;
+
+    pool = cache->pool;
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    sh = ngx_slab_alloc_locked(pool, offsetof(ngx_slab_magazines_t, mags)
+                                     + n * sizeof(ngx_slab_magazine_t)
+                                     + n * cache->size * sizeof(void *));
+    if (sh == NULL) {
+        cache->size = 0;
+        return NGX_ERROR;
+    }
+
+    p = (u_char *) &sh->mags[n];
+
+    for (i = 0; i < n; i++) {
+        sh->mags[i].n = 0;
+        sh->mags[i].chunks = (void **) p;
+        p += cache->size * sizeof(void *);
+    }
+
+    sh->pid = ngx_pid;
+    sh->next = pool->caches;
+    pool->caches = sh;
+
+    cache->sh = sh;
+    cache->mags = sh->mags;
+
+    return NGX_OK;
+}
+
+
+// 根据内存块所在页的类型得到它的slot，整页分配的内存和不属于内存池的地址返回NGX_ERROR。
+// 内存块还在使用，所以所在页的类型和块大小不会改变，不加锁读取也是安全的
+static ngx_int_t
+ngx_slab_cache_slot(ngx_slab_cache_t *cache, void *p)
+{
+    ngx_uint_t        shift;
+    ngx_slab_page_t  *page;
+    ngx_slab_pool_t  *pool;
+
+    pool = cache->pool;
+
+    if ((u_char *) p < pool->start || (u_char *) p >= pool->end) {
+        return NGX_ERROR;
+    }
+
+    page = &pool->pages[((u_char *) p - pool->start) >> ngx_pagesize_shift];
+
+    switch (page->prev & NGX_SLAB_PAGE_MASK) {
+
+    case NGX_SLAB_SMALL:
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+        break;
+
+    case NGX_SLAB_EXACT:
+        shift = ngx_slab_exact_shift;
+        break;
+
+    default: /* NGX_SLAB_PAGE */
+        return NGX_ERROR;
+    }
+
+    return shift - pool->min_shift;
+}
+
+
+// 从内存池取半个缓存的内存块，返回取到的块数
+static ngx_uint_t
+ngx_slab_cache_refill_locked(ngx_slab_cache_t *cache, ngx_uint_t slot)
+{
+    void                 *p;
+    size_t                size;
+    ngx_uint_t            n;
+    ngx_slab_magazine_t  *mag;
+
+    mag = &cache->mags[slot];
+    size = (size_t) 1 << (slot + cache->pool->min_shift);
+
+    for (n = (cache->size + 1) / 2; n; n--) {
+        p = ngx_slab_alloc_locked(cache->pool, size);
+        if (p == NULL) {
+            break;
+        }
+
+        mag->chunks[mag->n++] = p;
+    }
+
+    return mag->n;
+}
+
+
+// 把半个缓存的内存块还给内存池
+static void
+ngx_slab_cache_drain_locked(ngx_slab_cache_t *cache, ngx_uint_t slot)
+{
+    ngx_uint_t            n;
+    ngx_slab_magazine_t  *mag;
+
+    mag = &cache->mags[slot];
+
+    for (n = (cache->size + 1) / 2; n && mag->n; n--) {
+        ngx_slab_free_locked(cache->pool, mag->chunks[--mag->n]);
+    }
+}
+
+
+// 进程退出时把缓存的内存块全部还给内存池，并释放本进程的magazine。
+// master进程从不使用缓存，不会访问共享内存
+static void
+ngx_slab_cache_cleanup(void *data)
+{
+    ngx_slab_cache_t  *cache = data;
+
+    ngx_slab_pool_t  *pool;
+
+    if (cache->sh == NULL) {
+        return;
+    }
+
+    pool = cache->pool;
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    (void) ngx_slab_cache_reclaim_locked(pool, ngx_pid);
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    cache->sh = NULL;
+    cache->mags = NULL;
+}
+
+
+// 由master进程在子进程退出后调用，把pid进程的magazine中缓存的内存块还给内存池，
+// 返回还回的块数。进程正常退出时已经在ngx_slab_cache_cleanup()中还过了
+ngx_uint_t
+ngx_slab_cache_reclaim(ngx_slab_pool_t *pool, ngx_pid_t pid)
+{
+    ngx_uint_t  n;
+
+    if (pool->caches == NULL) {
+        return 0;
+    }
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    n = ngx_slab_cache_reclaim_locked(pool, pid);
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_slab_cache_reclaim_locked(ngx_slab_pool_t *pool, ngx_pid_t pid)
+{
+    ngx_uint_t             i, n, nmags;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *sh, **shp;
+
+    n = 0;
+    nmags = ngx_pagesize_shift - pool->min_shift;
+
+    shp = &pool->caches;
+
+    while (*shp) {
+        sh = *shp;
+
+        if (sh->pid != pid) {
+            shp = &sh->next;
+            continue;
+        }
+
+        for (i = 0; i < nmags; i++) {
+            mag = &sh->mags[i];
+
+            while (mag->n) {
+                ngx_slab_free_locked(pool, mag->chunks[--mag->n]);
+                n++;
+            }
+        }
+
+        *shp = sh->next;
+
+        ngx_slab_free_locked(pool, sh);
+    }
+
+    return n;
+}
+
+
 static void
 ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text)
 {
@@ -27,8 +27,36 @@ struct ngx_slab_page_s {
 };
 
 
-// 由slab内存分配算法实现的内存池。
+// 一个slot(一种大小的内存块)的统计，在持有内存池的锁时更新
+typedef struct {
+    // 已分配给这个slot的页中共有多少块，及其中已使用的块数
+    ngx_uint_t        total;
+    ngx_uint_t        used;
+
+    // 申请次数，及申请失败的次数
+    ngx_uint_t        reqs;
+    ngx_uint_t        fails;
+} ngx_slab_stat_t;
+
+
+// 内存页的使用情况，由ngx_slab_pages_stat_locked()遍历空闲页链表得到
 typedef struct {
+    ngx_uint_t        pages;
+    ngx_uint_t        free;
+    // 空闲页被分成了多少段连续的页，及其中最长的一段的页数。
+    // 超过一页的申请只能从一段连续的空闲页中分配
+    ngx_uint_t        runs;
+    ngx_uint_t        largest;
+} ngx_slab_pages_stat_t;
+
+
+typedef struct ngx_slab_magazines_s  ngx_slab_magazines_t;
+
+
+// 由slab内存分配算法实现的内存池。
+typedef struct ngx_slab_pool_s  ngx_slab_pool_t;
+
+struct ngx_slab_pool_s {
     // mutex成员加锁需要使用的两个原子变量
     ngx_shmtx_sh_t    lock;
 
@@ -43,6 +71,11 @@ typedef struct {
     // 空闲页链表
     ngx_slab_page_t   free;
 
+    // 每个slot的统计，紧跟在slot数组之后
+    ngx_slab_stat_t  *stats;
+    // 空闲页数
+    ngx_uint_t        pfree;
+
     // 可分配内存的起始地址
     // 在作为参数输入给ngx_slab_init()时作为输入
     u_char           *start;
@@ -62,7 +95,43 @@ typedef struct {
     void             *data;
     // 指向这个结构体对象的开头
     void             *addr;
-} ngx_slab_pool_t;
+
+    // 在同一块共享内存中分出的下一个独立的内存池（如limit_req的分片），
+    // 子进程异常退出时master沿着这个链表强制解锁每个内存池的锁
+    ngx_slab_pool_t  *next;
+
+    // 各个进程的内存块缓存，在持有内存池的锁时修改
+    ngx_slab_magazines_t  *caches;
+};
+
+
+// 一种大小的内存块的缓存
+typedef struct {
+    ngx_uint_t        n;
+    void            **chunks;
+} ngx_slab_magazine_t;
+
+
+// 一个进程的各个magazine，从内存池中分配并挂在它的caches链表上，
+// 这样进程异常退出后master进程还能把其中的内存块还给内存池
+struct ngx_slab_magazines_s {
+    ngx_pid_t              pid;
+    ngx_slab_magazines_t  *next;
+    ngx_slab_magazine_t    mags[1];
+};
+
+
+// 每个worker的内存块缓存，放在一个内存池前面。每种大小的内存块各有一个magazine，
+// 申请和释放只操作本进程的magazine，空了或满了时才持锁从内存池批量取或批量还一半。
+// 缓存中的内存块在内存池看来是已使用的，共享内存的布局不变
+typedef struct {
+    ngx_slab_pool_t       *pool;
+    // 每个magazine最多缓存的块数，为0时直接使用内存池
+    ngx_uint_t             size;
+    // 本进程第一次从内存池补充时才分配，之前为NULL
+    ngx_slab_magazines_t  *sh;
+    ngx_slab_magazine_t   *mags;
+} ngx_slab_cache_t;
 
 
 void ngx_slab_init(ngx_slab_pool_t *pool);
@@ -70,6 +139,15 @@ void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_pages_stat_locked(ngx_slab_pool_t *pool,
+    ngx_slab_pages_stat_t *stat);
+
+ngx_slab_cache_t *ngx_slab_cache_create(ngx_pool_t *pool, ngx_uint_t size);
+void *ngx_slab_cache_alloc(ngx_slab_cache_t *cache, size_t size);
+void *ngx_slab_cache_alloc_locked(ngx_slab_cache_t *cache, size_t size);
+void ngx_slab_cache_free(ngx_slab_cache_t *cache, void *p);
+void ngx_slab_cache_free_locked(ngx_slab_cache_t *cache, void *p);
+ngx_uint_t ngx_slab_cache_reclaim(ngx_slab_pool_t *pool, ngx_pid_t pid);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
@@ -6,6 +6,9 @@
 
 // 这组头文件和实现文件声明了一些字符串相关的结构体实现了一些字符串相关的函数。
 
+// 这个文件里的内存池申请记在调用者的源文件上
+#define NGX_POOL_PROFILE_CORE  1
+
 #include <ngx_config.h>
 #include <ngx_core.h>
 
@@ -1788,6 +1791,99 @@ ngx_escape_html(u_char *dst, u_char *src, size_t size)
 }
 
 
+// dst[in&out]: 如果为NULL,函数功能为src转义为JSON字符串内容以后增加的长度
+//              如果不为NULL，是将src转义为JSON字符串内容并存入到dst中
+// size[in]: src的长度
+uintptr_t
+ngx_escape_json(u_char *dst, u_char *src, size_t size)
+{
+    u_char      ch;
+    ngx_uint_t  len;
+
+    if (dst == NULL) {
+
+        len = 0;
+
+        while (size) {
+            ch = *src++;
+
+            if (ch == '\\' || ch == '"') {
+                len++;
+
+            } else if (ch <= 0x1f) {
+
+                switch (ch) {
+                case '\n':
+                case '\r':
+                case '\t':
+                case '\b':
+                case '\f':
+                    len++;
+                    break;
+
+                default:
+                    len += sizeof("\\u001F") - 2;
+                }
+            }
+
+            size--;
+        }
+
+        return (uintptr_t) len;
+    }
+
+    while (size) {
+        ch = *src++;
+
+        if (ch > 0x1f) {
+
+            if (ch == '\\' || ch == '"') {
+                *dst++ = '\\';
+            }
+
+            *dst++ = ch;
+
+        } else {
+            *dst++ = '\\';
+
+            switch (ch) {
+            case '\n':
+                *dst++ = 'n';
+                break;
+
+            case '\r':
+                *dst++ = 'r';
+                break;
+
+            case '\t':
+                *dst++ = 't';
+                break;
+
+            case '\b':
+                *dst++ = 'b';
+                break;
+
+            case '\f':
+                *dst++ = 'f';
+                break;
+
+            default:
+                *dst++ = 'u'; *dst++ = '0'; *dst++ = '0';
+                *dst++ = '0' + (ch >> 4);
+
+                ch &= 0xf;
+
+                *dst++ = (ch < 10) ? ('0' + ch) : ('A' + ch - 10);
+            }
+        }
+
+        size--;
+    }
+
+    return (uintptr_t) dst;
+}
+
+
 // 向红黑树插入一个ngx_str_node_t对象节点的回调函数
 void
 ngx_str_rbtree_insert_value(ngx_rbtree_node_t *temp,
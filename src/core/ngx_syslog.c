@@ -0,0 +1,571 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这组头文件和实现文件实现了把日志以RFC 5424格式发给syslog。
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_SYSLOG_BATCH          16
+#define NGX_SYSLOG_FLUSH          100
+
+
+static char *ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer);
+static u_char *ngx_syslog_header(ngx_syslog_peer_t *peer, u_char *buf,
+    ngx_uint_t severity);
+static ngx_int_t ngx_syslog_init_peer(ngx_syslog_peer_t *peer);
+static ngx_int_t ngx_syslog_send_one(ngx_syslog_peer_t *peer, u_char *buf,
+    size_t len);
+static void ngx_syslog_error(ngx_syslog_peer_t *peer, ngx_err_t err,
+    char *text);
+static void ngx_syslog_flush_handler(ngx_event_t *ev);
+static void ngx_syslog_cleanup(void *data);
+
+
+static char  *facilities[] = {
+    "kern", "user", "mail", "daemon", "auth", "intern", "lpr", "news", "uucp",
+    "clock", "authpriv", "ftp", "ntp", "audit", "alert", "cron", "local0",
+    "local1", "local2", "local3", "local4", "local5", "local6", "local7",
+    NULL
+};
+
+/* note 'error/warn' like in nginx.conf, not 'err/warning' */
+static char  *severities[] = {
+    "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug", NULL
+};
+
+// 缓冲区中有待发送消息的peer
+static ngx_queue_t  ngx_syslog_pending = {
+    &ngx_syslog_pending, &ngx_syslog_pending
+};
+
+
+// 解析"syslog:server=address[,facility=...][,severity=...][,tag=...]
+// [,batch=number][,flush=time]"形式的第一个参数，并为peer分配发送缓冲区
+char *
+ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    peer->facility = NGX_CONF_UNSET_UINT;
+    peer->severity = NGX_CONF_UNSET_UINT;
+    peer->batch = NGX_CONF_UNSET_UINT;
+    peer->flush = NGX_CONF_UNSET_MSEC;
+
+    if (ngx_syslog_parse_args(cf, peer) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (peer->server.sockaddr == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no syslog server specified");
+        return NGX_CONF_ERROR;
+    }
+
+    if (peer->facility == NGX_CONF_UNSET_UINT) {
+        peer->facility = 23; /* local7 */
+    }
+
+    if (peer->severity == NGX_CONF_UNSET_UINT) {
+        peer->severity = 6; /* info */
+    }
+
+    if (peer->tag.data == NULL) {
+        ngx_str_set(&peer->tag, "nginx");
+    }
+
+    ngx_conf_init_uint_value(peer->batch, NGX_SYSLOG_BATCH);
+    ngx_conf_init_msec_value(peer->flush, NGX_SYSLOG_FLUSH);
+
+    peer->fd = (ngx_socket_t) -1;
+
+    if (peer->batch > 1) {
+        peer->size = peer->batch * 1024;
+
+        peer->buf = ngx_pnalloc(cf->pool, peer->size);
+        if (peer->buf == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        peer->iovs = ngx_palloc(cf->pool, peer->batch * sizeof(struct iovec));
+        if (peer->iovs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    peer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+    if (peer->event == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    peer->event->handler = ngx_syslog_flush_handler;
+    peer->event->data = peer;
+    peer->event->log = &cf->cycle->new_log;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_syslog_cleanup;
+    cln->data = peer;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
+{
+    u_char      *p, *comma, *last;
+    size_t       len;
+    ngx_str_t   *value, s;
+    ngx_url_t    u;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    value = cf->args->elts;
+
+    p = value[1].data + sizeof("syslog:") - 1;
+    last = value[1].data + value[1].len;
+
+    for ( ;; ) {
+        comma = ngx_strlchr(p, last, ',');
+
+        len = (comma ? comma : last) - p;
+
+        if (len > 7 && ngx_strncmp(p, "server=", 7) == 0) {
+
+            if (peer->server.sockaddr != NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate syslog \"server\"");
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url.data = p + 7;
+            u.url.len = len - 7;
+            u.default_port = 514;
+
+            if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+                if (u.err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "%s in syslog server \"%V\"",
+                                       u.err, &u.url);
+                }
+
+                return NGX_CONF_ERROR;
+            }
+
+            peer->server = u.addrs[0];
+
+        } else if (len > 9 && ngx_strncmp(p, "facility=", 9) == 0) {
+
+            for (i = 0; facilities[i] != NULL; i++) {
+                if (ngx_strlen(facilities[i]) == len - 9
+                    && ngx_strncmp(p + 9, facilities[i], len - 9) == 0)
+                {
+                    peer->facility = i;
+                    break;
+                }
+            }
+
+            if (facilities[i] == NULL) {
+                goto invalid;
+            }
+
+        } else if (len > 9 && ngx_strncmp(p, "severity=", 9) == 0) {
+
+            for (i = 0; severities[i] != NULL; i++) {
+                if (ngx_strlen(severities[i]) == len - 9
+                    && ngx_strncmp(p + 9, severities[i], len - 9) == 0)
+                {
+                    peer->severity = i;
+                    break;
+                }
+            }
+
+            if (severities[i] == NULL) {
+                goto invalid;
+            }
+
+        } else if (len > 4 && ngx_strncmp(p, "tag=", 4) == 0) {
+
+            if (len - 4 > NGX_SYSLOG_MAX_TAG) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "syslog tag length exceeds %d",
+                                   NGX_SYSLOG_MAX_TAG);
+                return NGX_CONF_ERROR;
+            }
+
+            for (i = 4; i < len; i++) {
+                if (p[i] <= ' ' || p[i] >= 0x7f) {
+                    goto invalid;
+                }
+            }
+
+            peer->tag.data = p + 4;
+            peer->tag.len = len - 4;
+
+        } else if (len > 6 && ngx_strncmp(p, "batch=", 6) == 0) {
+
+            n = ngx_atoi(p + 6, len - 6);
+
+            if (n < 1 || n > NGX_SYSLOG_MAX_BATCH) {
+                goto invalid;
+            }
+
+            peer->batch = n;
+
+        } else if (len > 6 && ngx_strncmp(p, "flush=", 6) == 0) {
+
+            s.data = p + 6;
+            s.len = len - 6;
+
+            peer->flush = ngx_parse_time(&s, 0);
+
+            if (peer->flush == (ngx_msec_t) NGX_ERROR || peer->flush == 0) {
+                goto invalid;
+            }
+
+        } else {
+            goto invalid;
+        }
+
+        if (comma == NULL) {
+            break;
+        }
+
+        p = comma + 1;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid syslog parameter \"%*s\"", len, p);
+
+    return NGX_CONF_ERROR;
+}
+
+
+// 在buf中写入RFC 5424消息的PRI和HEADER部分，buf至少要有NGX_SYSLOG_MAX_HEADER字节
+u_char *
+ngx_syslog_add_header(ngx_syslog_peer_t *peer, u_char *buf)
+{
+    return ngx_syslog_header(peer, buf, peer->severity);
+}
+
+
+// 错误日志的每条消息按自己的级别设置severity，不修改peer->severity
+static u_char *
+ngx_syslog_header(ngx_syslog_peer_t *peer, u_char *buf, ngx_uint_t severity)
+{
+    ngx_str_t   *host;
+    ngx_uint_t   pri;
+    static ngx_str_t  nil = ngx_string("-");
+
+    pri = peer->facility * 8 + severity;
+
+    /* the hostname is not known until the first cycle is initialized */
+
+    host = ngx_cycle->hostname.len ? (ngx_str_t *) &ngx_cycle->hostname
+                                   : &nil;
+
+    return ngx_sprintf(buf, "<%ui>1 %V %V %V %P - - ", pri,
+                       (ngx_str_t *) &ngx_cached_http_log_iso8601,
+                       host, &peer->tag, ngx_log_pid);
+}
+
+
+// 作为ngx_log_t的writer回调，把错误日志发给syslog，级别不低于crit的消息立即发送
+void
+ngx_syslog_writer(ngx_log_t *log, ngx_uint_t level, u_char *buf,
+    size_t len)
+{
+    u_char             *p, msg[NGX_SYSLOG_MAX_STR];
+    ngx_uint_t          head_len;
+    ngx_syslog_peer_t  *peer;
+
+    peer = log->wdata;
+
+    if (peer->busy) {
+        /* a message logged while sending to the same peer */
+        peer->dropped++;
+        return;
+    }
+
+    peer->busy = 1;
+
+    p = ngx_syslog_header(peer, msg, level ? level - 1 : 0);
+    head_len = p - msg;
+
+    len -= NGX_LINEFEED_SIZE;
+
+    if (len > NGX_SYSLOG_MAX_STR - head_len) {
+        len = NGX_SYSLOG_MAX_STR - head_len;
+    }
+
+    p = ngx_cpymem(p, buf, len);
+
+    (void) ngx_syslog_send(peer, msg, p - msg);
+
+    if (level <= NGX_LOG_CRIT) {
+        ngx_syslog_flush(peer);
+    }
+
+    peer->busy = 0;
+}
+
+
+// 发送一条完整的syslog消息。消息先复制到peer的缓冲区里，
+// 攒够batch条或者flush毫秒后一起发送；没有事件循环的进程（如master进程）
+// 和正在退出的进程直接发送
+ngx_int_t
+ngx_syslog_send(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
+{
+    u_char  *p;
+
+    if (peer->fd == (ngx_socket_t) -1 && ngx_syslog_init_peer(peer) != NGX_OK) {
+        peer->dropped++;
+        return NGX_ERROR;
+    }
+
+    if (peer->batch == 1
+        || len > peer->size
+        || ngx_exiting
+        || ngx_event_timer_rbtree.root == NULL)
+    {
+        ngx_syslog_flush(peer);
+
+        return ngx_syslog_send_one(peer, buf, len);
+    }
+
+    if (len > peer->size - peer->used) {
+        ngx_syslog_flush(peer);
+    }
+
+    if (peer->nmsgs == 0) {
+        ngx_queue_insert_tail(&ngx_syslog_pending, &peer->queue);
+    }
+
+    p = peer->buf + peer->used;
+
+    ngx_memcpy(p, buf, len);
+
+    peer->iovs[peer->nmsgs].iov_base = (void *) p;
+    peer->iovs[peer->nmsgs].iov_len = len;
+    peer->nmsgs++;
+    peer->used += len;
+
+    if (peer->nmsgs == peer->batch) {
+        ngx_syslog_flush(peer);
+        return NGX_OK;
+    }
+
+    if (!peer->event->timer_set) {
+        ngx_add_timer(peer->event, peer->flush);
+    }
+
+    return NGX_OK;
+}
+
+
+// 把peer缓冲区中攒下的消息一次发送出去，发送失败的消息被丢弃
+void
+ngx_syslog_flush(ngx_syslog_peer_t *peer)
+{
+    ngx_uint_t       i, n;
+#if (NGX_HAVE_SENDMMSG)
+    int              rc;
+    ngx_err_t        err;
+    struct mmsghdr   msgs[NGX_SYSLOG_MAX_BATCH];
+#endif
+
+    if (peer->event->timer_set) {
+        ngx_del_timer(peer->event);
+    }
+
+    n = peer->nmsgs;
+
+    if (n == 0) {
+        return;
+    }
+
+    peer->nmsgs = 0;
+    peer->used = 0;
+
+    ngx_queue_remove(&peer->queue);
+
+#if (NGX_HAVE_SENDMMSG)
+
+    ngx_memzero(msgs, n * sizeof(struct mmsghdr));
+
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_iov = &peer->iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (i = 0; i < n; i += rc) {
+
+        rc = sendmmsg(peer->fd, &msgs[i], n - i, 0);
+
+        if (rc == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                rc = 0;
+                continue;
+            }
+
+            peer->dropped += n - i;
+            ngx_syslog_error(peer, err, "sendmmsg()");
+
+            return;
+        }
+
+        peer->sent += rc;
+    }
+
+#else
+
+    for (i = 0; i < n; i++) {
+        (void) ngx_syslog_send_one(peer, peer->iovs[i].iov_base,
+                                   peer->iovs[i].iov_len);
+    }
+
+#endif
+}
+
+
+// 发送所有peer缓冲区中攒下的消息，在进程退出前调用，否则这些消息会丢失
+void
+ngx_syslog_flush_all(void)
+{
+    ngx_queue_t        *q;
+    ngx_syslog_peer_t  *peer;
+
+    while (!ngx_queue_empty(&ngx_syslog_pending)) {
+        q = ngx_queue_head(&ngx_syslog_pending);
+        peer = ngx_queue_data(q, ngx_syslog_peer_t, queue);
+
+        peer->busy = 1;
+        ngx_syslog_flush(peer);
+        peer->busy = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_syslog_send_one(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
+{
+    if (send(peer->fd, buf, len, 0) == -1) {
+        peer->dropped++;
+        ngx_syslog_error(peer, ngx_socket_errno, "send()");
+        return NGX_ERROR;
+    }
+
+    peer->sent++;
+
+    return NGX_OK;
+}
+
+
+// 在本进程中第一次发送时创建非阻塞的数据报套接字并connect()到syslog服务器
+static ngx_int_t
+ngx_syslog_init_peer(ngx_syslog_peer_t *peer)
+{
+    ngx_socket_t  fd;
+
+    fd = ngx_socket(peer->server.sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (fd == (ngx_socket_t) -1) {
+        ngx_syslog_error(peer, ngx_socket_errno, ngx_socket_n);
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(fd) == -1) {
+        ngx_syslog_error(peer, ngx_socket_errno, ngx_nonblocking_n);
+        goto failed;
+    }
+
+    if (connect(fd, peer->server.sockaddr, peer->server.socklen) == -1) {
+        ngx_syslog_error(peer, ngx_socket_errno, "connect()");
+        goto failed;
+    }
+
+    peer->fd = fd;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_socket(fd) == -1) {
+        ngx_syslog_error(peer, ngx_socket_errno, ngx_close_socket_n);
+    }
+
+    return NGX_ERROR;
+}
+
+
+// 记录发送失败，每分钟最多记录一次，避免错误日志也写到这个syslog时出现递归
+static void
+ngx_syslog_error(ngx_syslog_peer_t *peer, ngx_err_t err, char *text)
+{
+    time_t    now;
+    unsigned  busy;
+
+    now = ngx_time();
+
+    if (peer->error_log_time && now - peer->error_log_time < 60) {
+        return;
+    }
+
+    peer->error_log_time = now;
+
+    busy = peer->busy;
+    peer->busy = 1;
+
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                  "%s failed for syslog server \"%V\", %uA messages dropped",
+                  text, &peer->server.name, peer->dropped);
+
+    peer->busy = busy;
+}
+
+
+static void
+ngx_syslog_flush_handler(ngx_event_t *ev)
+{
+    ngx_syslog_peer_t  *peer = ev->data;
+
+    peer->busy = 1;
+    ngx_syslog_flush(peer);
+    peer->busy = 0;
+}
+
+
+// 配置内存池销毁时调用，先发送还攒在缓冲区中的消息，
+// 比如worker进程退出时在exit_process之后记录的消息
+static void
+ngx_syslog_cleanup(void *data)
+{
+    ngx_syslog_peer_t  *peer = data;
+
+    if (peer->fd == (ngx_socket_t) -1) {
+        return;
+    }
+
+    peer->busy = 1;
+    ngx_syslog_flush(peer);
+
+    if (ngx_close_socket(peer->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
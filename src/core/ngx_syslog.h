@@ -0,0 +1,73 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这组头文件和实现文件实现了把日志以RFC 5424格式通过UDP或unix数据报套接字发给syslog，
+// 多条消息攒在一起用sendmmsg()一次发送，发送失败时丢弃并计数，不会阻塞进程。
+
+#ifndef _NGX_SYSLOG_H_INCLUDED_
+#define _NGX_SYSLOG_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_SYSLOG_MAX_TAG        32
+#define NGX_SYSLOG_MAX_BATCH      64
+
+// "<PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID SD "
+#define NGX_SYSLOG_MAX_HEADER                                                 \
+    (sizeof("<191>1 1970-09-28T12:00:00+06:00 ") - 1                          \
+     + NGX_MAXHOSTNAMELEN + 1 + NGX_SYSLOG_MAX_TAG + 1 + NGX_INT64_LEN        \
+     + sizeof(" - - ") - 1)
+
+#define NGX_SYSLOG_MAX_STR        (NGX_SYSLOG_MAX_HEADER + NGX_MAX_ERROR_STR)
+
+
+typedef struct {
+    ngx_uint_t          facility;
+    ngx_uint_t          severity;
+    ngx_str_t           tag;
+
+    ngx_addr_t          server;
+    ngx_socket_t        fd;
+
+    // 攒够batch条消息或者flush毫秒后调用一次sendmmsg()
+    ngx_uint_t          batch;
+    ngx_msec_t          flush;
+
+    // 待发送的消息依次存放在buf中，iovs[i]指向第i条消息
+    u_char             *buf;
+    size_t              size;
+    size_t              used;
+    struct iovec       *iovs;
+    ngx_uint_t          nmsgs;
+    // 缓冲区中有待发送消息时链入待发送队列，进程退出前由ngx_syslog_flush_all()发送
+    ngx_queue_t         queue;
+
+    ngx_event_t        *event;
+
+    // 本进程发送成功和丢弃的消息数，dropped也包括写错误日志时递归调用writer而丢弃的消息
+    ngx_atomic_uint_t   sent;
+    ngx_atomic_uint_t   dropped;
+
+    time_t              error_log_time;
+
+    ngx_log_t          *log;
+
+    unsigned            busy:1;
+} ngx_syslog_peer_t;
+
+
+char *ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer);
+u_char *ngx_syslog_add_header(ngx_syslog_peer_t *peer, u_char *buf);
+void ngx_syslog_writer(ngx_log_t *log, ngx_uint_t level, u_char *buf,
+    size_t len);
+ngx_int_t ngx_syslog_send(ngx_syslog_peer_t *peer, u_char *buf, size_t len);
+void ngx_syslog_flush(ngx_syslog_peer_t *peer);
+void ngx_syslog_flush_all(void);
+
+
+#endif /* _NGX_SYSLOG_H_INCLUDED_ */
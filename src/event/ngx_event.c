@@ -25,6 +25,7 @@ extern ngx_module_t ngx_select_module;
 static char *ngx_event_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle);
 static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle);
+static void ngx_event_pool_cache_handler(ngx_event_t *ev);
 static char *ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -45,6 +46,11 @@ sig_atomic_t          ngx_event_timer_alarm;
 // 事件模块的个数。
 static ngx_uint_t     ngx_event_max_module;
 
+// 定时整理内存池块缓存的事件
+#define NGX_EVENT_POOL_CACHE_TRIM  5000
+
+static ngx_event_t    ngx_event_pool_cache_ev;
+
 // 所用事件模型的标志位，linux用epoll事件模型下，
 // 为NGX_USE_CLEAR_EVENT|NGX_USE_GREEDY_EVENT|NGX_USE_EPOLL_EVENT。
 ngx_uint_t            ngx_event_flags;
@@ -88,6 +94,8 @@ ngx_atomic_t   ngx_stat_writing0;
 ngx_atomic_t  *ngx_stat_writing = &ngx_stat_writing0;
 ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t  *ngx_stat_waiting = &ngx_stat_waiting0;
+ngx_atomic_t   ngx_stat_queued0;
+ngx_atomic_t  *ngx_stat_queued = &ngx_stat_queued0;
 
 #endif
 
@@ -550,7 +558,14 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl          /* ngx_stat_queued */
+           + cl          /* ngx_stat_pool_mallocs */
+           + cl          /* ngx_stat_pool_frees */
+           + cl          /* ngx_stat_pool_reused */
+           + cl          /* ngx_stat_upstream_ssl_full */
+           + cl          /* ngx_stat_upstream_ssl_resumed */
+           + cl;         /* ngx_stat_spliced */
 
 #endif
 
@@ -598,6 +613,17 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_queued = (ngx_atomic_t *) (shared + 10 * cl);
+    ngx_stat_pool_mallocs = (ngx_atomic_t *) (shared + 11 * cl);
+    ngx_stat_pool_frees = (ngx_atomic_t *) (shared + 12 * cl);
+    ngx_stat_pool_reused = (ngx_atomic_t *) (shared + 13 * cl);
+#if (NGX_SSL)
+    ngx_stat_upstream_ssl_full = (ngx_atomic_t *) (shared + 14 * cl);
+    ngx_stat_upstream_ssl_resumed = (ngx_atomic_t *) (shared + 15 * cl);
+#endif
+#if (NGX_HAVE_SPLICE)
+    ngx_stat_spliced = (ngx_atomic_t *) (shared + 16 * cl);
+#endif
 
 #endif
 
@@ -667,6 +693,14 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         return NGX_ERROR;
     }
 
+    if (ngx_pool_cache_max) {
+        ngx_event_pool_cache_ev.handler = ngx_event_pool_cache_handler;
+        ngx_event_pool_cache_ev.log = cycle->log;
+        ngx_event_pool_cache_ev.data = &ngx_event_pool_cache_ev;
+
+        ngx_add_timer(&ngx_event_pool_cache_ev, NGX_EVENT_POOL_CACHE_TRIM);
+    }
+
 
     // 调用被选用事件模型的初始化函数。
     for (m = 0; ngx_modules[m]; m++) {
@@ -911,6 +945,20 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 }
 
 
+// 释放一个整理周期内没有用到的内存池缓存块，worker退出时不再整理
+static void
+ngx_event_pool_cache_handler(ngx_event_t *ev)
+{
+    ngx_pool_cache_trim();
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, NGX_EVENT_POOL_CACHE_TRIM);
+}
+
+
 // 这个函数在linux下不会被调用。
 ngx_int_t
 ngx_send_lowat(ngx_connection_t *c, size_t lowat)
@@ -537,6 +537,8 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+// 在limit_conn或upstream队列中等待的请求数
+extern ngx_atomic_t  *ngx_stat_queued;
 
 #endif
 
@@ -37,6 +37,9 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
 static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
     ngx_slab_pool_t *shpool, ngx_uint_t n);
+static void ngx_ssl_expire_client_sessions(
+    ngx_ssl_client_session_cache_t *cache, ngx_slab_pool_t *shpool,
+    ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
@@ -95,6 +98,17 @@ int  ngx_ssl_certificate_index;
 int  ngx_ssl_stapling_index;
 
 
+#if (NGX_STAT_STUB)
+
+// 到upstream的完整握手次数和复用会话的握手次数
+ngx_atomic_t   ngx_stat_upstream_ssl_full0;
+ngx_atomic_t  *ngx_stat_upstream_ssl_full = &ngx_stat_upstream_ssl_full0;
+ngx_atomic_t   ngx_stat_upstream_ssl_resumed0;
+ngx_atomic_t  *ngx_stat_upstream_ssl_resumed = &ngx_stat_upstream_ssl_resumed0;
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
 {
@@ -2359,6 +2373,243 @@ ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+ngx_int_t
+ngx_ssl_client_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                           len;
+    ngx_slab_pool_t                 *shpool;
+    ngx_ssl_client_session_cache_t  *cache;
+
+    // 重新加载配置时沿用原来的共享内存，缓存的会话不会丢失
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_client_session_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = cache;
+    shm_zone->data = cache;
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->expire_queue);
+
+    len = sizeof(" in SSL client session shared cache \"\"")
+          + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in SSL client session shared cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * as with the server cache, i2d_SSL_SESSION() and d2i_SSL_SESSION()
+ * are called outside of the shared pool mutex
+ */
+
+ngx_ssl_session_t *
+ngx_ssl_get_client_session(ngx_shm_zone_t *shm_zone, ngx_str_t *key)
+{
+    size_t                           len;
+    uint32_t                         hash;
+    const u_char                    *p;
+    ngx_str_node_t                  *sn;
+    ngx_slab_pool_t                 *shpool;
+    ngx_ssl_client_session_t        *sess;
+    ngx_ssl_client_session_cache_t  *cache;
+    u_char                           buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&cache->rbtree, key, hash);
+
+    if (sn == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NULL;
+    }
+
+    sess = (ngx_ssl_client_session_t *) sn;
+
+    if (sess->expire < ngx_time()) {
+        ngx_queue_remove(&sess->queue);
+        ngx_rbtree_delete(&cache->rbtree, &sess->sn.node);
+        ngx_slab_free_locked(shpool, sess);
+
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NULL;
+    }
+
+    len = sess->len;
+    ngx_memcpy(buf, sess->data + key->len, len);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "ssl get client session: %08XD:%uz", hash, len);
+
+    p = buf;
+
+    return d2i_SSL_SESSION(NULL, &p, len);
+}
+
+
+// 保存连接的会话，同一个key只保存最新的会话，会话的有效期由会话本身决定
+void
+ngx_ssl_save_client_session(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    ngx_connection_t *c)
+{
+    int                              len;
+    u_char                          *p;
+    size_t                           size;
+    uint32_t                         hash;
+    ngx_str_node_t                  *sn;
+    ngx_slab_pool_t                 *shpool;
+    ngx_ssl_session_t               *ssl_session;
+    ngx_ssl_client_session_t        *sess;
+    ngx_ssl_client_session_cache_t  *cache;
+    u_char                           buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    ssl_session = SSL_get_session(c->ssl->connection);
+
+    if (ssl_session == NULL) {
+        return;
+    }
+
+    len = i2d_SSL_SESSION(ssl_session, NULL);
+
+    /* do not cache too big session */
+
+    if (len <= 0 || len > (int) NGX_SSL_MAX_SESSION_SIZE) {
+        return;
+    }
+
+    p = buf;
+    i2d_SSL_SESSION(ssl_session, &p);
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&cache->rbtree, key, hash);
+
+    if (sn) {
+        sess = (ngx_ssl_client_session_t *) sn;
+
+        ngx_queue_remove(&sess->queue);
+        ngx_rbtree_delete(&cache->rbtree, &sess->sn.node);
+        ngx_slab_free_locked(shpool, sess);
+    }
+
+    /* drop one or two expired sessions */
+    ngx_ssl_expire_client_sessions(cache, shpool, 1);
+
+    size = offsetof(ngx_ssl_client_session_t, data) + key->len + len;
+
+    sess = ngx_slab_alloc_locked(shpool, size);
+
+    if (sess == NULL) {
+
+        /* drop the oldest non-expired session and try once more */
+
+        ngx_ssl_expire_client_sessions(cache, shpool, 0);
+
+        sess = ngx_slab_alloc_locked(shpool, size);
+
+        if (sess == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "could not allocate client session%s",
+                          shpool->log_ctx);
+            return;
+        }
+    }
+
+    ngx_memcpy(sess->data, key->data, key->len);
+    ngx_memcpy(sess->data + key->len, buf, len);
+
+    sess->sn.node.key = hash;
+    sess->sn.str.len = key->len;
+    sess->sn.str.data = sess->data;
+    sess->len = len;
+    sess->expire = ngx_time() + SSL_SESSION_get_timeout(ssl_session);
+
+    ngx_queue_insert_head(&cache->expire_queue, &sess->queue);
+
+    ngx_rbtree_insert(&cache->rbtree, &sess->sn.node);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl save client session: %08XD:%d", hash, len);
+}
+
+
+static void
+ngx_ssl_expire_client_sessions(ngx_ssl_client_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_uint_t n)
+{
+    time_t                     now;
+    ngx_queue_t               *q;
+    ngx_ssl_client_session_t  *sess;
+
+    now = ngx_time();
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+
+        sess = ngx_queue_data(q, ngx_ssl_client_session_t, queue);
+
+        if (n++ != 0 && sess->expire > now) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                       "expire client session: %08Xi", sess->sn.node.key);
+
+        ngx_rbtree_delete(&cache->rbtree, &sess->sn.node);
+
+        ngx_slab_free_locked(shpool, sess);
+    }
+}
+
+
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 
 ngx_int_t
@@ -85,6 +85,24 @@ typedef struct {
 } ngx_ssl_session_cache_t;
 
 
+// 作为客户端时保存的一个会话，data中依次存放key和会话的ASN1表示，
+// key由使用者决定，比如upstream的server名字和地址
+typedef struct {
+    ngx_str_node_t              sn;
+    ngx_queue_t                 queue;
+    time_t                      expire;
+    size_t                      len;
+    u_char                      data[1];
+} ngx_ssl_client_session_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 expire_queue;
+} ngx_ssl_client_session_cache_t;
+
+
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 
 typedef struct {
@@ -131,6 +149,12 @@ ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *paths);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_int_t ngx_ssl_client_session_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+ngx_ssl_session_t *ngx_ssl_get_client_session(ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key);
+void ngx_ssl_save_client_session(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    ngx_connection_t *c);
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
 
@@ -193,5 +217,12 @@ extern int  ngx_ssl_session_ticket_keys_index;
 extern int  ngx_ssl_certificate_index;
 extern int  ngx_ssl_stapling_index;
 
+#if (NGX_STAT_STUB)
+
+extern ngx_atomic_t  *ngx_stat_upstream_ssl_full;
+extern ngx_atomic_t  *ngx_stat_upstream_ssl_resumed;
+
+#endif
+
 
 #endif /* _NGX_EVENT_OPENSSL_H_INCLUDED_ */
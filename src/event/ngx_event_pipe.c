@@ -19,6 +19,15 @@ static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
 static ngx_inline void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 static ngx_int_t ngx_event_pipe_drain_chains(ngx_event_pipe_t *p);
+#if (NGX_HAVE_MEMFD)
+static ngx_int_t ngx_event_pipe_reserve_memory(ngx_event_pipe_t *p,
+    off_t size);
+static void ngx_event_pipe_memory_cleanup(void *data);
+static ngx_atomic_uint_t ngx_event_pipe_account_memory(
+    ngx_event_pipe_memory_t *mem, off_t n);
+static ngx_uint_t ngx_event_pipe_reclaim_memory(ngx_event_pipe_memory_t *mem,
+    ngx_log_t *log);
+#endif
 
 
 ngx_int_t
@@ -187,7 +196,13 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
                 /* allocate a new buf if it's still allowed */
 
-                b = ngx_create_temp_buf(p->pool, p->bufs.size);
+                if (p->alloc_buf) {
+                    b = p->alloc_buf(p);
+
+                } else {
+                    b = ngx_create_temp_buf(p->pool, p->bufs.size);
+                }
+
                 if (b == NULL) {
                     return NGX_ABORT;
                 }
@@ -687,6 +702,9 @@ ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
     ngx_buf_t    *b;
     ngx_uint_t    prev_last_shadow;
     ngx_chain_t  *cl, *tl, *next, *out, **ll, **last_out, **last_free, fl;
+#if (NGX_HAVE_MEMFD)
+    ngx_int_t     rc;
+#endif
 
     if (p->buf_to_file) {
         fl.buf = p->buf_to_file;
@@ -737,6 +755,22 @@ ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
             return NGX_BUSY;
         }
 
+#if (NGX_HAVE_MEMFD)
+
+        if (p->temp_memory) {
+            rc = ngx_event_pipe_reserve_memory(p, p->temp_file->offset + size);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ABORT;
+            }
+
+            if (rc == NGX_BUSY) {
+                return NGX_BUSY;
+            }
+        }
+
+#endif
+
         if (cl) {
            p->in = cl;
            *ll = NULL;
@@ -972,6 +1006,204 @@ ngx_event_pipe_add_free_buf(ngx_event_pipe_t *p, ngx_buf_t *b)
 }
 
 
+#if (NGX_HAVE_MEMFD)
+
+/*
+ * the temporary file is kept in memory while all workers together hold
+ * no more than p->temp_memory_max bytes in such files; if the budget is
+ * exhausted before the first write, the response is buffered on disk,
+ * otherwise the pipe waits until the client reads the data already saved
+ */
+
+static ngx_int_t
+ngx_event_pipe_reserve_memory(ngx_event_pipe_t *p, off_t size)
+{
+    off_t                n;
+    ngx_atomic_uint_t    used;
+    ngx_temp_file_t     *tf;
+    ngx_pool_cleanup_t  *cln;
+
+    if (size <= p->temp_memory_size) {
+        return NGX_OK;
+    }
+
+    tf = p->temp_file;
+    n = size - p->temp_memory_size;
+
+    used = ngx_event_pipe_account_memory(p->temp_memory, n);
+
+    if ((off_t) used + n > p->temp_memory_max
+        && ngx_event_pipe_reclaim_memory(p->temp_memory, p->log))
+    {
+        (void) ngx_event_pipe_account_memory(p->temp_memory, -n);
+        used = ngx_event_pipe_account_memory(p->temp_memory, n);
+    }
+
+    if ((off_t) used + n > p->temp_memory_max) {
+        (void) ngx_event_pipe_account_memory(p->temp_memory, -n);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "pipe temp memory exhausted: %uA, need %O", used, n);
+
+        if (tf->file.fd == NGX_INVALID_FILE) {
+            p->temp_memory = NULL;
+            return NGX_DECLINED;
+        }
+
+        return NGX_BUSY;
+    }
+
+    if (tf->file.fd == NGX_INVALID_FILE) {
+
+        cln = ngx_pool_cleanup_add(tf->pool, 0);
+        if (cln == NULL) {
+            (void) ngx_event_pipe_account_memory(p->temp_memory, -n);
+            return NGX_ERROR;
+        }
+
+        tf->file.fd = ngx_open_memory_file("nginx_temp");
+
+        if (tf->file.fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ALERT, p->log, ngx_errno,
+                          ngx_open_memory_file_n " failed");
+
+            (void) ngx_event_pipe_account_memory(p->temp_memory, -n);
+            p->temp_memory = NULL;
+
+            return NGX_DECLINED;
+        }
+
+        ngx_str_set(&tf->file.name, "memfd:nginx_temp");
+
+        cln->handler = ngx_event_pipe_memory_cleanup;
+        cln->data = p;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "pipe temp memory file: %d", tf->file.fd);
+    }
+
+    p->temp_memory_size = size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_event_pipe_memory_cleanup(void *data)
+{
+    ngx_event_pipe_t  *p = data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe temp memory cleanup: %d, %O",
+                   p->temp_file->file.fd, p->temp_memory_size);
+
+    (void) ngx_event_pipe_account_memory(p->temp_memory,
+                                         -p->temp_memory_size);
+
+    if (ngx_close_file(p->temp_file->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, p->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed",
+                      &p->temp_file->file.name);
+    }
+}
+
+
+// 同时修改总数和本进程slot的计数，返回修改前的总数
+static ngx_atomic_uint_t
+ngx_event_pipe_account_memory(ngx_event_pipe_memory_t *mem, off_t n)
+{
+    ngx_atomic_uint_t  used;
+
+    used = ngx_atomic_fetch_add(&mem->used, (ngx_atomic_int_t) n);
+
+    (void) ngx_atomic_fetch_add(&mem->slots[ngx_process_slot].used,
+                                (ngx_atomic_int_t) n);
+
+    return used;
+}
+
+
+/*
+ * a process that exits abnormally never returns its bytes;
+ * its slot is cleared by the next process spawned in the slot,
+ * or here once the process is gone and the budget is exhausted
+ */
+
+static ngx_uint_t
+ngx_event_pipe_reclaim_memory(ngx_event_pipe_memory_t *mem, ngx_log_t *log)
+{
+    ngx_pid_t                      pid;
+    ngx_uint_t                     i, reclaimed;
+    ngx_atomic_uint_t              n;
+    ngx_event_pipe_memory_slot_t  *slot;
+
+    reclaimed = 0;
+
+    ngx_shmtx_lock(&mem->shpool->mutex);
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        slot = &mem->slots[i];
+        pid = (ngx_pid_t) slot->pid;
+
+        if (pid == 0 || pid == ngx_pid || slot->used == 0) {
+            continue;
+        }
+
+        if (kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH) {
+            continue;
+        }
+
+        n = slot->used;
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "reclaimed %uA bytes of temp memory "
+                      "left by process %P", n, pid);
+
+        (void) ngx_atomic_fetch_add(&mem->used, -(ngx_atomic_int_t) n);
+
+        slot->used = 0;
+        slot->pid = 0;
+
+        reclaimed = 1;
+    }
+
+    ngx_shmtx_unlock(&mem->shpool->mutex);
+
+    return reclaimed;
+}
+
+
+// 进程启动时清掉之前使用同一个slot的进程留下的计数
+void
+ngx_event_pipe_init_memory_slot(ngx_event_pipe_memory_t *mem, ngx_log_t *log)
+{
+    ngx_atomic_uint_t              n;
+    ngx_event_pipe_memory_slot_t  *slot;
+
+    slot = &mem->slots[ngx_process_slot];
+
+    ngx_shmtx_lock(&mem->shpool->mutex);
+
+    n = slot->used;
+
+    if (n) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "reclaimed %uA bytes of temp memory "
+                      "left by process %P", n, (ngx_pid_t) slot->pid);
+
+        (void) ngx_atomic_fetch_add(&mem->used, -(ngx_atomic_int_t) n);
+
+        slot->used = 0;
+    }
+
+    slot->pid = ngx_pid;
+
+    ngx_shmtx_unlock(&mem->shpool->mutex);
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_event_pipe_drain_chains(ngx_event_pipe_t *p)
 {
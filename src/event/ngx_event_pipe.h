@@ -22,6 +22,26 @@ typedef ngx_int_t (*ngx_event_pipe_input_filter_pt)(ngx_event_pipe_t *p,
                                                     ngx_buf_t *buf);
 typedef ngx_int_t (*ngx_event_pipe_output_filter_pt)(void *data,
                                                      ngx_chain_t *chain);
+typedef ngx_buf_t *(*ngx_event_pipe_alloc_buf_pt)(ngx_event_pipe_t *p);
+
+
+#if (NGX_HAVE_MEMFD)
+
+// 共享内存中内存临时文件的计数，按进程的slot另外记一份，
+// 异常退出的进程留下的字节数可以从总数中减掉
+typedef struct {
+    ngx_atomic_t       pid;
+    ngx_atomic_t       used;
+} ngx_event_pipe_memory_slot_t;
+
+typedef struct {
+    ngx_atomic_t                   used;
+    // 只在清理slot时加锁，加减计数不需要锁
+    ngx_slab_pool_t               *shpool;
+    ngx_event_pipe_memory_slot_t   slots[NGX_MAX_PROCESSES];
+} ngx_event_pipe_memory_t;
+
+#endif
 
 
 struct ngx_event_pipe_s {
@@ -51,6 +71,10 @@ struct ngx_event_pipe_s {
     ngx_event_pipe_output_filter_pt   output_filter;
     void                             *output_ctx;
 
+    // 分配新的读缓冲区，为NULL时从p->pool中分配p->bufs.size大小的缓冲区
+    ngx_event_pipe_alloc_buf_pt       alloc_buf;
+    void                             *alloc_ctx;
+
     unsigned           read:1;
     unsigned           cacheable:1;
     unsigned           single_buf:1;
@@ -89,6 +113,14 @@ struct ngx_event_pipe_s {
     // 存放上游响应的临时文件
     ngx_temp_file_t   *temp_file;
 
+#if (NGX_HAVE_MEMFD)
+    // 所有worker进程在内存临时文件中保存的字节数和上限，为NULL时只使用磁盘
+    ngx_event_pipe_memory_t  *temp_memory;
+    off_t              temp_memory_max;
+    // 这个请求计入temp_memory的字节数
+    off_t              temp_memory_size;
+#endif
+
     // 已使用的缓冲区数目
     /* STUB */ int     num;
 };
@@ -97,6 +129,10 @@ struct ngx_event_pipe_s {
 ngx_int_t ngx_event_pipe(ngx_event_pipe_t *p, ngx_int_t do_write);
 ngx_int_t ngx_event_pipe_copy_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf);
 ngx_int_t ngx_event_pipe_add_free_buf(ngx_event_pipe_t *p, ngx_buf_t *b);
+#if (NGX_HAVE_MEMFD)
+void ngx_event_pipe_init_memory_slot(ngx_event_pipe_memory_t *mem,
+    ngx_log_t *log);
+#endif
 
 
 #endif /* _NGX_EVENT_PIPE_H_INCLUDED_ */
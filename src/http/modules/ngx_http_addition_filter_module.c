@@ -121,6 +121,8 @@ ngx_http_addition_header_filter(ngx_http_request_t *r)
 
     ngx_http_set_ctx(r, ctx, ngx_http_addition_filter_module);
 
+    r->filter_need_body = 1;
+
     ngx_http_clear_content_length(r);
     ngx_http_clear_accept_ranges(r);
     ngx_http_clear_etag(r);
@@ -12,15 +12,38 @@
 #include <ngx_http.h>
 
 
+typedef struct ngx_http_limit_conn_peer_s  ngx_http_limit_conn_peer_t;
+
+// sync区中其他节点上一个变量值的并发数
+struct ngx_http_limit_conn_peer_s {
+    ngx_http_limit_conn_peer_t  *next;
+    uint32_t                     id;
+    ngx_uint_t                   conn;
+    ngx_msec_t                   updated;
+};
+
+
 typedef struct {
     // 这个color不能被使用，是为了衔接ngx_rbtree_node_t的color
-    u_char              color;
-    u_char              len;
-    u_short             conn;
-    u_char              data[1];
+    u_char                       color;
+    u_char                       len;
+    u_short                      conn;
+    ngx_queue_t                  queue;
+    ngx_http_limit_conn_peer_t  *peers;
+    u_char                       data[1];
 } ngx_http_limit_conn_node_t;
 
 
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    // 所有节点，同步时按这个队列遍历
+    ngx_queue_t                  queue;
+    // 上次同步的时间，多个worker中只需要有一个导出并发数
+    ngx_msec_t                   synced;
+} ngx_http_limit_conn_shctx_t;
+
+
 typedef struct {
     ngx_shm_zone_t     *shm_zone;
     ngx_rbtree_node_t  *node;
@@ -28,18 +51,57 @@ typedef struct {
 
 
 typedef struct {
-    ngx_rbtree_t       *rbtree;
-    ngx_int_t           index;
-    ngx_str_t           var;
+    ngx_http_limit_conn_shctx_t  *sh;
+    ngx_int_t                     index;
+    ngx_str_t                     var;
+    // 不为NULL表示这个共享内存区和其他节点同步
+    ngx_http_limit_sync_zone_t   *sync;
+    // 本worker进程中正在排队的变量值，每个变量值一个ngx_http_limit_conn_wait_t
+    ngx_rbtree_t                  waiting;
+    ngx_rbtree_node_t             waiting_sentinel;
 } ngx_http_limit_conn_ctx_t;
 
 
+// 本worker进程中等待同一个变量值空出并发数的请求，先进先出。
+// 不同变量值的请求互不影响，队列空了就释放
+typedef struct {
+    ngx_rbtree_node_t             node;
+    ngx_queue_t                   waiters;
+    ngx_uint_t                    n;
+    size_t                        len;
+    u_char                        data[1];
+} ngx_http_limit_conn_wait_t;
+
+
 typedef struct {
     ngx_shm_zone_t     *shm_zone;
     ngx_uint_t          conn;
+    // 每个变量值最多排队的请求数，0表示超限时直接拒绝
+    ngx_uint_t          queue;
+    ngx_msec_t          timeout;
 } ngx_http_limit_conn_limit_t;
 
 
+// 在某个变量值的队列中排队的请求，作为请求的模块上下文
+typedef struct {
+    ngx_queue_t                   queue;
+    ngx_event_t                   event;
+    ngx_http_request_t           *request;
+    // 所在的共享内存区和队列，不在队列中时为NULL
+    ngx_http_limit_conn_ctx_t    *ctx;
+    ngx_http_limit_conn_wait_t   *wait;
+    ngx_msec_t                    start;
+    ngx_msec_t                    expire;
+    // 累计排队时间
+    ngx_msec_t                    time;
+    unsigned                      woken:1;
+} ngx_http_limit_conn_waiter_t;
+
+
+// 排队的请求至少每隔这么长时间重试一次，以便发现其他worker进程释放的并发数
+#define NGX_HTTP_LIMIT_CONN_POLL  100
+
+
 typedef struct {
     ngx_array_t         limits;
     ngx_uint_t          log_level;
@@ -51,6 +113,28 @@ static ngx_rbtree_node_t *ngx_http_limit_conn_lookup(ngx_rbtree_t *rbtree,
     ngx_http_variable_value_t *vv, uint32_t hash);
 static void ngx_http_limit_conn_cleanup(void *data);
 static ngx_inline void ngx_http_limit_conn_cleanup_all(ngx_pool_t *pool);
+static ngx_int_t ngx_http_limit_conn_enqueue(ngx_http_request_t *r,
+    ngx_http_limit_conn_ctx_t *ctx, ngx_http_limit_conn_limit_t *limit,
+    ngx_http_variable_value_t *vv, uint32_t hash);
+static void ngx_http_limit_conn_dequeue(ngx_http_limit_conn_waiter_t *w);
+static void ngx_http_limit_conn_wake(ngx_http_limit_conn_wait_t *wait);
+static ngx_http_limit_conn_wait_t *ngx_http_limit_conn_wait_lookup(
+    ngx_http_limit_conn_ctx_t *ctx, u_char *data, size_t len, uint32_t hash);
+static void ngx_http_limit_conn_wait_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_limit_conn_wait_handler(ngx_event_t *ev);
+static void ngx_http_limit_conn_waiter_cleanup(void *data);
+static void ngx_http_limit_conn_delete(ngx_http_limit_conn_ctx_t *ctx,
+    ngx_slab_pool_t *shpool, ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_http_limit_conn_remote(ngx_http_limit_conn_ctx_t *ctx,
+    ngx_slab_pool_t *shpool, ngx_http_limit_conn_node_t *lc);
+static void ngx_http_limit_conn_sync_export(ngx_http_limit_sync_zone_t *zone);
+static void ngx_http_limit_conn_sync_apply(ngx_http_limit_sync_zone_t *zone,
+    uint32_t peer, u_char *key, size_t len, ngx_uint_t value);
+
+static ngx_int_t ngx_http_limit_conn_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_limit_conn_add_variables(ngx_conf_t *cf);
 
 static void *ngx_http_limit_conn_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_conn_merge_conf(ngx_conf_t *cf, void *parent,
@@ -86,9 +170,10 @@ static ngx_conf_num_bounds_t  ngx_http_limit_conn_status_bounds = {
 static ngx_command_t  ngx_http_limit_conn_commands[] = {
 
     // 为限制一个ip的连接数而设置的共享内存块
-    // limit_conn_zone $variable zone=name:size;  $variable需是nginx内置变量，用来取客户端ip
+    // limit_conn_zone $variable zone=name:size [sync];  $variable需是nginx内置变量，用来取客户端ip
+    // 带sync参数时各个节点互相通告自己的并发数，限制的是所有节点的并发数之和
     { ngx_string("limit_conn_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2|NGX_CONF_TAKE3,
       ngx_http_limit_conn_zone,
       0,
       0,
@@ -104,8 +189,12 @@ static ngx_command_t  ngx_http_limit_conn_commands[] = {
       NULL },
 
     // 限值一个IP的最大连接数，及实现这条指令使用的共享内存的名字
+    // limit_conn zone number [queue=number] [timeout=time];
+    // 带queue参数时超限的请求按变量值分别排队，这个变量值有连接结束时按先后顺序继续处理，
+    // 排队超过timeout(默认60s)才返回limit_conn_status
     { ngx_string("limit_conn"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+                        |NGX_CONF_TAKE2|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
       ngx_http_limit_conn,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
@@ -132,7 +221,7 @@ static ngx_command_t  ngx_http_limit_conn_commands[] = {
 
 
 static ngx_http_module_t  ngx_http_limit_conn_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_limit_conn_add_variables,     /* preconfiguration */
     ngx_http_limit_conn_init,              /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -146,6 +235,16 @@ static ngx_http_module_t  ngx_http_limit_conn_module_ctx = {
 };
 
 
+static ngx_http_variable_t  ngx_http_limit_conn_vars[] = {
+
+    { ngx_string("limit_conn_queue_time"), NULL,
+      ngx_http_limit_conn_queue_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
 ngx_module_t  ngx_http_limit_conn_module = {
     NGX_MODULE_V1,
     &ngx_http_limit_conn_module_ctx,       /* module context */
@@ -168,7 +267,8 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 {
     size_t                          len, n;
     uint32_t                        hash;
-    ngx_uint_t                      i;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i, conn;
     ngx_slab_pool_t                *shpool;
     ngx_rbtree_node_t              *node;
     ngx_pool_cleanup_t             *cln;
@@ -177,6 +277,8 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
     ngx_http_limit_conn_node_t     *lc;
     ngx_http_limit_conn_conf_t     *lccf;
     ngx_http_limit_conn_limit_t    *limits;
+    ngx_http_limit_conn_wait_t     *wait;
+    ngx_http_limit_conn_waiter_t   *w;
     ngx_http_limit_conn_cleanup_t  *lccln;
 
     if (r->main->limit_conn_set) {
@@ -186,6 +288,8 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
     lccf = ngx_http_get_module_loc_conf(r, ngx_http_limit_conn_module);
     limits = lccf->limits.elts;
 
+    w = ngx_http_get_module_ctx(r, ngx_http_limit_conn_module);
+
     for (i = 0; i < lccf->limits.nelts; i++) {
         ctx = limits[i].shm_zone->data;
 
@@ -214,12 +318,22 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(vv->data, len);
 
+        wait = ngx_http_limit_conn_wait_lookup(ctx, vv->data, len, hash);
+
+        if (wait
+            && (w == NULL || w->wait != wait
+                || ngx_queue_head(&wait->waiters) != &w->queue))
+        {
+            /* do not overtake the requests waiting for the same key */
+            goto limited;
+        }
+
         shpool = (ngx_slab_pool_t *) limits[i].shm_zone->shm.addr;
 
         ngx_shmtx_lock(&shpool->mutex);
 
         // 从红黑树中查找这个变量值是否已经存在
-        node = ngx_http_limit_conn_lookup(ctx->rbtree, vv, hash);
+        node = ngx_http_limit_conn_lookup(&ctx->sh->rbtree, vv, hash);
 
         if (node == NULL) {
         // 这个变量值在红黑树中不存在,
@@ -243,27 +357,28 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
             node->key = hash;
             lc->len = (u_char) len;
             lc->conn = 1;
+            lc->peers = NULL;
             ngx_memcpy(lc->data, vv->data, len);
 
-            ngx_rbtree_insert(ctx->rbtree, node);
+            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+            ngx_queue_insert_head(&ctx->sh->queue, &lc->queue);
 
         } else {
         // 这个变量值在红黑树中已存在,
 
             lc = (ngx_http_limit_conn_node_t *) &node->color;
 
-            if ((ngx_uint_t) lc->conn >= limits[i].conn) {
-            // 这个变量值的并发连接数已达到上限，
+            conn = lc->conn;
 
-                ngx_shmtx_unlock(&shpool->mutex);
+            if (lc->peers) {
+                conn += ngx_http_limit_conn_remote(ctx, shpool, lc);
+            }
 
-                ngx_log_error(lccf->log_level, r->connection->log, 0,
-                              "limiting connections by zone \"%V\"",
-                              &limits[i].shm_zone->shm.name);
+            if (conn >= limits[i].conn) {
+            // 这个变量值的并发连接数已达到上限，
 
-                // 将r对应的所有变量值并发数减一，并给客户端返回错误码lccf->status_code
-                ngx_http_limit_conn_cleanup_all(r->pool);
-                return lccf->status_code;
+                ngx_shmtx_unlock(&shpool->mutex);
+                goto limited;
             }
 
             // 这个变量值的并发连接数未达到上限，将这个变量值对应的并发数加一
@@ -286,9 +401,297 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
         lccln->shm_zone = limits[i].shm_zone;
         lccln->node = node;
+
+        if (w && w->wait && w->wait == wait) {
+            ngx_http_limit_conn_dequeue(w);
+        }
     }
 
     return NGX_DECLINED;
+
+limited:
+
+    // 将r对应的所有变量值并发数减一
+    ngx_http_limit_conn_cleanup_all(r->pool);
+
+    if (limits[i].queue) {
+
+        rc = ngx_http_limit_conn_enqueue(r, ctx, &limits[i], vv, hash);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    ngx_log_error(lccf->log_level, r->connection->log, 0,
+                  "limiting connections by zone \"%V\"",
+                  &limits[i].shm_zone->shm.name);
+
+    // 给客户端返回错误码lccf->status_code
+    return lccf->status_code;
+}
+
+
+// 并发数超限时把请求加入这个变量值的队列，已经在队列中的保持原来的位置。
+// queue参数限制的是每个变量值的排队请求数。
+// 返回NGX_AGAIN表示请求已挂起，NGX_DECLINED表示队列已满或等待已超时
+static ngx_int_t
+ngx_http_limit_conn_enqueue(ngx_http_request_t *r,
+    ngx_http_limit_conn_ctx_t *ctx, ngx_http_limit_conn_limit_t *limit,
+    ngx_http_variable_value_t *vv, uint32_t hash)
+{
+    ngx_msec_t                     timer;
+    ngx_msec_int_t                 ms;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_limit_conn_wait_t    *wait;
+    ngx_http_limit_conn_conf_t    *lccf;
+    ngx_http_limit_conn_waiter_t  *w;
+
+    w = ngx_http_get_module_ctx(r, ngx_http_limit_conn_module);
+
+    if (w == NULL) {
+        w = ngx_pcalloc(r->pool, sizeof(ngx_http_limit_conn_waiter_t));
+        if (w == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cln->handler = ngx_http_limit_conn_waiter_cleanup;
+        cln->data = w;
+
+        w->event.handler = ngx_http_limit_conn_wait_handler;
+        w->event.data = r;
+        w->event.log = r->connection->log;
+        w->request = r;
+
+        ngx_http_set_ctx(r, w, ngx_http_limit_conn_module);
+    }
+
+    wait = ngx_http_limit_conn_wait_lookup(ctx, vv->data, vv->len, hash);
+
+    if (w->wait == NULL || w->wait != wait) {
+
+        if (w->wait) {
+            ngx_http_limit_conn_dequeue(w);
+
+            /* the queue may have been freed */
+
+            wait = ngx_http_limit_conn_wait_lookup(ctx, vv->data, vv->len,
+                                                   hash);
+        }
+
+        if (wait && wait->n >= limit->queue) {
+            return NGX_DECLINED;
+        }
+
+        if (wait == NULL) {
+            wait = ngx_alloc(offsetof(ngx_http_limit_conn_wait_t, data)
+                             + vv->len, ngx_cycle->log);
+            if (wait == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            wait->node.key = hash;
+            wait->len = vv->len;
+            wait->n = 0;
+            ngx_memcpy(wait->data, vv->data, vv->len);
+            ngx_queue_init(&wait->waiters);
+
+            ngx_rbtree_insert(&ctx->waiting, &wait->node);
+        }
+
+        lccf = ngx_http_get_module_loc_conf(r, ngx_http_limit_conn_module);
+
+        ngx_log_error(lccf->log_level, r->connection->log, 0,
+                      "queueing connection by zone \"%V\"",
+                      &limit->shm_zone->shm.name);
+
+        w->ctx = ctx;
+        w->wait = wait;
+        w->start = ngx_current_msec;
+        w->expire = ngx_current_msec + limit->timeout;
+
+        ngx_queue_insert_tail(&wait->waiters, &w->queue);
+        wait->n++;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_queued, 1);
+#endif
+    }
+
+    ms = (ngx_msec_int_t) (w->expire - ngx_current_msec);
+
+    if (ms <= 0) {
+        ngx_http_limit_conn_dequeue(w);
+        return NGX_DECLINED;
+    }
+
+    w->woken = 0;
+
+    timer = ngx_min((ngx_msec_t) ms, NGX_HTTP_LIMIT_CONN_POLL);
+
+    if (w->event.timer_set) {
+        ngx_del_timer(&w->event);
+    }
+
+    ngx_add_timer(&w->event, timer);
+
+    if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->main->limit_conn_set = 0;
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_AGAIN;
+}
+
+
+// 请求离开所在的队列，队列空了就释放
+static void
+ngx_http_limit_conn_dequeue(ngx_http_limit_conn_waiter_t *w)
+{
+    ngx_event_t                 *ev;
+    ngx_http_limit_conn_ctx_t   *ctx;
+    ngx_http_limit_conn_wait_t  *wait;
+
+    ctx = w->ctx;
+    wait = w->wait;
+
+    ngx_queue_remove(&w->queue);
+    wait->n--;
+
+    w->ctx = NULL;
+    w->wait = NULL;
+    w->woken = 0;
+    w->time += ngx_current_msec - w->start;
+
+    ev = &w->event;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_queued, -1);
+#endif
+
+    if (wait->n == 0) {
+        ngx_rbtree_delete(&ctx->waiting, &wait->node);
+        ngx_free(wait);
+        return;
+    }
+
+    /* the next request may get the connection left */
+
+    ngx_http_limit_conn_wake(wait);
+}
+
+
+// 唤醒一个变量值队首的请求，同一时刻只有队首的请求重试，保证先进先出
+static void
+ngx_http_limit_conn_wake(ngx_http_limit_conn_wait_t *wait)
+{
+    ngx_event_t                   *ev;
+    ngx_http_limit_conn_waiter_t  *w;
+
+    if (ngx_queue_empty(&wait->waiters)) {
+        return;
+    }
+
+    w = ngx_queue_data(ngx_queue_head(&wait->waiters),
+                       ngx_http_limit_conn_waiter_t, queue);
+
+    if (w->woken) {
+        return;
+    }
+
+    w->woken = 1;
+
+    ev = &w->event;
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+// 排队的请求被唤醒或定时器到期时调用，重新执行NGX_HTTP_PREACCESS_PHASE阶段
+static void
+ngx_http_limit_conn_wait_handler(ngx_event_t *ev)
+{
+    ngx_msec_int_t                 ms;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_log_ctx_t            *ctx;
+    ngx_http_limit_conn_conf_t    *lccf;
+    ngx_http_limit_conn_waiter_t  *w;
+
+    r = ev->data;
+    c = r->connection;
+
+    ctx = c->log->data;
+    ctx->current_request = r;
+
+    w = ngx_http_get_module_ctx(r, ngx_http_limit_conn_module);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "limit conn wait, timedout: %d", ev->timedout);
+
+    ev->timedout = 0;
+
+    if (ngx_queue_head(&w->wait->waiters) != &w->queue) {
+
+        ms = (ngx_msec_int_t) (w->expire - ngx_current_msec);
+
+        if (ms > 0) {
+            ngx_add_timer(ev, ngx_min((ngx_msec_t) ms,
+                                      NGX_HTTP_LIMIT_CONN_POLL));
+            return;
+        }
+
+        ngx_http_limit_conn_dequeue(w);
+
+        lccf = ngx_http_get_module_loc_conf(r, ngx_http_limit_conn_module);
+
+        ngx_log_error(lccf->log_level, c->log, 0,
+                      "limiting connections, queue timed out");
+
+        ngx_http_finalize_request(r, lccf->status_code);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+    ngx_http_run_posted_requests(c);
+}
+
+
+// 请求结束时如果还在排队，从队列中删除
+static void
+ngx_http_limit_conn_waiter_cleanup(void *data)
+{
+    ngx_http_limit_conn_waiter_t  *w = data;
+
+    if (w->ctx) {
+        ngx_http_limit_conn_dequeue(w);
+    }
 }
 
 
@@ -375,6 +778,87 @@ ngx_http_limit_conn_lookup(ngx_rbtree_t *rbtree, ngx_http_variable_value_t *vv,
 }
 
 
+// 在本worker进程的排队红黑树中查找变量值的队列
+static ngx_http_limit_conn_wait_t *
+ngx_http_limit_conn_wait_lookup(ngx_http_limit_conn_ctx_t *ctx, u_char *data,
+    size_t len, uint32_t hash)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_conn_wait_t  *wait;
+
+    node = ctx->waiting.root;
+    sentinel = ctx->waiting.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        wait = (ngx_http_limit_conn_wait_t *) node;
+
+        rc = ngx_memn2cmp(data, wait->data, len, wait->len);
+        if (rc == 0) {
+            return wait;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_limit_conn_wait_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_limit_conn_wait_t   *wn, *wt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            wn = (ngx_http_limit_conn_wait_t *) node;
+            wt = (ngx_http_limit_conn_wait_t *) temp;
+
+            p = (ngx_memn2cmp(wn->data, wt->data, wn->len, wt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 // 将data对应的变量值并发数减一，
 // 如果这个request已经是这个变量值的并发数的最后一个，
 // 顺便将这个变量值对应的红黑树节点释放 
@@ -387,6 +871,7 @@ ngx_http_limit_conn_cleanup(void *data)
     ngx_rbtree_node_t           *node;
     ngx_http_limit_conn_ctx_t   *ctx;
     ngx_http_limit_conn_node_t  *lc;
+    ngx_http_limit_conn_wait_t  *wait;
 
     ctx = lccln->shm_zone->data;
     shpool = (ngx_slab_pool_t *) lccln->shm_zone->shm.addr;
@@ -398,14 +883,24 @@ ngx_http_limit_conn_cleanup(void *data)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, lccln->shm_zone->shm.log, 0,
                    "limit conn cleanup: %08XD %d", node->key, lc->conn);
 
+    /* the node may be freed below */
+
+    wait = ngx_http_limit_conn_wait_lookup(ctx, lc->data, lc->len,
+                                           (uint32_t) node->key);
+
     lc->conn--;
 
-    if (lc->conn == 0) {
-        ngx_rbtree_delete(ctx->rbtree, node);
-        ngx_slab_free_locked(shpool, node);
+    /* synchronized nodes are deleted after the zero count is exported */
+
+    if (lc->conn == 0 && ctx->sync == NULL) {
+        ngx_http_limit_conn_delete(ctx, shpool, node);
     }
 
     ngx_shmtx_unlock(&shpool->mutex);
+
+    if (wait) {
+        ngx_http_limit_conn_wake(wait);
+    }
 }
 
 
@@ -428,6 +923,214 @@ ngx_http_limit_conn_cleanup_all(ngx_pool_t *pool)
 }
 
 
+// 从红黑树中删除节点并释放，调用前要加锁
+static void
+ngx_http_limit_conn_delete(ngx_http_limit_conn_ctx_t *ctx,
+    ngx_slab_pool_t *shpool, ngx_rbtree_node_t *node)
+{
+    ngx_http_limit_conn_node_t  *lc;
+    ngx_http_limit_conn_peer_t  *peer, *next;
+
+    lc = (ngx_http_limit_conn_node_t *) &node->color;
+
+    for (peer = lc->peers; peer; peer = next) {
+        next = peer->next;
+        ngx_slab_free_locked(shpool, peer);
+    }
+
+    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    ngx_queue_remove(&lc->queue);
+
+    ngx_slab_free_locked(shpool, node);
+}
+
+
+// 返回其他节点上这个变量值的并发数之和，调用前要加锁。
+// 超过3个同步间隔没有更新的节点认为已经没有这个变量值的连接，顺便释放它的记录
+static ngx_uint_t
+ngx_http_limit_conn_remote(ngx_http_limit_conn_ctx_t *ctx,
+    ngx_slab_pool_t *shpool, ngx_http_limit_conn_node_t *lc)
+{
+    ngx_uint_t                   conn;
+    ngx_msec_int_t               ms;
+    ngx_http_limit_conn_peer_t  *peer, **pp;
+
+    conn = 0;
+
+    for (pp = &lc->peers; *pp; /* void */) {
+        peer = *pp;
+
+        ms = (ngx_msec_int_t) (ngx_current_msec - peer->updated);
+
+        if (ctx->sync == NULL
+            || (ngx_msec_t) ngx_abs(ms) > 3 * ctx->sync->interval)
+        {
+            *pp = peer->next;
+            ngx_slab_free_locked(shpool, peer);
+            continue;
+        }
+
+        conn += peer->conn;
+        pp = &peer->next;
+    }
+
+    return conn;
+}
+
+
+// 同步定时器到期时调用，发送本节点每个变量值当前的并发数，
+// 并发数降为0的节点发送一次0之后删除
+static void
+ngx_http_limit_conn_sync_export(ngx_http_limit_sync_zone_t *zone)
+{
+    ngx_queue_t                 *q;
+    ngx_msec_int_t               ms;
+    ngx_slab_pool_t             *shpool;
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_conn_ctx_t   *ctx;
+    ngx_http_limit_conn_node_t  *lc;
+
+    ctx = zone->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) zone->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ms = (ngx_msec_int_t) (ngx_current_msec - ctx->sh->synced);
+
+    if (ngx_abs(ms) < (ngx_msec_int_t) zone->interval / 2) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    ctx->sh->synced = ngx_current_msec;
+
+    q = ngx_queue_head(&ctx->sh->queue);
+
+    while (q != ngx_queue_sentinel(&ctx->sh->queue)) {
+
+        lc = ngx_queue_data(q, ngx_http_limit_conn_node_t, queue);
+
+        q = ngx_queue_next(q);
+
+        if (lc->peers) {
+            (void) ngx_http_limit_conn_remote(ctx, shpool, lc);
+        }
+
+        if (lc->conn == 0 && lc->peers) {
+            continue;
+        }
+
+        ngx_http_limit_sync_add(zone, lc->data, lc->len, lc->conn);
+
+        if (lc->conn == 0) {
+            node = (ngx_rbtree_node_t *)
+                       ((u_char *) lc - offsetof(ngx_rbtree_node_t, color));
+
+            ngx_http_limit_conn_delete(ctx, shpool, node);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+// 记录节点peer上这个变量值的并发数，value为0时删除记录
+static void
+ngx_http_limit_conn_sync_apply(ngx_http_limit_sync_zone_t *zone, uint32_t peer,
+    u_char *key, size_t len, ngx_uint_t value)
+{
+    size_t                       n;
+    uint32_t                     hash;
+    ngx_slab_pool_t             *shpool;
+    ngx_rbtree_node_t           *node;
+    ngx_http_variable_value_t    vv;
+    ngx_http_limit_conn_ctx_t   *ctx;
+    ngx_http_limit_conn_node_t  *lc;
+    ngx_http_limit_conn_peer_t  *p, **pp;
+
+    if (len > 255) {
+        return;
+    }
+
+    ctx = zone->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) zone->shm_zone->shm.addr;
+
+    vv.len = len;
+    vv.data = key;
+
+    hash = ngx_crc32_short(key, len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_http_limit_conn_lookup(&ctx->sh->rbtree, &vv, hash);
+
+    if (node == NULL) {
+
+        if (value == 0) {
+            goto done;
+        }
+
+        n = offsetof(ngx_rbtree_node_t, color)
+            + offsetof(ngx_http_limit_conn_node_t, data)
+            + len;
+
+        node = ngx_slab_alloc_locked(shpool, n);
+        if (node == NULL) {
+            goto done;
+        }
+
+        lc = (ngx_http_limit_conn_node_t *) &node->color;
+
+        node->key = hash;
+        lc->len = (u_char) len;
+        lc->conn = 0;
+        lc->peers = NULL;
+        ngx_memcpy(lc->data, key, len);
+
+        ngx_rbtree_insert(&ctx->sh->rbtree, node);
+        ngx_queue_insert_head(&ctx->sh->queue, &lc->queue);
+
+    } else {
+        lc = (ngx_http_limit_conn_node_t *) &node->color;
+    }
+
+    for (pp = &lc->peers; *pp; pp = &(*pp)->next) {
+        if ((*pp)->id == peer) {
+            break;
+        }
+    }
+
+    p = *pp;
+
+    if (value == 0) {
+        if (p) {
+            *pp = p->next;
+            ngx_slab_free_locked(shpool, p);
+        }
+
+        goto done;
+    }
+
+    if (p == NULL) {
+        p = ngx_slab_alloc_locked(shpool, sizeof(ngx_http_limit_conn_peer_t));
+        if (p == NULL) {
+            goto done;
+        }
+
+        p->id = peer;
+        p->next = lc->peers;
+        lc->peers = p;
+    }
+
+    p->conn = value;
+    p->updated = ngx_current_msec;
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
 // 这个模块使用的每一块共享内存区初始化时都会调用的回调函数
 static ngx_int_t
 ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
@@ -436,7 +1139,6 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 
     size_t                      len;
     ngx_slab_pool_t            *shpool;
-    ngx_rbtree_node_t          *sentinel;
     ngx_http_limit_conn_ctx_t  *ctx;
 
     ctx = shm_zone->data;
@@ -450,7 +1152,7 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->rbtree = octx->rbtree;
+        ctx->sh = octx->sh;
 
         return NGX_OK;
     }
@@ -458,26 +1160,25 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->rbtree = shpool->data;
+        ctx->sh = shpool->data;
 
         return NGX_OK;
     }
 
-    ctx->rbtree = ngx_slab_alloc(shpool, sizeof(ngx_rbtree_t));
-    if (ctx->rbtree == NULL) {
+    ctx->sh = ngx_slab_alloc(shpool, sizeof(ngx_http_limit_conn_shctx_t));
+    if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
-    shpool->data = ctx->rbtree;
+    shpool->data = ctx->sh;
 
-    sentinel = ngx_slab_alloc(shpool, sizeof(ngx_rbtree_node_t));
-    if (sentinel == NULL) {
-        return NGX_ERROR;
-    }
-
-    ngx_rbtree_init(ctx->rbtree, sentinel,
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
                     ngx_http_limit_conn_rbtree_insert_value);
 
+    ngx_queue_init(&ctx->sh->queue);
+
+    ctx->sh->synced = 0;
+
     len = sizeof(" in limit_conn_zone \"\"") + shm_zone->shm.name.len;
 
     shpool->log_ctx = ngx_slab_alloc(shpool, len);
@@ -492,6 +1193,62 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+// $limit_conn_queue_time变量，请求在limit_conn队列中等待的时间
+static ngx_int_t
+ngx_http_limit_conn_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                        *p;
+    ngx_msec_t                     ms;
+    ngx_http_limit_conn_waiter_t  *w;
+
+    w = ngx_http_get_module_ctx(r, ngx_http_limit_conn_module);
+
+    if (w == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ms = w->time;
+
+    if (w->ctx) {
+        ms += ngx_current_msec - w->start;
+    }
+
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t) ms / 1000, ms % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_conn_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_limit_conn_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
 // ngx_http_module_t::create_loc_conf回调函数
 static void *
 ngx_http_limit_conn_create_conf(ngx_conf_t *cf)
@@ -542,7 +1299,7 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                     *p;
     ssize_t                     size;
     ngx_str_t                  *value, name, s;
-    ngx_uint_t                  i;
+    ngx_uint_t                  i, sync;
     ngx_shm_zone_t             *shm_zone;
     ngx_http_limit_conn_ctx_t  *ctx;
 
@@ -550,6 +1307,7 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ctx = NULL;
     size = 0;
+    sync = 0;
     name.len = 0;
 
     for (i = 1; i < cf->args->nelts; i++) {
@@ -588,6 +1346,11 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
         if (value[i].data[0] == '$') {
 
             value[i].len--;
@@ -605,6 +1368,9 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
             ctx->var = value[i];
 
+            ngx_rbtree_init(&ctx->waiting, &ctx->waiting_sentinel,
+                            ngx_http_limit_conn_wait_insert_value);
+
             continue;
         }
 
@@ -645,6 +1411,17 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_conn_init_zone;
     shm_zone->data = ctx;
 
+    if (sync) {
+        ctx->sync = ngx_http_limit_sync_add_zone(cf, shm_zone,
+                                                 NGX_HTTP_LIMIT_SYNC_CONN);
+        if (ctx->sync == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->sync->export = ngx_http_limit_conn_sync_export;
+        ctx->sync->apply = ngx_http_limit_conn_sync_apply;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -683,6 +1460,9 @@ ngx_http_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ctx->var = value[2];
 
+    ngx_rbtree_init(&ctx->waiting, &ctx->waiting_sentinel,
+                    ngx_http_limit_conn_wait_insert_value);
+
     n = ngx_parse_size(&value[3]);
 
     if (n == NGX_ERROR) {
@@ -728,9 +1508,10 @@ ngx_http_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_limit_conn_conf_t   *lccf = conf;
     ngx_http_limit_conn_limit_t  *limit, *limits;
 
-    ngx_str_t  *value;
-    ngx_int_t   n;
-    ngx_uint_t  i;
+    ngx_str_t   *value, s;
+    ngx_int_t    n, queue;
+    ngx_uint_t   i;
+    ngx_msec_t   timeout;
 
     value = cf->args->elts;
 
@@ -770,6 +1551,43 @@ ngx_http_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    queue = 0;
+    timeout = 60000;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+
+            queue = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (queue <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid queue size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
     limit = ngx_array_push(&lccf->limits);
     if (limit == NULL) {
         return NGX_CONF_ERROR;
@@ -777,6 +1595,8 @@ ngx_http_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     limit->conn = n;
     limit->shm_zone = shm_zone;
+    limit->queue = queue;
+    limit->timeout = timeout;
 
     return NGX_CONF_OK;
 }
@@ -0,0 +1,962 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这个文件是一个加入到NGX_HTTP_PREACCESS_PHASE阶段的http handler模块
+// 这个模块用共享内存中的令牌桶限制同一个变量值的所有连接的总发送速度，
+// write filter在发送前向这个模块申请可以发送的字节数，发送后扣除实际发送的字节数。
+// 一个location可以配置多个limit_rate_shared，发送量同时受所有桶的限制，
+// 这样可以实现按虚拟主机限速的同时再按客户端限速。
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    // 这个color不能被使用，是为了衔接ngx_rbtree_node_t的color
+    u_char                       color;
+    u_char                       dummy;
+    u_short                      len;
+    ngx_queue_t                  queue;
+    // 使用这个桶的请求数，不为0时桶不会被删除
+    ngx_uint_t                   conns;
+    // 已经开始发送响应的请求数，桶的速度在这些请求之间平均分配
+    ngx_uint_t                   active;
+    // 桶中剩余的字节数，发送的字节数超过申请的字节数时可能为负数
+    off_t                        tokens;
+    ngx_msec_t                   last;
+    u_char                       data[1];
+} ngx_http_limit_rate_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_http_limit_rate_shctx_t;
+
+
+typedef struct {
+    ngx_http_limit_rate_shctx_t *sh;
+    ngx_slab_pool_t             *shpool;
+    // 每秒补充的字节数和桶的容量
+    size_t                       rate;
+    size_t                       burst;
+    ngx_int_t                    index;
+    ngx_str_t                    var;
+} ngx_http_limit_rate_ctx_t;
+
+
+// 请求使用的一个桶，同时也是释放这个桶的pool cleanup的数据
+typedef struct {
+    ngx_shm_zone_t              *shm_zone;
+    ngx_http_limit_rate_node_t  *node;
+    ngx_uint_t                   active;  /* unsigned  active:1; */
+} ngx_http_limit_rate_bucket_t;
+
+
+typedef struct {
+    ngx_array_t                  limits;   /* ngx_shm_zone_t * */
+} ngx_http_limit_rate_conf_t;
+
+
+static ngx_array_t *ngx_http_limit_rate_get_buckets(ngx_http_request_t *r);
+static ngx_http_limit_rate_node_t *ngx_http_limit_rate_lookup(
+    ngx_http_limit_rate_ctx_t *ctx, ngx_uint_t hash, u_char *data, size_t len);
+static void ngx_http_limit_rate_refill(ngx_http_limit_rate_ctx_t *ctx,
+    ngx_http_limit_rate_node_t *lr, ngx_msec_t now);
+static void ngx_http_limit_rate_expire(ngx_http_limit_rate_ctx_t *ctx,
+    ngx_uint_t n);
+static void ngx_http_limit_rate_cleanup(void *data);
+
+static ngx_int_t ngx_http_limit_rate_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void *ngx_http_limit_rate_create_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_rate_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_limit_rate_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_limit_rate_shared_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_limit_rate_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_limit_rate_commands[] = {
+
+    // 例：limit_rate_zone $binary_remote_addr zone=client:10m rate=1m [burst=2m]
+    // 同一个binary_remote_addr的所有连接每秒总共最多发送1m字节，
+    // 桶的容量默认和rate相同
+    { ngx_string("limit_rate_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
+      ngx_http_limit_rate_zone,
+      0,
+      0,
+      NULL },
+
+    // 例：limit_rate_shared client;
+    // 可以配置多条，每条使用一个limit_rate_zone
+    { ngx_string("limit_rate_shared"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_rate_shared_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_limit_rate_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_limit_rate_init,              /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_limit_rate_create_conf,       /* create location configuration */
+    ngx_http_limit_rate_merge_conf         /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_limit_rate_module = {
+    NGX_MODULE_V1,
+    &ngx_http_limit_rate_module_ctx,       /* module context */
+    ngx_http_limit_rate_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+// 每个http请求在NGX_HTTP_PREACCESS_PHASE阶段会调用的回调函数，
+// 找到请求在每个共享内存区中对应的桶，并把桶的使用者数加一
+static ngx_int_t
+ngx_http_limit_rate_handler(ngx_http_request_t *r)
+{
+    size_t                         len, size;
+    uint32_t                       hash;
+    ngx_uint_t                     i;
+    ngx_array_t                   *buckets;
+    ngx_shm_zone_t               **limits;
+    ngx_pool_cleanup_t            *cln;
+    ngx_rbtree_node_t             *node;
+    ngx_http_variable_value_t     *vv;
+    ngx_http_limit_rate_ctx_t     *ctx;
+    ngx_http_limit_rate_node_t    *lr;
+    ngx_http_limit_rate_conf_t    *lrcf;
+    ngx_http_limit_rate_bucket_t  *bucket, **bp;
+
+    if (r->main->limit_rate_set) {
+        return NGX_DECLINED;
+    }
+
+    lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_rate_module);
+
+    if (lrcf->limits.nelts == 0) {
+        return NGX_DECLINED;
+    }
+
+    r->main->limit_rate_set = 1;
+
+    buckets = ngx_array_create(r->pool, lrcf->limits.nelts,
+                               sizeof(ngx_http_limit_rate_bucket_t *));
+    if (buckets == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    limits = lrcf->limits.elts;
+
+    for (i = 0; i < lrcf->limits.nelts; i++) {
+        ctx = limits[i]->data;
+
+        vv = ngx_http_get_indexed_variable(r, ctx->index);
+
+        if (vv == NULL || vv->not_found) {
+            continue;
+        }
+
+        len = vv->len;
+
+        if (len == 0) {
+            continue;
+        }
+
+        if (len > 65535) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "the value of the \"%V\" variable "
+                          "is more than 65535 bytes: \"%v\"",
+                          &ctx->var, vv);
+            continue;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool,
+                                   sizeof(ngx_http_limit_rate_bucket_t));
+        if (cln == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        bp = ngx_array_push(buckets);
+        if (bp == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        hash = ngx_crc32_short(vv->data, len);
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        lr = ngx_http_limit_rate_lookup(ctx, hash, vv->data, len);
+
+        if (lr == NULL) {
+
+            size = offsetof(ngx_rbtree_node_t, color)
+                   + offsetof(ngx_http_limit_rate_node_t, data)
+                   + len;
+
+            ngx_http_limit_rate_expire(ctx, 1);
+
+            node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+            if (node == NULL) {
+                ngx_http_limit_rate_expire(ctx, 0);
+
+                node = ngx_slab_alloc_locked(ctx->shpool, size);
+                if (node == NULL) {
+                    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+                    ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                                  "could not allocate node%s",
+                                  ctx->shpool->log_ctx);
+
+                    buckets->nelts--;
+                    continue;
+                }
+            }
+
+            node->key = hash;
+
+            lr = (ngx_http_limit_rate_node_t *) &node->color;
+
+            lr->len = (u_short) len;
+            lr->conns = 0;
+            lr->active = 0;
+            lr->tokens = ctx->burst;
+            lr->last = ngx_current_msec;
+
+            ngx_memcpy(lr->data, vv->data, len);
+
+            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+        } else {
+            ngx_queue_remove(&lr->queue);
+        }
+
+        ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+
+        lr->conns++;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "limit rate: %08XD conns:%ui tokens:%O",
+                       hash, lr->conns, lr->tokens);
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        cln->handler = ngx_http_limit_rate_cleanup;
+        bucket = cln->data;
+
+        bucket->shm_zone = limits[i];
+        bucket->node = lr;
+        bucket->active = 0;
+
+        *bp = bucket;
+    }
+
+    if (buckets->nelts) {
+        ngx_http_set_ctx(r->main, buckets, ngx_http_limit_rate_module);
+    }
+
+    return NGX_DECLINED;
+}
+
+
+// 由write filter在发送前调用，把limit减小到所有桶允许发送的字节数。
+// 每个桶允许发送的是平均分给每个发送者的令牌数，但不少于一页，
+// 令牌不足一页时返回需要等待的毫秒数
+ngx_msec_t
+ngx_http_limit_rate_shared(ngx_http_request_t *r, off_t *limit)
+{
+    off_t                          share, min;
+    ngx_uint_t                     i;
+    ngx_msec_t                     delay, d;
+    ngx_array_t                   *buckets;
+    ngx_http_limit_rate_ctx_t     *ctx;
+    ngx_http_limit_rate_node_t    *lr;
+    ngx_http_limit_rate_bucket_t **bp;
+
+    buckets = ngx_http_limit_rate_get_buckets(r);
+
+    if (buckets == NULL) {
+        return 0;
+    }
+
+    delay = 0;
+    bp = buckets->elts;
+
+    for (i = 0; i < buckets->nelts; i++) {
+        ctx = bp[i]->shm_zone->data;
+        lr = bp[i]->node;
+
+        min = ngx_min((off_t) ngx_pagesize, (off_t) ctx->burst);
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        if (!bp[i]->active) {
+            bp[i]->active = 1;
+            lr->active++;
+        }
+
+        ngx_http_limit_rate_refill(ctx, lr, ngx_current_msec);
+
+        if (lr->tokens < min) {
+            d = (ngx_msec_t) ((min - lr->tokens) * 1000 / ctx->rate + 1);
+
+            if (d > delay) {
+                delay = d;
+            }
+
+            share = 0;
+
+        } else {
+            share = lr->tokens / lr->active;
+
+            if (share < min) {
+                share = min;
+            }
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "limit rate shared: active:%ui tokens:%O share:%O "
+                       "delay:%M", lr->active, lr->tokens, share, delay);
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (share && (*limit == 0 || share < *limit)) {
+            *limit = share;
+        }
+    }
+
+    return delay;
+}
+
+
+// 由write filter在发送后调用，从所有桶中扣除实际发送的字节数。
+// 返回的延迟让每个发送者的速度不超过桶的速度除以发送者数，
+// 这样同一个桶的多个连接平均分配带宽，不会有连接总是抢先拿走令牌
+ngx_msec_t
+ngx_http_limit_rate_charge(ngx_http_request_t *r, off_t sent)
+{
+    ngx_uint_t                     i;
+    ngx_msec_t                     delay, d;
+    ngx_array_t                   *buckets;
+    ngx_http_limit_rate_ctx_t     *ctx;
+    ngx_http_limit_rate_node_t    *lr;
+    ngx_http_limit_rate_bucket_t **bp;
+
+    if (sent == 0) {
+        return 0;
+    }
+
+    buckets = ngx_http_limit_rate_get_buckets(r);
+
+    if (buckets == NULL) {
+        return 0;
+    }
+
+    delay = 0;
+    bp = buckets->elts;
+
+    for (i = 0; i < buckets->nelts; i++) {
+        ctx = bp[i]->shm_zone->data;
+        lr = bp[i]->node;
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        lr->tokens -= sent;
+
+        d = (ngx_msec_t) (sent * lr->active * 1000 / ctx->rate);
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (d > delay) {
+            delay = d;
+        }
+    }
+
+    return delay;
+}
+
+
+// 返回请求使用的桶。内部跳转（try_files、index、error_page、命名location）
+// 会清空r->main->ctx，而limit_rate_set标志保留，handler不会再次执行，
+// 这时从请求内存池的cleanup链表中找回这些桶，重新设置ctx
+static ngx_array_t *
+ngx_http_limit_rate_get_buckets(ngx_http_request_t *r)
+{
+    ngx_array_t                    *buckets;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_limit_rate_bucket_t  **bp;
+
+    buckets = ngx_http_get_module_ctx(r->main, ngx_http_limit_rate_module);
+
+    if (buckets) {
+        return buckets;
+    }
+
+    for (cln = r->main->pool->cleanup; cln; cln = cln->next) {
+
+        if (cln->handler != ngx_http_limit_rate_cleanup) {
+            continue;
+        }
+
+        if (buckets == NULL) {
+            buckets = ngx_array_create(r->pool, 2,
+                                     sizeof(ngx_http_limit_rate_bucket_t *));
+            if (buckets == NULL) {
+                return NULL;
+            }
+        }
+
+        bp = ngx_array_push(buckets);
+        if (bp == NULL) {
+            return NULL;
+        }
+
+        *bp = cln->data;
+    }
+
+    if (buckets) {
+        ngx_http_set_ctx(r->main, buckets, ngx_http_limit_rate_module);
+    }
+
+    return buckets;
+}
+
+
+// 在红黑树中查找key，调用前要加锁
+static ngx_http_limit_rate_node_t *
+ngx_http_limit_rate_lookup(ngx_http_limit_rate_ctx_t *ctx, ngx_uint_t hash,
+    u_char *data, size_t len)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_rate_node_t  *lr;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_rate_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(data, lr->data, len, (size_t) lr->len);
+
+        if (rc == 0) {
+            return lr;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+// 按经过的时间往桶中补充令牌，不超过桶的容量，调用前要加锁。
+// 不足一个字节的部分留到下次补充，所以只在补充了令牌时才更新last
+static void
+ngx_http_limit_rate_refill(ngx_http_limit_rate_ctx_t *ctx,
+    ngx_http_limit_rate_node_t *lr, ngx_msec_t now)
+{
+    off_t           n;
+    ngx_msec_int_t  ms;
+
+    ms = (ngx_msec_int_t) (now - lr->last);
+
+    if (ms <= 0) {
+        return;
+    }
+
+    n = (off_t) ctx->rate * ms / 1000;
+
+    if (n == 0) {
+        return;
+    }
+
+    lr->tokens += n;
+
+    if (lr->tokens > (off_t) ctx->burst) {
+        lr->tokens = ctx->burst;
+    }
+
+    lr->last = now;
+}
+
+
+// 删除没有使用者而且已经装满的桶，
+// n == 0时强制删除最旧的一个没有使用者的桶
+static void
+ngx_http_limit_rate_expire(ngx_http_limit_rate_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_queue_t                 *q;
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_rate_node_t  *lr;
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&ctx->sh->queue);
+
+        lr = ngx_queue_data(q, ngx_http_limit_rate_node_t, queue);
+
+        if (lr->conns) {
+            return;
+        }
+
+        if (n++ != 0) {
+
+            ngx_http_limit_rate_refill(ctx, lr, ngx_current_msec);
+
+            if (lr->tokens < (off_t) ctx->burst) {
+                return;
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+        ngx_slab_free_locked(ctx->shpool, node);
+    }
+}
+
+
+// 请求结束时把桶的使用者数减一
+static void
+ngx_http_limit_rate_cleanup(void *data)
+{
+    ngx_http_limit_rate_bucket_t  *bucket = data;
+
+    ngx_http_limit_rate_ctx_t  *ctx;
+
+    ctx = bucket->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    bucket->node->conns--;
+
+    if (bucket->active) {
+        bucket->node->active--;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static void
+ngx_http_limit_rate_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_limit_rate_node_t   *lrn, *lrnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lrn = (ngx_http_limit_rate_node_t *) &node->color;
+            lrnt = (ngx_http_limit_rate_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lrn->data, lrnt->data, lrn->len, lrnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+// 这个模块使用的每一块共享内存区初始化时都会调用的回调函数
+static ngx_int_t
+ngx_http_limit_rate_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_limit_rate_ctx_t  *octx = data;
+
+    size_t                      len;
+    ngx_http_limit_rate_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        if (ngx_strcmp(ctx->var.data, octx->var.data) != 0) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_rate_zone \"%V\" uses the \"%V\" variable "
+                          "while previously it used the \"%V\" variable",
+                          &shm_zone->shm.name, &ctx->var, &octx->var);
+            return NGX_ERROR;
+        }
+
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_rate_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_limit_rate_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in limit_rate_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in limit_rate_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+// ngx_http_module_t::create_loc_conf回调函数
+static void *
+ngx_http_limit_rate_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_rate_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_rate_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->limits.elts = NULL;
+     */
+
+    return conf;
+}
+
+
+// ngx_http_module_t::merge_loc_conf回调函数
+static char *
+ngx_http_limit_rate_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_limit_rate_conf_t *prev = parent;
+    ngx_http_limit_rate_conf_t *conf = child;
+
+    if (conf->limits.elts == NULL) {
+        conf->limits = prev->limits;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+// 解析配置文件时遇到limit_rate_zone指令时会调用的回调函数
+static char *
+ngx_http_limit_rate_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                     *p;
+    ssize_t                     size, rate, burst;
+    ngx_str_t                  *value, name, s;
+    ngx_uint_t                  i;
+    ngx_shm_zone_t             *shm_zone;
+    ngx_http_limit_rate_ctx_t  *ctx;
+
+    value = cf->args->elts;
+
+    ctx = NULL;
+    size = 0;
+    rate = 0;
+    burst = 0;
+    name.len = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            rate = ngx_parse_size(&s);
+
+            if (rate == NGX_ERROR || rate == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+
+            burst = ngx_parse_size(&s);
+
+            if (burst == NGX_ERROR || burst == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid burst \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (value[i].data[0] == '$') {
+
+            value[i].len--;
+            value[i].data++;
+
+            ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_rate_ctx_t));
+            if (ctx == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->index = ngx_http_get_variable_index(cf, &value[i]);
+            if (ctx->index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->var = value[i];
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no variable is defined for %V \"%V\"",
+                           &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"rate\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->rate = rate;
+    ctx->burst = burst ? burst : rate;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_limit_rate_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ctx = shm_zone->data;
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" is already bound to variable \"%V\"",
+                           &cmd->name, &name, &ctx->var);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_limit_rate_init_zone;
+    shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+}
+
+
+// 解析配置文件时遇到limit_rate_shared指令时会调用的回调函数
+static char *
+ngx_http_limit_rate_shared_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_limit_rate_conf_t  *lrcf = conf;
+
+    ngx_str_t        *value;
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *shm_zone, **limits, **limit;
+
+    value = cf->args->elts;
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                     &ngx_http_limit_rate_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown limit_rate_zone \"%V\"",
+                           &shm_zone->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+    limits = lrcf->limits.elts;
+
+    if (limits == NULL) {
+        if (ngx_array_init(&lrcf->limits, cf->pool, 1,
+                           sizeof(ngx_shm_zone_t *))
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    for (i = 0; i < lrcf->limits.nelts; i++) {
+        if (shm_zone == limits[i]) {
+            return "is duplicate";
+        }
+    }
+
+    limit = ngx_array_push(&lrcf->limits);
+    if (limit == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *limit = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+
+// ngx_http_module_t::postconfiguration回调函数
+// 将ngx_http_limit_rate_handler()加入到NGX_HTTP_PREACCESS_PHASE阶段的回调函数中
+static ngx_int_t
+ngx_http_limit_rate_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_limit_rate_handler;
+
+    return NGX_OK;
+}
@@ -0,0 +1,23 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_LIMIT_RATE_H_INCLUDED_
+#define _NGX_HTTP_LIMIT_RATE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+ngx_msec_t ngx_http_limit_rate_shared(ngx_http_request_t *r, off_t *limit);
+ngx_msec_t ngx_http_limit_rate_charge(ngx_http_request_t *r, off_t sent);
+
+
+extern ngx_module_t  ngx_http_limit_rate_module;
+
+
+#endif /* _NGX_HTTP_LIMIT_RATE_H_INCLUDED_ */
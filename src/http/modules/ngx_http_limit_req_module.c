@@ -18,6 +18,9 @@ typedef struct {
     u_char                       dummy;
     u_short                      len;
     ngx_queue_t                  queue;
+    // sync区中上次同步之后本节点接受的请求数，不为0时节点在分片的dirty队列中
+    ngx_queue_t                  dirty;
+    ngx_uint_t                   pending;
     ngx_msec_t                   last;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   excess;
@@ -30,20 +33,39 @@ typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+    ngx_queue_t                   dirty;
 } ngx_http_limit_req_shctx_t;
 
 
+// 共享内存可以分成多个分片，每个分片是一个独立的slab内存池，有自己的锁、红黑树和LRU队列，
+// 按照key的hash值选择分片，不同分片的请求不会竞争同一把锁
 typedef struct {
     ngx_http_limit_req_shctx_t  *sh;
     ngx_slab_pool_t             *shpool;
+    // 本worker在这个分片前面的内存块缓存，节点的申请和释放都经过它
+    ngx_slab_cache_t            *cache;
+} ngx_http_limit_req_shard_t;
+
+
+typedef struct {
+    ngx_http_limit_req_shard_t  *shards;
+    /* power of 2 */
+    ngx_uint_t                   nshards;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_int_t                    index;
     ngx_str_t                    var;
     ngx_http_limit_req_node_t   *node;
+    // node所在的分片
+    ngx_http_limit_req_shard_t  *shard;
+    // 不为NULL表示这个共享内存区和其他节点同步
+    ngx_http_limit_sync_zone_t  *sync;
 } ngx_http_limit_req_ctx_t;
 
 
+#define NGX_HTTP_LIMIT_REQ_MAX_SHARDS  64
+
+
 typedef struct {
     ngx_shm_zone_t              *shm_zone;
     /* integer value, 1 corresponds to 0.001 r/s */
@@ -62,12 +84,20 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, u_char *data, size_t len, ngx_uint_t *ep,
-    ngx_uint_t account);
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_req_ctx_t *ctx, u_char *log_ctx);
+static ngx_inline void ngx_http_limit_req_sync_pending(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shard_t *shard,
+    ngx_http_limit_req_node_t *lr);
+static void ngx_http_limit_req_sync_export(ngx_http_limit_sync_zone_t *zone);
+static void ngx_http_limit_req_sync_apply(ngx_http_limit_sync_zone_t *zone,
+    uint32_t peer, u_char *key, size_t len, ngx_uint_t value);
 
 static void *ngx_http_limit_req_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent,
@@ -95,10 +125,14 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
-    // 例：limit_req_zone $binary_remote_addr zone=one:10m rate=1r/s
-    // binary_remote_addr相同的连接每秒请求数不超过一个
+    // 例：limit_req_zone $binary_remote_addr zone=one:10m rate=1r/s [shards=8] [sync]
+    //         [slab_cache=32]
+    // binary_remote_addr相同的连接每秒请求数不超过一个，
+    // 带sync参数时每个key的请求数会和limit_sync_peer配置的节点同步，限制的是所有节点的请求总数。
+    // slab_cache是每个worker为每种大小的节点缓存的空闲内存块数，默认为0不缓存
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4|NGX_CONF_TAKE5
+                        |NGX_CONF_TAKE6,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -175,6 +209,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_http_variable_value_t   *vv;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
+    ngx_http_limit_req_shard_t  *shard;
     ngx_http_limit_req_limit_t  *limit, *limits;
 
     if (r->main->limit_req_set) {
@@ -220,12 +255,14 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(vv->data, len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        shard = &ctx->shards[hash & (ctx->nshards - 1)];
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-        rc = ngx_http_limit_req_lookup(limit, hash, vv->data, len, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+        rc = ngx_http_limit_req_lookup(limit, shard, hash, vv->data, len,
+                                       &excess, (n == lrcf->limits.nelts - 1));
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -258,11 +295,11 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
                 continue;
             }
 
-            ngx_shmtx_lock(&ctx->shpool->mutex);
+            ngx_shmtx_lock(&ctx->shard->shpool->mutex);
 
             ctx->node->count--;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_unlock(&ctx->shard->shpool->mutex);
 
             ctx->node = NULL;
         }
@@ -372,9 +409,11 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+// 在shard中查找key，调用前要对shard加锁
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    u_char *data, size_t len, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account)
 {
     size_t                      size;
     ngx_int_t                   rc, excess;
@@ -390,8 +429,8 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -413,7 +452,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
 
             ms = (ngx_msec_int_t) (now - lr->last);
 
@@ -432,12 +471,14 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             if (account) {
                 lr->excess = excess;
                 lr->last = now;
+                ngx_http_limit_req_sync_pending(ctx, shard, lr);
                 return NGX_OK;
             }
 
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = shard;
 
             return NGX_AGAIN;
         }
@@ -451,17 +492,17 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
            + offsetof(ngx_http_limit_req_node_t, data)
            + len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, shard, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = ngx_slab_cache_alloc_locked(shard->cache, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, shard, 0);
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        node = ngx_slab_cache_alloc_locked(shard->cache, size);
         if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", ctx->shpool->log_ctx);
+                          "could not allocate node%s", shard->shpool->log_ctx);
             return NGX_ERROR;
         }
     }
@@ -472,16 +513,18 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     lr->len = (u_char) len;
     lr->excess = 0;
+    lr->pending = 0;
 
     ngx_memcpy(lr->data, data, len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&shard->sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
 
     if (account) {
         lr->last = now;
         lr->count = 0;
+        ngx_http_limit_req_sync_pending(ctx, shard, lr);
         return NGX_OK;
     }
 
@@ -489,6 +532,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     lr->count = 1;
 
     ctx->node = lr;
+    ctx->shard = shard;
 
     return NGX_AGAIN;
 }
@@ -523,7 +567,7 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shmtx_lock(&ctx->shard->shpool->mutex);
 
         tp = ngx_timeofday();
 
@@ -540,7 +584,9 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_http_limit_req_sync_pending(ctx, ctx->shard, lr);
+
+        ngx_shmtx_unlock(&ctx->shard->shpool->mutex);
 
         ctx->node = NULL;
 
@@ -562,7 +608,8 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
 
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_time_t                 *tp;
@@ -584,11 +631,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&shard->sh->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -620,12 +667,16 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
         ngx_queue_remove(q);
 
+        if (lr->pending) {
+            ngx_queue_remove(&lr->dirty);
+        }
+
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&shard->sh->rbtree, node);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_slab_cache_free_locked(shard->cache, node);
     }
 }
 
@@ -637,6 +688,9 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ngx_http_limit_req_ctx_t  *octx = data;
 
     size_t                     len;
+    u_char                    *log_ctx;
+    ngx_uint_t                 i;
+    ngx_slab_pool_t           *shpool, **pools;
     ngx_http_limit_req_ctx_t  *ctx;
 
     ctx = shm_zone->data;
@@ -650,48 +704,314 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i].sh = octx->shards[i].sh;
+            ctx->shards[i].shpool = octx->shards[i].shpool;
+            ctx->shards[i].cache->pool = octx->shards[i].shpool;
+        }
 
         return NGX_OK;
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+
+        if (ctx->nshards == 1) {
+            ctx->shards[0].shpool = shpool;
+            ctx->shards[0].sh = shpool->data;
+            ctx->shards[0].cache->pool = shpool;
+
+            return NGX_OK;
+        }
+
+        pools = shpool->data;
+
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i].shpool = pools[i];
+            ctx->shards[i].sh = pools[i]->data;
+            ctx->shards[i].cache->pool = pools[i];
+        }
 
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
-    if (ctx->sh == NULL) {
+    len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
+
+    log_ctx = ngx_slab_alloc(shpool, len);
+    if (log_ctx == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
+    ngx_sprintf(log_ctx, " in limit_req zone \"%V\"%Z", &shm_zone->shm.name);
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
+    shpool->log_ctx = log_ctx;
 
-    ngx_queue_init(&ctx->sh->queue);
+    if (ctx->nshards == 1) {
+        ctx->shards[0].shpool = shpool;
 
-    len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
+    } else if (ngx_http_limit_req_init_shards(shm_zone, ctx, log_ctx)
+               != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shpool = ctx->shards[i].shpool;
+        ctx->shards[i].cache->pool = shpool;
+
+        ctx->shards[i].sh = ngx_slab_alloc(shpool,
+                                           sizeof(ngx_http_limit_req_shctx_t));
+        if (ctx->shards[i].sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        shpool->data = ctx->shards[i].sh;
+
+        ngx_rbtree_init(&ctx->shards[i].sh->rbtree,
+                        &ctx->shards[i].sh->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&ctx->shards[i].sh->queue);
+        ngx_queue_init(&ctx->shards[i].sh->dirty);
+
+        shpool->log_nomem = 0;
+    }
+
+    return NGX_OK;
+}
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
+
+// 把共享内存的空闲页平均分给各个分片，每个分片初始化为一个独立的slab内存池。
+// 各分片内存池的地址记录在共享内存的data中，并从根内存池串成链表，
+// worker异常退出时master据此强制解锁分片的锁
+static ngx_int_t
+ngx_http_limit_req_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_req_ctx_t *ctx, u_char *log_ctx)
+{
+    u_char           *p;
+    size_t            size;
+    ngx_uint_t        i;
+    ngx_slab_pool_t  *shpool, *sp, **pools, **next;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    pools = ngx_slab_alloc(shpool, ctx->nshards * sizeof(ngx_slab_pool_t *));
+    if (pools == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    shpool->data = pools;
+
+    /* the log context and the array of pools take at most two pages */
 
-    ctx->shpool->log_nomem = 0;
+    size = (shpool->end - shpool->start) / ngx_pagesize - 2;
+    size = size / ctx->nshards * ngx_pagesize;
+
+    next = &shpool->next;
+
+    for (i = 0; i < ctx->nshards; i++) {
+
+        p = ngx_slab_alloc(shpool, size);
+        if (p == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "could not allocate %ui shards%s",
+                          ctx->nshards, log_ctx);
+            return NGX_ERROR;
+        }
+
+        sp = (ngx_slab_pool_t *) p;
+
+        sp->end = p + size;
+        sp->min_shift = 3;
+        sp->addr = p;
+        sp->next = NULL;
+
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_slab_init(sp);
+
+        sp->log_ctx = log_ctx;
+
+        pools[i] = sp;
+        ctx->shards[i].shpool = sp;
+
+        *next = sp;
+        next = &sp->next;
+    }
 
     return NGX_OK;
 }
 
 
+// 本节点接受了一个请求，记录下来等待同步给其他节点，调用前要对shard加锁
+static ngx_inline void
+ngx_http_limit_req_sync_pending(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shard_t *shard, ngx_http_limit_req_node_t *lr)
+{
+    if (ctx->sync && lr->pending++ == 0) {
+        ngx_queue_insert_tail(&shard->sh->dirty, &lr->dirty);
+    }
+}
+
+
+// 同步定时器到期时调用，发送每个key上次同步之后本节点接受的请求数。
+// 每个worker取走的是不同的请求数，所以多个worker同时导出也不会重复计数
+static void
+ngx_http_limit_req_sync_export(ngx_http_limit_sync_zone_t *zone)
+{
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shard_t  *shard;
+
+    ctx = zone->shm_zone->data;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
+
+        while (!ngx_queue_empty(&shard->sh->dirty)) {
+            q = ngx_queue_head(&shard->sh->dirty);
+            lr = ngx_queue_data(q, ngx_http_limit_req_node_t, dirty);
+
+            ngx_queue_remove(q);
+
+            ngx_http_limit_sync_add(zone, lr->data, lr->len, lr->pending);
+
+            lr->pending = 0;
+        }
+
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+    }
+}
+
+
+// 其他节点接受了value个key的请求，同样计入本节点的excess，
+// 这样每个节点看到的excess近似于所有节点的请求总数
+static void
+ngx_http_limit_req_sync_apply(ngx_http_limit_sync_zone_t *zone, uint32_t peer,
+    u_char *key, size_t len, ngx_uint_t value)
+{
+    size_t                       size;
+    uint32_t                     hash;
+    ngx_int_t                    rc, excess;
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shard_t  *shard;
+
+    ctx = zone->shm_zone->data;
+
+    if (value > 65535) {
+        value = 65535;
+    }
+
+    hash = ngx_crc32_short(key, len);
+
+    shard = &ctx->shards[hash & (ctx->nshards - 1)];
+
+    tp = ngx_timeofday();
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key, lr->data, len, (size_t) lr->len);
+
+        if (rc == 0) {
+            ngx_queue_remove(&lr->queue);
+            ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
+
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000;
+
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            lr->excess = excess + value * 1000;
+            lr->last = now;
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            return;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_limit_req_node_t, data)
+           + len;
+
+    ngx_http_limit_req_expire(ctx, shard, 1);
+
+    node = ngx_slab_cache_alloc_locked(shard->cache, size);
+
+    if (node == NULL) {
+        ngx_http_limit_req_expire(ctx, shard, 0);
+
+        node = ngx_slab_cache_alloc_locked(shard->cache, size);
+        if (node == NULL) {
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            return;
+        }
+    }
+
+    node->key = hash;
+
+    lr = (ngx_http_limit_req_node_t *) &node->color;
+
+    lr->len = (u_short) len;
+    lr->excess = value * 1000;
+    lr->pending = 0;
+    lr->last = now;
+    lr->count = 0;
+
+    ngx_memcpy(lr->data, key, len);
+
+    ngx_rbtree_insert(&shard->sh->rbtree, node);
+
+    ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+}
+
+
 // ngx_http_module_t::create_loc_conf回调函数
 static void *
 ngx_http_limit_req_create_conf(ngx_conf_t *cf)
@@ -747,8 +1067,8 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                     len;
     ssize_t                    size;
     ngx_str_t                 *value, name, s;
-    ngx_int_t                  rate, scale;
-    ngx_uint_t                 i;
+    ngx_int_t                  rate, scale, shards, cache;
+    ngx_uint_t                 i, sync;
     ngx_shm_zone_t            *shm_zone;
     ngx_http_limit_req_ctx_t  *ctx;
 
@@ -758,6 +1078,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    shards = 1;
+    cache = 0;
+    sync = 0;
     name.len = 0;
 
     for (i = 1; i < cf->args->nelts; i++) {
@@ -820,6 +1143,52 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (shards <= 0
+                || shards > NGX_HTTP_LIMIT_REQ_MAX_SHARDS
+                || (shards & (shards - 1)))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\", "
+                                   "it must be a power of 2 up to %d",
+                                   &value[i], NGX_HTTP_LIMIT_REQ_MAX_SHARDS);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"shards\" requires atomic operations "
+                                   "on this platform");
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slab_cache=", 11) == 0) {
+
+            cache = ngx_atoi(value[i].data + 11, value[i].len - 11);
+
+            if (cache == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid slab cache size \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (value[i].data[0] == '$') {
 
             value[i].len--;
@@ -859,8 +1228,30 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (size < (ssize_t) (8 * ngx_pagesize * shards)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small for %i shards",
+                           &name, shards);
+        return NGX_CONF_ERROR;
+    }
+
     ctx->rate = rate * 1000 / scale;
 
+    ctx->nshards = shards;
+
+    ctx->shards = ngx_pcalloc(cf->pool,
+                              shards * sizeof(ngx_http_limit_req_shard_t));
+    if (ctx->shards == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < (ngx_uint_t) shards; i++) {
+        ctx->shards[i].cache = ngx_slab_cache_create(cf->pool, cache);
+        if (ctx->shards[i].cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
     if (shm_zone == NULL) {
@@ -879,6 +1270,17 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_req_init_zone;
     shm_zone->data = ctx;
 
+    if (sync) {
+        ctx->sync = ngx_http_limit_sync_add_zone(cf, shm_zone,
+                                                 NGX_HTTP_LIMIT_SYNC_REQ);
+        if (ctx->sync == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->sync->export = ngx_http_limit_req_sync_export;
+        ctx->sync->apply = ngx_http_limit_req_sync_apply;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -0,0 +1,795 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这个模块让limit_req_zone和limit_conn_zone的计数在多个nginx节点之间同步。
+// 每个worker每隔limit_sync_interval把本节点的计数打包成UDP报文发给所有limit_sync_peer，
+// 收到的报文交给对应的共享内存区合并，请求处理过程中不会因为同步而阻塞。
+//
+// 报文格式(多字节整数都是网络字节序)：
+//     "LS" 版本(1字节) 类型(1字节) 共享内存区名字长度(1字节) 共享内存区名字
+//     之后是若干条记录：key长度(2字节) 计数(4字节) key
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_LIMIT_SYNC_VERSION  1
+#define NGX_HTTP_LIMIT_SYNC_ENTRY    6
+
+
+typedef struct {
+    ngx_addr_t                    addr;
+    // 节点地址的crc32值，用来在共享内存中区分不同节点的计数
+    uint32_t                      id;
+} ngx_http_limit_sync_peer_t;
+
+
+typedef struct {
+    ngx_addr_t                   *listen;
+    ngx_array_t                   peers;   /* ngx_http_limit_sync_peer_t */
+    ngx_array_t                   zones;   /* ngx_http_limit_sync_zone_t * */
+    ngx_msec_t                    interval;
+
+    // 在master进程中绑定，由所有worker进程共用
+    ngx_socket_t                  fd;
+    ngx_connection_t             *connection;
+    ngx_event_t                   event;
+} ngx_http_limit_sync_main_conf_t;
+
+
+static void ngx_http_limit_sync_handler(ngx_event_t *ev);
+static void ngx_http_limit_sync_send(ngx_http_limit_sync_main_conf_t *smcf);
+static void ngx_http_limit_sync_read_handler(ngx_event_t *rev);
+static void ngx_http_limit_sync_process(ngx_http_limit_sync_main_conf_t *smcf,
+    ngx_http_limit_sync_peer_t *peer, u_char *p, size_t size);
+static void ngx_http_limit_sync_error(ngx_err_t err, const char *fmt,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_limit_sync_open(ngx_conf_t *cf,
+    ngx_http_limit_sync_main_conf_t *smcf);
+static void ngx_http_limit_sync_cleanup(void *data);
+
+static void *ngx_http_limit_sync_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_sync_init_main_conf(ngx_conf_t *cf, void *conf);
+static char *ngx_http_limit_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_limit_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_limit_sync_init_process(ngx_cycle_t *cycle);
+static void ngx_http_limit_sync_exit_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_limit_sync_commands[] = {
+
+    // 例：limit_sync_listen 10.0.0.1:7000;
+    // 接收其他节点计数的UDP地址，也是发送报文的源地址
+    { ngx_string("limit_sync_listen"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_sync_listen,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    // 例：limit_sync_peer 10.0.0.2:7000;
+    // 其他节点的limit_sync_listen地址，可以配置多条，和本节点地址相同的会被忽略，
+    // 这样所有节点可以使用同一份配置
+    { ngx_string("limit_sync_peer"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_sync_peer,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_sync_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_limit_sync_main_conf_t, interval),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_limit_sync_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    ngx_http_limit_sync_create_main_conf,  /* create main configuration */
+    ngx_http_limit_sync_init_main_conf,    /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_limit_sync_module = {
+    NGX_MODULE_V1,
+    &ngx_http_limit_sync_module_ctx,       /* module context */
+    ngx_http_limit_sync_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_limit_sync_init_process,      /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_http_limit_sync_exit_process,      /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+// 正在组装的报文，每个worker进程一份
+static u_char   ngx_http_limit_sync_buf[NGX_HTTP_LIMIT_SYNC_MTU];
+static u_char  *ngx_http_limit_sync_start;
+static u_char  *ngx_http_limit_sync_pos;
+
+static time_t   ngx_http_limit_sync_error_time;
+
+
+// 由limit_req_zone和limit_conn_zone指令的sync参数调用，
+// 调用者需要设置返回的zone的export和apply回调函数
+ngx_http_limit_sync_zone_t *
+ngx_http_limit_sync_add_zone(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone,
+    u_char type)
+{
+    ngx_http_limit_sync_zone_t        *zone, **zonep;
+    ngx_http_limit_sync_main_conf_t   *smcf;
+
+    if (shm_zone->shm.name.len > 255) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone name \"%V\" is too long to be synchronized",
+                           &shm_zone->shm.name);
+        return NULL;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_limit_sync_module);
+
+    zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_sync_zone_t));
+    if (zone == NULL) {
+        return NULL;
+    }
+
+    zone->shm_zone = shm_zone;
+    zone->type = type;
+
+    zonep = ngx_array_push(&smcf->zones);
+    if (zonep == NULL) {
+        return NULL;
+    }
+
+    *zonep = zone;
+
+    return zone;
+}
+
+
+// 在export回调中调用，把一条计数加入报文，报文满了就先发送出去
+void
+ngx_http_limit_sync_add(ngx_http_limit_sync_zone_t *zone, u_char *key,
+    size_t len, ngx_uint_t value)
+{
+    u_char                           *p;
+    ngx_http_limit_sync_main_conf_t  *smcf;
+
+    p = ngx_http_limit_sync_pos;
+
+    if (ngx_http_limit_sync_start + NGX_HTTP_LIMIT_SYNC_ENTRY + len
+        > ngx_http_limit_sync_buf + NGX_HTTP_LIMIT_SYNC_MTU)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "limit sync: key of %uz bytes in \"%V\" skipped",
+                       len, &zone->shm_zone->shm.name);
+        return;
+    }
+
+    if (p + NGX_HTTP_LIMIT_SYNC_ENTRY + len
+        > ngx_http_limit_sync_buf + NGX_HTTP_LIMIT_SYNC_MTU)
+    {
+        smcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                                   ngx_http_limit_sync_module);
+        ngx_http_limit_sync_send(smcf);
+
+        p = ngx_http_limit_sync_start;
+    }
+
+    if (value > 0xffffffff) {
+        value = 0xffffffff;
+    }
+
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) (value >> 24);
+    *p++ = (u_char) (value >> 16);
+    *p++ = (u_char) (value >> 8);
+    *p++ = (u_char) value;
+
+    ngx_http_limit_sync_pos = ngx_cpymem(p, key, len);
+}
+
+
+// 同步定时器的回调函数，依次导出每个共享内存区的计数并发送
+static void
+ngx_http_limit_sync_handler(ngx_event_t *ev)
+{
+    u_char                            *p;
+    ngx_uint_t                         i;
+    ngx_http_limit_sync_zone_t        *zone, **zones;
+    ngx_http_limit_sync_main_conf_t   *smcf;
+
+    smcf = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "limit sync timer");
+
+    zones = smcf->zones.elts;
+
+    for (i = 0; i < smcf->zones.nelts; i++) {
+        zone = zones[i];
+
+        p = ngx_http_limit_sync_buf;
+
+        *p++ = 'L';
+        *p++ = 'S';
+        *p++ = NGX_HTTP_LIMIT_SYNC_VERSION;
+        *p++ = zone->type;
+        *p++ = (u_char) zone->shm_zone->shm.name.len;
+
+        p = ngx_cpymem(p, zone->shm_zone->shm.name.data,
+                       zone->shm_zone->shm.name.len);
+
+        ngx_http_limit_sync_start = p;
+        ngx_http_limit_sync_pos = p;
+
+        zone->export(zone);
+
+        if (ngx_http_limit_sync_pos != ngx_http_limit_sync_start) {
+            ngx_http_limit_sync_send(smcf);
+        }
+    }
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, smcf->interval);
+}
+
+
+// 把组装好的报文发给所有节点，发送失败的报文直接丢弃
+static void
+ngx_http_limit_sync_send(ngx_http_limit_sync_main_conf_t *smcf)
+{
+    size_t                       size;
+    ngx_err_t                    err;
+    ngx_uint_t                   i;
+    ngx_http_limit_sync_peer_t  *peers;
+
+    size = ngx_http_limit_sync_pos - ngx_http_limit_sync_buf;
+    peers = smcf->peers.elts;
+
+    for (i = 0; i < smcf->peers.nelts; i++) {
+
+        if (sendto(smcf->fd, (void *) ngx_http_limit_sync_buf, size, 0,
+                   peers[i].addr.sockaddr, peers[i].addr.socklen)
+            == -1)
+        {
+            err = ngx_socket_errno;
+
+            if (err != NGX_EAGAIN) {
+                ngx_http_limit_sync_error(err, "sendto() to limit sync "
+                                          "peer \"%V\" failed",
+                                          &peers[i].addr.name);
+            }
+        }
+    }
+
+    ngx_http_limit_sync_pos = ngx_http_limit_sync_start;
+}
+
+
+// 读取套接字上所有报文，只接受limit_sync_peer配置的节点发来的报文
+static void
+ngx_http_limit_sync_read_handler(ngx_event_t *rev)
+{
+    ssize_t                           n;
+    ngx_err_t                         err;
+    ngx_str_t                         name;
+    socklen_t                         socklen;
+    ngx_uint_t                        i;
+    ngx_connection_t                 *c;
+    ngx_http_limit_sync_peer_t       *peers;
+    ngx_http_limit_sync_main_conf_t  *smcf;
+    u_char                            sa[NGX_SOCKADDRLEN];
+    u_char                            text[NGX_SOCKADDR_STRLEN];
+    u_char                            buf[NGX_HTTP_LIMIT_SYNC_MTU];
+
+    c = rev->data;
+    smcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_limit_sync_module);
+
+    peers = smcf->peers.elts;
+
+    for ( ;; ) {
+
+        socklen = NGX_SOCKADDRLEN;
+
+        n = recvfrom(c->fd, (void *) buf, sizeof(buf), 0,
+                     (struct sockaddr *) sa, &socklen);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                return;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, c->log, err,
+                          "recvfrom() on limit sync socket failed");
+            return;
+        }
+
+        for (i = 0; i < smcf->peers.nelts; i++) {
+            if (ngx_cmp_sockaddr((struct sockaddr *) sa, socklen,
+                                 peers[i].addr.sockaddr, peers[i].addr.socklen,
+                                 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i == smcf->peers.nelts) {
+            name.len = ngx_sock_ntop((struct sockaddr *) sa, socklen, text,
+                                     NGX_SOCKADDR_STRLEN, 1);
+            name.data = text;
+
+            ngx_http_limit_sync_error(0, "limit sync packet from unknown "
+                                      "peer \"%V\" ignored", &name);
+            continue;
+        }
+
+        ngx_http_limit_sync_process(smcf, &peers[i], buf, n);
+    }
+}
+
+
+// 解析一个报文，把每条记录交给对应共享内存区的apply回调函数
+static void
+ngx_http_limit_sync_process(ngx_http_limit_sync_main_conf_t *smcf,
+    ngx_http_limit_sync_peer_t *peer, u_char *p, size_t size)
+{
+    u_char                       *last;
+    size_t                        len;
+    ngx_str_t                     name;
+    ngx_uint_t                    i, value;
+    ngx_http_limit_sync_zone_t   *zone, **zones;
+
+    last = p + size;
+
+    if (size < 5
+        || p[0] != 'L' || p[1] != 'S'
+        || p[2] != NGX_HTTP_LIMIT_SYNC_VERSION
+        || size < 5 + (size_t) p[4])
+    {
+        goto invalid;
+    }
+
+    name.len = p[4];
+    name.data = p + 5;
+
+    zones = smcf->zones.elts;
+
+    for (i = 0; i < smcf->zones.nelts; i++) {
+        zone = zones[i];
+
+        if (zone->type == p[3]
+            && zone->shm_zone->shm.name.len == name.len
+            && ngx_strncmp(zone->shm_zone->shm.name.data, name.data, name.len)
+               == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == smcf->zones.nelts) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "limit sync: unknown zone \"%V\" from \"%V\"",
+                       &name, &peer->addr.name);
+        return;
+    }
+
+    p += 5 + name.len;
+
+    while (p < last) {
+
+        if (last - p < NGX_HTTP_LIMIT_SYNC_ENTRY) {
+            goto invalid;
+        }
+
+        len = (p[0] << 8) + p[1];
+        value = ((ngx_uint_t) p[2] << 24) + (p[3] << 16) + (p[4] << 8) + p[5];
+
+        p += NGX_HTTP_LIMIT_SYNC_ENTRY;
+
+        if ((size_t) (last - p) < len) {
+            goto invalid;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "limit sync: \"%V\" from \"%V\": %*s",
+                       &name, &peer->addr.name, len, p);
+
+        if (len) {
+            zone->apply(zone, peer->id, p, len, value);
+        }
+
+        p += len;
+    }
+
+    return;
+
+invalid:
+
+    ngx_http_limit_sync_error(0, "invalid limit sync packet from \"%V\"",
+                              &peer->addr.name);
+}
+
+
+// 同步相关的错误每分钟最多记录一次，避免节点不可达时刷满错误日志
+static void
+ngx_http_limit_sync_error(ngx_err_t err, const char *fmt, ngx_str_t *name)
+{
+    time_t  now;
+
+    now = ngx_time();
+
+    if (ngx_http_limit_sync_error_time
+        && now - ngx_http_limit_sync_error_time < 60)
+    {
+        return;
+    }
+
+    ngx_http_limit_sync_error_time = now;
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err, fmt, name);
+}
+
+
+// 在master进程中创建并绑定UDP套接字，worker进程继承这个套接字。
+// 设置SO_REUSEADDR是因为reload时旧配置的套接字在新套接字绑定后才会关闭
+static ngx_int_t
+ngx_http_limit_sync_open(ngx_conf_t *cf, ngx_http_limit_sync_main_conf_t *smcf)
+{
+    int                  reuseaddr;
+    ngx_socket_t         s;
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    s = ngx_socket(smcf->listen->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_socket_errno,
+                           ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    smcf->fd = s;
+
+    cln->handler = ngx_http_limit_sync_cleanup;
+    cln->data = smcf;
+
+    reuseaddr = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *) &reuseaddr, sizeof(int))
+        == -1)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_socket_errno,
+                           "setsockopt(SO_REUSEADDR) %V failed",
+                           &smcf->listen->name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_socket_errno,
+                           ngx_nonblocking_n " %V failed",
+                           &smcf->listen->name);
+        return NGX_ERROR;
+    }
+
+    if (bind(s, smcf->listen->sockaddr, smcf->listen->socklen) == -1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_socket_errno,
+                           "bind() to %V failed", &smcf->listen->name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_sync_cleanup(void *data)
+{
+    ngx_http_limit_sync_main_conf_t  *smcf = data;
+
+    if (smcf->connection) {
+        return;
+    }
+
+    if (ngx_close_socket(smcf->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " %V failed", &smcf->listen->name);
+    }
+}
+
+
+static void *
+ngx_http_limit_sync_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_sync_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_sync_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->listen = NULL;
+     *     smcf->connection = NULL;
+     */
+
+    if (ngx_array_init(&smcf->peers, cf->pool, 4,
+                       sizeof(ngx_http_limit_sync_peer_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->zones, cf->pool, 4,
+                       sizeof(ngx_http_limit_sync_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    smcf->interval = NGX_CONF_UNSET_MSEC;
+    smcf->fd = (ngx_socket_t) -1;
+
+    return smcf;
+}
+
+
+static char *
+ngx_http_limit_sync_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_limit_sync_main_conf_t *smcf = conf;
+
+    ngx_uint_t                    i;
+    ngx_http_limit_sync_zone_t  **zones;
+    ngx_http_limit_sync_peer_t   *peers;
+
+    ngx_conf_init_msec_value(smcf->interval, 100);
+
+    if (smcf->interval == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"limit_sync_interval\" must be positive");
+        return NGX_CONF_ERROR;
+    }
+
+    if (smcf->zones.nelts == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (smcf->listen == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "synchronized zones require "
+                           "the \"limit_sync_listen\" directive");
+        return NGX_CONF_ERROR;
+    }
+
+    zones = smcf->zones.elts;
+
+    for (i = 0; i < smcf->zones.nelts; i++) {
+        zones[i]->interval = smcf->interval;
+    }
+
+    /* skip the address of this node */
+
+    peers = smcf->peers.elts;
+
+    for (i = 0; i < smcf->peers.nelts; /* void */) {
+
+        if (ngx_cmp_sockaddr(peers[i].addr.sockaddr, peers[i].addr.socklen,
+                             smcf->listen->sockaddr, smcf->listen->socklen, 1)
+            == NGX_OK)
+        {
+            peers[i] = peers[--smcf->peers.nelts];
+            continue;
+        }
+
+        i++;
+    }
+
+    if (ngx_test_config || ngx_process == NGX_PROCESS_SIGNALLER) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_http_limit_sync_open(cf, smcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_sync_main_conf_t *smcf = conf;
+
+    ngx_str_t  *value;
+    ngx_url_t   u;
+
+    if (smcf->listen) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.listen = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"limit_sync_listen\" "
+                               "directive", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"limit_sync_listen\" "
+                           "directive", &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->listen = ngx_palloc(cf->pool, sizeof(ngx_addr_t));
+    if (smcf->listen == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->listen->sockaddr = ngx_palloc(cf->pool, u.socklen);
+    if (smcf->listen->sockaddr == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memcpy(smcf->listen->sockaddr, u.sockaddr, u.socklen);
+
+    smcf->listen->socklen = u.socklen;
+    smcf->listen->name = value[1];
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_sync_main_conf_t *smcf = conf;
+
+    ngx_str_t                   *value;
+    ngx_url_t                    u;
+    ngx_uint_t                   i;
+    ngx_http_limit_sync_peer_t  *peer;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"limit_sync_peer\" "
+                               "directive", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"limit_sync_peer\" "
+                           "directive", &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        peer = ngx_array_push(&smcf->peers);
+        if (peer == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        peer->addr = u.addrs[i];
+        peer->id = ngx_crc32_short((u_char *) u.addrs[i].sockaddr,
+                                   u.addrs[i].socklen);
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+// 每个worker进程都监听同步套接字，并启动自己的同步定时器
+static ngx_int_t
+ngx_http_limit_sync_init_process(ngx_cycle_t *cycle)
+{
+    ngx_connection_t                 *c;
+    ngx_http_limit_sync_main_conf_t  *smcf;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_sync_module);
+
+    if (smcf == NULL || smcf->fd == (ngx_socket_t) -1) {
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(smcf->fd, cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_http_limit_sync_read_handler;
+    c->read->log = cycle->log;
+    c->write->log = cycle->log;
+
+    smcf->connection = c;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    smcf->event.handler = ngx_http_limit_sync_handler;
+    smcf->event.data = smcf;
+    smcf->event.log = cycle->log;
+
+    ngx_add_timer(&smcf->event, smcf->interval);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_sync_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_limit_sync_main_conf_t  *smcf;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_sync_module);
+
+    if (smcf == NULL || smcf->connection == NULL) {
+        return;
+    }
+
+    ngx_close_connection(smcf->connection);
+}
@@ -0,0 +1,54 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_LIMIT_SYNC_H_INCLUDED_
+#define _NGX_HTTP_LIMIT_SYNC_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_LIMIT_SYNC_REQ     'R'
+#define NGX_HTTP_LIMIT_SYNC_CONN    'C'
+
+// 一个UDP报文的最大长度，保证不会在以太网上分片
+#define NGX_HTTP_LIMIT_SYNC_MTU     1400
+
+
+typedef struct ngx_http_limit_sync_zone_s  ngx_http_limit_sync_zone_t;
+
+// 把本节点需要同步的计数用ngx_http_limit_sync_add()加入报文
+typedef void (*ngx_http_limit_sync_export_pt)(ngx_http_limit_sync_zone_t *zone);
+// 处理从节点peer收到的一条计数，peer是这个节点地址的crc32值
+typedef void (*ngx_http_limit_sync_apply_pt)(ngx_http_limit_sync_zone_t *zone,
+    uint32_t peer, u_char *key, size_t len, ngx_uint_t value);
+
+
+// 一个参与同步的limit_req_zone或limit_conn_zone
+struct ngx_http_limit_sync_zone_s {
+    ngx_shm_zone_t                 *shm_zone;
+    u_char                          type;
+
+    // 同步间隔，由limit_sync_interval指令设置
+    ngx_msec_t                      interval;
+
+    ngx_http_limit_sync_export_pt   export;
+    ngx_http_limit_sync_apply_pt    apply;
+};
+
+
+ngx_http_limit_sync_zone_t *ngx_http_limit_sync_add_zone(ngx_conf_t *cf,
+    ngx_shm_zone_t *shm_zone, u_char type);
+void ngx_http_limit_sync_add(ngx_http_limit_sync_zone_t *zone, u_char *key,
+    size_t len, ngx_uint_t value);
+
+
+extern ngx_module_t  ngx_http_limit_sync_module;
+
+
+#endif /* _NGX_HTTP_LIMIT_SYNC_H_INCLUDED_ */
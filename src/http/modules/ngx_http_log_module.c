@@ -32,10 +32,35 @@ struct ngx_http_log_op_s {
 };
 
 
+#define NGX_HTTP_LOG_ESCAPE_DEFAULT   0
+#define NGX_HTTP_LOG_ESCAPE_JSON      1
+#define NGX_HTTP_LOG_ESCAPE_BINARY    2
+
+/*
+ * a binary log is a sequence of records, each starts with the header:
+ * 4 bytes of the body length, the record type ('S' for the schema, 'R' for
+ * the data), the version, 2 bytes of the number of fields and 4 bytes of
+ * the schema id; all numbers are in network byte order.  The body is a list
+ * of fields, each is 2 bytes of the length followed by the data.  The schema
+ * body starts with the format name followed by the field names.
+ */
+
+#define NGX_HTTP_LOG_BINARY_HEADER    12
+#define NGX_HTTP_LOG_BINARY_VERSION   1
+#define NGX_HTTP_LOG_BINARY_MAX_FIELD 65535
+
+
 typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+
+    ngx_uint_t                  escape;
+
+    // 二进制格式的字段名、预先生成的schema记录和数据记录的头部
+    ngx_array_t                *fields;     /* array of ngx_str_t */
+    ngx_str_t                   schema;
+    u_char                      header[NGX_HTTP_LOG_BINARY_HEADER];
 } ngx_http_log_fmt_t;
 
 
@@ -65,6 +90,10 @@ typedef struct {
 typedef struct {
     ngx_open_file_t            *file;
     ngx_http_log_script_t      *script;
+    ngx_log_ring_t             *ring;
+    ngx_syslog_peer_t          *syslog_peer;
+    // 二进制格式已经写过schema记录的文件的generation加1，为0表示还没有写过
+    ngx_uint_t                  schema;
     time_t                      disk_full_time;
     time_t                      error_log_time;
     ngx_http_log_fmt_t         *format;
@@ -89,6 +118,8 @@ typedef struct {
 } ngx_http_log_var_t;
 
 
+static u_char *ngx_http_log_line(ngx_http_request_t *r, ngx_http_log_t *log,
+    u_char *buf);
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
@@ -125,24 +156,39 @@ static u_char *ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 
 static ngx_int_t ngx_http_log_variable_compile(ngx_conf_t *cf,
-    ngx_http_log_op_t *op, ngx_str_t *value);
+    ngx_http_log_op_t *op, ngx_str_t *value, ngx_uint_t escape);
 static size_t ngx_http_log_variable_getlen(ngx_http_request_t *r,
     uintptr_t data);
 static u_char *ngx_http_log_variable(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static uintptr_t ngx_http_log_escape(u_char *dst, u_char *src, size_t size);
+static size_t ngx_http_log_json_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_json_variable(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static size_t ngx_http_log_binary_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_binary_variable(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
 
 
 static void *ngx_http_log_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_log_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_log_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static char *ngx_http_log_set_ring(ngx_conf_t *cf, ngx_http_log_t *log,
+    ngx_str_t *name, size_t size, ngx_uint_t buffered, ngx_msec_t flush,
+    ngx_uint_t overflow);
 static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_compile_format(ngx_conf_t *cf,
-    ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
+    ngx_http_log_fmt_t *fmt, ngx_array_t *args, ngx_uint_t s);
+static char *ngx_http_log_compile_schema(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt);
+static void ngx_http_log_binary_header(u_char *p, u_char type, size_t len,
+    ngx_uint_t n, uint32_t id);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
@@ -283,7 +329,53 @@ ngx_http_log_handler(ngx_http_request_t *r)
             }
         }
 
-        len += NGX_LINEFEED_SIZE;
+        if (log[l].syslog_peer) {
+
+            /* the syslog header replaces the linefeed */
+
+            len += NGX_SYSLOG_MAX_HEADER;
+
+            line = ngx_pnalloc(r->pool, len);
+            if (line == NULL) {
+                return NGX_ERROR;
+            }
+
+            p = ngx_syslog_add_header(log[l].syslog_peer, line);
+
+            for (i = 0; i < log[l].format->ops->nelts; i++) {
+                p = op[i].run(r, p, &op[i]);
+            }
+
+            (void) ngx_syslog_send(log[l].syslog_peer, line, p - line);
+
+            continue;
+        }
+
+        if (log[l].format->escape == NGX_HTTP_LOG_ESCAPE_BINARY) {
+            len += NGX_HTTP_LOG_BINARY_HEADER + 2 * log[l].format->ops->nelts;
+
+            if (log[l].schema != log[l].file->generation + 1) {
+                len += log[l].format->schema.len;
+            }
+
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
+
+        // 由log writer进程写文件，单进程模式下没有log writer进程，直接写文件
+        if (log[l].ring && ngx_process == NGX_PROCESS_WORKER) {
+
+            line = ngx_log_ring_reserve(log[l].ring, len);
+            if (line == NULL) {
+                continue;
+            }
+
+            p = ngx_http_log_line(r, &log[l], line);
+
+            ngx_log_ring_commit(log[l].ring, line, p - line);
+
+            continue;
+        }
 
         buffer = log[l].file ? log[l].file->data : NULL;
 
@@ -305,13 +397,7 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
-                for (i = 0; i < log[l].format->ops->nelts; i++) {
-                    p = op[i].run(r, p, &op[i]);
-                }
-
-                ngx_linefeed(p);
-
-                buffer->pos = p;
+                buffer->pos = ngx_http_log_line(r, &log[l], p);
 
                 continue;
             }
@@ -326,18 +412,68 @@ ngx_http_log_handler(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
-        p = line;
+        p = ngx_http_log_line(r, &log[l], line);
 
-        for (i = 0; i < log[l].format->ops->nelts; i++) {
+        ngx_http_log_write(r, &log[l], line, p - line);
+    }
+
+    return NGX_OK;
+}
+
+
+// 按照日志格式在buf中生成一条记录，buf的长度已经由各个op的len或getlen()算好。
+// 二进制格式每个字段前有2个字节的长度，本进程第一次写这个文件时先写schema记录
+static u_char *
+ngx_http_log_line(ngx_http_request_t *r, ngx_http_log_t *log, u_char *buf)
+{
+    u_char              *p, *field;
+    size_t               len;
+    ngx_uint_t           i;
+    ngx_http_log_op_t   *op;
+    ngx_http_log_fmt_t  *fmt;
+
+    fmt = log->format;
+    op = fmt->ops->elts;
+
+    if (fmt->escape != NGX_HTTP_LOG_ESCAPE_BINARY) {
+
+        p = buf;
+
+        for (i = 0; i < fmt->ops->nelts; i++) {
             p = op[i].run(r, p, &op[i]);
         }
 
         ngx_linefeed(p);
 
-        ngx_http_log_write(r, &log[l], line, p - line);
+        return p;
     }
 
-    return NGX_OK;
+    if (log->schema != log->file->generation + 1) {
+        buf = ngx_cpymem(buf, fmt->schema.data, fmt->schema.len);
+        log->schema = log->file->generation + 1;
+    }
+
+    p = ngx_cpymem(buf, fmt->header, NGX_HTTP_LOG_BINARY_HEADER);
+
+    for (i = 0; i < fmt->ops->nelts; i++) {
+        field = p;
+
+        p = op[i].run(r, p + 2, &op[i]);
+
+        len = p - field - 2;
+
+        field[0] = (u_char) (len >> 8);
+        field[1] = (u_char) len;
+    }
+
+    len = p - buf - NGX_HTTP_LOG_BINARY_HEADER;
+
+    buf[0] = (u_char) (len >> 24);
+    buf[1] = (u_char) (len >> 16);
+    buf[2] = (u_char) (len >> 8);
+    buf[3] = (u_char) len;
+
+    return p;
 }
 
 
@@ -846,9 +982,11 @@ ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
 }
 
 
+// 变量的值按照日志格式的escape方式输出：默认用\xXX转义，
+// json转义为JSON字符串的内容，binary不转义，但长度不超过65535字节
 static ngx_int_t
 ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
-    ngx_str_t *value)
+    ngx_str_t *value, ngx_uint_t escape)
 {
     ngx_int_t  index;
 
@@ -858,8 +996,24 @@ ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
     }
 
     op->len = 0;
-    op->getlen = ngx_http_log_variable_getlen;
-    op->run = ngx_http_log_variable;
+
+    switch (escape) {
+
+    case NGX_HTTP_LOG_ESCAPE_JSON:
+        op->getlen = ngx_http_log_json_variable_getlen;
+        op->run = ngx_http_log_json_variable;
+        break;
+
+    case NGX_HTTP_LOG_ESCAPE_BINARY:
+        op->getlen = ngx_http_log_binary_variable_getlen;
+        op->run = ngx_http_log_binary_variable;
+        break;
+
+    default: /* NGX_HTTP_LOG_ESCAPE_DEFAULT */
+        op->getlen = ngx_http_log_variable_getlen;
+        op->run = ngx_http_log_variable;
+    }
+
     op->data = index;
 
     return NGX_OK;
@@ -967,6 +1121,79 @@ ngx_http_log_escape(u_char *dst, u_char *src, size_t size)
 }
 
 
+static size_t
+ngx_http_log_json_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    uintptr_t                   len;
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 0;
+    }
+
+    len = ngx_escape_json(NULL, value->data, value->len);
+
+    value->escape = len ? 1 : 0;
+
+    return value->len + len;
+}
+
+
+static u_char *
+ngx_http_log_json_variable(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, op->data);
+
+    if (value == NULL || value->not_found) {
+        return buf;
+    }
+
+    if (value->escape == 0) {
+        return ngx_cpymem(buf, value->data, value->len);
+
+    } else {
+        return (u_char *) ngx_escape_json(buf, value->data, value->len);
+    }
+}
+
+
+static size_t
+ngx_http_log_binary_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 0;
+    }
+
+    return ngx_min(value->len, NGX_HTTP_LOG_BINARY_MAX_FIELD);
+}
+
+
+static u_char *
+ngx_http_log_binary_variable(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, op->data);
+
+    if (value == NULL || value->not_found) {
+        return buf;
+    }
+
+    return ngx_cpymem(buf, value->data,
+                      ngx_min(value->len, NGX_HTTP_LOG_BINARY_MAX_FIELD));
+}
+
+
 static void *
 ngx_http_log_create_main_conf(ngx_conf_t *cf)
 {
@@ -993,6 +1220,8 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
     ngx_str_set(&fmt->name, "combined");
 
     fmt->flushes = NULL;
+    fmt->escape = NGX_HTTP_LOG_ESCAPE_DEFAULT;
+    fmt->fields = NULL;
 
     fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_http_log_op_t));
     if (fmt->ops == NULL) {
@@ -1086,9 +1315,9 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_log_loc_conf_t *llcf = conf;
 
-    ssize_t                     size;
+    ssize_t                     size, ring;
     ngx_int_t                   gzip;
-    ngx_uint_t                  i, n;
+    ngx_uint_t                  i, n, overflow;
     ngx_msec_t                  flush;
     ngx_str_t                  *value, name, s;
     ngx_http_log_t             *log;
@@ -1126,6 +1355,20 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ngx_memzero(log, sizeof(ngx_http_log_t));
 
+    if (ngx_strncmp(value[1].data, "syslog:", 7) == 0) {
+
+        log->syslog_peer = ngx_pcalloc(cf->pool, sizeof(ngx_syslog_peer_t));
+        if (log->syslog_peer == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_syslog_process_conf(cf, log->syslog_peer) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        goto process_formats;
+    }
+
     n = ngx_http_script_variables_count(&value[1]);
 
     if (n == 0) {
@@ -1159,6 +1402,8 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
+process_formats:
+
     if (cf->args->nelts >= 3) {
         name = value[2];
 
@@ -1187,9 +1432,21 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->escape == NGX_HTTP_LOG_ESCAPE_BINARY
+        && (log->syslog_peer || log->script))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format \"%V\" can be used only "
+                           "with a log file without variables in name",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
     size = 0;
     flush = 0;
     gzip = 0;
+    ring = 0;
+    overflow = NGX_LOG_RING_DROP;
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1208,6 +1465,31 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "ring=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            ring = ngx_parse_size(&s);
+
+            if (ring == NGX_ERROR || ring == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ring size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "overflow=drop") == 0) {
+            overflow = NGX_LOG_RING_DROP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "overflow=block") == 0) {
+            overflow = NGX_LOG_RING_BLOCK;
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
             s.len = value[i].len - 6;
             s.data = value[i].data + 6;
@@ -1261,6 +1543,30 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (log->syslog_peer) {
+
+        if (size || flush || ring) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "logs to syslog cannot be buffered, "
+                               "use \"batch\" and \"flush\" of syslog");
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (ring && log->format->escape == NGX_HTTP_LOG_ESCAPE_BINARY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format \"%V\" cannot be used "
+                           "with \"ring\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ring) {
+        return ngx_http_log_set_ring(cf, log, &value[1], ring, size || gzip,
+                                     flush, overflow);
+    }
+
     if (flush && size == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "no buffer is defined for access_log \"%V\"",
@@ -1329,13 +1635,59 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+// access_log的ring参数，日志记录写入共享内存中的环形缓冲区，由log writer进程写文件
+static char *
+ngx_http_log_set_ring(ngx_conf_t *cf, ngx_http_log_t *log, ngx_str_t *name,
+    size_t size, ngx_uint_t buffered, ngx_msec_t flush, ngx_uint_t overflow)
+{
+    if (log->script) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ring logs cannot have variables in name");
+        return NGX_CONF_ERROR;
+    }
+
+    if (buffered) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ring\" cannot be used with \"buffer\" "
+                           "or \"gzip\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (flush == 0) {
+        flush = 100;
+    }
+
+    log->ring = ngx_log_ring_add(cf, log->file, size);
+    if (log->ring == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (log->ring->flush) {
+
+        if (log->ring->flush != flush || log->ring->overflow != overflow) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "access_log \"%V\" already defined "
+                               "with conflicting parameters", name);
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    log->ring->flush = flush;
+    log->ring->overflow = overflow;
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_log_main_conf_t *lmcf = conf;
 
     ngx_str_t           *value;
-    ngx_uint_t           i;
+    ngx_uint_t           i, s;
     ngx_http_log_fmt_t  *fmt;
 
     if (cf->cmd_type != NGX_HTTP_MAIN_CONF) {
@@ -1364,6 +1716,37 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     fmt->name = value[1];
+    fmt->escape = NGX_HTTP_LOG_ESCAPE_DEFAULT;
+    fmt->fields = NULL;
+
+    s = 2;
+
+    if (ngx_strncmp(value[2].data, "escape=", 7) == 0) {
+
+        if (ngx_strcmp(value[2].data + 7, "default") == 0) {
+            fmt->escape = NGX_HTTP_LOG_ESCAPE_DEFAULT;
+
+        } else if (ngx_strcmp(value[2].data + 7, "json") == 0) {
+            fmt->escape = NGX_HTTP_LOG_ESCAPE_JSON;
+
+        } else if (ngx_strcmp(value[2].data + 7, "binary") == 0) {
+            fmt->escape = NGX_HTTP_LOG_ESCAPE_BINARY;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown log format escaping \"%s\"",
+                               value[2].data + 7);
+            return NGX_CONF_ERROR;
+        }
+
+        s = 3;
+
+        if (cf->args->nelts == 3) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "no fields in log format \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
 
     fmt->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_int_t));
     if (fmt->flushes == NULL) {
@@ -1375,17 +1758,34 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
+    if (fmt->escape == NGX_HTTP_LOG_ESCAPE_BINARY) {
+        fmt->fields = ngx_array_create(cf->pool, 16, sizeof(ngx_str_t));
+        if (fmt->fields == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_http_log_compile_format(cf, fmt, cf->args, s) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (fmt->escape == NGX_HTTP_LOG_ESCAPE_BINARY) {
+        return ngx_http_log_compile_schema(cf, fmt);
+    }
+
+    return NGX_CONF_OK;
 }
 
 
+// 把日志格式编译为fmt->ops中的op，每个op在记录日志时只需计算长度和复制一次。
+// 二进制格式只保留变量，变量之间的文本只起分隔作用，变量名记录在fmt->fields中
 static char *
-ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
-    ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s)
+ngx_http_log_compile_format(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt,
+    ngx_array_t *args, ngx_uint_t s)
 {
     u_char              *data, *p, ch;
     size_t               i, len;
-    ngx_str_t           *value, var;
+    ngx_str_t           *value, var, *field;
     ngx_int_t           *flush;
     ngx_uint_t           bracket;
     ngx_http_log_op_t   *op;
@@ -1399,15 +1799,15 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
 
         while (i < value[s].len) {
 
-            op = ngx_array_push(ops);
-            if (op == NULL) {
-                return NGX_CONF_ERROR;
-            }
-
             data = &value[s].data[i];
 
             if (value[s].data[i] == '$') {
 
+                op = ngx_array_push(fmt->ops);
+                if (op == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+
                 if (++i == value[s].len) {
                     goto invalid;
                 }
@@ -1457,6 +1857,15 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
                     goto invalid;
                 }
 
+                if (fmt->fields) {
+                    field = ngx_array_push(fmt->fields);
+                    if (field == NULL) {
+                        return NGX_CONF_ERROR;
+                    }
+
+                    *field = var;
+                }
+
                 for (v = ngx_http_log_vars; v->name.len; v++) {
 
                     if (v->name.len == var.len
@@ -1471,13 +1880,15 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
                     }
                 }
 
-                if (ngx_http_log_variable_compile(cf, op, &var) != NGX_OK) {
+                if (ngx_http_log_variable_compile(cf, op, &var, fmt->escape)
+                    != NGX_OK)
+                {
                     return NGX_CONF_ERROR;
                 }
 
-                if (flushes) {
+                if (fmt->flushes) {
 
-                    flush = ngx_array_push(flushes);
+                    flush = ngx_array_push(fmt->flushes);
                     if (flush == NULL) {
                         return NGX_CONF_ERROR;
                     }
@@ -1498,7 +1909,12 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
 
             len = &value[s].data[i] - data;
 
-            if (len) {
+            if (len && fmt->escape != NGX_HTTP_LOG_ESCAPE_BINARY) {
+
+                op = ngx_array_push(fmt->ops);
+                if (op == NULL) {
+                    return NGX_CONF_ERROR;
+                }
 
                 op->len = len;
                 op->getlen = NULL;
@@ -1537,6 +1953,88 @@ invalid:
 }
 
 
+// 预先生成二进制格式的schema记录和数据记录的头部，
+// schema id是schema记录内容的crc32，解码时用来找到每条数据记录对应的字段名
+static char *
+ngx_http_log_compile_schema(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt)
+{
+    u_char      *p, *body;
+    size_t       len;
+    uint32_t     id;
+    ngx_str_t   *field;
+    ngx_uint_t   i, n;
+
+    field = fmt->fields->elts;
+    n = fmt->fields->nelts;
+
+    if (n == 0 || n > 0xffff) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of fields in binary log format "
+                           "\"%V\"", &fmt->name);
+        return NGX_CONF_ERROR;
+    }
+
+    len = 2 + fmt->name.len;
+
+    for (i = 0; i < n; i++) {
+        len += 2 + field[i].len;
+    }
+
+    p = ngx_pnalloc(cf->pool, NGX_HTTP_LOG_BINARY_HEADER + len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->schema.data = p;
+    fmt->schema.len = NGX_HTTP_LOG_BINARY_HEADER + len;
+
+    body = p + NGX_HTTP_LOG_BINARY_HEADER;
+    p = body;
+
+    *p++ = (u_char) (fmt->name.len >> 8);
+    *p++ = (u_char) fmt->name.len;
+    p = ngx_cpymem(p, fmt->name.data, fmt->name.len);
+
+    for (i = 0; i < n; i++) {
+        *p++ = (u_char) (field[i].len >> 8);
+        *p++ = (u_char) field[i].len;
+        p = ngx_cpymem(p, field[i].data, field[i].len);
+    }
+
+    id = ngx_crc32_short(body, len);
+
+    ngx_http_log_binary_header(fmt->schema.data, 'S', len, n, id);
+
+    /* the record length is set for each record */
+
+    ngx_http_log_binary_header(fmt->header, 'R', 0, n, id);
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_http_log_binary_header(u_char *p, u_char type, size_t len, ngx_uint_t n,
+    uint32_t id)
+{
+    *p++ = (u_char) (len >> 24);
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+
+    *p++ = type;
+    *p++ = NGX_HTTP_LOG_BINARY_VERSION;
+
+    *p++ = (u_char) (n >> 8);
+    *p++ = (u_char) n;
+
+    *p++ = (u_char) (id >> 24);
+    *p++ = (u_char) (id >> 16);
+    *p++ = (u_char) (id >> 8);
+    *p = (u_char) id;
+}
+
+
 static char *
 ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1670,8 +2168,7 @@ ngx_http_log_init(ngx_conf_t *cf)
         *value = ngx_http_combined_fmt;
         fmt = lmcf->formats.elts;
 
-        if (ngx_http_log_compile_format(cf, NULL, fmt->ops, &a, 0)
-            != NGX_CONF_OK)
+        if (ngx_http_log_compile_format(cf, fmt, &a, 0) != NGX_CONF_OK)
         {
             return NGX_ERROR;
         }
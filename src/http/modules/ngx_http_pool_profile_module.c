@@ -0,0 +1,331 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这个文件只在--with-pool-profiler时编译，它为内存池分析模式创建共享内存中的统计表，
+// 并提供一个将handler函数设置为clcf->handler的http handler，
+// 按申请内存的源文件和按location列出内存池的申请次数、字节数、大块内存次数和占用的最大值
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_POOL_PROFILE_SITES      256
+#define NGX_HTTP_POOL_PROFILE_LOCATIONS  256
+
+#define NGX_HTTP_POOL_PROFILE_ZONE_SIZE  (128 * 1024)
+
+
+static ngx_int_t ngx_http_pool_profile_handler(ngx_http_request_t *r);
+static ngx_chain_t *ngx_http_pool_profile_table(ngx_http_request_t *r,
+    ngx_pool_profile_entry_t *table, ngx_uint_t n, ngx_uint_t locations);
+static int ngx_libc_cdecl ngx_http_pool_profile_cmp(const void *one,
+    const void *two);
+static ngx_int_t ngx_http_pool_profile_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_pool_profile_preconfiguration(ngx_conf_t *cf);
+static char *ngx_http_pool_profile(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_pool_profile_commands[] = {
+
+    { ngx_string("pool_profile"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_pool_profile,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_pool_profile_module_ctx = {
+    ngx_http_pool_profile_preconfiguration, /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_pool_profile_module = {
+    NGX_MODULE_V1,
+    &ngx_http_pool_profile_module_ctx,     /* module context */
+    ngx_http_pool_profile_commands,        /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_pool_profile_zone = ngx_string("pool_profile");
+
+
+static ngx_int_t
+ngx_http_pool_profile_handler(ngx_http_request_t *r)
+{
+    ngx_int_t     rc;
+    ngx_chain_t  *out;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_pool_profile == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    out = ngx_http_pool_profile_table(r, ngx_pool_profile->sites,
+                                      ngx_pool_profile->nsites, 0);
+    if (out == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out->next = ngx_http_pool_profile_table(r, ngx_pool_profile->locations,
+                                            ngx_pool_profile->nlocations, 1);
+    if (out->next == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = out->buf->last - out->buf->pos
+                                      + out->next->buf->last
+                                      - out->next->buf->pos;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out->next->buf->last_buf = (r == r->main) ? 1 : 0;
+    out->next->buf->last_in_chain = 1;
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+// 输出一张统计表，表不加锁复制出来后按字节数从大到小排序
+static ngx_chain_t *
+ngx_http_pool_profile_table(ngx_http_request_t *r,
+    ngx_pool_profile_entry_t *table, ngx_uint_t n, ngx_uint_t locations)
+{
+    size_t                     size;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 i, k;
+    ngx_chain_t               *cl;
+    ngx_pool_profile_entry_t  *e;
+
+    e = ngx_palloc(r->pool, n * sizeof(ngx_pool_profile_entry_t));
+    if (e == NULL) {
+        return NULL;
+    }
+
+    k = 0;
+
+    for (i = 0; i < n; i++) {
+        if (table[i].key) {
+            e[k++] = table[i];
+        }
+    }
+
+    ngx_qsort(e, k, sizeof(ngx_pool_profile_entry_t),
+              ngx_http_pool_profile_cmp);
+
+    size = sizeof("    requests       allocs            bytes      large"
+                  "        peak location\n") - 1
+           + k * (5 * (NGX_ATOMIC_T_LEN + 1) + NGX_POOL_PROFILE_NAME_LEN + 1)
+           + 1;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    if (locations) {
+        b->last = ngx_sprintf(b->last,
+                              "    requests       allocs            bytes"
+                              "      large        peak location\n");
+
+    } else {
+        b->last = ngx_sprintf(b->last,
+                              "      allocs            bytes      large"
+                              " site\n");
+    }
+
+    for (i = 0; i < k; i++) {
+
+        // location的名字在占用表项之后才写入，还没写完时显示为"-"
+        if (e[i].name[0] == '\0') {
+            e[i].name[0] = '-';
+            e[i].name[1] = '\0';
+        }
+
+        e[i].name[NGX_POOL_PROFILE_NAME_LEN - 1] = '\0';
+
+        if (locations) {
+            b->last = ngx_sprintf(b->last, "%12uA ", e[i].requests);
+        }
+
+        b->last = ngx_sprintf(b->last, "%12uA %16uA %10uA ",
+                              e[i].count, e[i].bytes, e[i].large);
+
+        if (locations) {
+            b->last = ngx_sprintf(b->last, "%11uA ", e[i].peak);
+        }
+
+        b->last = ngx_sprintf(b->last, "%s\n", e[i].name);
+    }
+
+    *b->last++ = LF;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_pool_profile_cmp(const void *one, const void *two)
+{
+    ngx_pool_profile_entry_t  *first, *second;
+
+    first = (ngx_pool_profile_entry_t *) one;
+    second = (ngx_pool_profile_entry_t *) two;
+
+    if (first->bytes == second->bytes) {
+        return 0;
+    }
+
+    return (first->bytes < second->bytes) ? 1 : -1;
+}
+
+
+// 在master进程中创建统计表，之后fork出的worker进程都通过ngx_pool_profile写入
+static ngx_int_t
+ngx_http_pool_profile_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_pool_profile_t  *opp = data;
+
+    ngx_slab_pool_t     *shpool;
+    ngx_pool_profile_t  *pp;
+
+    if (opp) {
+        // 重新加载配置后旧的location配置都不再使用，按location的统计重新开始
+        ngx_memzero(opp->locations,
+                    opp->nlocations * sizeof(ngx_pool_profile_entry_t));
+
+        shm_zone->data = opp;
+        ngx_pool_profile = opp;
+
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        ngx_pool_profile = shpool->data;
+
+        return NGX_OK;
+    }
+
+    pp = ngx_slab_alloc(shpool, sizeof(ngx_pool_profile_t));
+    if (pp == NULL) {
+        return NGX_ERROR;
+    }
+
+    pp->nsites = NGX_HTTP_POOL_PROFILE_SITES;
+    pp->nlocations = NGX_HTTP_POOL_PROFILE_LOCATIONS;
+
+    pp->sites = ngx_slab_alloc(shpool,
+                         pp->nsites * sizeof(ngx_pool_profile_entry_t));
+    if (pp->sites == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(pp->sites, pp->nsites * sizeof(ngx_pool_profile_entry_t));
+
+    pp->locations = ngx_slab_alloc(shpool,
+                         pp->nlocations * sizeof(ngx_pool_profile_entry_t));
+    if (pp->locations == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(pp->locations, pp->nlocations * sizeof(ngx_pool_profile_entry_t));
+
+    shpool->data = pp;
+    shm_zone->data = pp;
+    ngx_pool_profile = pp;
+
+    return NGX_OK;
+}
+
+
+// 新的配置里可能不再有pool_profile，旧的共享内存会被释放，
+// 所以解析配置前先停止写入，由init_zone重新设置
+static ngx_int_t
+ngx_http_pool_profile_preconfiguration(ngx_conf_t *cf)
+{
+    ngx_pool_profile = NULL;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_pool_profile(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_shm_zone_t            *shm_zone;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    shm_zone = ngx_shared_memory_add(cf, &ngx_http_pool_profile_zone,
+                                     NGX_HTTP_POOL_PROFILE_ZONE_SIZE,
+                                     &ngx_http_pool_profile_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_pool_profile_init_zone;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_pool_profile_handler;
+
+    return NGX_CONF_OK;
+}
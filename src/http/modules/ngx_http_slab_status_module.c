@@ -0,0 +1,243 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+// 这个文件是一个将handler函数设置为clcf->handler的http handler模块，
+// 列出所有共享内存区（包括其中分出的子内存池）的slab分配统计：每种大小内存块的使用情况、内存页的碎片情况和锁的竞争情况
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+static ngx_int_t ngx_http_slab_status_handler(ngx_http_request_t *r);
+static ngx_chain_t *ngx_http_slab_status_zone(ngx_http_request_t *r,
+    ngx_shm_zone_t *shm_zone, ngx_slab_pool_t *shpool, ngx_uint_t shard);
+static char *ngx_http_slab_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_slab_status_commands[] = {
+
+    { ngx_string("slab_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_slab_status,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_slab_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_slab_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_slab_status_module_ctx,      /* module context */
+    ngx_http_slab_status_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_slab_status_handler(ngx_http_request_t *r)
+{
+    ngx_int_t         rc;
+    ngx_uint_t        i, n;
+    ngx_chain_t      *out, **ll;
+    ngx_list_part_t  *part;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_slab_pool_t  *sp;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    out = NULL;
+    ll = &out;
+
+    r->headers_out.content_length_n = 0;
+
+    part = &((ngx_cycle_t *) ngx_cycle)->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        for (sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr, n = 0;
+             sp;
+             sp = sp->next, n++)
+        {
+            *ll = ngx_http_slab_status_zone(r, &shm_zone[i], sp, n);
+            if (*ll == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            r->headers_out.content_length_n += (*ll)->buf->last
+                                               - (*ll)->buf->pos;
+            ll = &(*ll)->next;
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+
+    if (out == NULL || r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    for (ll = &out; (*ll)->next; ll = &(*ll)->next) { /* void */ }
+
+    (*ll)->buf->last_buf = (r == r->main) ? 1 : 0;
+    (*ll)->buf->last_in_chain = 1;
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+// 输出一个共享内存区的统计，统计在内存池的锁内复制出来。
+// shard不为0时输出的是共享内存中分出的第shard个子内存池
+static ngx_chain_t *
+ngx_http_slab_status_zone(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_slab_pool_t *shpool, ngx_uint_t shard)
+{
+    size_t                  size;
+    ngx_buf_t              *b;
+    ngx_uint_t              i, n, frag;
+    ngx_chain_t            *cl;
+    ngx_slab_stat_t        *stats;
+    ngx_slab_pages_stat_t   pages;
+
+    n = ngx_pagesize_shift - shpool->min_shift;
+
+    stats = ngx_palloc(r->pool, n * sizeof(ngx_slab_stat_t));
+    if (stats == NULL) {
+        return NULL;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ngx_memcpy(stats, shpool->stats, n * sizeof(ngx_slab_stat_t));
+    ngx_slab_pages_stat_locked(shpool, &pages);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    // 空闲页中不属于最长一段的比例，越大说明越难分配多页的内存
+    frag = pages.free ? (pages.free - pages.largest) * 10000 / pages.free : 0;
+
+    size = sizeof("zone \"\" shard  size  pages  free  runs  largest "
+                  " fragmentation .%\n") - 1
+           + shm_zone->shm.name.len + 7 * NGX_INT_T_LEN
+           + sizeof("mutex locks  contended  wait  usec\n") - 1
+           + 3 * NGX_ATOMIC_T_LEN
+           + sizeof("      slot      total       used       reqs      fails\n")
+           - 1
+           + n * (5 * (NGX_INT_T_LEN + 1) + 1)
+           + 1;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_sprintf(b->last, "zone \"%V\"", &shm_zone->shm.name);
+
+    if (shard) {
+        b->last = ngx_sprintf(b->last, " shard %ui", shard);
+    }
+
+    b->last = ngx_sprintf(b->last, " size %uz pages %ui free %ui "
+                          "runs %ui largest %ui fragmentation %ui.%02ui%%\n",
+                          (size_t) (shpool->end - (u_char *) shpool->addr),
+                          pages.pages, pages.free, pages.runs, pages.largest,
+                          frag / 100, frag % 100);
+
+    // 锁的统计不加锁读取，三个值之间可能不完全一致
+    b->last = ngx_sprintf(b->last,
+                          "mutex locks %uA contended %uA wait %uA usec\n",
+                          shpool->lock.locks, shpool->lock.contended,
+                          shpool->lock.wait_time);
+
+    b->last = ngx_cpymem(b->last,
+                 "      slot      total       used       reqs      fails\n",
+                 sizeof("      slot      total       used       reqs      "
+                        "fails\n") - 1);
+
+    for (i = 0; i < n; i++) {
+        b->last = ngx_sprintf(b->last, "%10uz %10ui %10ui %10ui %10ui\n",
+                              (size_t) 1 << (i + shpool->min_shift),
+                              stats[i].total, stats[i].used,
+                              stats[i].reqs, stats[i].fails);
+    }
+
+    *b->last++ = LF;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+static char *
+ngx_http_slab_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_slab_status_handler;
+
+    return NGX_CONF_OK;
+}
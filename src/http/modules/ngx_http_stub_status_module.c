@@ -78,6 +78,9 @@ static ngx_http_variable_t  ngx_http_stub_status_vars[] = {
     { ngx_string("connections_waiting"), NULL, ngx_http_stub_status_variable,
       3, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("connections_queued"), NULL, ngx_http_stub_status_variable,
+      4, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
 
@@ -88,7 +91,7 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     ngx_int_t          rc;
     ngx_buf_t         *b;
     ngx_chain_t        out;
-    ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
+    ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa, qu;
 
     if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
         return NGX_HTTP_NOT_ALLOWED;
@@ -117,7 +120,19 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     size = sizeof("Active connections:  \n") + NGX_ATOMIC_T_LEN
            + sizeof("server accepts handled requests\n") - 1
            + 6 + 3 * NGX_ATOMIC_T_LEN
-           + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN;
+           + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN
+           + sizeof("Queued:  \n") + NGX_ATOMIC_T_LEN
+           + sizeof("Pool mallocs:  frees:  reused:  \n")
+           + 3 * NGX_ATOMIC_T_LEN;
+
+#if (NGX_HTTP_SSL)
+    size += sizeof("Upstream SSL handshakes: full  resumed  \n")
+            + 2 * NGX_ATOMIC_T_LEN;
+#endif
+
+#if (NGX_HAVE_SPLICE)
+    size += sizeof("Spliced bytes:  \n") + NGX_ATOMIC_T_LEN;
+#endif
 
     b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
@@ -134,6 +149,7 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     rd = *ngx_stat_reading;
     wr = *ngx_stat_writing;
     wa = *ngx_stat_waiting;
+    qu = *ngx_stat_queued;
 
     b->last = ngx_sprintf(b->last, "Active connections: %uA \n", ac);
 
@@ -145,6 +161,29 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+    // 在limit_conn和upstream队列中等待空闲连接的请求数
+    b->last = ngx_sprintf(b->last, "Queued: %uA \n", qu);
+
+    // 内存池调用malloc()和free()的次数，及从worker_pool_cache缓存中取得块的次数
+    b->last = ngx_sprintf(b->last,
+                          "Pool mallocs: %uA frees: %uA reused: %uA \n",
+                          *ngx_stat_pool_mallocs, *ngx_stat_pool_frees,
+                          *ngx_stat_pool_reused);
+
+#if (NGX_HTTP_SSL)
+    // 到upstream的SSL握手中完整握手和复用会话的次数
+    b->last = ngx_sprintf(b->last,
+                          "Upstream SSL handshakes: full %uA resumed %uA \n",
+                          *ngx_stat_upstream_ssl_full,
+                          *ngx_stat_upstream_ssl_resumed);
+#endif
+
+#if (NGX_HAVE_SPLICE)
+    // 用splice()直接从upstream转发给客户端和从客户端转发给upstream的字节数
+    b->last = ngx_sprintf(b->last, "Spliced bytes: %uA \n",
+                          *ngx_stat_spliced);
+#endif
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
@@ -190,6 +229,10 @@ ngx_http_stub_status_variable(ngx_http_request_t *r,
         value = *ngx_stat_waiting;
         break;
 
+    case 4:
+        value = *ngx_stat_queued;
+        break;
+
     /* suppress warning */
     default:
         value = 0;
@@ -11,16 +11,87 @@
 #include <ngx_http.h>
 
 
+// 共享内存中一个server的统计：从缓存中取到连接和没有取到连接的次数
 typedef struct {
+    ngx_atomic_t                       hits;
+    ngx_atomic_t                       misses;
+} ngx_http_upstream_keepalive_stat_t;
+
+
+// 共享内存中一个worker进程缓存的连接数，只有pid对应的进程改写这一项，
+// 重新加载配置后同一序号的旧worker进程不会覆盖新进程的计数
+typedef struct {
+    ngx_atomic_t                       pid;
+    ngx_atomic_t                       idle;
+} ngx_http_upstream_keepalive_slot_t;
+
+
+// 共享内存中按一种布局分配的内存块的头部，布局是各个upstream的名字和
+// server数的crc32，重新加载配置时旧worker进程还在使用的内存块不会释放
+typedef struct ngx_http_upstream_keepalive_layout_s
+    ngx_http_upstream_keepalive_layout_t;
+
+struct ngx_http_upstream_keepalive_layout_s {
+    uint32_t                               crc;
+    ngx_http_upstream_keepalive_layout_t  *next;
+};
+
+
+// 本worker进程到一个server缓存的连接，最后一项对应不在server列表中的地址
+typedef struct ngx_http_upstream_keepalive_srv_conf_s
+    ngx_http_upstream_keepalive_srv_conf_t;
+
+typedef struct {
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+    ngx_http_upstream_rr_peer_t             *rrp;
+
+    struct sockaddr                   *sockaddr;
+    socklen_t                          socklen;
+    ngx_str_t                         *name;
+
+    // 按最近使用排序的缓存连接
+    ngx_queue_t                        cache;
+    ngx_uint_t                         cached;
+    // 预先建立、还没有连接成功的连接数，及上次预先建立连接失败的时间
+    ngx_uint_t                         connecting;
+    time_t                             failed;
+
+    ngx_http_upstream_keepalive_stat_t  *stat;
+} ngx_http_upstream_keepalive_peer_t;
+
+
+struct ngx_http_upstream_keepalive_srv_conf_s {
     ngx_uint_t                         max_cached;
+    // keepalive指令的per_peer、timeout、requests、global和min_idle参数
+    ngx_uint_t                         max_per_peer;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         max_requests;
+    ngx_uint_t                         global;
+    ngx_uint_t                         min_idle;
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_uint_t                         cached;
+    ngx_uint_t                         connecting;
+
+    // 定时为每个server补足min_idle个空闲连接，pending是还在连接或者
+    // 握手的预先建立的连接，worker进程退出时逐个关闭
+    ngx_event_t                        prewarm;
+    ngx_queue_t                        pending;
+
+    ngx_http_upstream_keepalive_peer_t  *peers;
+    ngx_uint_t                         npeers;
+
+    // 共享内存中每个worker进程缓存的连接数，每个worker只写自己的一项，
+    // 进程退出或重新产生后不会留下错误的计数
+    ngx_http_upstream_keepalive_slot_t  *idle;
+    ngx_uint_t                         nworkers;
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
-} ngx_http_upstream_keepalive_srv_conf_t;
+    ngx_http_upstream_srv_conf_t      *upstream;
+};
 
 
 typedef struct {
@@ -43,8 +114,10 @@ typedef struct {
 
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
+    ngx_http_upstream_keepalive_peer_t      *peer;
 
     ngx_queue_t                        queue;
+    ngx_queue_t                        peer_queue;
     ngx_connection_t                  *connection;
 
     socklen_t                          socklen;
@@ -53,6 +126,15 @@ typedef struct {
 } ngx_http_upstream_keepalive_cache_t;
 
 
+// 一个还在连接或者握手的预先建立的连接，从连接的内存池中分配
+typedef struct {
+    ngx_http_upstream_keepalive_peer_t      *peer;
+
+    ngx_queue_t                        queue;
+    ngx_connection_t                  *connection;
+} ngx_http_upstream_keepalive_pending_t;
+
+
 static ngx_int_t ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
@@ -60,9 +142,38 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_peer_t *peer, ngx_connection_t *c,
+    struct sockaddr *sockaddr, socklen_t socklen);
+static void ngx_http_upstream_keepalive_prewarm(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_keepalive_prewarm_peer(
+    ngx_http_upstream_keepalive_peer_t *peer);
+static void ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *wev);
+static void ngx_http_upstream_keepalive_prewarm_close_handler(
+    ngx_event_t *ev);
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_keepalive_prewarm_ssl_handshake(
+    ngx_connection_t *c);
+#endif
+static void ngx_http_upstream_keepalive_prewarm_done(ngx_connection_t *c,
+    ngx_int_t rc);
+static void ngx_http_upstream_keepalive_prewarm_cancel(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static ngx_int_t ngx_http_upstream_keepalive_test_connect(
+    ngx_connection_t *c, ngx_str_t *name);
+
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
+static ngx_http_upstream_keepalive_peer_t *ngx_http_upstream_keepalive_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc);
+static void ngx_http_upstream_keepalive_remove(
+    ngx_http_upstream_keepalive_cache_t *item);
+static ngx_uint_t ngx_http_upstream_keepalive_over_global(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static void ngx_http_upstream_keepalive_update_idle(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
 
 
 #if (NGX_HTTP_SSL)
@@ -72,27 +183,44 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_status_handler(
+    ngx_http_request_t *r);
+
+static ngx_int_t ngx_http_upstream_keepalive_add_zone(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_keepalive_exit_process(ngx_cycle_t *cycle);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_keepalive_status(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
       NULL },
 
+    { ngx_string("upstream_keepalive_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_keepalive_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_upstream_keepalive_add_zone,  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -112,20 +240,30 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_upstream_keepalive_exit_process, /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
 
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_PREWARM  1000
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_CONNECT  60000
+
+
+static ngx_str_t  ngx_http_upstream_keepalive_zone =
+    ngx_string("upstream_keepalive");
+
+
 static ngx_int_t
 ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_uint_t                               i;
+    ngx_uint_t                               i, n;
+    ngx_http_upstream_rr_peers_t            *peers;
+    ngx_http_upstream_keepalive_peer_t      *peer;
     ngx_http_upstream_keepalive_srv_conf_t  *kcf;
     ngx_http_upstream_keepalive_cache_t     *cached;
 
@@ -140,6 +278,7 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     }
 
     kcf->original_init_peer = us->peer.init;
+    kcf->upstream = us;
 
     us->peer.init = ngx_http_upstream_init_keepalive_peer;
 
@@ -159,6 +298,40 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
         cached[i].conf = kcf;
     }
 
+    /*
+     * all balancers in the tree keep round robin peers in us->peer.data,
+     * the backup servers follow the primary ones
+     */
+
+    kcf->npeers = 0;
+
+    for (peers = us->peer.data; peers; peers = peers->next) {
+        kcf->npeers += peers->number;
+    }
+
+    peer = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_keepalive_peer_t)
+                                 * (kcf->npeers + 1));
+    if (peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    kcf->peers = peer;
+
+    for (peers = us->peer.data; peers; peers = peers->next) {
+        for (n = 0; n < peers->number; n++) {
+            peer->conf = kcf;
+            peer->rrp = &peers->peer[n];
+            peer->sockaddr = peers->peer[n].sockaddr;
+            peer->socklen = peers->peer[n].socklen;
+            peer->name = &peers->peer[n].name;
+            ngx_queue_init(&peer->cache);
+            peer++;
+        }
+    }
+
+    peer->conf = kcf;
+    ngx_queue_init(&peer->cache);
+
     return NGX_OK;
 }
 
@@ -212,9 +385,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q, *cache;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -229,25 +403,35 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 
     /* search cache for suitable connection */
 
-    cache = &kp->conf->cache;
+    peer = ngx_http_upstream_keepalive_peer(kp->conf, pc);
+
+    cache = &peer->cache;
 
     for (q = ngx_queue_head(cache);
          q != ngx_queue_sentinel(cache);
          q = ngx_queue_next(q))
     {
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                              peer_queue);
         c = item->connection;
 
         if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
                          item->socklen, pc->socklen)
             == 0)
         {
-            ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
+            ngx_http_upstream_keepalive_remove(item);
 
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                            "get keepalive peer: using connection %p", c);
 
+            if (peer->stat) {
+                (void) ngx_atomic_fetch_add(&peer->stat->hits, 1);
+            }
+
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
             c->idle = 0;
             c->log = pc->log;
             c->read->log = pc->log;
@@ -261,6 +445,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+    if (peer->stat) {
+        (void) ngx_atomic_fetch_add(&peer->stat->misses, 1);
+    }
+
     return NGX_OK;
 }
 
@@ -272,9 +460,11 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    ngx_queue_t                             *q;
+    ngx_connection_t                        *c;
+    ngx_http_upstream_t                     *u;
+    ngx_http_upstream_keepalive_peer_t      *peer;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
@@ -299,33 +489,90 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    // 响应在请求发完之前就结束了，连接上还有没发完的请求
+    if (!u->request_body_sent) {
+        goto invalid;
+    }
+
+    kcf = kp->conf;
+
+    c->requests++;
+
+    if (kcf->max_requests && c->requests >= kcf->max_requests) {
+        goto invalid;
+    }
+
     if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
         goto invalid;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                   "free keepalive peer: saving connection %p", c);
+    peer = ngx_http_upstream_keepalive_peer(kcf, pc);
+
+    /*
+     * make room: the oldest connection to the same server if the server
+     * is at its per_peer limit, otherwise the oldest connection overall
+     * if there are no free items or the global idle budget is used up
+     */
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    q = NULL;
 
-        q = ngx_queue_last(&kp->conf->cache);
-        ngx_queue_remove(q);
+    if (kcf->max_per_peer && peer->cached >= kcf->max_per_peer) {
+        q = ngx_queue_last(&peer->cache);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                              peer_queue);
 
+    } else if (ngx_queue_empty(&kcf->free)
+               || ngx_http_upstream_keepalive_over_global(kcf))
+    {
+        if (ngx_queue_empty(&kcf->cache)) {
+            goto invalid;
+        }
+
+        q = ngx_queue_last(&kcf->cache);
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+    }
 
+    if (q) {
+        ngx_http_upstream_keepalive_remove(item);
         ngx_http_upstream_keepalive_close(item->connection);
+    }
 
-    } else {
-        q = ngx_queue_head(&kp->conf->free);
-        ngx_queue_remove(q);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free keepalive peer: saving connection %p", c);
 
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-    }
+    pc->connection = NULL;
+
+    ngx_http_upstream_keepalive_save(kcf, peer, c, pc->sockaddr, pc->socklen);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+// 把一个连接放进缓存，调用者保证有空闲的缓存项
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_peer_t *peer, ngx_connection_t *c,
+    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
     item->connection = c;
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    item->peer = peer;
+    ngx_queue_insert_head(&kcf->cache, q);
+    ngx_queue_insert_head(&peer->cache, &item->peer_queue);
 
-    pc->connection = NULL;
+    peer->cached++;
+    kcf->cached++;
+
+    ngx_http_upstream_keepalive_update_idle(kcf);
 
     if (c->read->timer_set) {
         ngx_del_timer(c->read);
@@ -344,159 +591,1012 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->socklen = socklen;
+    ngx_memcpy(&item->sockaddr, sockaddr, socklen);
+
+    if (kcf->timeout) {
+        ngx_add_timer(c->read, kcf->timeout);
+    }
 
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
-
-invalid:
-
-    kp->original_free_peer(pc, kp->data, state);
 }
 
 
+// 为每个可用的server补足min_idle个空闲连接，不超过缓存的总数和global的限制
 static void
-ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
+ngx_http_upstream_keepalive_prewarm(ngx_event_t *ev)
 {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
-                   "keepalive dummy handler");
+    ngx_uint_t                               i;
+    ngx_http_upstream_rr_peer_t             *rrp;
+    ngx_http_upstream_keepalive_peer_t      *peer;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = ev->data;
+
+    if (ngx_exiting) {
+        ngx_http_upstream_keepalive_prewarm_cancel(kcf);
+        return;
+    }
+
+    for (i = 0; i < kcf->npeers; i++) {
+        peer = &kcf->peers[i];
+        rrp = peer->rrp;
+
+        if (rrp->down) {
+            continue;
+        }
+
+        if (rrp->max_fails
+            && rrp->fails >= rrp->max_fails
+            && ngx_time() - rrp->checked <= rrp->fail_timeout)
+        {
+            continue;
+        }
+
+        if (ngx_time() - peer->failed < rrp->fail_timeout) {
+            continue;
+        }
+
+        while (peer->cached + peer->connecting < kcf->min_idle
+               && kcf->cached + kcf->connecting < kcf->max_cached
+               && !ngx_http_upstream_keepalive_over_global(kcf))
+        {
+            if (ngx_http_upstream_keepalive_prewarm_peer(peer) != NGX_OK) {
+                break;
+            }
+        }
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_UPSTREAM_KEEPALIVE_PREWARM);
 }
 
 
-static void
-ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
+static ngx_int_t
+ngx_http_upstream_keepalive_prewarm_peer(
+    ngx_http_upstream_keepalive_peer_t *peer)
 {
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
-    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_int_t                              rc;
+    ngx_connection_t                      *c;
+    ngx_peer_connection_t                  pc;
+    ngx_http_upstream_keepalive_pending_t  *pw;
 
-    int                n;
-    char               buf[1];
-    ngx_connection_t  *c;
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
-                   "keepalive close handler");
+    pc.sockaddr = peer->sockaddr;
+    pc.socklen = peer->socklen;
+    pc.name = peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_ERR;
 
-    c = ev->data;
+    rc = ngx_event_connect_peer(&pc);
 
-    if (c->close) {
-        goto close;
-    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "keepalive prewarm %V: %i", peer->name, rc);
 
-    n = recv(c->fd, buf, 1, MSG_PEEK);
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        peer->failed = ngx_time();
+        return NGX_ERROR;
+    }
 
-    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
-        /* stale event */
+    c = pc.connection;
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            goto close;
-        }
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
 
-        return;
+    pw = ngx_palloc(c->pool, sizeof(ngx_http_upstream_keepalive_pending_t));
+    if (pw == NULL) {
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+        return NGX_ERROR;
     }
 
-close:
+    pw->peer = peer;
+    pw->connection = c;
 
-    item = c->data;
-    conf = item->conf;
+    ngx_queue_insert_tail(&peer->conf->pending, &pw->queue);
 
-    ngx_http_upstream_keepalive_close(c);
+    /* a pending connection is closed as idle when the worker is exiting */
 
-    ngx_queue_remove(&item->queue);
-    ngx_queue_insert_head(&conf->free, &item->queue);
+    c->data = pw;
+    c->idle = 1;
+    c->read->handler = ngx_http_upstream_keepalive_prewarm_close_handler;
+    c->write->handler = ngx_http_upstream_keepalive_prewarm_handler;
+
+    peer->connecting++;
+    peer->conf->connecting++;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, peer->conf->upstream->connect_timeout
+                                ? peer->conf->upstream->connect_timeout
+                                : NGX_HTTP_UPSTREAM_KEEPALIVE_CONNECT);
+        return NGX_OK;
+    }
+
+    /* rc == NGX_OK */
+
+    ngx_http_upstream_keepalive_prewarm_handler(c->write);
+
+    return NGX_OK;
 }
 
 
+// 预先建立的连接连接成功后，upstream使用SSL时先完成握手，再放进缓存，
+// 和请求用过的连接一样使用
 static void
-ngx_http_upstream_keepalive_close(ngx_connection_t *c)
+ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *wev)
 {
+    ngx_connection_t                       *c;
+    ngx_http_upstream_keepalive_peer_t     *peer;
+    ngx_http_upstream_keepalive_pending_t  *pw;
+#if (NGX_HTTP_SSL)
+    ngx_int_t                               rc;
+    ngx_http_upstream_srv_conf_t           *us;
+#endif
+
+    c = wev->data;
+    pw = c->data;
+    peer = pw->peer;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "keepalive prewarm to %V timed out", peer->name);
+        ngx_http_upstream_keepalive_prewarm_done(c, NGX_ERROR);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    if (ngx_http_upstream_keepalive_test_connect(c, peer->name) != NGX_OK) {
+        ngx_http_upstream_keepalive_prewarm_done(c, NGX_ERROR);
+        return;
+    }
 
 #if (NGX_HTTP_SSL)
 
-    if (c->ssl) {
-        c->ssl->no_wait_shutdown = 1;
-        c->ssl->no_send_shutdown = 1;
+    us = peer->conf->upstream;
 
-        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
-            c->ssl->handler = ngx_http_upstream_keepalive_close;
+    if (us->ssl && !ngx_exiting) {
+
+        if (ngx_ssl_create_connection(us->ssl, c,
+                                      NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+            != NGX_OK)
+        {
+            ngx_http_upstream_keepalive_prewarm_done(c, NGX_ERROR);
             return;
         }
-    }
 
-#endif
+        c->sendfile = 0;
 
-    ngx_destroy_pool(c->pool);
-    ngx_close_connection(c);
-}
+        rc = ngx_ssl_handshake(c);
 
+        if (rc == NGX_AGAIN) {
+            ngx_add_timer(c->write, us->connect_timeout);
+            c->ssl->handler = ngx_http_upstream_keepalive_prewarm_ssl_handshake;
+            return;
+        }
 
-#if (NGX_HTTP_SSL)
+        ngx_http_upstream_keepalive_prewarm_ssl_handshake(c);
+        return;
+    }
 
-static ngx_int_t
-ngx_http_upstream_keepalive_set_session(ngx_peer_connection_t *pc, void *data)
-{
-    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+#endif
 
-    return kp->original_set_session(pc, kp->data);
+    ngx_http_upstream_keepalive_prewarm_done(c, NGX_OK);
 }
 
 
+// 还在连接的预先建立的连接，worker进程退出时关闭；握手期间读事件
+// 由ngx_ssl_handshake_handler处理，由ngx_http_upstream_keepalive_prewarm()关闭
 static void
-ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
+ngx_http_upstream_keepalive_prewarm_close_handler(ngx_event_t *ev)
 {
-    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_connection_t  *c;
 
-    kp->original_save_session(pc, kp->data);
-    return;
+    c = ev->data;
+
+    if (c->close) {
+        ngx_http_upstream_keepalive_prewarm_done(c, NGX_DECLINED);
+    }
 }
 
-#endif
 
+#if (NGX_HTTP_SSL)
 
-static void *
-ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
+// 握手期间读写事件都由ngx_ssl_handshake_handler处理，它只在超时或者
+// 握手结束时调用这个函数，worker进程退出时不会调用
+static void
+ngx_http_upstream_keepalive_prewarm_ssl_handshake(ngx_connection_t *c)
 {
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
-
-    conf = ngx_pcalloc(cf->pool,
-                       sizeof(ngx_http_upstream_keepalive_srv_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+    ngx_http_upstream_keepalive_pending_t  *pw;
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->original_init_upstream = NULL;
-     *     conf->original_init_peer = NULL;
-     */
+    pw = c->data;
 
-    conf->max_cached = 1;
+    if (c->read->timedout || c->write->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "keepalive prewarm SSL handshake to %V timed out",
+                      pw->peer->name);
+        ngx_http_upstream_keepalive_prewarm_done(c, NGX_ERROR);
+        return;
+    }
 
-    return conf;
+    ngx_http_upstream_keepalive_prewarm_done(c, c->ssl->handshaked
+                                                ? NGX_OK : NGX_ERROR);
 }
 
+#endif
+
 
-static char *
-ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+// 预先建立连接结束：rc为NGX_OK时把连接放进缓存，NGX_ERROR表示server出错，
+// NGX_DECLINED表示worker进程正在退出
+static void
+ngx_http_upstream_keepalive_prewarm_done(ngx_connection_t *c, ngx_int_t rc)
 {
-    ngx_http_upstream_srv_conf_t            *uscf;
-    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+    ngx_http_upstream_keepalive_peer_t      *peer;
+    ngx_http_upstream_keepalive_pending_t   *pw;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
 
-    ngx_int_t    n;
-    ngx_str_t   *value;
-    ngx_uint_t   i;
+    pw = c->data;
+    peer = pw->peer;
+    kcf = peer->conf;
 
-    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    ngx_queue_remove(&pw->queue);
 
-    if (kcf->original_init_upstream) {
-        return "is duplicate";
+    peer->connecting--;
+    kcf->connecting--;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
     }
 
-    kcf->original_init_upstream = uscf->peer.init_upstream
-                                  ? uscf->peer.init_upstream
-                                  : ngx_http_upstream_init_round_robin;
+    if (rc == NGX_ERROR) {
+        peer->failed = ngx_time();
+        goto close;
+    }
+
+    if (rc == NGX_DECLINED
+        || ngx_exiting
+        || ngx_queue_empty(&kcf->free)
+        || peer->cached >= kcf->min_idle
+        || ngx_http_upstream_keepalive_over_global(kcf))
+    {
+        goto close;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto close;
+    }
+
+    ngx_http_upstream_keepalive_save(kcf, peer, c, peer->sockaddr,
+                                     peer->socklen);
+
+    return;
+
+close:
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl && !c->ssl->handshaked) {
+
+        /* SSL_shutdown() fails in the middle of a handshake */
+
+        SSL_free(c->ssl->connection);
+        c->ssl = NULL;
+    }
+
+#endif
+
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
+// worker进程退出时关闭所有还在连接或者握手的预先建立的连接，
+// 否则它们的定时器要等到连接超时才能让进程退出
+static void
+ngx_http_upstream_keepalive_prewarm_cancel(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_queue_t                            *q;
+    ngx_http_upstream_keepalive_pending_t  *pw;
+
+    while (!ngx_queue_empty(&kcf->pending)) {
+        q = ngx_queue_head(&kcf->pending);
+        pw = ngx_queue_data(q, ngx_http_upstream_keepalive_pending_t, queue);
+
+        ngx_http_upstream_keepalive_prewarm_done(pw->connection,
+                                                 NGX_DECLINED);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_test_connect(ngx_connection_t *c, ngx_str_t *name)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, c->log, err,
+                          "kevent() reported that keepalive prewarm "
+                          "connect() to %V failed", name);
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            ngx_log_error(NGX_LOG_ERR, c->log, err,
+                          "keepalive prewarm connect() to %V failed", name);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive dummy handler");
+}
+
+
+static void
+ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_keepalive_cache_t     *item;
+
+    int                n;
+    char               buf[1];
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive close handler");
+
+    c = ev->data;
+
+    // 空闲超过了keepalive指令的timeout参数
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        /* stale event */
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+
+    ngx_http_upstream_keepalive_remove(item);
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
+static void
+ngx_http_upstream_keepalive_close(ngx_connection_t *c)
+{
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_http_upstream_keepalive_close;
+            return;
+        }
+    }
+
+#endif
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+
+
+// 查找地址对应的server，找不到时返回最后一项
+static ngx_http_upstream_keepalive_peer_t *
+ngx_http_upstream_keepalive_peer(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_peer_connection_t *pc)
+{
+    ngx_uint_t                           i;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+
+    peer = kcf->peers;
+
+    for (i = 0; i < kcf->npeers; i++) {
+        if (ngx_memn2cmp((u_char *) peer[i].sockaddr, (u_char *) pc->sockaddr,
+                         peer[i].socklen, pc->socklen)
+            == 0)
+        {
+            return &peer[i];
+        }
+    }
+
+    return &peer[kcf->npeers];
+}
+
+
+// 把一个缓存的连接移出缓存，连接由调用者关闭或者使用
+static void
+ngx_http_upstream_keepalive_remove(ngx_http_upstream_keepalive_cache_t *item)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = item->conf;
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_remove(&item->peer_queue);
+    ngx_queue_insert_head(&kcf->free, &item->queue);
+
+    item->peer->cached--;
+    kcf->cached--;
+
+    ngx_http_upstream_keepalive_update_idle(kcf);
+}
+
+
+// 所有worker进程缓存的连接数是否已经达到了global参数的限制
+static ngx_uint_t
+ngx_http_upstream_keepalive_over_global(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_uint_t  i, n;
+
+    if (kcf->global == 0 || kcf->idle == NULL) {
+        return 0;
+    }
+
+    n = 0;
+
+    for (i = 0; i < kcf->nworkers; i++) {
+        n += kcf->idle[i].idle;
+    }
+
+    return n >= kcf->global;
+}
+
+
+// 只有占有了自己那一项的worker进程更新共享内存中的计数，
+// cache manager等辅助进程和重新加载配置后退出中的旧worker进程不会改写
+static void
+ngx_http_upstream_keepalive_update_idle(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_http_upstream_keepalive_slot_t  *slot;
+
+    if (kcf->idle == NULL) {
+        return;
+    }
+
+    slot = &kcf->idle[ngx_worker % kcf->nworkers];
+
+    if (slot->pid == (ngx_atomic_uint_t) ngx_pid) {
+        slot->idle = kcf->cached;
+    }
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+
+    return kp->original_set_session(pc, kp->data);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+
+    kp->original_save_session(pc, kp->data);
+    return;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_status_handler(ngx_http_request_t *r)
+{
+    size_t                                   size;
+    ngx_int_t                                rc;
+    ngx_buf_t                               *b;
+    ngx_uint_t                               i, n, idle;
+    ngx_chain_t                              out;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_peer_t      *peer;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    size = 0;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL || kcf->idle == NULL) {
+            continue;
+        }
+
+        size += sizeof("upstream  idle  global \n") - 1
+                + uscfp[i]->host.len + 2 * NGX_INT_T_LEN;
+
+        for (n = 0; n <= kcf->npeers; n++) {
+            size += sizeof("     hits  misses \n") - 1
+                    + (kcf->peers[n].name ? kcf->peers[n].name->len
+                                          : sizeof("other") - 1)
+                    + 2 * NGX_ATOMIC_T_LEN;
+        }
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD || size == 0) {
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = 0;
+        r->header_only = 1;
+
+        return ngx_http_send_header(r);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL || kcf->idle == NULL) {
+            continue;
+        }
+
+        idle = 0;
+
+        for (n = 0; n < kcf->nworkers; n++) {
+            idle += kcf->idle[n].idle;
+        }
+
+        b->last = ngx_sprintf(b->last, "upstream %V idle %ui global %ui\n",
+                              &uscfp[i]->host, idle, kcf->global);
+
+        for (n = 0; n <= kcf->npeers; n++) {
+            peer = &kcf->peers[n];
+
+            if (peer->name) {
+                b->last = ngx_sprintf(b->last, "    %V", peer->name);
+
+            } else {
+                b->last = ngx_cpymem(b->last, "    other",
+                                     sizeof("    other") - 1);
+            }
+
+            b->last = ngx_sprintf(b->last, " hits %uA misses %uA\n",
+                                  peer->stat->hits, peer->stat->misses);
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+// 在所有upstream都初始化完以后，为配置了keepalive的upstream在一块共享内存中
+// 分配每个worker进程缓存的连接数和每个server的统计
+static ngx_int_t
+ngx_http_upstream_keepalive_add_zone(ngx_conf_t *cf)
+{
+    size_t                                   size;
+    ngx_uint_t                               i, nworkers;
+    ngx_shm_zone_t                          *shm_zone;
+    ngx_core_conf_t                         *ccf;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    /*
+     * worker_processes after the http block is not known yet,
+     * such an order is rejected in ngx_http_upstream_keepalive_init_zone()
+     */
+
+    nworkers = (ccf->worker_processes == NGX_CONF_UNSET)
+               ? 1 : (ngx_uint_t) ccf->worker_processes;
+
+    uscfp = umcf->upstreams.elts;
+    size = sizeof(ngx_http_upstream_keepalive_layout_t);
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL) {
+            continue;
+        }
+
+        kcf->nworkers = nworkers;
+
+        size = ngx_align(size, sizeof(ngx_atomic_t));
+        size += nworkers * sizeof(ngx_http_upstream_keepalive_slot_t)
+                + (kcf->npeers + 1)
+                  * sizeof(ngx_http_upstream_keepalive_stat_t);
+    }
+
+    if (size == sizeof(ngx_http_upstream_keepalive_layout_t)) {
+        return NGX_OK;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &ngx_http_upstream_keepalive_zone,
+                                     8 * ngx_pagesize
+                                     + ngx_align(size, ngx_pagesize),
+                                     &ngx_http_upstream_keepalive_module);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+    shm_zone->data = cf->cycle;
+
+    return NGX_OK;
+}
+
+
+// 共享内存中是按不同布局分配的内存块组成的链表，重新加载配置后
+// 已经有同样布局的内存块时保留原来的统计，否则按新的布局分配一块；
+// 旧的内存块可能还在被正在退出的旧worker进程使用，不能释放，
+// 这些内存要到重新启动时才回收
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    u_char                                  *p;
+    size_t                                   size;
+    uint32_t                                 crc;
+    ngx_uint_t                               i, n;
+    ngx_cycle_t                             *cycle;
+    ngx_core_conf_t                         *ccf;
+    ngx_slab_pool_t                         *shpool;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_layout_t    *layout;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    cycle = shm_zone->data;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_crc32_init(crc);
+
+    size = sizeof(ngx_http_upstream_keepalive_layout_t);
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL) {
+            continue;
+        }
+
+        if (kcf->nworkers != (ngx_uint_t) ccf->worker_processes) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "\"worker_processes\" must be specified before "
+                          "the \"http\" block if \"keepalive\" is used");
+            return NGX_ERROR;
+        }
+
+        ngx_crc32_update(&crc, uscfp[i]->host.data, uscfp[i]->host.len);
+        ngx_crc32_update(&crc, (u_char *) &kcf->npeers, sizeof(ngx_uint_t));
+        ngx_crc32_update(&crc, (u_char *) &kcf->nworkers, sizeof(ngx_uint_t));
+
+        size = ngx_align(size, sizeof(ngx_atomic_t));
+        size += kcf->nworkers * sizeof(ngx_http_upstream_keepalive_slot_t)
+                + (kcf->npeers + 1)
+                  * sizeof(ngx_http_upstream_keepalive_stat_t);
+    }
+
+    ngx_crc32_final(crc);
+
+    layout = (data || shm_zone->shm.exists) ? shpool->data : NULL;
+
+    while (layout && layout->crc != crc) {
+        layout = layout->next;
+    }
+
+    if (layout == NULL) {
+
+        /*
+         * blocks of other layouts may still be referenced by old
+         * workers, so they are kept until the zone is recreated
+         */
+
+        layout = ngx_slab_alloc(shpool, size);
+
+        if (layout == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "no memory for the new layout in the \"%V\" "
+                          "zone, restart is required",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(layout, size);
+
+        layout->crc = crc;
+        layout->next = (data || shm_zone->shm.exists) ? shpool->data : NULL;
+
+        shpool->data = layout;
+    }
+
+    p = (u_char *) (layout + 1);
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL) {
+            continue;
+        }
+
+        p = ngx_align_ptr(p, sizeof(ngx_atomic_t));
+
+        kcf->idle = (ngx_http_upstream_keepalive_slot_t *) p;
+        p += kcf->nworkers * sizeof(ngx_http_upstream_keepalive_slot_t);
+
+        for (n = 0; n <= kcf->npeers; n++) {
+            kcf->peers[n].stat = (ngx_http_upstream_keepalive_stat_t *) p;
+            p += sizeof(ngx_http_upstream_keepalive_stat_t);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+// worker进程占有同一序号的计数并清掉之前的进程留下的值，并开始预先建立连接
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_slot_t      *slot;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    /* cache manager and cache loader neither prewarm nor own a slot */
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->idle) {
+            slot = &kcf->idle[ngx_worker % kcf->nworkers];
+            slot->idle = 0;
+            slot->pid = ngx_pid;
+        }
+
+        if (kcf->min_idle) {
+            ngx_queue_init(&kcf->pending);
+
+            kcf->prewarm.handler = ngx_http_upstream_keepalive_prewarm;
+            kcf->prewarm.data = kcf;
+            kcf->prewarm.log = cycle->log;
+
+            ngx_add_timer(&kcf->prewarm, 1);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+// worker进程立即退出（ngx_terminate）时不经过预先建立连接的定时器，
+// 在这里关闭还没有完成的预先建立的连接
+static void
+ngx_http_upstream_keepalive_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->min_idle) {
+            ngx_http_upstream_keepalive_prewarm_cancel(kcf);
+        }
+    }
+}
+
+
+static void *
+ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->max_per_peer = 0;
+     *     conf->timeout = 0;
+     *     conf->max_requests = 0;
+     *     conf->global = 0;
+     *     conf->min_idle = 0;
+     *     conf->idle = NULL;
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     */
+
+    conf->max_cached = 1;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_msec_t   timeout;
+    ngx_uint_t   i;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (kcf->original_init_upstream) {
+        return "is duplicate";
+    }
+
+    kcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
 
     uscf->peer.init_upstream = ngx_http_upstream_init_keepalive;
 
@@ -523,9 +1623,78 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "per_peer=", 9) == 0) {
+
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->max_per_peer = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+                goto invalid;
+            }
+
+            kcf->timeout = timeout;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
+
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->max_requests = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min_idle=", 9) == 0) {
+
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->min_idle = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "global=", 7) == 0) {
+
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->global = n;
+
+            continue;
+        }
+
         goto invalid;
     }
 
+    if (kcf->max_per_peer && kcf->min_idle > kcf->max_per_peer) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"min_idle\" must not exceed \"per_peer\"");
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 
 invalid:
@@ -535,3 +1704,16 @@ invalid:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_upstream_keepalive_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_keepalive_status_handler;
+
+    return NGX_CONF_OK;
+}
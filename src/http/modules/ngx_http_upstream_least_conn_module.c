@@ -11,19 +11,11 @@
 #include <ngx_http.h>
 
 
-typedef struct {
-    ngx_uint_t                        *conns;
-} ngx_http_upstream_least_conn_conf_t;
-
-
 typedef struct {
     /* the round robin data must be first */
     ngx_http_upstream_rr_peer_data_t   rrp;
 
-    ngx_uint_t                        *conns;
-
     ngx_event_get_peer_pt              get_rr_peer;
-    ngx_event_free_peer_pt             free_rr_peer;
 } ngx_http_upstream_lc_peer_data_t;
 
 
@@ -31,9 +23,6 @@ static ngx_int_t ngx_http_upstream_init_least_conn_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_least_conn_peer(
     ngx_peer_connection_t *pc, void *data);
-static void ngx_http_upstream_free_least_conn_peer(ngx_peer_connection_t *pc,
-    void *data, ngx_uint_t state);
-static void *ngx_http_upstream_least_conn_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -58,7 +47,7 @@ static ngx_http_module_t  ngx_http_upstream_least_conn_module_ctx = {
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
 
-    ngx_http_upstream_least_conn_create_conf, /* create server configuration */
+    NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
 
     NULL,                                  /* create location configuration */
@@ -86,10 +75,6 @@ static ngx_int_t
 ngx_http_upstream_init_least_conn(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_uint_t                            n;
-    ngx_http_upstream_rr_peers_t         *peers;
-    ngx_http_upstream_least_conn_conf_t  *lcf;
-
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
                    "init least conn");
 
@@ -97,22 +82,6 @@ ngx_http_upstream_init_least_conn(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
-    peers = us->peer.data;
-
-    n = peers->number;
-
-    if (peers->next) {
-        n += peers->next->number;
-    }
-
-    lcf = ngx_http_conf_upstream_srv_conf(us,
-                                          ngx_http_upstream_least_conn_module);
-
-    lcf->conns = ngx_pcalloc(cf->pool, sizeof(ngx_uint_t) * n);
-    if (lcf->conns == NULL) {
-        return NGX_ERROR;
-    }
-
     us->peer.init = ngx_http_upstream_init_least_conn_peer;
 
     return NGX_OK;
@@ -123,22 +92,16 @@ static ngx_int_t
 ngx_http_upstream_init_least_conn_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_http_upstream_lc_peer_data_t     *lcp;
-    ngx_http_upstream_least_conn_conf_t  *lcf;
+    ngx_http_upstream_lc_peer_data_t  *lcp;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "init least conn peer");
 
-    lcf = ngx_http_conf_upstream_srv_conf(us,
-                                          ngx_http_upstream_least_conn_module);
-
     lcp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_lc_peer_data_t));
     if (lcp == NULL) {
         return NGX_ERROR;
     }
 
-    lcp->conns = lcf->conns;
-
     r->upstream->peer.data = &lcp->rrp;
 
     if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
@@ -146,10 +109,8 @@ ngx_http_upstream_init_least_conn_peer(ngx_http_request_t *r,
     }
 
     r->upstream->peer.get = ngx_http_upstream_get_least_conn_peer;
-    r->upstream->peer.free = ngx_http_upstream_free_least_conn_peer;
 
     lcp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
-    lcp->free_rr_peer = ngx_http_upstream_free_round_robin_peer;
 
     return NGX_OK;
 }
@@ -211,6 +172,10 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
             continue;
         }
 
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
         /*
          * select peer with least number of connections; if there are
          * multiple peers with the same number of connections, select
@@ -218,15 +183,13 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
          */
 
         if (best == NULL
-            || lcp->conns[i] * best->weight < lcp->conns[p] * peer->weight)
+            || peer->conns * best->weight < best->conns * peer->weight)
         {
             best = peer;
             many = 0;
             p = i;
 
-        } else if (lcp->conns[i] * best->weight
-                   == lcp->conns[p] * peer->weight)
-        {
+        } else if (peer->conns * best->weight == best->conns * peer->weight) {
             many = 1;
         }
     }
@@ -257,7 +220,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (lcp->conns[i] * best->weight != lcp->conns[p] * peer->weight) {
+            if (peer->conns * best->weight != best->conns * peer->weight) {
                 continue;
             }
 
@@ -268,6 +231,10 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -298,7 +265,8 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
     m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
 
     lcp->rrp.tried[n] |= m;
-    lcp->conns[p]++;
+
+    best->conns++;
 
     if (pc->tries == 1 && peers->next) {
         pc->tries += peers->next->number;
@@ -312,8 +280,6 @@ failed:
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "get least conn peer, backup servers");
 
-        lcp->conns += peers->number;
-
         lcp->rrp.peers = peers->next;
         pc->tries = lcp->rrp.peers->number;
 
@@ -343,47 +309,6 @@ failed:
 }
 
 
-static void
-ngx_http_upstream_free_least_conn_peer(ngx_peer_connection_t *pc,
-    void *data, ngx_uint_t state)
-{
-    ngx_http_upstream_lc_peer_data_t  *lcp = data;
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                   "free least conn peer %ui %ui", pc->tries, state);
-
-    if (lcp->rrp.peers->single) {
-        lcp->free_rr_peer(pc, &lcp->rrp, state);
-        return;
-    }
-
-    lcp->conns[lcp->rrp.current]--;
-
-    lcp->free_rr_peer(pc, &lcp->rrp, state);
-}
-
-
-static void *
-ngx_http_upstream_least_conn_create_conf(ngx_conf_t *cf)
-{
-    ngx_http_upstream_least_conn_conf_t  *conf;
-
-    conf = ngx_pcalloc(cf->pool,
-                       sizeof(ngx_http_upstream_least_conn_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
-
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->conns = NULL;
-     */
-
-    return conf;
-}
-
-
 static char *
 ngx_http_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -402,6 +327,7 @@ ngx_http_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                   |NGX_HTTP_UPSTREAM_WEIGHT
                   |NGX_HTTP_UPSTREAM_MAX_FAILS
                   |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
                   |NGX_HTTP_UPSTREAM_DOWN
                   |NGX_HTTP_UPSTREAM_BACKUP;
 
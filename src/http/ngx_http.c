@@ -11,11 +11,32 @@
 #include <ngx_http.h>
 
 
+typedef struct ngx_http_location_trie_build_s  ngx_http_location_trie_build_t;
+
+// 构造压缩前缀树时使用的临时节点，子节点用单链表连接，
+// 构造完成后由ngx_http_location_trie_compile()转换成ngx_http_location_trie_node_t
+struct ngx_http_location_trie_build_s {
+    ngx_http_location_trie_build_t  *child;
+    ngx_http_location_trie_build_t  *next;
+
+    ngx_http_core_loc_conf_t        *exact;
+    ngx_http_core_loc_conf_t        *inclusive;
+    ngx_http_core_loc_conf_t        *auto_redirect;
+
+    ngx_uint_t                       nchildren;
+
+    size_t                           len;
+    u_char                          *name;
+};
+
+
 static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_http_init_phases(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf);
 static ngx_int_t ngx_http_init_headers_in_hash(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf);
+static ngx_int_t ngx_http_init_headers_in_phash(ngx_conf_t *cf,
+    ngx_http_core_main_conf_t *cmcf, ngx_hash_key_t *names, ngx_uint_t nelts);
 static ngx_int_t ngx_http_init_phase_handlers(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf);
 
@@ -38,6 +59,10 @@ static ngx_int_t ngx_http_init_locations(ngx_conf_t *cf,
     ngx_http_core_srv_conf_t *cscf, ngx_http_core_loc_conf_t *pclcf);
 static ngx_int_t ngx_http_init_static_location_trees(ngx_conf_t *cf,
     ngx_http_core_loc_conf_t *pclcf);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_init_regex_locations(ngx_conf_t *cf,
+    ngx_http_core_loc_conf_t *pclcf, ngx_uint_t n);
+#endif
 static ngx_int_t ngx_http_cmp_locations(const ngx_queue_t *one,
     const ngx_queue_t *two);
 static ngx_int_t ngx_http_join_exact_locations(ngx_conf_t *cf,
@@ -47,11 +72,22 @@ static void ngx_http_create_locations_list(ngx_queue_t *locations,
 static ngx_http_location_tree_node_t *
     ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
     size_t prefix);
+static ngx_int_t ngx_http_create_locations_trie(ngx_conf_t *cf,
+    ngx_http_core_loc_conf_t *pclcf, ngx_queue_t *locations);
+static ngx_http_location_trie_build_t *ngx_http_location_trie_insert(
+    ngx_conf_t *cf, ngx_http_location_trie_build_t *node, u_char *name,
+    size_t len);
+static ngx_int_t ngx_http_location_trie_compile(ngx_conf_t *cf,
+    ngx_http_location_trie_build_t *b, ngx_http_location_trie_node_t *node);
 
 static ngx_int_t ngx_http_optimize_servers(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_array_t *ports);
 static ngx_int_t ngx_http_server_names(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_http_conf_addr_t *addr);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_server_names_regex(ngx_conf_t *cf,
+    ngx_http_conf_addr_t *addr);
+#endif
 static ngx_int_t ngx_http_cmp_conf_addrs(const void *one, const void *two);
 static int ngx_libc_cdecl ngx_http_cmp_dns_wildcards(const void *one,
     const void *two);
@@ -461,6 +497,86 @@ ngx_http_init_headers_in_hash(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf)
         return NGX_ERROR;
     }
 
+    return ngx_http_init_headers_in_phash(cf, cmcf, headers_in.elts,
+                                          headers_in.nelts);
+}
+
+
+// 为ngx_http_headers_in查找没有冲突的散列表大小和移位数，初始化cmcf->headers_in_phash。
+// 槽号是(key >> shift) & mask，从最小的表开始尝试，找不到时headers_in_phash保持NULL
+static ngx_int_t
+ngx_http_init_headers_in_phash(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
+    ngx_hash_key_t *names, ngx_uint_t nelts)
+{
+    u_char                       *used;
+    ngx_uint_t                    i, k, n, size, shift;
+    ngx_http_header_phash_elt_t  *elt;
+
+    used = ngx_palloc(cf->temp_pool, NGX_HTTP_HEADERS_IN_PHASH_MAX);
+    if (used == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (size = 32; size <= NGX_HTTP_HEADERS_IN_PHASH_MAX; size *= 2) {
+
+        if (size < nelts) {
+            continue;
+        }
+
+        for (shift = 0; shift < 16; shift++) {
+
+            ngx_memzero(used, size);
+
+            for (n = 0; n < nelts; n++) {
+                k = (names[n].key_hash >> shift) & (size - 1);
+
+                if (used[k]) {
+                    break;
+                }
+
+                used[k] = 1;
+            }
+
+            if (n == nelts) {
+                goto found;
+            }
+        }
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
+                  "could not build headers_in perfect hash, "
+                  "using headers_in_hash");
+
+    return NGX_OK;
+
+found:
+
+    elt = ngx_pcalloc(cf->pool, size * sizeof(ngx_http_header_phash_elt_t));
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < nelts; n++) {
+        k = (names[n].key_hash >> shift) & (size - 1);
+
+        elt[k].key = names[n].key_hash;
+        elt[k].header = names[n].value;
+
+        elt[k].name.len = names[n].key.len;
+        elt[k].name.data = ngx_pnalloc(cf->pool, names[n].key.len);
+        if (elt[k].name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < names[n].key.len; i++) {
+            elt[k].name.data[i] = ngx_tolower(names[n].key.data[i]);
+        }
+    }
+
+    cmcf->headers_in_phash = elt;
+    cmcf->headers_in_phash_mask = size - 1;
+    cmcf->headers_in_phash_shift = shift;
+
     return NGX_OK;
 }
 
@@ -822,6 +938,10 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
         *clcfp = NULL;
 
         ngx_queue_split(locations, regex, &tail);
+
+        if (ngx_http_init_regex_locations(cf, pclcf, r) != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
 #endif
@@ -829,6 +949,67 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
     return NGX_OK;
 }
 
+#if (NGX_PCRE)
+
+// 按声明顺序把pclcf->regex_locations中的n个正则location分成块，给pclcf->regex_blocks赋值，
+// 每块和全部的正则location分别合并成一个正则表达式。
+// 查找时合并后的正则表达式不匹配就只测试全部或整块中没有参与合并的standalone正则location，
+// 匹配时再在块内按顺序逐个测试
+static ngx_int_t
+ngx_http_init_regex_locations(ngx_conf_t *cf, ngx_http_core_loc_conf_t *pclcf,
+    ngx_uint_t n)
+{
+    ngx_uint_t                   i, nblocks;
+    ngx_http_regex_t           **re;
+    ngx_http_regex_locations_t  *block;
+
+    nblocks = (n + NGX_HTTP_REGEX_LOCATIONS_BLOCK - 1)
+              / NGX_HTTP_REGEX_LOCATIONS_BLOCK;
+
+    block = ngx_pcalloc(cf->pool,
+                        (nblocks + 1) * sizeof(ngx_http_regex_locations_t));
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    re = ngx_palloc(cf->temp_pool, n * sizeof(ngx_http_regex_t *));
+    if (re == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        re[i] = pclcf->regex_locations[i]->regex;
+
+        if (re[i]->standalone) {
+            block[i / NGX_HTTP_REGEX_LOCATIONS_BLOCK].nstandalone++;
+        }
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        block[i].locations =
+                         &pclcf->regex_locations[i * NGX_HTTP_REGEX_LOCATIONS_BLOCK];
+        block[i].nelts = ngx_min(NGX_HTTP_REGEX_LOCATIONS_BLOCK,
+                                 n - i * NGX_HTTP_REGEX_LOCATIONS_BLOCK);
+
+        if (block[i].nelts > 1) {
+            block[i].regex = ngx_http_regex_compile_set(cf,
+                                    &re[i * NGX_HTTP_REGEX_LOCATIONS_BLOCK],
+                                    block[i].nelts);
+        }
+    }
+
+    if (nblocks > 1) {
+        pclcf->regex_locations_set = ngx_http_regex_compile_set(cf, re, n);
+    }
+
+    pclcf->regex_blocks = block;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 // 给pclcf->static_locations赋值
 static ngx_int_t
 ngx_http_init_static_location_trees(ngx_conf_t *cf,
@@ -867,6 +1048,14 @@ ngx_http_init_static_location_trees(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
+#if !(NGX_HAVE_CASELESS_FILESYSTEM)
+
+    if (pclcf->location_trie) {
+        return ngx_http_create_locations_trie(cf, pclcf, locations);
+    }
+
+#endif
+
     ngx_http_create_locations_list(locations, ngx_queue_head(locations));
 
     pclcf->static_locations = ngx_http_create_locations_tree(cf, locations, 0);
@@ -1175,6 +1364,185 @@ inclusive:
     return node;
 }
 
+
+// 用已经去掉同名节点的locations构造压缩前缀树，给pclcf->static_trie赋值。
+// 对需要自动重定向的location，在它的名字去掉最后一个字符的位置上也放一个节点
+static ngx_int_t
+ngx_http_create_locations_trie(ngx_conf_t *cf, ngx_http_core_loc_conf_t *pclcf,
+    ngx_queue_t *locations)
+{
+    ngx_queue_t                     *q;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_location_queue_t       *lq;
+    ngx_http_location_trie_build_t  *root, *b;
+
+    root = ngx_pcalloc(cf->temp_pool, sizeof(ngx_http_location_trie_build_t));
+    if (root == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
+    {
+        lq = (ngx_http_location_queue_t *) q;
+
+        b = ngx_http_location_trie_insert(cf, root, lq->name->data,
+                                          lq->name->len);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->exact = lq->exact;
+        b->inclusive = lq->inclusive;
+
+        if ((lq->exact && lq->exact->auto_redirect)
+            || (lq->inclusive && lq->inclusive->auto_redirect))
+        {
+            if (lq->name->len < 2) {
+                continue;
+            }
+
+            clcf = lq->exact ? lq->exact : lq->inclusive;
+
+            b = ngx_http_location_trie_insert(cf, root, lq->name->data,
+                                              lq->name->len - 1);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            b->auto_redirect = clcf;
+        }
+    }
+
+    pclcf->static_trie = ngx_pcalloc(cf->pool,
+                                     sizeof(ngx_http_location_trie_node_t));
+    if (pclcf->static_trie == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_location_trie_compile(cf, root, pclcf->static_trie);
+}
+
+
+// 在以node为根的前缀树中插入名字为name的节点，必要时拆分已有的边，返回对应name的节点
+static ngx_http_location_trie_build_t *
+ngx_http_location_trie_insert(ngx_conf_t *cf,
+    ngx_http_location_trie_build_t *node, u_char *name, size_t len)
+{
+    size_t                            i, n;
+    ngx_http_location_trie_build_t   *child, *split, **cp;
+
+    while (len) {
+
+        for (cp = &node->child; *cp; cp = &(*cp)->next) {
+            if ((*cp)->name[0] == name[0]) {
+                break;
+            }
+        }
+
+        child = *cp;
+
+        if (child == NULL) {
+            child = ngx_pcalloc(cf->temp_pool,
+                                sizeof(ngx_http_location_trie_build_t));
+            if (child == NULL) {
+                return NULL;
+            }
+
+            child->name = name;
+            child->len = len;
+
+            child->next = node->child;
+            node->child = child;
+            node->nchildren++;
+
+            return child;
+        }
+
+        n = ngx_min(len, child->len);
+
+        for (i = 1; i < n && child->name[i] == name[i]; i++) { /* void */ }
+
+        if (i < child->len) {
+
+            /* split the edge */
+
+            split = ngx_pcalloc(cf->temp_pool,
+                                sizeof(ngx_http_location_trie_build_t));
+            if (split == NULL) {
+                return NULL;
+            }
+
+            split->name = child->name;
+            split->len = i;
+            split->child = child;
+            split->nchildren = 1;
+            split->next = child->next;
+
+            child->name += i;
+            child->len -= i;
+            child->next = NULL;
+
+            *cp = split;
+            child = split;
+        }
+
+        node = child;
+        name += i;
+        len -= i;
+    }
+
+    return node;
+}
+
+
+// 把构造时的临时节点b转换成查找时用的节点node，子节点连续存放以提高缓存命中率
+static ngx_int_t
+ngx_http_location_trie_compile(ngx_conf_t *cf,
+    ngx_http_location_trie_build_t *b, ngx_http_location_trie_node_t *node)
+{
+    ngx_uint_t                       i;
+    ngx_http_location_trie_build_t  *c;
+
+    node->exact = b->exact;
+    node->inclusive = b->inclusive;
+    node->auto_redirect = b->auto_redirect;
+    node->len = b->len;
+    node->name = b->name;
+    node->nchildren = b->nchildren;
+
+    if (b->nchildren == 0) {
+        node->children = NULL;
+        node->keys = NULL;
+
+        return NGX_OK;
+    }
+
+    node->children = ngx_palloc(cf->pool,
+                         b->nchildren * sizeof(ngx_http_location_trie_node_t));
+    if (node->children == NULL) {
+        return NGX_ERROR;
+    }
+
+    node->keys = ngx_pnalloc(cf->pool, b->nchildren);
+    if (node->keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0, c = b->child; c; i++, c = c->next) {
+        node->keys[i] = c->name[0];
+
+        if (ngx_http_location_trie_compile(cf, c, &node->children[i])
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
 // 根据参数lsopt向cmcf->ports数组添加元素。
 ngx_int_t
 ngx_http_add_listen(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
@@ -1409,6 +1777,8 @@ ngx_http_add_address(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     addr->nregex = 0;
     addr->regex = NULL;
+    addr->regex_set = NULL;
+    addr->regex_blocks = NULL;
 #endif
     addr->default_server = cscf;
     addr->servers.elts = NULL;
@@ -1648,6 +2018,10 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
         }
     }
 
+    if (ngx_http_server_names_regex(cf, addr) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
 #endif
 
     return NGX_OK;
@@ -1660,6 +2034,66 @@ failed:
 }
 
 
+#if (NGX_PCRE)
+
+// 把addr->regex按顺序每NGX_HTTP_SERVER_NAMES_REGEX_BLOCK个分成一块，
+// 每块以及全部正则表达式分别合并成一个正则表达式，
+// 查找虚拟主机时不匹配的块可以整块跳过
+static ngx_int_t
+ngx_http_server_names_regex(ngx_conf_t *cf, ngx_http_conf_addr_t *addr)
+{
+    ngx_uint_t                      i, n, nblocks;
+    ngx_http_regex_t              **re;
+    ngx_http_server_names_regex_t  *block;
+
+    n = addr->nregex;
+
+    nblocks = (n + NGX_HTTP_SERVER_NAMES_REGEX_BLOCK - 1)
+              / NGX_HTTP_SERVER_NAMES_REGEX_BLOCK;
+
+    block = ngx_pcalloc(cf->pool,
+                        (nblocks + 1) * sizeof(ngx_http_server_names_regex_t));
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    re = ngx_palloc(cf->temp_pool, n * sizeof(ngx_http_regex_t *));
+    if (re == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        re[i] = addr->regex[i].regex;
+
+        if (re[i]->standalone) {
+            block[i / NGX_HTTP_SERVER_NAMES_REGEX_BLOCK].nstandalone++;
+        }
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        block[i].names = &addr->regex[i * NGX_HTTP_SERVER_NAMES_REGEX_BLOCK];
+        block[i].nelts = ngx_min(NGX_HTTP_SERVER_NAMES_REGEX_BLOCK,
+                                 n - i * NGX_HTTP_SERVER_NAMES_REGEX_BLOCK);
+
+        if (block[i].nelts > 1) {
+            block[i].regex = ngx_http_regex_compile_set(cf,
+                                    &re[i * NGX_HTTP_SERVER_NAMES_REGEX_BLOCK],
+                                    block[i].nelts);
+        }
+    }
+
+    if (nblocks > 1) {
+        addr->regex_set = ngx_http_regex_compile_set(cf, re, n);
+    }
+
+    addr->regex_blocks = block;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_cmp_conf_addrs(const void *one, const void *two)
 {
@@ -1920,6 +2354,8 @@ ngx_http_add_addrs(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_set = addr[i].regex_set;
+        vn->regex_blocks = addr[i].regex_blocks;
 #endif
     }
 
@@ -1984,6 +2420,8 @@ ngx_http_add_addrs6(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_set = addr[i].regex_set;
+        vn->regex_blocks = addr[i].regex_blocks;
 #endif
     }
 
@@ -52,6 +52,12 @@ typedef u_char *(*ngx_http_log_handler_pt)(ngx_http_request_t *r,
 #if (NGX_HTTP_SSL)
 #include <ngx_http_ssl_module.h>
 #endif
+#if (NGX_HTTP_LIMIT_SYNC)
+#include <ngx_http_limit_sync_module.h>
+#endif
+#if (NGX_HTTP_LIMIT_RATE)
+#include <ngx_http_limit_rate_module.h>
+#endif
 
 
 struct ngx_http_log_ctx_s {
@@ -143,6 +149,7 @@ ngx_int_t ngx_http_send_special(ngx_http_request_t *r, ngx_uint_t flags);
 
 ngx_int_t ngx_http_read_client_request_body(ngx_http_request_t *r,
     ngx_http_client_body_handler_pt post_handler);
+ngx_int_t ngx_http_read_unbuffered_request_body(ngx_http_request_t *r);
 
 ngx_int_t ngx_http_send_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_special_response_handler(ngx_http_request_t *r,
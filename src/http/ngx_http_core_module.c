@@ -24,6 +24,8 @@ typedef struct {
 static ngx_int_t ngx_http_core_find_location(ngx_http_request_t *r);
 static ngx_int_t ngx_http_core_find_static_location(ngx_http_request_t *r,
     ngx_http_location_tree_node_t *node);
+static ngx_int_t ngx_http_core_find_static_trie(ngx_http_request_t *r,
+    ngx_http_location_trie_node_t *node);
 
 static ngx_int_t ngx_http_core_preconfiguration(ngx_conf_t *cf);
 static void *ngx_http_core_create_main_conf(ngx_conf_t *cf);
@@ -627,6 +629,14 @@ static ngx_command_t  ngx_http_core_commands[] = {
       offsetof(ngx_http_core_loc_conf_t, port_in_redirect),
       NULL },
 
+    // 是否用压缩前缀树代替二叉树查找前缀location，默认关闭，适用于有大量前缀location的情况
+    { ngx_string("location_trie"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_core_loc_conf_t, location_trie),
+      NULL },
+
     { ngx_string("msie_padding"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -1603,19 +1613,25 @@ ngx_http_update_location_config(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_core_find_location(ngx_http_request_t *r)
 {
-    ngx_int_t                  rc;
-    ngx_http_core_loc_conf_t  *pclcf;
+    ngx_int_t                    rc;
+    ngx_http_core_loc_conf_t    *pclcf;
 #if (NGX_PCRE)
-    ngx_int_t                  n;
-    ngx_uint_t                 noregex;
-    ngx_http_core_loc_conf_t  *clcf, **clcfp;
+    ngx_int_t                    n;
+    ngx_uint_t                   i, noregex, missed, skip;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_regex_locations_t  *block;
 
     noregex = 0;
 #endif
 
     pclcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    rc = ngx_http_core_find_static_location(r, pclcf->static_locations);
+    if (pclcf->static_trie) {
+        rc = ngx_http_core_find_static_trie(r, pclcf->static_trie);
+
+    } else {
+        rc = ngx_http_core_find_static_location(r, pclcf->static_locations);
+    }
 
     if (rc == NGX_AGAIN) {
 
@@ -1641,28 +1657,74 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
     if (noregex == 0 && pclcf->regex_locations) {
 
-        for (clcfp = pclcf->regex_locations; *clcfp; clcfp++) {
+        /*
+         * after a combined regex did not match only the standalone
+         * regexes left out of it are still to be tested
+         */
+
+        missed = 0;
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "test location: ~ \"%V\"", &(*clcfp)->name);
+        if (pclcf->regex_locations_set) {
+            n = ngx_http_regex_set_exec(r, pclcf->regex_locations_set,
+                                        &r->uri);
+
+            if (n == NGX_DECLINED) {
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "test regex locations: no match");
+                missed = 1;
 
-            n = ngx_http_regex_exec(r, (*clcfp)->regex, &r->uri);
+            } else if (n != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
 
-            if (n == NGX_OK) {
-                r->loc_conf = (*clcfp)->loc_conf;
+        for (block = pclcf->regex_blocks; block->nelts; block++) {
 
-                /* look up nested locations */
+            skip = missed;
 
-                rc = ngx_http_core_find_location(r);
+            if (!skip && block->regex) {
+                n = ngx_http_regex_set_exec(r, block->regex, &r->uri);
 
-                return (rc == NGX_ERROR) ? rc : NGX_OK;
+                if (n == NGX_DECLINED) {
+                    skip = 1;
+
+                } else if (n != NGX_OK) {
+                    return NGX_ERROR;
+                }
             }
 
-            if (n == NGX_DECLINED) {
+            if (skip && block->nstandalone == 0) {
                 continue;
             }
 
-            return NGX_ERROR;
+            for (i = 0; i < block->nelts; i++) {
+                clcf = block->locations[i];
+
+                if (skip && !clcf->regex->standalone) {
+                    continue;
+                }
+
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "test location: ~ \"%V\"", &clcf->name);
+
+                n = ngx_http_regex_exec(r, clcf->regex, &r->uri);
+
+                if (n == NGX_OK) {
+                    r->loc_conf = clcf->loc_conf;
+
+                    /* look up nested locations */
+
+                    rc = ngx_http_core_find_location(r);
+
+                    return (rc == NGX_ERROR) ? rc : NGX_OK;
+                }
+
+                if (n == NGX_DECLINED) {
+                    continue;
+                }
+
+                return NGX_ERROR;
+            }
         }
     }
 #endif
@@ -1757,6 +1819,76 @@ ngx_http_core_find_static_location(ngx_http_request_t *r,
 }
 
 
+/*
+ * NGX_OK       - exact match
+ * NGX_DONE     - auto redirect
+ * NGX_AGAIN    - inclusive match
+ * NGX_DECLINED - no match
+ */
+
+// 在压缩前缀树中查找与r->uri最长前缀匹配的location，返回值与
+// ngx_http_core_find_static_location()相同，时间与uri的长度成正比，与location的个数无关
+static ngx_int_t
+ngx_http_core_find_static_trie(ngx_http_request_t *r,
+    ngx_http_location_trie_node_t *node)
+{
+    u_char     *uri, *key;
+    size_t      len;
+    ngx_int_t   rv;
+
+    len = r->uri.len;
+    uri = r->uri.data;
+
+    rv = NGX_DECLINED;
+
+    for ( ;; ) {
+
+        if (len == 0) {
+
+            if (node->exact) {
+                r->loc_conf = node->exact->loc_conf;
+                return NGX_OK;
+            }
+
+            if (node->inclusive) {
+                r->loc_conf = node->inclusive->loc_conf;
+                return NGX_AGAIN;
+            }
+
+            if (node->auto_redirect) {
+                r->loc_conf = node->auto_redirect->loc_conf;
+                return NGX_DONE;
+            }
+
+            return rv;
+        }
+
+        if (node->inclusive) {
+            r->loc_conf = node->inclusive->loc_conf;
+            rv = NGX_AGAIN;
+        }
+
+        key = ngx_strlchr(node->keys, node->keys + node->nchildren, *uri);
+
+        if (key == NULL) {
+            return rv;
+        }
+
+        node = &node->children[key - node->keys];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "test location trie: \"%*s\"", node->len, node->name);
+
+        if (len < node->len || ngx_memcmp(uri, node->name, node->len) != 0) {
+            return rv;
+        }
+
+        uri += node->len;
+        len -= node->len;
+    }
+}
+
+
 void *
 ngx_http_test_content_type(ngx_http_request_t *r, ngx_hash_t *types_hash)
 {
@@ -3496,6 +3628,13 @@ ngx_http_core_init_main_conf(ngx_conf_t *cf, void *conf)
 {
     ngx_http_core_main_conf_t *cmcf = conf;
 
+    // 两个都没有配置时，由ngx_hash_init()自动选择server_name散列表的大小
+    if (cmcf->server_names_hash_max_size == NGX_CONF_UNSET_UINT
+        && cmcf->server_names_hash_bucket_size == NGX_CONF_UNSET_UINT)
+    {
+        cmcf->server_names_hash_max_size = NGX_HASH_AUTO_SIZE;
+    }
+
     ngx_conf_init_uint_value(cmcf->server_names_hash_max_size, 512);
     ngx_conf_init_uint_value(cmcf->server_names_hash_bucket_size,
                              ngx_cacheline_size);
@@ -3690,6 +3829,7 @@ ngx_http_core_create_loc_conf(ngx_conf_t *cf)
     clcf->reset_timedout_connection = NGX_CONF_UNSET;
     clcf->server_name_in_redirect = NGX_CONF_UNSET;
     clcf->port_in_redirect = NGX_CONF_UNSET;
+    clcf->location_trie = NGX_CONF_UNSET;
     clcf->msie_padding = NGX_CONF_UNSET;
     clcf->msie_refresh = NGX_CONF_UNSET;
     clcf->log_not_found = NGX_CONF_UNSET;
@@ -3949,6 +4089,7 @@ ngx_http_core_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->server_name_in_redirect,
                               prev->server_name_in_redirect, 0);
     ngx_conf_merge_value(conf->port_in_redirect, prev->port_in_redirect, 1);
+    ngx_conf_merge_value(conf->location_trie, prev->location_trie, 0);
     ngx_conf_merge_value(conf->msie_padding, prev->msie_padding, 1);
     ngx_conf_merge_value(conf->msie_refresh, prev->msie_refresh, 0);
     ngx_conf_merge_value(conf->log_not_found, prev->log_not_found, 1);
@@ -50,9 +50,27 @@
 
 
 typedef struct ngx_http_location_tree_node_s  ngx_http_location_tree_node_t;
+typedef struct ngx_http_location_trie_node_s  ngx_http_location_trie_node_t;
 typedef struct ngx_http_core_loc_conf_s  ngx_http_core_loc_conf_t;
 
 
+#if (NGX_PCRE)
+
+#define NGX_HTTP_REGEX_LOCATIONS_BLOCK  16
+
+// regex_locations中连续的若干个正则location组成的块，
+// regex是它们合并后的正则表达式，不匹配时只需测试块内nstandalone个
+// 没有参与合并的正则location，为NULL时逐个测试
+typedef struct {
+    ngx_regex_t                     *regex;
+    ngx_http_core_loc_conf_t       **locations;
+    ngx_uint_t                       nelts;
+    ngx_uint_t                       nstandalone;
+} ngx_http_regex_locations_t;
+
+#endif
+
+
 // 配置文件中一个listen指令的信息会存到这个结构体的一个对象里，
 // 这个结构体是组成ngx_http_conf_addr_t结构体的一部分。
 typedef struct {
@@ -183,6 +201,19 @@ typedef struct {
 } ngx_http_phase_t;
 
 
+#define NGX_HTTP_HEADERS_IN_PHASH_MAX  1024
+
+
+// headers_in_phash散列表的槽
+typedef struct {
+    // 小写头部名的散列值，与ngx_http_parse_header_line()算出的一致
+    ngx_uint_t                 key;
+    // 小写的头部名，空槽的长度为0
+    ngx_str_t                  name;
+    ngx_http_header_t         *header;
+} ngx_http_header_phash_elt_t;
+
+
 // 这个结构体在内存中只有一个实例对象。
 typedef struct {
     // 数组元素是ngx_http_core_srv_conf_t *
@@ -196,6 +227,13 @@ typedef struct {
     // ngx_http_headers_in数组元素组成的散列表。
     ngx_hash_t                 headers_in_hash;
 
+    // ngx_http_headers_in数组元素组成的没有冲突的完美散列表，用解析头部时已经算好的
+    // 散列值移位和掩码后直接定位到唯一的槽，只需一次比较。
+    // 找不到没有冲突的参数时为NULL，这时使用headers_in_hash
+    ngx_http_header_phash_elt_t *headers_in_phash;
+    ngx_uint_t                 headers_in_phash_mask;
+    ngx_uint_t                 headers_in_phash_shift;
+
     // 配置文件中的变量名的散列表。由这个结构体的variables_keys成员生成，
     // 这个成员中的元素与variables_keys中的元素一一对应。
     ngx_hash_t                 variables_hash;
@@ -277,11 +315,34 @@ typedef struct {
 } ngx_http_server_name_t;
 
 
+#if (NGX_PCRE)
+
+#define NGX_HTTP_SERVER_NAMES_REGEX_BLOCK  16
+
+// 连续的若干个server_name正则表达式，regex是它们合并后的正则表达式，
+// nstandalone是其中没有参与合并、总要单独执行的个数
+typedef struct {
+    ngx_regex_t               *regex;
+    ngx_http_server_name_t    *names;
+    ngx_uint_t                 nelts;
+    ngx_uint_t                 nstandalone;
+} ngx_http_server_names_regex_t;
+
+#endif
+
+
 typedef struct {
      ngx_hash_combined_t       names;
 
      ngx_uint_t                nregex;
      ngx_http_server_name_t   *regex;
+
+#if (NGX_PCRE)
+     // 全部正则表达式合并后的正则表达式，没有合并时为NULL
+     ngx_regex_t                    *regex_set;
+     // 以nelts为0的元素结尾
+     ngx_http_server_names_regex_t  *regex_blocks;
+#endif
 } ngx_http_virtual_names_t;
 
 
@@ -339,8 +400,10 @@ typedef struct {
     ngx_hash_wildcard_t       *wc_tail;
 
 #if (NGX_PCRE)
-    ngx_uint_t                 nregex;
-    ngx_http_server_name_t    *regex;
+    ngx_uint_t                      nregex;
+    ngx_http_server_name_t         *regex;
+    ngx_regex_t                    *regex_set;
+    ngx_http_server_names_regex_t  *regex_blocks;
 #endif
 
     /* the default server configuration for this address:port */
@@ -394,8 +457,15 @@ struct ngx_http_core_loc_conf_s {
 #endif
 
     ngx_http_location_tree_node_t   *static_locations;
+    // "location_trie on"时代替static_locations的压缩前缀树
+    ngx_http_location_trie_node_t   *static_trie;
 #if (NGX_PCRE)
     ngx_http_core_loc_conf_t       **regex_locations;
+
+    // 所有正则location合并后的正则表达式，只有一块或不能合并时为NULL
+    ngx_regex_t                     *regex_locations_set;
+    // 按声明顺序把regex_locations分成的块，以nelts为0的元素结尾
+    ngx_http_regex_locations_t      *regex_blocks;
 #endif
 
     // 当这个结构体对象对应一个"location{"时，这个成员指向父层配置对应的ngx_http_conf_ctx_t::loc_conf
@@ -462,6 +532,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_flag_t    reset_timedout_connection; /* reset_timedout_connection */
     ngx_flag_t    server_name_in_redirect; /* server_name_in_redirect */
     ngx_flag_t    port_in_redirect;        /* port_in_redirect */
+    ngx_flag_t    location_trie;           /* location_trie */
     ngx_flag_t    msie_padding;            /* msie_padding */
     ngx_flag_t    msie_refresh;            /* msie_refresh */
     ngx_flag_t    log_not_found;           /* log_not_found */
@@ -540,6 +611,26 @@ struct ngx_http_location_tree_node_s {
 };
 
 
+// 前缀location组成的压缩前缀树的节点，从根节点到这个节点的边上的字符串连起来是节点对应的前缀。
+// 每个节点的子节点连续存放在children数组中，keys是各个子节点边上字符串的首字符
+struct ngx_http_location_trie_node_s {
+    // 名字等于这个前缀的"location ="
+    ngx_http_core_loc_conf_t        *exact;
+    // 名字等于这个前缀的"location"或"location ^~"
+    ngx_http_core_loc_conf_t        *inclusive;
+    // 名字等于这个前缀加"/"并且需要自动重定向的location
+    ngx_http_core_loc_conf_t        *auto_redirect;
+
+    ngx_http_location_trie_node_t   *children;
+    u_char                          *keys;
+    ngx_uint_t                       nchildren;
+
+    // 从父节点到这个节点的边上的字符串
+    size_t                           len;
+    u_char                          *name;
+};
+
+
 void ngx_http_core_run_phases(ngx_http_request_t *r);
 ngx_int_t ngx_http_core_generic_phase(ngx_http_request_t *r,
     ngx_http_phase_handler_t *ph);
@@ -10,6 +10,31 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE42)
+#include <nmmintrin.h>
+#endif
+
+
+#if (NGX_HAVE_SSE42)
+
+#define ngx_http_parse_sse42  __attribute__((target("sse4.2")))
+
+static ngx_http_parse_sse42 u_char *ngx_http_parse_sse42_find(u_char *p,
+    u_char *last, const u_char *set, int n);
+static ngx_http_parse_sse42 u_char *ngx_http_parse_sse42_span(u_char *p,
+    u_char *last, const u_char *ranges, int n);
+
+/*
+ * the characters that are not "usual" in URI, '\\' is included even
+ * if it is usual, the fast path may stop earlier than the state machine
+ */
+static const u_char  ngx_http_parse_uri_set[16] = "\0 \r\n#%+./?\\";
+static const u_char  ngx_http_parse_args_set[16] = "\0 \r\n#";
+static const u_char  ngx_http_parse_value_set[16] = "\0\r\n";
+static const u_char  ngx_http_parse_name_ranges[16] = "--09AZaz";
+
+#endif
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -99,12 +124,75 @@ static uint32_t  usual[] = {
 #endif
 
 
+#if (NGX_HAVE_SSE42)
+
+// 以16字节为单位查找[p, last)中第一个属于set的字符，set中可以包含'\0'，n是set的长度。
+// 返回值之前的字符都不属于set，不足16字节的尾部不检查，由调用者交给状态机处理
+static ngx_http_parse_sse42 u_char *
+ngx_http_parse_sse42_find(u_char *p, u_char *last, const u_char *set, int n)
+{
+    int      i;
+    __m128i  needle, v;
+
+    needle = _mm_loadu_si128((const __m128i *) set);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        i = _mm_cmpestri(needle, n, v, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY
+                         |_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+// 以16字节为单位查找[p, last)中第一个不在ranges所给出的字符区间内的字符，
+// ranges由成对的区间上下界组成，n是ranges的长度
+static ngx_http_parse_sse42 u_char *
+ngx_http_parse_sse42_span(u_char *p, u_char *last, const u_char *ranges, int n)
+{
+    int      i;
+    __m128i  needle, v;
+
+    needle = _mm_loadu_si128((const __m128i *) ranges);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        i = _mm_cmpestri(needle, n, v, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_RANGES
+                         |_SIDD_NEGATIVE_POLARITY|_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+#endif
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 // 解析客户端请求的起始行。
 ngx_int_t
 ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
 {
     u_char  c, ch, *p, *m;
+#if (NGX_HAVE_SSE42)
+    u_char  *q;
+#endif
     enum {
         sw_start = 0,
         sw_method,
@@ -542,6 +630,15 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+
+#if (NGX_HAVE_SSE42)
+                if (ngx_cpu_sse42 && b->last - p > 16) {
+                    q = ngx_http_parse_sse42_find(p + 1, b->last,
+                                                  ngx_http_parse_uri_set, 11);
+                    p = q - 1;
+                }
+#endif
+
                 break;
             }
 
@@ -628,6 +725,15 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+
+#if (NGX_HAVE_SSE42)
+                if (ngx_cpu_sse42 && b->last - p > 16) {
+                    q = ngx_http_parse_sse42_find(p + 1, b->last,
+                                                  ngx_http_parse_args_set, 5);
+                    p = q - 1;
+                }
+#endif
+
                 break;
             }
 
@@ -830,6 +936,9 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 {
     u_char      c, ch, *p;
     ngx_uint_t  hash, i;
+#if (NGX_HAVE_SSE42)
+    u_char     *q;
+#endif
     enum {
         sw_start = 0,
         sw_name,
@@ -919,6 +1028,27 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 hash = ngx_hash(hash, c);
                 r->lowcase_header[i++] = c;
                 i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+
+#if (NGX_HAVE_SSE42)
+                if (ngx_cpu_sse42 && b->last - p > 16) {
+
+                    /* the token characters have no effect on the state */
+
+                    q = ngx_http_parse_sse42_span(p + 1, b->last,
+                                                  ngx_http_parse_name_ranges,
+                                                  8);
+
+                    while (++p < q) {
+                        c = lowcase[*p];
+                        hash = ngx_hash(hash, c);
+                        r->lowcase_header[i++] = c;
+                        i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+                    }
+
+                    p--;
+                }
+#endif
+
                 break;
             }
 
@@ -999,6 +1129,33 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 
         /* header value */
         case sw_value:
+
+#if (NGX_HAVE_SSE42)
+            if (ngx_cpu_sse42 && b->last - p >= 16) {
+                q = ngx_http_parse_sse42_find(p, b->last,
+                                              ngx_http_parse_value_set, 3);
+
+                if (q != p) {
+
+                    /*
+                     * only the spaces change the state in [p, q),
+                     * the character before p is not a space
+                     */
+
+                    p = q - 1;
+
+                    if (*p == ' ') {
+                        for (q = p; *(q - 1) == ' '; q--) { /* void */ }
+
+                        r->header_end = q;
+                        state = sw_space_after_value;
+                    }
+
+                    break;
+                }
+            }
+#endif
+
             switch (ch) {
             case ' ':
                 r->header_end = p;
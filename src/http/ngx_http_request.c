@@ -15,6 +15,8 @@
 static void ngx_http_wait_request_handler(ngx_event_t *ev);
 static void ngx_http_process_request_line(ngx_event_t *rev);
 static void ngx_http_process_request_headers(ngx_event_t *rev);
+static ngx_inline ngx_http_header_t *ngx_http_find_header_in(
+    ngx_http_core_main_conf_t *cmcf, ngx_table_elt_t *h);
 static ssize_t ngx_http_read_request_header(ngx_http_request_t *r);
 static ngx_int_t ngx_http_alloc_large_header_buffer(ngx_http_request_t *r,
     ngx_uint_t request_line);
@@ -1327,8 +1329,7 @@ ngx_http_process_request_headers(ngx_event_t *rev)
                 ngx_strlow(h->lowcase_key, h->key.data, h->key.len);
             }
 
-            hh = ngx_hash_find(&cmcf->headers_in_hash, h->hash,
-                               h->lowcase_key, h->key.len);
+            hh = ngx_http_find_header_in(cmcf, h);
 
             if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
                 return;
@@ -1384,6 +1385,33 @@ ngx_http_process_request_headers(ngx_event_t *rev)
 }
 
 
+// 在cmcf->headers_in_phash中查找头部h对应的ngx_http_headers_in元素，
+// h->hash是解析头部时算好的小写头部名的散列值，每个头部最多只比较一次
+static ngx_inline ngx_http_header_t *
+ngx_http_find_header_in(ngx_http_core_main_conf_t *cmcf, ngx_table_elt_t *h)
+{
+    ngx_http_header_phash_elt_t  *elt;
+
+    if (cmcf->headers_in_phash == NULL) {
+        return ngx_hash_find(&cmcf->headers_in_hash, h->hash,
+                             h->lowcase_key, h->key.len);
+    }
+
+    elt = &cmcf->headers_in_phash[(h->hash >> cmcf->headers_in_phash_shift)
+                                  & cmcf->headers_in_phash_mask];
+
+    if (elt->key != h->hash
+        || elt->name.len != h->key.len
+        || elt->header == NULL
+        || ngx_memcmp(elt->name.data, h->lowcase_key, h->key.len) != 0)
+    {
+        return NULL;
+    }
+
+    return elt->header;
+}
+
+
 // 接收客户端发给nginx的首行和头部,存放到r->header_in中
 static ssize_t
 ngx_http_read_request_header(ngx_http_request_t *r)
@@ -2144,60 +2172,125 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 #if (NGX_PCRE)
 
     if (host->len && virtual_names->nregex) {
-        ngx_int_t                n;
-        ngx_uint_t               i;
-        ngx_http_server_name_t  *sn;
+        ngx_int_t                       n;
+        ngx_uint_t                      i, missed, skip;
+        ngx_http_server_name_t         *sn;
+        ngx_http_server_names_regex_t  *block;
 
-        sn = virtual_names->regex;
+        /*
+         * after a combined regex did not match only the standalone
+         * regexes left out of it are still to be tested
+         */
 
-#if (NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
+        missed = 0;
 
-        if (r == NULL) {
-            ngx_http_connection_t  *hc;
+        if (virtual_names->regex_set) {
+            n = ngx_regex_exec(virtual_names->regex_set, host, NULL, 0);
 
-            for (i = 0; i < virtual_names->nregex; i++) {
+            if (n == NGX_REGEX_NO_MATCHED) {
+                missed = 1;
 
-                n = ngx_regex_exec(sn[i].regex->regex, host, NULL, 0);
+            } else if (ngx_regex_exec_limited(n)) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                              ngx_regex_exec_n " failed: %i on \"%V\" "
+                              "using combined regex, testing regexes "
+                              "one by one", n, host);
+
+            } else if (n < 0) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              ngx_regex_exec_n " failed: %i on \"%V\" "
+                              "using combined regex", n, host);
+                return NGX_ERROR;
+            }
+        }
+
+        for (block = virtual_names->regex_blocks; block->nelts; block++) {
+
+            skip = missed;
+
+            if (!skip && block->regex) {
+                n = ngx_regex_exec(block->regex, host, NULL, 0);
 
                 if (n == NGX_REGEX_NO_MATCHED) {
-                    continue;
+                    skip = 1;
+
+                } else if (ngx_regex_exec_limited(n)) {
+                    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                                  ngx_regex_exec_n " failed: %i on \"%V\" "
+                                  "using combined regex, testing regexes "
+                                  "one by one", n, host);
+
+                } else if (n < 0) {
+                    ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                                  ngx_regex_exec_n " failed: %i on \"%V\" "
+                                  "using combined regex", n, host);
+                    return NGX_ERROR;
                 }
+            }
 
-                if (n >= 0) {
-                    hc = c->data;
-                    hc->ssl_servername_regex = sn[i].regex;
+            if (skip && block->nstandalone == 0) {
+                continue;
+            }
 
-                    *cscfp = sn[i].server;
-                    return NGX_OK;
-                }
+            sn = block->names;
 
-                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                              ngx_regex_exec_n " failed: %i "
-                              "on \"%V\" using \"%V\"",
-                              n, host, &sn[i].regex->name);
+#if (NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
 
-                return NGX_ERROR;
-            }
+            if (r == NULL) {
+                ngx_http_connection_t  *hc;
 
-            return NGX_DECLINED;
-        }
+                for (i = 0; i < block->nelts; i++) {
 
-#endif /* NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME */
+                    if (skip && !sn[i].regex->standalone) {
+                        continue;
+                    }
+
+                    n = ngx_regex_exec(sn[i].regex->regex, host, NULL, 0);
+
+                    if (n == NGX_REGEX_NO_MATCHED) {
+                        continue;
+                    }
+
+                    if (n >= 0) {
+                        hc = c->data;
+                        hc->ssl_servername_regex = sn[i].regex;
 
-        for (i = 0; i < virtual_names->nregex; i++) {
+                        *cscfp = sn[i].server;
+                        return NGX_OK;
+                    }
+
+                    ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                                  ngx_regex_exec_n " failed: %i "
+                                  "on \"%V\" using \"%V\"",
+                                  n, host, &sn[i].regex->name);
 
-            n = ngx_http_regex_exec(r, sn[i].regex, host);
+                    return NGX_ERROR;
+                }
 
-            if (n == NGX_DECLINED) {
                 continue;
             }
 
-            if (n == NGX_OK) {
-                *cscfp = sn[i].server;
-                return NGX_OK;
-            }
+#endif /* NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME */
 
-            return NGX_ERROR;
+            for (i = 0; i < block->nelts; i++) {
+
+                if (skip && !sn[i].regex->standalone) {
+                    continue;
+                }
+
+                n = ngx_http_regex_exec(r, sn[i].regex, host);
+
+                if (n == NGX_DECLINED) {
+                    continue;
+                }
+
+                if (n == NGX_OK) {
+                    *cscfp = sn[i].server;
+                    return NGX_OK;
+                }
+
+                return NGX_ERROR;
+            }
         }
     }
 
@@ -2572,6 +2665,12 @@ ngx_http_finalize_connection(ngx_http_request_t *r)
         return;
     }
 
+    // 不缓存包体时请求可能在包体读完前就结束了，剩下的包体只能丢弃后关闭连接
+    if (r->reading_body) {
+        r->keepalive = 0;
+        r->lingering_close = 1;
+    }
+
     if (!ngx_terminate
          && !ngx_exiting
          && r->keepalive
@@ -3529,6 +3628,14 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
 
     r->connection->destroyed = 1;
 
+#if (NGX_POOL_PROFILE)
+
+    // 请求内存池的统计记在请求最后所在的location上
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_pool_profile_account(r->pool, clcf, &clcf->name);
+
+#endif
+
     /*
      * Setting r->pool to NULL will increase probability to catch double close
      * of request since the request object is allocated from its own pool.
@@ -505,6 +505,8 @@ struct ngx_http_request_s {
     unsigned                          request_body_in_clean_file:1;
     unsigned                          request_body_file_group_access:1;
     unsigned                          request_body_file_log_level:3;
+    // 包体不缓存到内存或临时文件，边接收边发给上游服务器
+    unsigned                          request_body_no_buffering:1;
 
     unsigned                          subrequest_in_memory:1;
     unsigned                          waited:1;
@@ -530,6 +532,7 @@ struct ngx_http_request_s {
      */
     unsigned                          limit_conn_set:1;
     unsigned                          limit_req_set:1;
+    unsigned                          limit_rate_set:1;
 
 #if 0
     unsigned                          cacheable:1;
@@ -541,6 +544,8 @@ struct ngx_http_request_s {
     unsigned                          keepalive:1;
     unsigned                          lingering_close:1;
     unsigned                          discard_body:1;
+    // 不缓存包体时，包体还没有接收完
+    unsigned                          reading_body:1;
     unsigned                          internal:1;
     unsigned                          error_page:1;
     unsigned                          ignore_content_encoding:1;
@@ -559,6 +564,8 @@ struct ngx_http_request_s {
     unsigned                          main_filter_need_in_memory:1;
     unsigned                          filter_need_in_memory:1;
     unsigned                          filter_need_temporary:1;
+    // 过滤模块要处理响应体，upstream不能用splice()绕过过滤模块转发
+    unsigned                          filter_need_body:1;
     unsigned                          allow_ranges:1;
     unsigned                          single_range:1;
 
@@ -620,6 +627,8 @@ extern ngx_http_header_out_t   ngx_http_headers_out[];
                                                                               \
     c->log->file = l->file;                                                   \
     c->log->next = l->next;                                                   \
+    c->log->writer = l->writer;                                               \
+    c->log->wdata = l->wdata;                                                 \
     if (!(c->log->log_level & NGX_LOG_DEBUG_CONNECTION)) {                    \
         c->log->log_level = l->log_level;                                     \
     }
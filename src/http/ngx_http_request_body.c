@@ -32,6 +32,8 @@ static ngx_int_t ngx_http_request_body_save_filter(ngx_http_request_t *r,
 // webdav的PUT等方法会调用这个函数接收客户端包体，
 // 做反向代理时用这个函数接收客户端包体传递给上游服务器。
 // post_handler[in]: 没有包体直接返回前或接收包体完成时调用的回调函数
+// 设置了r->request_body_no_buffering时，第一次读完可读的数据后就调用post_handler，
+// 余下的包体由调用者通过ngx_http_read_unbuffered_request_body()继续读取
 ngx_int_t
 ngx_http_read_client_request_body(ngx_http_request_t *r,
     ngx_http_client_body_handler_pt post_handler)
@@ -48,12 +50,14 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
 
 #if (NGX_HTTP_SPDY)
     if (r->spdy_stream && r == r->main) {
+        r->request_body_no_buffering = 0;
         rc = ngx_http_spdy_read_request_body(r, post_handler);
         goto done;
     }
 #endif
 
     if (r != r->main || r->request_body || r->discard_body) {
+        r->request_body_no_buffering = 0;
         post_handler(r);
         return NGX_OK;
     }
@@ -87,6 +91,7 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
     r->request_body = rb;
 
     if (r->headers_in.content_length_n < 0 && !r->headers_in.chunked) {
+        r->request_body_no_buffering = 0;
         post_handler(r);
         return NGX_OK;
     }
@@ -179,6 +184,8 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
             }
         }
 
+        r->request_body_no_buffering = 0;
+
         post_handler(r);
 
         return NGX_OK;
@@ -222,6 +229,23 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
 
 done:
 
+    if (r->request_body_no_buffering
+        && (rc == NGX_OK || rc == NGX_AGAIN))
+    {
+        // 第一次能读到的包体已经读完，不等余下的包体就开始处理请求，
+        // 包体一次就读完时和缓存包体的情况一样处理
+        if (rc == NGX_OK) {
+            r->request_body_no_buffering = 0;
+
+        } else {
+            /* rc == NGX_AGAIN */
+            r->reading_body = 1;
+        }
+
+        r->read_event_handler = ngx_http_block_reading;
+        post_handler(r);
+    }
+
     if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
         r->main->count--;
     }
@@ -230,6 +254,28 @@ done:
 }
 
 
+// 不缓存包体时读取余下的包体，读到的数据放在r->request_body->bufs中，
+// 由调用者取走，返回NGX_OK表示包体已经读完
+ngx_int_t
+ngx_http_read_unbuffered_request_body(ngx_http_request_t *r)
+{
+    ngx_int_t  rc;
+
+    if (r->connection->read->timedout) {
+        r->connection->timedout = 1;
+        return NGX_HTTP_REQUEST_TIME_OUT;
+    }
+
+    rc = ngx_http_do_read_client_request_body(r);
+
+    if (rc == NGX_OK) {
+        r->reading_body = 0;
+    }
+
+    return rc;
+}
+
+
 static void
 ngx_http_read_client_request_body_handler(ngx_http_request_t *r)
 {
@@ -273,21 +319,27 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         for ( ;; ) {
             if (rb->buf->last == rb->buf->end) {
 
-                /* pass buffer to request body filter chain */
+                if (rb->buf->pos != rb->buf->last) {
 
-                out.buf = rb->buf;
-                out.next = NULL;
+                    /* pass buffer to request body filter chain */
 
-                rc = ngx_http_request_body_filter(r, &out);
+                    out.buf = rb->buf;
+                    out.next = NULL;
 
-                if (rc != NGX_OK) {
-                    return rc;
+                    rc = ngx_http_request_body_filter(r, &out);
+
+                    if (rc != NGX_OK) {
+                        return rc;
+                    }
                 }
 
-                /* write to file */
+                if (!r->request_body_no_buffering) {
 
-                if (ngx_http_write_request_body(r) != NGX_OK) {
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    /* write to file */
+
+                    if (ngx_http_write_request_body(r) != NGX_OK) {
+                        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    }
                 }
 
                 /* update chains */
@@ -299,6 +351,21 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
                 }
 
                 if (rb->busy != NULL) {
+
+                    if (r->request_body_no_buffering) {
+                        // 缓冲区中的数据还没有全部发给上游服务器，
+                        // 暂停读客户端，等发送完后再由调用者继续读
+                        if (c->read->timer_set) {
+                            ngx_del_timer(c->read);
+                        }
+
+                        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                        }
+
+                        return NGX_AGAIN;
+                    }
+
                     return NGX_HTTP_INTERNAL_SERVER_ERROR;
                 }
 
@@ -365,6 +432,22 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         }
 
         if (!c->read->ready) {
+
+            if (r->request_body_no_buffering
+                && rb->buf->pos != rb->buf->last)
+            {
+                /* pass buffer to request body filter chain */
+
+                out.buf = rb->buf;
+                out.next = NULL;
+
+                rc = ngx_http_request_body_filter(r, &out);
+
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
             clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
             ngx_add_timer(c->read, clcf->client_body_timeout);
 
@@ -380,6 +463,10 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         ngx_del_timer(c->read);
     }
 
+    if (r->request_body_no_buffering) {
+        return NGX_OK;
+    }
+
     if (rb->temp_file || r->request_body_in_file_only) {
 
         /* save the last part */
@@ -1069,9 +1156,8 @@ ngx_http_request_body_chunked_filter(ngx_http_request_t *r, ngx_chain_t *in)
 static ngx_int_t
 ngx_http_request_body_save_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-#if (NGX_DEBUG)
-    ngx_chain_t               *cl;
-#endif
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl, *last;
     ngx_http_request_body_t   *rb;
 
     rb = r->request_body;
@@ -1102,10 +1188,51 @@ ngx_http_request_body_save_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
 #endif
 
-    /* TODO: coalesce neighbouring buffers */
+    // 同一块接收缓冲区里紧挨着的数据片段（一个大chunk或者定长body
+    // 分多次recv读入时产生）直接并入rb->bufs最后一个buf，不再多挂一个链节，
+    // 写临时文件或发往上游时也就少一个iovec；被并掉的buf标记为已消费，
+    // 调用方的ngx_chain_update_chains()会马上把它放回rb->free
 
-    if (ngx_chain_add_copy(r->pool, &rb->bufs, in) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    for (last = rb->bufs; last && last->next; last = last->next) {
+        /* void */
+    }
+
+    for ( /* void */ ; in; in = in->next) {
+
+        b = in->buf;
+
+        if (last
+            && last->buf->temporary
+            && !last->buf->last_buf
+            && b->temporary
+            && b->pos != b->last
+            && b->pos == last->buf->last
+            && b->end == last->buf->end)
+        {
+            last->buf->last = b->last;
+            last->buf->last_buf = b->last_buf;
+
+            b->pos = b->last;
+
+            continue;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        if (last) {
+            last->next = cl;
+
+        } else {
+            rb->bufs = cl;
+        }
+
+        last = cl;
     }
 
     return NGX_OK;
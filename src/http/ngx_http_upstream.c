@@ -12,6 +12,28 @@
 #include <ngx_http.h>
 
 
+// 至少统计了这么多个响应后才按大小的分布分配缓冲区
+#define NGX_HTTP_UPSTREAM_SIZES_MIN     16
+#define NGX_HTTP_UPSTREAM_SIZES_WINDOW  1024
+
+// 缓存ngx_pagesize到(ngx_pagesize << 8)大小的缓冲区，每个worker最多缓存4M
+#define NGX_HTTP_UPSTREAM_BUF_CLASSES   9
+#define NGX_HTTP_UPSTREAM_BUF_CACHE     (4 * 1024 * 1024)
+
+
+typedef struct ngx_http_upstream_free_buf_s  ngx_http_upstream_free_buf_t;
+
+struct ngx_http_upstream_free_buf_s {
+    ngx_http_upstream_free_buf_t    *next;
+};
+
+
+typedef struct {
+    ngx_http_upstream_free_buf_t    *buf;
+    ngx_uint_t                       cls;
+} ngx_http_upstream_buf_clean_t;
+
+
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_upstream_cache(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
@@ -31,12 +53,20 @@ static void ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ngx_event_t *ev);
 static void ngx_http_upstream_connect(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_enqueue(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_dequeue(ngx_http_upstream_t *u);
+static void ngx_http_upstream_queue_wake(ngx_http_upstream_queue_t *q);
+static void ngx_http_upstream_queue_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_upstream_reinit(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_request(ngx_http_request_t *r,
-    ngx_http_upstream_t *u);
+    ngx_http_upstream_t *u, ngx_uint_t do_write);
+static ngx_int_t ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write);
 static void ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_read_request_handler(ngx_http_request_t *r);
 static void ngx_http_upstream_process_header(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_test_next(ngx_http_request_t *r,
@@ -58,6 +88,19 @@ static void ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_adaptive_buffers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_buf_t *ngx_http_upstream_alloc_buf(ngx_event_pipe_t *p);
+static u_char *ngx_http_upstream_buf_alloc(ngx_pool_t *pool, size_t *size);
+static void ngx_http_upstream_buf_free(void *data);
+static void ngx_http_upstream_record_size(ngx_http_upstream_sizes_t *sizes,
+    off_t size);
+#if (NGX_HAVE_SPLICE)
+static void ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_splice_non_buffered(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#endif
 static void ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
 static void
@@ -143,10 +186,21 @@ static ngx_int_t ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_length_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_temp_memory(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_init_process(ngx_cycle_t *cycle);
+#if (NGX_HAVE_MEMFD)
+static ngx_int_t ngx_http_upstream_init_temp_memory_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+#endif
 
 static ngx_addr_t *ngx_http_upstream_get_local(ngx_http_request_t *r,
     ngx_http_upstream_local_t *local);
@@ -158,6 +212,12 @@ static char *ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf);
 static void ngx_http_upstream_ssl_init_connection(ngx_http_request_t *,
     ngx_http_upstream_t *u, ngx_connection_t *c);
 static void ngx_http_upstream_ssl_handshake(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_ssl_session_key(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *key);
+static ngx_int_t ngx_http_upstream_ssl_set_session(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c);
+static void ngx_http_upstream_ssl_save_session(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c);
 #endif
 
 
@@ -303,6 +363,26 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    // queue number [timeout=time];
+    // 所有server都不可用(如都达到max_conns)时请求最多排队number个，
+    // 有连接释放时按先进先出的顺序继续处理，等待超过timeout返回502
+    { ngx_string("queue"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_queue,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    // upstream_temp_memory size;
+    // 不缓存的响应超出缓冲区时先写入内存中的临时文件，
+    // 所有worker进程共用size字节，用完后写入磁盘
+    { ngx_string("upstream_temp_memory"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_temp_memory,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -329,7 +409,7 @@ ngx_module_t  ngx_http_upstream_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -338,6 +418,11 @@ ngx_module_t  ngx_http_upstream_module = {
 };
 
 
+static ngx_http_upstream_free_buf_t
+    *ngx_http_upstream_free_bufs[NGX_HTTP_UPSTREAM_BUF_CLASSES];
+static size_t  ngx_http_upstream_free_bufs_size;
+
+
 static ngx_http_variable_t  ngx_http_upstream_vars[] = {
 
     { ngx_string("upstream_addr"), NULL,
@@ -356,6 +441,10 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_response_length_variable, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_queue_time"), NULL,
+      ngx_http_upstream_queue_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #if (NGX_HTTP_CACHE)
 
     { ngx_string("upstream_cache_status"), NULL,
@@ -545,8 +634,12 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     u->output.pool = r->pool;
     u->output.bufs.num = 1;
     u->output.bufs.size = clcf->client_body_buffer_size;
-    u->output.output_filter = ngx_chain_writer;
-    u->output.filter_ctx = &u->writer;
+
+    // create_request()可能已经设置了给包体加上分块或记录格式的过滤函数
+    if (u->output.output_filter == NULL) {
+        u->output.output_filter = ngx_chain_writer;
+        u->output.filter_ctx = &u->writer;
+    }
 
     u->writer.pool = r->pool;
 
@@ -673,6 +766,8 @@ found:
         return;
     }
 
+    u->upstream = uscf;
+
     if (uscf->peer.init(r, uscf) != NGX_OK) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -1216,11 +1311,26 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->response_sec = tp->sec;
     u->state->response_msec = tp->msec;
 
-    rc = ngx_event_connect_peer(&u->peer);
+    if (u->upstream && u->upstream->queue
+        && !ngx_queue_empty(&u->upstream->queue->waiting)
+        && (u->waiter == NULL || !u->waiter->queued))
+    {
+        /* do not overtake the requests already waiting in the queue */
+
+        u->peer.name = &u->upstream->host;
+        rc = NGX_BUSY;
+
+    } else {
+        rc = ngx_event_connect_peer(&u->peer);
+    }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http upstream connect: %i", rc);
 
+    if (rc != NGX_BUSY && u->waiter && u->waiter->queued) {
+        ngx_http_upstream_dequeue(u);
+    }
+
     if (rc == NGX_ERROR) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -1230,6 +1340,22 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->peer = u->peer.name;
 
     if (rc == NGX_BUSY) {
+
+        if (u->upstream && u->upstream->queue) {
+
+            rc = ngx_http_upstream_enqueue(r, u);
+
+            if (rc == NGX_OK) {
+                return;
+            }
+
+            if (rc == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+        }
+
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
@@ -1329,7 +1455,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #endif
 
-    ngx_http_upstream_send_request(r, u);
+    ngx_http_upstream_send_request(r, u, 1);
 }
 
 
@@ -1359,7 +1485,15 @@ ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
     u->output.sendfile = 0;
 
     if (u->conf->ssl_session_reuse) {
-        if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
+
+        if (u->conf->ssl_session_cache) {
+            rc = ngx_http_upstream_ssl_set_session(r, u, c);
+
+        } else {
+            rc = u->peer.set_session(&u->peer, u->peer.data);
+        }
+
+        if (rc != NGX_OK) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_INTERNAL_SERVER_ERROR);
             return;
@@ -1390,8 +1524,20 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 
     if (c->ssl->handshaked) {
 
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(SSL_session_reused(c->ssl->connection)
+                                    ? ngx_stat_upstream_ssl_resumed
+                                    : ngx_stat_upstream_ssl_full, 1);
+#endif
+
         if (u->conf->ssl_session_reuse) {
-            u->peer.save_session(&u->peer, u->peer.data);
+
+            if (u->conf->ssl_session_cache) {
+                ngx_http_upstream_ssl_save_session(r, u, c);
+
+            } else {
+                u->peer.save_session(&u->peer, u->peer.data);
+            }
         }
 
         c->write->handler = ngx_http_upstream_handler;
@@ -1399,7 +1545,7 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 
         c = r->connection;
 
-        ngx_http_upstream_send_request(r, u);
+        ngx_http_upstream_send_request(r, u, 1);
 
         ngx_http_run_posted_requests(c);
         return;
@@ -1412,8 +1558,249 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
     ngx_http_run_posted_requests(c);
 }
 
+
+// 共享会话缓存的key是server的名字加上它的地址
+static ngx_int_t
+ngx_http_upstream_ssl_session_key(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *key)
+{
+    u_char  *p;
+
+    key->len = u->peer.name->len + u->peer.socklen;
+
+    key->data = ngx_pnalloc(r->pool, key->len);
+    if (key->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key->data, u->peer.name->data, u->peer.name->len);
+    ngx_memcpy(p, u->peer.sockaddr, u->peer.socklen);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_ssl_set_session(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c)
+{
+    ngx_int_t           rc;
+    ngx_str_t           key;
+    ngx_ssl_session_t  *ssl_session;
+
+    if (ngx_http_upstream_ssl_session_key(r, u, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ssl_session = ngx_ssl_get_client_session(u->conf->ssl_session_cache,
+                                             &key);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream set shared session: %p", ssl_session);
+
+    if (ssl_session == NULL) {
+        return NGX_OK;
+    }
+
+    rc = ngx_ssl_set_session(c, ssl_session);
+
+    ngx_ssl_free_session(ssl_session);
+
+    return rc;
+}
+
+
+// 只在完整握手后保存会话，复用的会话已经在缓存中了
+static void
+ngx_http_upstream_ssl_save_session(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c)
+{
+    ngx_str_t  key;
+
+    if (SSL_session_reused(c->ssl->connection)) {
+        return;
+    }
+
+    if (ngx_http_upstream_ssl_session_key(r, u, &key) != NGX_OK) {
+        return;
+    }
+
+    ngx_ssl_save_client_session(u->conf->ssl_session_cache, &key, c);
+}
+
+#endif
+
+
+// 选不出可用的server时把请求加入upstream的等待队列，
+// 返回NGX_DECLINED表示队列已满
+static ngx_int_t
+ngx_http_upstream_enqueue(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_uint_t                   kick;
+    ngx_http_upstream_queue_t   *q;
+    ngx_http_upstream_waiter_t  *w;
+
+    q = u->upstream->queue;
+    w = u->waiter;
+    kick = 0;
+
+    if (w == NULL || !w->queued) {
+
+        if (q->length >= q->max) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream \"%V\" queue is full", &u->upstream->host);
+            return NGX_DECLINED;
+        }
+
+        if (w == NULL) {
+            w = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_waiter_t));
+            if (w == NULL) {
+                return NGX_ERROR;
+            }
+
+            w->event.handler = ngx_http_upstream_queue_handler;
+            w->event.data = r;
+            w->event.log = r->connection->log;
+            w->request = r;
+
+            u->waiter = w;
+        }
+
+        w->start = ngx_current_msec;
+        w->queued = 1;
+
+        kick = !ngx_queue_empty(&q->waiting);
+
+        ngx_queue_insert_tail(&q->waiting, &w->queue);
+        q->length++;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_queued, 1);
+#endif
+
+        ngx_add_timer(&w->event, q->timeout);
+    }
+
+    /* the request will be connected again, forget this attempt */
+
+    r->upstream_states->nelts--;
+    u->state = NULL;
+
+    w->woken = 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream queued: %ui", q->length);
+
+    /*
+     * a new request behind others lets the head of the queue retry,
+     * so the queue drains once the failed peers are marked live again
+     */
+
+    if (kick) {
+        ngx_http_upstream_queue_wake(q);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_dequeue(ngx_http_upstream_t *u)
+{
+    ngx_event_t                 *ev;
+    ngx_http_upstream_queue_t   *q;
+    ngx_http_upstream_waiter_t  *w;
+
+    q = u->upstream->queue;
+    w = u->waiter;
+
+    ngx_queue_remove(&w->queue);
+    q->length--;
+
+    w->queued = 0;
+    w->woken = 0;
+
+    ev = &w->event;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+
+    u->queue_time += ngx_current_msec - w->start;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_queued, -1);
 #endif
 
+    /* let the next request try the peers */
+
+    ngx_http_upstream_queue_wake(q);
+}
+
+
+// 唤醒队首的请求重新选择server，同一时刻只有队首的请求在尝试，保证先进先出
+static void
+ngx_http_upstream_queue_wake(ngx_http_upstream_queue_t *q)
+{
+    ngx_event_t                 *ev;
+    ngx_http_upstream_waiter_t  *w;
+
+    if (ngx_queue_empty(&q->waiting)) {
+        return;
+    }
+
+    w = ngx_queue_data(ngx_queue_head(&q->waiting),
+                       ngx_http_upstream_waiter_t, queue);
+
+    if (w->woken) {
+        return;
+    }
+
+    w->woken = 1;
+
+    ev = &w->event;
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_upstream_queue_handler(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_log_ctx_t   *ctx;
+    ngx_http_upstream_t  *u;
+
+    r = ev->data;
+    u = r->upstream;
+    c = r->connection;
+
+    ctx = c->log->data;
+    ctx->current_request = r;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream queue: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream \"%V\" queue timed out", &u->upstream->host);
+
+        ngx_http_upstream_dequeue(u);
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+
+    } else {
+        ngx_http_upstream_connect(r, u);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
 
 static ngx_int_t
 ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
@@ -1426,6 +1813,7 @@ ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->keepalive = 0;
     u->upgrade = 0;
+    u->request_body_sent = 0;
 
     ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
     u->headers_in.content_length_n = -1;
@@ -1484,7 +1872,8 @@ ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 
 static void
-ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t do_write)
 {
     ngx_int_t          rc;
     ngx_connection_t  *c;
@@ -1501,21 +1890,26 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     c->log->action = "sending request to upstream";
 
-    rc = ngx_output_chain(&u->output, u->request_sent ? NULL : u->request_bufs);
-
-    u->request_sent = 1;
+    rc = ngx_http_upstream_send_request_body(r, u, do_write);
 
     if (rc == NGX_ERROR) {
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
         return;
     }
 
-    if (c->write->timer_set) {
-        ngx_del_timer(c->write);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
     }
 
     if (rc == NGX_AGAIN) {
-        ngx_add_timer(c->write, u->conf->send_timeout);
+        // 写不出去时等待上游连接可写，只是在等客户端的包体时不计发送超时
+        if (!c->write->ready) {
+            ngx_add_timer(c->write, u->conf->send_timeout);
+
+        } else if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
 
         if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
             ngx_http_upstream_finalize_request(r, u,
@@ -1528,6 +1922,10 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     /* rc == NGX_OK */
 
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
     if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
         if (ngx_tcp_push(c->fd) == NGX_ERROR) {
             ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
@@ -1540,13 +1938,6 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
     }
 
-    ngx_add_timer(c->read, u->conf->read_timeout);
-
-    if (c->read->ready) {
-        ngx_http_upstream_process_header(r, u);
-        return;
-    }
-
     u->write_event_handler = ngx_http_upstream_dummy_handler;
 
     if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
@@ -1554,47 +1945,210 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
-}
-
-
-static void
-ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    ngx_connection_t  *c;
-
-    c = u->peer.connection;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream send request handler");
-
-    if (c->write->timedout) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+    if (u->request_body_sent) {
         return;
     }
 
-#if (NGX_HTTP_SSL)
+    u->request_body_sent = 1;
 
-    if (u->ssl && c->ssl == NULL) {
-        ngx_http_upstream_ssl_init_connection(r, u, c);
+    // 不缓存包体时上游服务器可能在包体发完之前就返回了响应头
+    if (u->header_sent) {
         return;
     }
 
-#endif
-
-    if (u->header_sent) {
-        u->write_event_handler = ngx_http_upstream_dummy_handler;
-
-        (void) ngx_handle_write_event(c->write, 0);
+    ngx_add_timer(c->read, u->conf->read_timeout);
 
+    if (c->read->ready) {
+        ngx_http_upstream_process_header(r, u);
         return;
     }
-
-    ngx_http_upstream_send_request(r, u);
 }
 
 
-static void
+// 发送请求，不缓存包体时还要边读客户端的包体边发送，
+// do_write为0时是客户端连接上有了新的包体数据，先读再发
+static ngx_int_t
+ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write)
+{
+    int                        tcp_nodelay;
+    ngx_int_t                  rc;
+    ngx_chain_t               *out, *cl, *ln;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request body");
+
+    if (!r->request_body_no_buffering) {
+
+        /* buffered request body */
+
+        if (!u->request_sent) {
+            u->request_sent = 1;
+            out = u->request_bufs;
+
+        } else {
+            out = NULL;
+        }
+
+        return ngx_output_chain(&u->output, out);
+    }
+
+    if (!u->request_sent) {
+        u->request_sent = 1;
+        out = u->request_bufs;
+
+        // 接在请求头后面发出已经读到的包体
+        if (r->request_body->bufs) {
+            for (cl = out; cl->next; cl = cl->next) { /* void */ }
+            cl->next = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
+
+        // 包体是一块块发出的，不能让小块的数据等待确认
+        c = u->peer.connection;
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            tcp_nodelay = 1;
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                return NGX_ERROR;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        r->read_event_handler = ngx_http_upstream_read_request_handler;
+
+    } else {
+        out = NULL;
+    }
+
+    for ( ;; ) {
+
+        if (do_write) {
+            rc = ngx_output_chain(&u->output, out);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            while (out) {
+                ln = out;
+                out = out->next;
+                ngx_free_chain(r->pool, ln);
+            }
+
+            if (rc == NGX_OK && !r->reading_body) {
+                break;
+            }
+        }
+
+        if (r->reading_body) {
+
+            /* read client request body */
+
+            rc = ngx_http_read_unbuffered_request_body(r);
+
+            if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+                return rc;
+            }
+
+            out = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
+
+        /* stop if there is nothing to send */
+
+        if (out == NULL) {
+            rc = NGX_AGAIN;
+            break;
+        }
+
+        do_write = 1;
+    }
+
+    if (!r->reading_body) {
+        if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
+            r->read_event_handler =
+                                  ngx_http_upstream_rd_check_broken_connection;
+        }
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request handler");
+
+    if (c->write->timedout) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl && c->ssl == NULL) {
+        ngx_http_upstream_ssl_init_connection(r, u, c);
+        return;
+    }
+
+#endif
+
+    if (u->header_sent && !r->request_body_no_buffering) {
+        u->write_event_handler = ngx_http_upstream_dummy_handler;
+
+        (void) ngx_handle_write_event(c->write, 0);
+
+        return;
+    }
+
+    ngx_http_upstream_send_request(r, u, 1);
+}
+
+
+// 不缓存包体时客户端连接上的读事件处理函数，读到的包体马上发给上游服务器
+static void
+ngx_http_upstream_read_request_handler(ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream read request handler");
+
+    if (c->read->timedout) {
+        c->timedout = 1;
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_send_request(r, u, 0);
+}
+
+
+static void
 ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
     ssize_t            n;
@@ -2196,12 +2750,15 @@ ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
 static void
 ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    int                        tcp_nodelay;
-    ssize_t                    n;
-    ngx_int_t                  rc;
-    ngx_event_pipe_t          *p;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
+    int                             tcp_nodelay;
+    ssize_t                         n;
+    ngx_int_t                       rc;
+    ngx_event_pipe_t               *p;
+    ngx_connection_t               *c;
+    ngx_http_core_loc_conf_t       *clcf;
+#if (NGX_HAVE_MEMFD)
+    ngx_http_upstream_main_conf_t  *umcf;
+#endif
 
     rc = ngx_http_send_header(r);
 
@@ -2264,6 +2821,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
+#if (NGX_HAVE_SPLICE)
+        ngx_http_upstream_splice_init(r, u);
+#endif
+
         if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
@@ -2422,6 +2983,17 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     p->max_temp_file_size = u->conf->max_temp_file_size;
     p->temp_file_write_size = u->conf->temp_file_write_size;
 
+#if (NGX_HAVE_MEMFD)
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    if (umcf->temp_memory_zone && !p->cacheable) {
+        p->temp_memory = umcf->temp_memory_zone->data;
+        p->temp_memory_max = umcf->temp_memory;
+    }
+
+#endif
+
     p->preread_bufs = ngx_alloc_chain_link(r->pool);
     if (p->preread_bufs == NULL) {
         ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
@@ -2434,6 +3006,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     p->preread_size = u->buffer.last - u->buffer.pos;
 
+    if (u->conf->adaptive_buffers) {
+        ngx_http_upstream_adaptive_buffers(r, u);
+    }
+
     if (u->cacheable) {
 
         p->buf_to_file = ngx_calloc_buf(r->pool);
@@ -2557,6 +3133,10 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+    ngx_http_upstream_splice_init(r, u);
+#endif
+
     if (u->peer.connection->read->ready
         || u->buffer.pos != u->buffer.last)
     {
@@ -2609,6 +3189,9 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
     ngx_http_upstream_t       *u;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t         *sp;
+#endif
 
     c = r->connection;
     u = r->upstream;
@@ -2636,11 +3219,17 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         src = upstream;
         dst = downstream;
         b = &u->buffer;
+#if (NGX_HAVE_SPLICE)
+        sp = u->splice_upstream;
+#endif
 
     } else {
         src = downstream;
         dst = upstream;
         b = &u->from_client;
+#if (NGX_HAVE_SPLICE)
+        sp = u->splice_downstream;
+#endif
 
         if (r->header_in->last > r->header_in->pos) {
             b = r->header_in;
@@ -2689,6 +3278,38 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        // 缓冲区中已读出的数据都写出后，之后的数据经过管道转发
+
+        if (sp && b->pos == b->last) {
+
+            if (sp->size && dst->write->ready) {
+
+                if (ngx_linux_splice_write(dst, sp) == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+            }
+
+            if (sp->size == 0 && src->read->ready) {
+
+                n = ngx_linux_splice_read(src, sp, NGX_SPLICE_SIZE);
+
+                if (n > 0) {
+                    continue;
+                }
+
+                if (n == NGX_ERROR) {
+                    src->read->eof = 1;
+                }
+            }
+
+            break;
+        }
+
+#endif
+
         size = b->end - b->last;
 
         if (size && src->read->ready) {
@@ -2714,8 +3335,17 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         break;
     }
 
-    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
-        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
+    if ((upstream->read->eof && u->buffer.pos == u->buffer.last
+#if (NGX_HAVE_SPLICE)
+         && (u->splice_upstream == NULL || u->splice_upstream->size == 0)
+#endif
+        )
+        || (downstream->read->eof && u->from_client.pos == u->from_client.last
+#if (NGX_HAVE_SPLICE)
+            && (u->splice_downstream == NULL
+                || u->splice_downstream->size == 0)
+#endif
+           )
         || (downstream->read->eof && upstream->read->eof))
     {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -2776,9 +3406,10 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 static void
 ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
 {
-    ngx_event_t          *wev;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
 
     c = r->connection;
     u = r->upstream;
@@ -2789,10 +3420,31 @@ ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
 
     c->log->action = "sending to client";
 
+    // r->limit_rate在这里为0，write filter只会因为limit_rate_shared延迟发送
     if (wev->timedout) {
-        c->timedout = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+
+        if (!wev->delayed) {
+            c->timedout = 1;
+            ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
+
+        wev->timedout = 0;
+        wev->delayed = 0;
+
+    } else if (wev->delayed) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http downstream delayed");
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        }
+
         return;
     }
 
@@ -2859,6 +3511,26 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
                                         &u->out_bufs, u->output.tag);
             }
 
+#if (NGX_HAVE_SPLICE)
+
+            if (u->splice_upstream && u->splice_upstream->size) {
+
+                if (downstream->write->ready) {
+                    n = ngx_linux_splice_write(downstream, u->splice_upstream);
+
+                    if (n == NGX_ERROR) {
+                        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                        return;
+                    }
+                }
+
+                if (u->splice_upstream->size) {
+                    break;
+                }
+            }
+
+#endif
+
             if (u->busy_bufs == NULL) {
 
                 if (u->length == 0
@@ -2888,6 +3560,28 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        rc = ngx_http_upstream_splice_non_buffered(r, u);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        if (rc == NGX_OK) {
+            do_write = 1;
+            continue;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        /* NGX_DECLINED */
+
+#endif
+
         size = b->end - b->last;
 
         if (size && upstream->read->ready) {
@@ -2915,34 +3609,340 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
         break;
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (downstream->data == r) {
+        if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
+            != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    /* keep the delay timer armed by the write filter */
+
+    if (!downstream->write->delayed) {
+
+        if (downstream->write->active && !downstream->write->ready) {
+            ngx_add_timer(downstream->write, clcf->send_timeout);
+
+        } else if (downstream->write->timer_set) {
+            ngx_del_timer(downstream->write);
+        }
+    }
+
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (upstream->read->active && !upstream->read->ready) {
+        ngx_add_timer(upstream->read, u->conf->read_timeout);
+
+    } else if (upstream->read->timer_set) {
+        ngx_del_timer(upstream->read);
+    }
+}
+
+
+#if (NGX_HAVE_SPLICE)
+
+// 只有两端都是明文的TCP连接，并且没有过滤模块需要处理响应体时才使用splice()，
+// 这和不能使用sendfile()的条件相同。splice()的数据不经过write filter，
+// 所以配置了limit_rate_shared的请求也不使用
+static void
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    if (!u->conf->splice || r != r->main) {
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl || u->peer.connection->ssl) {
+        return;
+    }
+#endif
+
+#if (NGX_HTTP_SPDY)
+    if (r->spdy_stream) {
+        return;
+    }
+#endif
+
+    if (!u->upgrade
+        && (!u->splice || r->header_only || r->chunked
+            || r->filter_need_in_memory || r->main_filter_need_in_memory
+            || r->filter_need_body || r->main->limit_rate_set))
+    {
+        return;
+    }
+
+    // 创建管道失败时仍然经过缓冲区转发
+    u->splice_upstream = ngx_linux_splice_pipe(r->pool, c->log);
+
+    if (u->upgrade && u->splice_upstream) {
+        u->splice_downstream = ngx_linux_splice_pipe(r->pool, c->log);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream splice: %p", u->splice_upstream);
+}
+
+
+// 管道为空时把upstream的数据移入管道，再由调用者写给客户端。
+// 缓冲区中还有数据要经过过滤模块输出，或者有子请求时返回NGX_DECLINED，
+// 仍然用缓冲区读取，这样数据不会乱序
+static ngx_int_t
+ngx_http_upstream_splice_non_buffered(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    size_t              size;
+    ssize_t             n;
+    ngx_connection_t   *c, *upstream;
+    ngx_splice_pipe_t  *sp;
+
+    c = r->connection;
+    upstream = u->peer.connection;
+    sp = u->splice_upstream;
+
+    if (sp == NULL
+        || u->out_bufs
+        || u->busy_bufs
+        || u->buffer.pos != u->buffer.last
+        || c->buffered
+        || c->data != r
+        || r->postponed)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (sp->size || !upstream->read->ready || u->length == 0) {
+        return NGX_AGAIN;
+    }
+
+    size = NGX_SPLICE_SIZE;
+
+    if (u->length != -1 && u->length < (off_t) size) {
+        size = (size_t) u->length;
+    }
+
+    n = ngx_linux_splice_read(upstream, sp, size);
+
+    if (n == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    if (n > 0) {
+        u->state->response_length += n;
+
+        if (u->length != -1) {
+            u->length -= n;
+
+            if (u->length == 0) {
+                u->keepalive = !u->headers_in.connection_close;
+            }
+        }
+    }
+
+    /* the end of the response and errors are handled by the caller */
+
+    return NGX_OK;
+}
+
+#endif
+
+
+// 第一个缓冲区按响应体的长度分配，长度未知时按这个location最近90%的响应大小分配，
+// 之后的缓冲区逐步增大到配置的大小，数目最多增加到proxy_adaptive_buffers，
+// 超过之后才写入临时文件
+static void
+ngx_http_upstream_adaptive_buffers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    off_t                       size;
+    ngx_uint_t                  i, n;
+    ngx_event_pipe_t           *p;
+    ngx_http_upstream_sizes_t  *sizes;
+
+    p = u->pipe;
+    sizes = u->conf->sizes;
+
+    if (u->headers_in.content_length_n >= 0) {
+        size = u->headers_in.content_length_n - p->preread_size;
+
+    } else if (sizes->total >= NGX_HTTP_UPSTREAM_SIZES_MIN) {
+        n = 0;
+
+        for (i = 0; i < NGX_HTTP_UPSTREAM_SIZE_CLASSES - 1; i++) {
+            n += sizes->count[i];
+
+            if (n * 10 >= sizes->total * 9) {
+                break;
+            }
+        }
+
+        size = (off_t) 1024 << i;
+
+    } else {
+        size = u->conf->bufs.size;
+    }
+
+    if (size < (off_t) ngx_pagesize) {
+        size = ngx_pagesize;
+    }
+
+    if (size > (off_t) u->conf->bufs.size) {
+        size = u->conf->bufs.size;
+    }
+
+    p->bufs.size = (size_t) size;
+    p->bufs.num = ngx_max((ngx_int_t) u->conf->adaptive_buffers,
+                          u->conf->bufs.num);
+
+    p->alloc_buf = ngx_http_upstream_alloc_buf;
+    p->alloc_ctx = u;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream adaptive buffers: %uz, max %i",
+                   p->bufs.size, p->bufs.num);
+}
+
+
+static ngx_buf_t *
+ngx_http_upstream_alloc_buf(ngx_event_pipe_t *p)
+{
+    size_t                size;
+    ngx_buf_t            *b;
+    ngx_http_upstream_t  *u;
+
+    u = p->alloc_ctx;
+    size = p->bufs.size;
+
+    b = ngx_calloc_buf(p->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->start = ngx_http_upstream_buf_alloc(p->pool, &size);
+    if (b->start == NULL) {
+        return NULL;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+
+    // 响应比预计的大，下一个缓冲区加倍
+    if (size < u->conf->bufs.size) {
+        p->bufs.size = ngx_min(2 * size, u->conf->bufs.size);
+    }
+
+    return b;
+}
+
+
+/*
+ * the worker keeps freed buffers of ngx_pagesize << n bytes and reuses them
+ * for the next requests instead of allocating them in each request pool
+ */
+
+static u_char *
+ngx_http_upstream_buf_alloc(ngx_pool_t *pool, size_t *size)
+{
+    size_t                          s;
+    ngx_uint_t                      i;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_upstream_free_buf_t   *fb;
+    ngx_http_upstream_buf_clean_t  *bc;
+
+    for (i = 0, s = ngx_pagesize; s < *size; i++, s <<= 1) { /* void */ }
+
+    if (i >= NGX_HTTP_UPSTREAM_BUF_CLASSES) {
+        return ngx_palloc(pool, *size);
+    }
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_upstream_buf_clean_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    fb = ngx_http_upstream_free_bufs[i];
+
+    if (fb) {
+        ngx_http_upstream_free_bufs[i] = fb->next;
+        ngx_http_upstream_free_bufs_size -= s;
+
+    } else {
+        fb = ngx_alloc(s, pool->log);
+        if (fb == NULL) {
+            return NULL;
+        }
+    }
+
+    bc = cln->data;
+    bc->buf = fb;
+    bc->cls = i;
+
+    cln->handler = ngx_http_upstream_buf_free;
+
+    *size = s;
+
+    return (u_char *) fb;
+}
+
+
+static void
+ngx_http_upstream_buf_free(void *data)
+{
+    ngx_http_upstream_buf_clean_t  *bc = data;
+
+    size_t                         s;
+    ngx_http_upstream_free_buf_t  *fb;
+
+    s = ngx_pagesize << bc->cls;
+    fb = bc->buf;
+
+    if (ngx_http_upstream_free_bufs_size + s > NGX_HTTP_UPSTREAM_BUF_CACHE) {
+        ngx_free(fb);
+        return;
+    }
+
+    fb->next = ngx_http_upstream_free_bufs[bc->cls];
+    ngx_http_upstream_free_bufs[bc->cls] = fb;
+    ngx_http_upstream_free_bufs_size += s;
+}
 
-    if (downstream->data == r) {
-        if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
-            != NGX_OK)
-        {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
-    }
 
-    if (downstream->write->active && !downstream->write->ready) {
-        ngx_add_timer(downstream->write, clcf->send_timeout);
+// 记录一个响应的大小，计数达到NGX_HTTP_UPSTREAM_SIZES_WINDOW后全部减半，
+// 这样较早的响应的影响逐渐变小
+static void
+ngx_http_upstream_record_size(ngx_http_upstream_sizes_t *sizes, off_t size)
+{
+    ngx_uint_t  i;
 
-    } else if (downstream->write->timer_set) {
-        ngx_del_timer(downstream->write);
+    for (i = 0; i < NGX_HTTP_UPSTREAM_SIZE_CLASSES - 1; i++) {
+        if (size <= (off_t) 1024 << i) {
+            break;
+        }
     }
 
-    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+    sizes->count[i]++;
+
+    if (++sizes->total < NGX_HTTP_UPSTREAM_SIZES_WINDOW) {
         return;
     }
 
-    if (upstream->read->active && !upstream->read->ready) {
-        ngx_add_timer(upstream->read, u->conf->read_timeout);
+    sizes->total = 0;
 
-    } else if (upstream->read->timer_set) {
-        ngx_del_timer(upstream->read);
+    for (i = 0; i < NGX_HTTP_UPSTREAM_SIZE_CLASSES; i++) {
+        sizes->count[i] /= 2;
+        sizes->total += sizes->count[i];
     }
 }
 
@@ -3273,7 +4273,7 @@ static void
 ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_uint_t ft_type)
 {
-    ngx_uint_t  status, state;
+    ngx_uint_t  status, state, unbuffered;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http next upstream, %xi", ft_type);
@@ -3298,7 +4298,13 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
                       "upstream timed out");
     }
 
-    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
+    // 不缓存包体时已经发出的包体无法再发给其他上游服务器，不能重试
+    unbuffered = (u->request_sent && r->request_body_no_buffering);
+
+    if (u->peer.cached
+        && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR
+        && !unbuffered)
+    {
         status = 0;
 
         /* TODO: inform balancer instead */
@@ -3343,7 +4349,10 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     if (status) {
         u->state->status = status;
 
-        if (u->peer.tries == 0 || !(u->conf->next_upstream & ft_type)) {
+        if (u->peer.tries == 0
+            || !(u->conf->next_upstream & ft_type)
+            || unbuffered)
+        {
 
 #if (NGX_HTTP_CACHE)
 
@@ -3417,6 +4426,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http upstream request: %i", rc);
 
+    if (u->waiter && u->waiter->queued) {
+        ngx_http_upstream_dequeue(u);
+    }
+
     if (u->cleanup) {
         *u->cleanup = NULL;
         u->cleanup = NULL;
@@ -3437,11 +4450,22 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
         }
     }
 
+    if (u->conf->sizes
+        && u->pipe
+        && (u->pipe->upstream_done || u->pipe->upstream_eof))
+    {
+        ngx_http_upstream_record_size(u->conf->sizes, u->pipe->read_length);
+    }
+
     u->finalize_request(r, rc);
 
     if (u->peer.free && u->peer.sockaddr) {
         u->peer.free(&u->peer, u->peer.data, 0);
         u->peer.sockaddr = NULL;
+
+        if (u->upstream && u->upstream->queue) {
+            ngx_http_upstream_queue_wake(u->upstream->queue);
+        }
     }
 
     if (u->peer.connection) {
@@ -4516,6 +5540,39 @@ ngx_http_upstream_response_length_variable(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char      *p;
+    ngx_msec_t   ms;
+
+    if (r->upstream == NULL || r->upstream->waiter == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ms = r->upstream->queue_time;
+
+    if (r->upstream->waiter->queued) {
+        ms += ngx_current_msec - r->upstream->waiter->start;
+    }
+
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t) ms / 1000, ms % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_upstream_header_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -4612,6 +5669,7 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
                                          |NGX_HTTP_UPSTREAM_WEIGHT
                                          |NGX_HTTP_UPSTREAM_MAX_FAILS
                                          |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                                         |NGX_HTTP_UPSTREAM_MAX_CONNS
                                          |NGX_HTTP_UPSTREAM_DOWN
                                          |NGX_HTTP_UPSTREAM_BACKUP);
     if (uscf == NULL) {
@@ -4705,7 +5763,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     time_t                       fail_timeout;
     ngx_str_t                   *value, s;
     ngx_url_t                    u;
-    ngx_int_t                    weight, max_fails;
+    ngx_int_t                    weight, max_fails, max_conns;
     ngx_uint_t                   i;
     ngx_http_upstream_server_t  *us;
 
@@ -4742,6 +5800,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     weight = 1;
     max_fails = 1;
+    max_conns = 0;
     fail_timeout = 10;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -4776,6 +5835,22 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        // max_conns=number，每个worker进程到这个server的最大并发连接数，0不限制
+        if (ngx_strncmp(value[i].data, "max_conns=", 10) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_CONNS)) {
+                goto invalid;
+            }
+
+            max_conns = ngx_atoi(&value[i].data[10], value[i].len - 10);
+
+            if (max_conns == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "fail_timeout=", 13) == 0) {
 
             if (!(uscf->flags & NGX_HTTP_UPSTREAM_FAIL_TIMEOUT)) {
@@ -4823,6 +5898,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     us->naddrs = u.naddrs;
     us->weight = weight;
     us->max_fails = max_fails;
+    us->max_conns = max_conns;
     us->fail_timeout = fail_timeout;
 
     return NGX_CONF_OK;
@@ -4836,6 +5912,176 @@ invalid:
 }
 
 
+static char *
+ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s;
+    ngx_msec_t                  timeout;
+    ngx_http_upstream_queue_t  *q;
+
+    if (uscf->queue) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid queue size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    timeout = 60000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "timeout=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = value[2].data + 8;
+
+        timeout = ngx_parse_time(&s, 0);
+
+        if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid timeout \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    q = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_queue_t));
+    if (q == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_queue_init(&q->waiting);
+    q->length = 0;
+    q->max = n;
+    q->timeout = timeout;
+
+    uscf->queue = q;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_temp_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_main_conf_t  *umcf = conf;
+
+#if (NGX_HAVE_MEMFD)
+
+    off_t                   size;
+    ngx_str_t              *value;
+    static ngx_str_t        name = ngx_string("upstream_temp_memory");
+
+    if (umcf->temp_memory_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_offset(&value[1]);
+
+    if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    umcf->temp_memory = size;
+
+    umcf->temp_memory_zone = ngx_shared_memory_add(cf, &name,
+                                                   8 * ngx_pagesize,
+                                                   &ngx_http_upstream_module);
+    if (umcf->temp_memory_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    umcf->temp_memory_zone->init = ngx_http_upstream_init_temp_memory_zone;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "\"upstream_temp_memory\" is not supported "
+                       "on this platform, ignored");
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_HAVE_MEMFD)
+
+static ngx_int_t
+ngx_http_upstream_init_temp_memory_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_event_pipe_memory_t  *mem;
+
+    // 旧的worker进程结束请求时仍然从这个计数中减去它们使用的字节数，
+    // 所以重新加载配置时沿用原来的计数
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    mem = ngx_slab_alloc(shpool, sizeof(ngx_event_pipe_memory_t));
+    if (mem == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(mem, sizeof(ngx_event_pipe_memory_t));
+
+    mem->shpool = shpool;
+
+    shpool->data = mem;
+    shm_zone->data = mem;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_init_process(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_MEMFD)
+
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf && umcf->temp_memory_zone) {
+        ngx_event_pipe_init_memory_slot(umcf->temp_memory_zone->data,
+                                        cycle->log);
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
 ngx_http_upstream_srv_conf_t *
 ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
 {
@@ -5029,6 +6275,125 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+// 解析proxy_adaptive_buffers等指令："off"或者缓冲区数目的上限
+char *
+ngx_http_upstream_adaptive_buffers_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value;
+    ngx_uint_t  *np;
+
+    np = (ngx_uint_t *) (p + cmd->offset);
+
+    if (*np != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *np = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of buffers \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    *np = n;
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_HTTP_SSL)
+
+// 解析proxy_ssl_session_cache等指令："off"或者"shared:name:size"
+char *
+ngx_http_upstream_ssl_session_cache_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ssize_t          n;
+    ngx_str_t       *value, name, size;
+    ngx_uint_t       j;
+    ngx_shm_zone_t  **zone;
+
+    zone = (ngx_shm_zone_t **) (p + cmd->offset);
+
+    if (*zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].len <= sizeof("shared:") - 1
+        || ngx_strncmp(value[1].data, "shared:", sizeof("shared:") - 1) != 0)
+    {
+        goto invalid;
+    }
+
+    for (j = sizeof("shared:") - 1; j < value[1].len; j++) {
+        if (value[1].data[j] == ':') {
+            break;
+        }
+    }
+
+    name.len = j - (sizeof("shared:") - 1);
+    name.data = value[1].data + sizeof("shared:") - 1;
+
+    if (name.len == 0 || j == value[1].len) {
+        goto invalid;
+    }
+
+    size.len = value[1].len - j - 1;
+    size.data = value[1].data + j + 1;
+
+    n = ngx_parse_size(&size);
+
+    if (n == NGX_ERROR) {
+        goto invalid;
+    }
+
+    if (n < (ngx_int_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "session cache \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = ngx_shared_memory_add(cf, &name, n, &ngx_http_upstream_module);
+    if (*zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    (*zone)->init = ngx_ssl_client_session_cache_init;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid session cache \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+#endif
+
+
 static ngx_addr_t *
 ngx_http_upstream_get_local(ngx_http_request_t *r,
     ngx_http_upstream_local_t *local)
@@ -71,6 +71,10 @@ typedef struct {
     ngx_hash_t                       headers_in_hash;
     ngx_array_t                      upstreams;
                                              /* ngx_http_upstream_srv_conf_t */
+
+    // 所有worker进程的内存临时文件最多保存的字节数，共享内存中记录已使用的字节数
+    off_t                            temp_memory;
+    ngx_shm_zone_t                  *temp_memory_zone;
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
@@ -94,6 +98,7 @@ typedef struct {
     ngx_uint_t                       weight;
     ngx_uint_t                       max_fails;
     time_t                           fail_timeout;
+    ngx_uint_t                       max_conns;
 
     unsigned                         down:1;
     unsigned                         backup:1;
@@ -106,6 +111,29 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_FAIL_TIMEOUT  0x0008
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
+#define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0040
+
+
+// upstream块中queue指令设置的等待队列，
+// 选不出可用的server时请求在这里排队，队列属于每个worker进程
+typedef struct {
+    ngx_queue_t                      waiting;
+    ngx_uint_t                       length;
+    ngx_uint_t                       max;
+    ngx_msec_t                       timeout;
+} ngx_http_upstream_queue_t;
+
+
+// 在ngx_http_upstream_queue_t中排队的一个请求
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_event_t                      event;
+    ngx_http_request_t              *request;
+    ngx_msec_t                       start;
+
+    unsigned                         queued:1;
+    unsigned                         woken:1;
+} ngx_http_upstream_waiter_t;
 
 
 struct ngx_http_upstream_srv_conf_s {
@@ -121,6 +149,15 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        port;
     in_port_t                        default_port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
+
+    ngx_http_upstream_queue_t       *queue;
+
+    // 第一个proxy_pass到这个upstream的location的连接超时和SSL上下文，
+    // 用于不属于任何请求的预先建立的连接
+    ngx_msec_t                       connect_timeout;
+#if (NGX_HTTP_SSL)
+    ngx_ssl_t                       *ssl;
+#endif
 };
 
 
@@ -130,6 +167,16 @@ typedef struct {
 } ngx_http_upstream_local_t;
 
 
+#define NGX_HTTP_UPSTREAM_SIZE_CLASSES  24
+
+
+// 一个location最近的响应体大小的分布，第i级统计不超过(1024 << i)字节的响应
+typedef struct {
+    ngx_uint_t                       count[NGX_HTTP_UPSTREAM_SIZE_CLASSES];
+    ngx_uint_t                       total;
+} ngx_http_upstream_sizes_t;
+
+
 typedef struct {
     ngx_http_upstream_srv_conf_t    *upstream;
 
@@ -151,13 +198,20 @@ typedef struct {
 
     ngx_bufs_t                       bufs;
 
+    // 按响应大小调整缓冲区时缓冲区数目的上限，为0时使用固定的bufs
+    ngx_uint_t                       adaptive_buffers;
+    ngx_http_upstream_sizes_t       *sizes;
+
     ngx_uint_t                       ignore_headers;
     ngx_uint_t                       next_upstream;
     ngx_uint_t                       store_access;
     ngx_flag_t                       buffering;
+    ngx_flag_t                       request_buffering;
     ngx_flag_t                       pass_request_headers;
     ngx_flag_t                       pass_request_body;
 
+    ngx_flag_t                       splice;
+
     ngx_flag_t                       ignore_client_abort;
     ngx_flag_t                       intercept_errors;
     ngx_flag_t                       cyclic_temp_file;
@@ -197,6 +251,8 @@ typedef struct {
 #if (NGX_HTTP_SSL)
     ngx_ssl_t                       *ssl;
     ngx_flag_t                       ssl_session_reuse;
+    // 所有worker进程共用的会话缓存，为NULL时会话保存在每个进程的server中
+    ngx_shm_zone_t                  *ssl_session_cache;
 #endif
 
     ngx_str_t                        module;
@@ -285,6 +341,7 @@ struct ngx_http_upstream_s {
     ngx_chain_writer_ctx_t           writer;
 
     ngx_http_upstream_conf_t        *conf;
+    ngx_http_upstream_srv_conf_t    *upstream;
 
     ngx_http_upstream_headers_in_t   headers_in;
 
@@ -295,6 +352,12 @@ struct ngx_http_upstream_s {
     ngx_buf_t                        buffer;
     off_t                            length;
 
+#if (NGX_HAVE_SPLICE)
+    // 从upstream和从客户端读出的数据经过的管道，不能使用splice()时为NULL
+    ngx_splice_pipe_t               *splice_upstream;
+    ngx_splice_pipe_t               *splice_downstream;
+#endif
+
     ngx_chain_t                     *out_bufs;
     ngx_chain_t                     *busy_bufs;
     ngx_chain_t                     *free_bufs;
@@ -321,6 +384,10 @@ struct ngx_http_upstream_s {
 
     ngx_http_upstream_state_t       *state;
 
+    ngx_http_upstream_waiter_t      *waiter;
+    // 在upstream队列中等待的总时间
+    ngx_msec_t                       queue_time;
+
     ngx_str_t                        method;
     ngx_str_t                        schema;
     ngx_str_t                        uri;
@@ -338,8 +405,12 @@ struct ngx_http_upstream_s {
     unsigned                         buffering:1;
     unsigned                         keepalive:1;
     unsigned                         upgrade:1;
+    // 响应体不需要upstream模块解析，可以原样转发给客户端
+    unsigned                         splice:1;
 
     unsigned                         request_sent:1;
+    // 请求（包括包体）已经全部发给了上游服务器
+    unsigned                         request_body_sent:1;
     unsigned                         header_sent:1;
 };
 
@@ -368,6 +439,12 @@ char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_upstream_adaptive_buffers_slot(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+#if (NGX_HTTP_SSL)
+char *ngx_http_upstream_ssl_session_cache_slot(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+#endif
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
@@ -31,6 +31,10 @@ typedef struct {
     ngx_uint_t                      max_fails;
     time_t                          fail_timeout;
 
+    // 本worker进程到这个server的活动连接数，及server指令的max_conns参数
+    ngx_uint_t                      conns;
+    ngx_uint_t                      max_conns;
+
     ngx_uint_t                      down;          /* unsigned  down:1; */
 
 #if (NGX_HTTP_SSL)
@@ -2425,6 +2425,7 @@ ngx_http_regex_compile(ngx_conf_t *cf, ngx_regex_compile_t *rc)
     re->regex = rc->regex;
     re->ncaptures = rc->captures;
     re->name = rc->pattern;
+    re->standalone = ngx_regex_has_verbs(rc->pattern.data);
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
     cmcf->ncaptures = ngx_max(cmcf->ncaptures, re->ncaptures);
@@ -2471,6 +2472,90 @@ ngx_http_regex_compile(ngx_conf_t *cf, ngx_regex_compile_t *rc)
 }
 
 
+// 把n个ngx_http_regex_t合并成一个正则表达式，用来一次判断它们中是否有一个匹配。
+// standalone的不参与合并，合并后的正则表达式不匹配时调用者还要单独执行它们。
+// 不能合并时返回NULL，这时调用者只能逐个执行
+ngx_regex_t *
+ngx_http_regex_compile_set(ngx_conf_t *cf, ngx_http_regex_t **re, ngx_uint_t n)
+{
+    ngx_int_t             rv;
+    ngx_uint_t            i;
+    ngx_regex_elt_t      *elts;
+    ngx_regex_compile_t   rc;
+    u_char                errstr[NGX_MAX_CONF_ERRSTR];
+
+    elts = ngx_palloc(cf->temp_pool, n * sizeof(ngx_regex_elt_t));
+    if (elts == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, 0,
+                      "regexes are not combined: no memory");
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        elts[i].regex = re[i]->regex;
+        elts[i].name = re[i]->name.data;
+    }
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pool = cf->pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+
+    rv = ngx_regex_compile_set(&rc, elts, n);
+
+    if (rv == NGX_OK) {
+        return rc.regex;
+    }
+
+    if (rv == NGX_ERROR) {
+        if (rc.err.len == NGX_MAX_CONF_ERRSTR) {
+            ngx_log_error(NGX_LOG_ALERT, cf->log, 0,
+                          "regexes are not combined: no memory");
+
+        } else {
+            ngx_log_error(NGX_LOG_INFO, cf->log, 0,
+                          "regexes are not combined: %V", &rc.err);
+        }
+    }
+
+    return NULL;
+}
+
+
+// 执行ngx_http_regex_compile_set()合并的正则表达式，不设置捕获变量。
+// 合并后的正则表达式可能超过PCRE的匹配限制而单独的不会，这时返回NGX_OK，
+// 调用者逐个执行参与合并的正则表达式
+ngx_int_t
+ngx_http_regex_set_exec(ngx_http_request_t *r, ngx_regex_t *re, ngx_str_t *s)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_regex_exec(re, s, NULL, 0);
+
+    if (rc == NGX_REGEX_NO_MATCHED) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_regex_exec_limited(rc)) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      ngx_regex_exec_n " failed: %i on \"%V\" "
+                      "using combined regex, testing regexes one by one",
+                      rc, s);
+        return NGX_OK;
+    }
+
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      ngx_regex_exec_n " failed: %i on \"%V\" "
+                      "using combined regex", rc, s);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_regex_exec(ngx_http_request_t *r, ngx_http_regex_t *re, ngx_str_t *s)
 {
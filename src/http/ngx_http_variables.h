@@ -77,6 +77,8 @@ typedef struct {
     ngx_http_regex_variable_t    *variables;
     ngx_uint_t                    nvariables;
     ngx_str_t                     name;
+    // 含有回溯控制动词，不参与ngx_http_regex_compile_set()的合并，总要单独执行
+    unsigned                      standalone:1;
 } ngx_http_regex_t;
 
 
@@ -90,6 +92,10 @@ ngx_http_regex_t *ngx_http_regex_compile(ngx_conf_t *cf,
     ngx_regex_compile_t *rc);
 ngx_int_t ngx_http_regex_exec(ngx_http_request_t *r, ngx_http_regex_t *re,
     ngx_str_t *s);
+ngx_regex_t *ngx_http_regex_compile_set(ngx_conf_t *cf, ngx_http_regex_t **re,
+    ngx_uint_t n);
+ngx_int_t ngx_http_regex_set_exec(ngx_http_request_t *r, ngx_regex_t *re,
+    ngx_str_t *s);
 
 #endif
 
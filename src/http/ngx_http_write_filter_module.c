@@ -55,7 +55,7 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     off_t                      size, sent, nsent, limit;
     ngx_uint_t                 last, flush;
-    ngx_msec_t                 delay;
+    ngx_msec_t                 delay, d;
     ngx_chain_t               *cl, *ln, **ll, *chain;
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
@@ -249,6 +249,24 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         limit = clcf->sendfile_max_chunk;
     }
 
+#if (NGX_HTTP_LIMIT_RATE)
+
+    // 按limit_rate_shared配置的共享令牌桶进一步限制本次发送的字节数
+    if (r->main->limit_rate_set) {
+        delay = ngx_http_limit_rate_shared(r, &limit);
+
+        if (delay) {
+            c->write->delayed = 1;
+            ngx_add_timer(c->write, delay);
+
+            c->buffered |= NGX_HTTP_WRITE_BUFFERED;
+
+            return NGX_AGAIN;
+        }
+    }
+
+#endif
+
     sent = c->sent;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -265,6 +283,21 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
+    /*
+     * the shared buckets and r->limit_rate may both ask for a delay,
+     * the timer is armed once with the longer one
+     */
+
+    delay = 0;
+
+#if (NGX_HTTP_LIMIT_RATE)
+
+    if (r->main->limit_rate_set) {
+        delay = ngx_http_limit_rate_charge(r, c->sent - sent);
+    }
+
+#endif
+
     if (r->limit_rate) {
 
         nsent = c->sent;
@@ -282,16 +315,20 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
             }
         }
 
-        delay = (ngx_msec_t) ((nsent - sent) * 1000 / r->limit_rate);
+        d = (ngx_msec_t) ((nsent - sent) * 1000 / r->limit_rate);
 
-        if (delay > 0) {
-        // 发送速度已超过限值,将delayed标志位置1，加定时器
-            limit = 0;
-            c->write->delayed = 1;
-            ngx_add_timer(c->write, delay);
+        if (d > delay) {
+            delay = d;
         }
     }
 
+    if (delay > 0) {
+        // 发送速度已超过限值,将delayed标志位置1，加定时器
+        limit = 0;
+        c->write->delayed = 1;
+        ngx_add_timer(c->write, delay);
+    }
+
     if (limit
         && c->write->ready
         && c->sent - sent >= limit - (off_t) (2 * ngx_pagesize))
@@ -120,6 +120,13 @@ ngx_fd_t ngx_open_tempfile(u_char *name, ngx_uint_t persistent,
     ngx_uint_t access);
 #define ngx_open_tempfile_n      "open()"
 
+#if (NGX_HAVE_MEMFD)
+// 创建只在内存中的匿名文件，可以像普通文件一样读写和sendfile()
+#define ngx_open_memory_file(name)                                           \
+    memfd_create((const char *) name, MFD_CLOEXEC)
+#define ngx_open_memory_file_n   "memfd_create()"
+#endif
+
 
 ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset);
 #if (NGX_HAVE_PREAD)
@@ -152,6 +159,10 @@ ngx_write_fd(ngx_fd_t fd, void *buf, size_t n)
 #define ngx_write_fd_n           "write()"
 
 
+#define ngx_writev_fd(fd, iov, n)  writev(fd, iov, n)
+#define ngx_writev_fd_n          "writev()"
+
+
 #define ngx_write_console        ngx_write_fd
 
 
@@ -15,4 +15,28 @@ ngx_chain_t *ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in,
 extern int ngx_linux_rtsig_max;
 
 
+#if (NGX_HAVE_SPLICE)
+
+// splice()一次从socket移入管道的最大字节数，也就是默认的管道容量
+#define NGX_SPLICE_SIZE  65536
+
+typedef struct {
+    ngx_fd_t                 fd[2];
+    // 已经移入管道还没有写出的字节数
+    size_t                   size;
+} ngx_splice_pipe_t;
+
+
+ngx_splice_pipe_t *ngx_linux_splice_pipe(ngx_pool_t *pool, ngx_log_t *log);
+ssize_t ngx_linux_splice_read(ngx_connection_t *c, ngx_splice_pipe_t *sp,
+    size_t size);
+ssize_t ngx_linux_splice_write(ngx_connection_t *c, ngx_splice_pipe_t *sp);
+
+#if (NGX_STAT_STUB)
+extern ngx_atomic_t  *ngx_stat_spliced;
+#endif
+
+#endif
+
+
 #endif /* _NGX_LINUX_H_INCLUDED_ */
@@ -70,6 +70,12 @@
 #endif
 
 
+#if (NGX_HAVE_FUTEX)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+
 #if (NGX_HAVE_SENDFILE64)
 #include <sys/sendfile.h>
 #else
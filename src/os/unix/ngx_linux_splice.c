@@ -0,0 +1,189 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+// 用splice()在两个socket之间经过一个管道传递数据，数据只在内核中移动，
+// 不复制到worker进程的缓冲区中
+
+static void ngx_linux_splice_pipe_cleanup(void *data);
+
+
+#if (NGX_STAT_STUB)
+
+// 经过管道写出的字节数
+ngx_atomic_t   ngx_stat_spliced0;
+ngx_atomic_t  *ngx_stat_spliced = &ngx_stat_spliced0;
+
+#endif
+
+
+// 创建一个非阻塞的管道，管道随内存池一起关闭
+ngx_splice_pipe_t *
+ngx_linux_splice_pipe(ngx_pool_t *pool, ngx_log_t *log)
+{
+    ngx_splice_pipe_t   *sp;
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_splice_pipe_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    sp = cln->data;
+
+    if (pipe(sp->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe() failed");
+        return NULL;
+    }
+
+    sp->size = 0;
+
+    cln->handler = ngx_linux_splice_pipe_cleanup;
+
+    if (ngx_nonblocking(sp->fd[0]) == -1
+        || ngx_nonblocking(sp->fd[1]) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        return NULL;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "splice pipe: %d:%d", sp->fd[0], sp->fd[1]);
+
+    return sp;
+}
+
+
+static void
+ngx_linux_splice_pipe_cleanup(void *data)
+{
+    ngx_splice_pipe_t  *sp = data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "splice pipe cleanup: %d:%d", sp->fd[0], sp->fd[1]);
+
+    if (close(sp->fd[0]) == -1 || close(sp->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() splice pipe failed");
+    }
+}
+
+
+// 从连接中读出最多size字节移入管道，和ngx_unix_recv()一样设置读事件的状态，
+// 返回读到的字节数，0表示连接已关闭
+ssize_t
+ngx_linux_splice_read(ngx_connection_t *c, ngx_splice_pipe_t *sp, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    for ( ;; ) {
+        n = splice(c->fd, NULL, sp->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice read: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+            sp->size += n;
+            return n;
+        }
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+
+            if (err == NGX_EAGAIN) {
+                rev->ready = 0;
+                return NGX_AGAIN;
+            }
+
+            continue;
+        }
+
+        rev->ready = 0;
+        rev->error = 1;
+        (void) ngx_connection_error(c, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+}
+
+
+// 把管道中的数据写到连接中，和ngx_unix_send()一样设置写事件的状态
+ssize_t
+ngx_linux_splice_write(ngx_connection_t *c, ngx_splice_pipe_t *sp)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    for ( ;; ) {
+        n = splice(sp->fd[0], NULL, c->fd, NULL, sp->size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice write: fd:%d %z of %uz", c->fd, n, sp->size);
+
+        if (n > 0) {
+            if (n < (ssize_t) sp->size) {
+                wev->ready = 0;
+            }
+
+            sp->size -= n;
+            c->sent += n;
+
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_spliced, n);
+#endif
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, err,
+                          "splice() returned zero");
+            wev->ready = 0;
+            return n;
+        }
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            wev->ready = 0;
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+
+            if (err == NGX_EAGAIN) {
+                return NGX_AGAIN;
+            }
+
+        } else {
+            wev->error = 1;
+            (void) ngx_connection_error(c, err, "splice() failed");
+            return NGX_ERROR;
+        }
+    }
+}
@@ -571,11 +571,13 @@ ngx_process_get_status(void)
 }
 
 
-// 在master进程的子进程退出时将这个进程的上的共享内存锁打开。
+// 在master进程的子进程退出时将这个进程的上的共享内存锁打开，
+// 包括共享内存中分出的各个子内存池的锁，
+// 并把这个进程缓存的内存块还给各个内存池
 static void
 ngx_unlock_mutexes(ngx_pid_t pid)
 {
-    ngx_uint_t        i;
+    ngx_uint_t        i, n;
     ngx_shm_zone_t   *shm_zone;
     ngx_list_part_t  *part;
     ngx_slab_pool_t  *sp;
@@ -608,12 +610,24 @@ ngx_unlock_mutexes(ngx_pid_t pid)
             i = 0;
         }
 
-        sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+        for (sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+             sp;
+             sp = sp->next)
+        {
+            if (ngx_shmtx_force_unlock(&sp->mutex, pid)) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "shared memory zone \"%V\" was locked by %P",
+                              &shm_zone[i].shm.name, pid);
+            }
 
-        if (ngx_shmtx_force_unlock(&sp->mutex, pid)) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "shared memory zone \"%V\" was locked by %P",
-                          &shm_zone[i].shm.name, pid);
+            n = ngx_slab_cache_reclaim(sp, pid);
+
+            if (n) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "%ui chunks cached by %P were returned to "
+                              "shared memory zone \"%V\"",
+                              n, pid, &shm_zone[i].shm.name);
+            }
         }
     }
 }
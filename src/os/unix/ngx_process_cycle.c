@@ -16,6 +16,8 @@ static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n,
     ngx_int_t type);
 static void ngx_start_cache_manager_processes(ngx_cycle_t *cycle,
     ngx_uint_t respawn);
+static void ngx_start_log_writer_process(ngx_cycle_t *cycle,
+    ngx_uint_t respawn);
 static void ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch);
 static void ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo);
 static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle);
@@ -31,6 +33,9 @@ static ngx_thread_value_t ngx_worker_thread_cycle(void *data);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+static void ngx_log_writer_process_cycle(ngx_cycle_t *cycle, void *data);
+static void ngx_log_writer_process_handler(ngx_event_t *ev);
+static ngx_msec_t ngx_log_writer_flush(ngx_cycle_t *cycle);
 
 
 // 记录当前进程类型的全局变量。
@@ -39,6 +44,8 @@ ngx_uint_t    ngx_process;
 // 记录当前进程pid的全局变量，需要时直接使用这个全局变量，
 // 不再需要用系统调用getpid()来获取。
 ngx_pid_t     ngx_pid;
+// worker进程的序号，从0到worker_processes - 1，重新产生的worker进程沿用原来的序号
+ngx_uint_t    ngx_worker;
 ngx_uint_t    ngx_threaded;
 
 // 当master进程的子进程意外退出时，这个全局变量会被置1.
@@ -166,6 +173,8 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
                                NGX_PROCESS_RESPAWN);
     // 配置文件配置了相关功能时打开cache manager或cache loader进程,
     ngx_start_cache_manager_processes(cycle, 0);
+    // 配置了日志环形缓冲区时打开log writer进程
+    ngx_start_log_writer_process(cycle, 0);
 
     ngx_new_binary = 0;
     delay = 0;
@@ -273,6 +282,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
                 ngx_start_worker_processes(cycle, ccf->worker_processes,
                                            NGX_PROCESS_RESPAWN);
                 ngx_start_cache_manager_processes(cycle, 0);
+                ngx_start_log_writer_process(cycle, 0);
                 ngx_noaccepting = 0;
 
                 continue;
@@ -292,6 +302,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_start_worker_processes(cycle, ccf->worker_processes,
                                        NGX_PROCESS_JUST_RESPAWN);
             ngx_start_cache_manager_processes(cycle, 1);
+            ngx_start_log_writer_process(cycle, 1);
 
             /* allow new processes to start */
             ngx_msleep(100);
@@ -307,6 +318,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_start_worker_processes(cycle, ccf->worker_processes,
                                        NGX_PROCESS_RESPAWN);
             ngx_start_cache_manager_processes(cycle, 0);
+            ngx_start_log_writer_process(cycle, 0);
             live = 1;
         }
 
@@ -481,6 +493,31 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 }
 
 
+// 配置了日志环形缓冲区时打开log writer进程，并同步所有已启动进程的ngx_processes全局变量
+static void
+ngx_start_log_writer_process(ngx_cycle_t *cycle, ngx_uint_t respawn)
+{
+    ngx_channel_t  ch;
+
+    if (cycle->log_rings.nelts == 0) {
+        return;
+    }
+
+    ngx_spawn_process(cycle, ngx_log_writer_process_cycle, NULL,
+                      "log writer process",
+                      respawn ? NGX_PROCESS_JUST_RESPAWN : NGX_PROCESS_RESPAWN);
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_OPEN_CHANNEL;
+    ch.pid = ngx_processes[ngx_process_slot].pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+    ngx_pass_open_channel(cycle, &ch);
+}
+
+
 // master进程通过这个函数通知所有子进程，进程组里又添加了某个进程。
 static void
 ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
@@ -768,9 +805,9 @@ ngx_master_process_exit(ngx_cycle_t *cycle)
      * ngx_cycle->pool is already destroyed.
      */
 
-    ngx_exit_log_file.fd = ngx_cycle->log->file->fd;
+    ngx_exit_log = *ngx_log_get_file_log(ngx_cycle->log);
 
-    ngx_exit_log = *ngx_cycle->log;
+    ngx_exit_log_file.fd = ngx_exit_log.file->fd;
     ngx_exit_log.file = &ngx_exit_log_file;
     ngx_exit_log.next = NULL;
 
@@ -862,6 +899,9 @@ ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data)
                 }
             }
 
+            // 不等syslog的flush定时器，否则进程要多等flush时间才能退出
+            ngx_syslog_flush_all();
+
             if (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel)
             {
                 ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
@@ -929,6 +969,12 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         }
     }
 
+    ngx_pool_cache_max = ccf->pool_cache;
+
+    if (worker >= 0) {
+        ngx_worker = worker;
+    }
+
     // 设置进程最多可以打开的fd数量
     if (ccf->rlimit_nofile != NGX_CONF_UNSET) {
         rlmt.rlim_cur = (rlim_t) ccf->rlimit_nofile;
@@ -1141,9 +1187,9 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
      * ngx_cycle->pool is already destroyed.
      */
 
-    ngx_exit_log_file.fd = ngx_cycle->log->file->fd;
+    ngx_exit_log = *ngx_log_get_file_log(ngx_cycle->log);
 
-    ngx_exit_log = *ngx_cycle->log;
+    ngx_exit_log_file.fd = ngx_exit_log.file->fd;
     ngx_exit_log.file = &ngx_exit_log_file;
     ngx_exit_log.next = NULL;
 
@@ -1488,3 +1534,85 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
 
     exit(0);
 }
+
+
+// 启动后log writer进程在这个函数进入死循环，退出前把缓冲区中剩余的记录写入文件
+static void
+ngx_log_writer_process_cycle(ngx_cycle_t *cycle, void *data)
+{
+    void         *ident[4];
+    ngx_event_t   ev;
+
+    ngx_process = NGX_PROCESS_HELPER;
+
+    ngx_close_listening_sockets(cycle);
+
+    /* Set a moderate number of connections for a helper process. */
+    cycle->connection_n = 512;
+
+    ngx_worker_process_init(cycle, -1);
+
+    ngx_memzero(&ev, sizeof(ngx_event_t));
+    ev.handler = ngx_log_writer_process_handler;
+    ev.data = ident;
+    ev.log = cycle->log;
+    ident[3] = (void *) -1;
+
+    ngx_use_accept_mutex = 0;
+
+    ngx_setproctitle("log writer process");
+
+    ngx_add_timer(&ev, 0);
+
+    for ( ;; ) {
+
+        if (ngx_terminate || ngx_quit) {
+            (void) ngx_log_writer_flush(cycle);
+
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
+            exit(0);
+        }
+
+        if (ngx_reopen) {
+            ngx_reopen = 0;
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reopening logs");
+
+            (void) ngx_log_writer_flush(cycle);
+            ngx_reopen_files(cycle, -1);
+        }
+
+        ngx_process_events_and_timers(cycle);
+    }
+}
+
+
+// log writer进程的定时器回调函数
+static void
+ngx_log_writer_process_handler(ngx_event_t *ev)
+{
+    ngx_add_timer(ev, ngx_log_writer_flush((ngx_cycle_t *) ngx_cycle));
+}
+
+
+// 把所有日志环形缓冲区中的记录写入文件，返回下次写入前需要等待的毫秒数
+static ngx_msec_t
+ngx_log_writer_flush(ngx_cycle_t *cycle)
+{
+    ngx_msec_t        next;
+    ngx_uint_t        i;
+    ngx_log_ring_t  **rings;
+
+    next = 1000;
+
+    rings = cycle->log_rings.elts;
+    for (i = 0; i < cycle->log_rings.nelts; i++) {
+
+        ngx_log_ring_flush(rings[i], cycle->log);
+
+        if (rings[i]->flush < next) {
+            next = rings[i]->flush;
+        }
+    }
+
+    return next;
+}
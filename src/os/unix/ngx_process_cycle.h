@@ -46,6 +46,7 @@ void ngx_single_process_cycle(ngx_cycle_t *cycle);
 
 extern ngx_uint_t      ngx_process;
 extern ngx_pid_t       ngx_pid;
+extern ngx_uint_t      ngx_worker;
 extern ngx_pid_t       ngx_new_binary;
 extern ngx_uint_t      ngx_inherited;
 extern ngx_uint_t      ngx_daemonized;